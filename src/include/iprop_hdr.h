@@ -41,7 +41,8 @@ typedef enum iprop_role iprop_role;
  */
 #define IPROPX_VERSION_0    0
 #define IPROPX_VERSION_1    1
-#define IPROPX_VERSION      IPROPX_VERSION_1
+#define IPROPX_VERSION_2    2   /* binary dump format */
+#define IPROPX_VERSION      IPROPX_VERSION_2
 
 #ifdef  __cplusplus
 }
@@ -186,11 +186,18 @@ typedef INT64_TYPE krb5_int64;
 #define KRB5_CONF_ADMIN_SERVER                   "admin_server"
 #define KRB5_CONF_ALLOW_WEAK_CRYPTO              "allow_weak_crypto"
 #define KRB5_CONF_AP_REQ_CHECKSUM_TYPE           "ap_req_checksum_type"
+#define KRB5_CONF_AUDIT_QUEUE_LENGTH             "audit_queue_length"
 #define KRB5_CONF_AUTH_TO_LOCAL                  "auth_to_local"
 #define KRB5_CONF_AUTH_TO_LOCAL_NAMES            "auth_to_local_names"
+#define KRB5_CONF_BACKING_LIBRARY                "backing_library"
 #define KRB5_CONF_CANONICALIZE                   "canonicalize"
 #define KRB5_CONF_CCACHE_TYPE                    "ccache_type"
+#define KRB5_CONF_CLIENT_RATE_BURST              "client_rate_burst"
+#define KRB5_CONF_CLIENT_RATE_IPV4_PREFIX        "client_rate_ipv4_prefix"
+#define KRB5_CONF_CLIENT_RATE_IPV6_PREFIX        "client_rate_ipv6_prefix"
+#define KRB5_CONF_CLIENT_RATE_LIMIT              "client_rate_limit"
 #define KRB5_CONF_CLOCKSKEW                      "clockskew"
+#define KRB5_CONF_COMPILED_DATABASE              "compiled_database"
 #define KRB5_CONF_DATABASE_NAME                  "database_name"
 #define KRB5_CONF_DB_MODULE_DIR                  "db_module_dir"
 #define KRB5_CONF_DEFAULT                        "default"
@@ -245,7 +252,12 @@ typedef INT64_TYPE krb5_int64;
 #define KRB5_CONF_LDAP_SERVERS                "ldap_servers"
 #define KRB5_CONF_LDAP_SERVICE_PASSWORD_FILE  "ldap_service_password_file"
 #define KRB5_CONF_LIBDEFAULTS                 "libdefaults"
+#define KRB5_CONF_LOCKOUT_TABLE_SIZE          "lockout_table_size"
 #define KRB5_CONF_LOGGING                     "logging"
+#define KRB5_CONF_LOOKASIDE_BUCKETS           "lookaside_buckets"
+#define KRB5_CONF_LOOKASIDE_MAX_SIZE          "lookaside_max_size"
+#define KRB5_CONF_LOOKASIDE_SHARED            "lookaside_shared"
+#define KRB5_CONF_LOOKASIDE_STALE_TIME        "lookaside_stale_time"
 #define KRB5_CONF_MASTER_KEY_NAME             "master_key_name"
 #define KRB5_CONF_MASTER_KEY_TYPE             "master_key_type"
 #define KRB5_CONF_MASTER_KDC                  "master_kdc"
@@ -255,10 +267,16 @@ typedef INT64_TYPE krb5_int64;
 #define KRB5_CONF_NOADDRESSES                 "noaddresses"
 #define KRB5_CONF_NO_HOST_REFERRAL            "no_host_referral"
 #define KRB5_CONF_PERMITTED_ENCTYPES          "permitted_enctypes"
+#define KRB5_CONF_PERSISTENT_HANDLE           "persistent_handle"
 #define KRB5_CONF_PLUGINS                     "plugins"
 #define KRB5_CONF_PLUGIN_BASE_DIR             "plugin_base_dir"
 #define KRB5_CONF_PREFERRED_PREAUTH_TYPES     "preferred_preauth_types"
+#define KRB5_CONF_PRINCIPAL_CACHE_SIZE        "principal_cache_size"
+#define KRB5_CONF_PRINCIPAL_RATE_BURST        "principal_rate_burst"
+#define KRB5_CONF_PRINCIPAL_RATE_LIMIT        "principal_rate_limit"
 #define KRB5_CONF_PROXIABLE                   "proxiable"
+#define KRB5_CONF_QUEUE_LENGTH                "queue_length"
+#define KRB5_CONF_QUEUE_OVERFLOW              "queue_overflow"
 #define KRB5_CONF_RDNS                        "rdns"
 #define KRB5_CONF_REALMS                      "realms"
 #define KRB5_CONF_REALM_TRY_DOMAINS           "realm_try_domains"
@@ -267,12 +285,16 @@ typedef INT64_TYPE krb5_int64;
 #define KRB5_CONF_RESTRICT_ANONYMOUS_TO_TGT   "restrict_anonymous_to_tgt"
 #define KRB5_CONF_ASSUME_DES_CRC_SESSION      "des_crc_session_supported"
 #define KRB5_CONF_SAFE_CHECKSUM_TYPE          "safe_checksum_type"
+#define KRB5_CONF_SLOW_REQUEST_THRESHOLD      "slow_request_threshold"
 #define KRB5_CONF_SUPPORTED_ENCTYPES          "supported_enctypes"
 #define KRB5_CONF_TICKET_LIFETIME             "ticket_lifetime"
+#define KRB5_CONF_UDP_MAX_QUEUE_TIME          "udp_max_queue_time"
 #define KRB5_CONF_UDP_PREFERENCE_LIMIT        "udp_preference_limit"
 #define KRB5_CONF_VERIFY_AP_REQ_NOFAIL        "verify_ap_req_nofail"
 #define KRB5_CONF_V4_INSTANCE_CONVERT         "v4_instance_convert"
 #define KRB5_CONF_V4_REALM                    "v4_realm"
+#define KRB5_CONF_WORKER_AFFINITY             "worker_affinity"
+#define KRB5_CONF_WORKER_REUSEPORT            "worker_reuseport"
 
 /* Cache configuration variables */
 #define KRB5_CC_CONF_FAST_AVAIL                  "fast_avail"
@@ -2075,6 +2097,11 @@ krb5_error_code krb5_rd_req_decoded_anyflag(krb5_context, krb5_auth_context *,
                                             krb5_const_principal, krb5_keytab,
                                             krb5_flags *, krb5_ticket **);
 
+krb5_error_code k5_rd_req_decoded_decrypted(krb5_context, krb5_auth_context *,
+                                            const krb5_ap_req *,
+                                            krb5_const_principal, krb5_keytab,
+                                            krb5_flags *, krb5_ticket **);
+
 krb5_error_code KRB5_CALLCONV
 krb5_cc_register(krb5_context, const krb5_cc_ops *, krb5_boolean );
 
@@ -2112,6 +2139,10 @@ krb5_auth_con_set_authdata_context(krb5_context context,
                                    krb5_auth_context auth_context,
                                    krb5_authdata_context ad_context);
 
+krb5_error_code
+krb5_auth_con_setuseruserkey_k(krb5_context context,
+                               krb5_auth_context auth_context, krb5_key key);
+
 krb5_error_code krb5_read_message(krb5_context, krb5_pointer, krb5_data *);
 krb5_error_code krb5_write_message(krb5_context, krb5_pointer, krb5_data *);
 int krb5_net_read(krb5_context, int , char *, int);
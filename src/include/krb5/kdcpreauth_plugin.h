@@ -118,6 +118,19 @@ typedef struct krb5_kdcpreauth_modreq_st *krb5_kdcpreauth_modreq;
  * header dependency for the moment). */
 struct verto_ctx;
 
+/*
+ * A computation passed to the offload callback.  context is a krb5 context
+ * belonging to the thread which runs the computation, for the same realm as
+ * the request.
+ */
+typedef krb5_error_code
+(*krb5_kdcpreauth_compute_fn)(krb5_context context, void *arg);
+
+/* The completion function for the offload callback, called with the result of
+ * the computation. */
+typedef void
+(*krb5_kdcpreauth_compute_done_fn)(void *arg, krb5_error_code code);
+
 /* Before using a callback after version 1, modules must check the vers
  * field of the callback structure. */
 typedef struct krb5_kdcpreauth_callbacks_st {
@@ -181,6 +194,23 @@ typedef struct krb5_kdcpreauth_callbacks_st {
 
     /* End of version 2 kdcpreauth callbacks. */
 
+    /*
+     * Run compute(context, arg) on a KDC worker thread, and then call
+     * done(arg, code) on the event loop thread with its result.  If the KDC
+     * has no worker threads, both functions are called before this callback
+     * returns.  Other requests are processed while compute runs, so it must
+     * not use the rock, the caller's krb5 context, or the event context, and
+     * may only read module data shared between requests.  If compute fails,
+     * its error message is copied into the caller's context before done is
+     * called.  This callback is meant for long public-key operations in an
+     * asynchronous verify method.
+     */
+    void (*offload)(krb5_context context, krb5_kdcpreauth_rock rock,
+                    krb5_kdcpreauth_compute_fn compute,
+                    krb5_kdcpreauth_compute_done_fn done, void *arg);
+
+    /* End of version 3 kdcpreauth callbacks. */
+
 } *krb5_kdcpreauth_callbacks;
 
 /* Optional: preauth plugin initialization function. */
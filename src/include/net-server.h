@@ -51,6 +51,7 @@ krb5_error_code loop_setup_network(verto_ctx *ctx, void *handle,
                                    const char *progname);
 krb5_error_code loop_setup_signals(verto_ctx *ctx, void *handle,
                                    void (*reset)());
+krb5_error_code loop_enable_reuseport(void);
 void loop_free(verto_ctx *ctx);
 
 /* to be supplied by the server application */
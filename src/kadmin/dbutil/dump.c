@@ -35,6 +35,7 @@
 #include <kdb.h>
 #include <com_err.h>
 #include "kdb5_util.h"
+#include "kdb5.h"
 #if defined(HAVE_REGEX_H) && defined(HAVE_REGCOMP)
 #include <regex.h>
 #endif  /* HAVE_REGEX_H */
@@ -60,6 +61,17 @@ krb5_kvno new_mkvno;
 #include <regexp.h>
 #endif /* !HAVE_REGCOMP && HAVE_REGEXP_H */
 
+/*
+ * With -threads, principal records are formatted (when dumping) or parsed
+ * (when loading) in memory by worker threads, a batch at a time, while the
+ * main thread reads the database or dump file and writes the results in their
+ * original order.  This requires fmemopen() and open_memstream().
+ */
+#if defined(HAVE_FMEMOPEN) && defined(HAVE_OPEN_MEMSTREAM)
+#define PARALLEL_DUMP
+#define BATCH_SIZE 256
+#endif
+
 typedef krb5_error_code (*dump_func)(krb5_context context,
                                      krb5_db_entry *entry, const char *name,
                                      FILE *fp, krb5_boolean verbose,
@@ -73,6 +85,7 @@ typedef struct _dump_version {
     int updateonly;
     int iprop;
     int ipropx;
+    int binary;
     dump_func dump_princ;
     osa_adb_iter_policy_func dump_policy;
     load_func load_record;
@@ -86,6 +99,10 @@ struct dump_args {
     krb5_boolean verbose;
     krb5_boolean omit_nra;      /* omit non-replicated attributes */
     dump_version *dump;
+    struct pipeline *pl;        /* formats entries when dumping with threads */
+    struct dump_batch *batch;   /* entries not yet submitted to pl */
+    struct k5buf block;         /* current block of a binary dump */
+    krb5_error_code block_err;  /* deferred error from dump_binary_policy */
 };
 
 /* External data */
@@ -463,6 +480,242 @@ dump_r1_11_policy(void *data, osa_policy_ent_t entry)
     fprintf(arg->ofile, "\n");
 }
 
+/*
+ * The binary dump format consists of the header line followed by a sequence
+ * of blocks.  Each block begins with a twelve-byte header giving the length of
+ * the block data, a flags field (reserved for compression methods; currently
+ * always zero), and a CRC-32 checksum of the block data.  A block of length
+ * zero marks the end of the dump, so that a truncated dump file can be
+ * detected.  The block data is a sequence of records, each consisting of a
+ * one-byte record type, a four-byte payload length, and the payload; records
+ * never span blocks, and records of unknown type are skipped when loading.
+ * All integers are big-endian.
+ */
+#define BIN_HEADER_LEN 12
+#define BIN_BLOCK_SIZE 65536
+#define BIN_MAX_BLOCK_SIZE (16 * 1024 * 1024)
+#define BIN_RECORD_PRINC 1
+#define BIN_RECORD_POLICY 2
+
+static void
+bin_put16(struct k5buf *buf, unsigned int val)
+{
+    unsigned char b[2];
+
+    store_16_be(val, b);
+    k5_buf_add_len(buf, (char *)b, 2);
+}
+
+static void
+bin_put32(struct k5buf *buf, uint32_t val)
+{
+    unsigned char b[4];
+
+    store_32_be(val, b);
+    k5_buf_add_len(buf, (char *)b, 4);
+}
+
+/* Add a string with a four-byte length.  A null string is written as an empty
+ * one. */
+static void
+bin_put_string(struct k5buf *buf, const char *str)
+{
+    size_t len = (str == NULL) ? 0 : strlen(str);
+
+    bin_put32(buf, len);
+    if (len > 0)
+        k5_buf_add_len(buf, str, len);
+}
+
+/* Add a byte string with a two-byte length. */
+static void
+bin_put_octets(struct k5buf *buf, const void *data, unsigned int len)
+{
+    bin_put16(buf, len);
+    if (len > 0)
+        k5_buf_add_len(buf, data, len);
+}
+
+static void
+bin_put_tl_data(struct k5buf *buf, krb5_tl_data *tl)
+{
+    for (; tl != NULL; tl = tl->tl_data_next) {
+        bin_put16(buf, tl->tl_data_type);
+        bin_put_octets(buf, tl->tl_data_contents, tl->tl_data_length);
+    }
+}
+
+/* Begin a record of the given type, returning the offset of its length. */
+static size_t
+bin_start_record(struct k5buf *buf, int type)
+{
+    char t = type;
+
+    k5_buf_add_len(buf, &t, 1);
+    bin_put32(buf, 0);
+    return (k5_buf_data(buf) == NULL) ? 0 : k5_buf_len(buf) - 4;
+}
+
+/* Fill in the length of the record whose length field is at lenpos. */
+static void
+bin_end_record(struct k5buf *buf, size_t lenpos)
+{
+    char *data = k5_buf_data(buf);
+
+    if (data != NULL)
+        store_32_be(k5_buf_len(buf) - lenpos - 4, data + lenpos);
+}
+
+/* Empty buf and reserve space for a block header. */
+static void
+bin_start_block(struct k5buf *buf)
+{
+    char header[BIN_HEADER_LEN];
+
+    memset(header, 0, sizeof(header));
+    k5_buf_truncate(buf, 0);
+    k5_buf_add_len(buf, header, sizeof(header));
+}
+
+/* Fill in the header of the block in buf. */
+static krb5_error_code
+bin_finish_block(krb5_context context, struct k5buf *buf)
+{
+    krb5_error_code ret;
+    char *data = k5_buf_data(buf);
+    size_t len;
+    krb5_data d;
+    krb5_checksum cksum;
+
+    if (data == NULL)
+        return ENOMEM;
+    len = k5_buf_len(buf) - BIN_HEADER_LEN;
+    d = make_data(data + BIN_HEADER_LEN, len);
+    ret = krb5_c_make_checksum(context, CKSUMTYPE_CRC32, NULL, 0, &d, &cksum);
+    if (ret)
+        return ret;
+    store_32_be(len, data);
+    store_32_be(0, data + 4);
+    memcpy(data + 8, cksum.contents, 4);
+    krb5_free_checksum_contents(context, &cksum);
+    return 0;
+}
+
+/* Add a principal record to the block in buf. */
+static krb5_error_code
+bin_add_princ(krb5_db_entry *entry, const char *name, krb5_boolean omit_nra,
+              struct k5buf *buf)
+{
+    krb5_tl_data *tlp;
+    krb5_key_data *kdata;
+    size_t lenpos;
+    int count, i, j;
+
+    count = 0;
+    for (tlp = entry->tl_data; tlp; tlp = tlp->tl_data_next)
+        count++;
+    if (count != entry->n_tl_data) {
+        fprintf(stderr, _("%s: tagged data list inconsistency for %s "
+                          "(counted %d, stored %d)\n"), progname, name,
+                count, (int)entry->n_tl_data);
+        return EINVAL;
+    }
+
+    lenpos = bin_start_record(buf, BIN_RECORD_PRINC);
+    bin_put16(buf, entry->len);
+    bin_put_string(buf, name);
+    bin_put32(buf, entry->attributes);
+    bin_put32(buf, entry->max_life);
+    bin_put32(buf, entry->max_renewable_life);
+    bin_put32(buf, entry->expiration);
+    bin_put32(buf, entry->pw_expiration);
+    bin_put32(buf, omit_nra ? 0 : entry->last_success);
+    bin_put32(buf, omit_nra ? 0 : entry->last_failed);
+    bin_put32(buf, omit_nra ? 0 : entry->fail_auth_count);
+    bin_put16(buf, entry->n_tl_data);
+    bin_put_tl_data(buf, entry->tl_data);
+    bin_put16(buf, entry->n_key_data);
+    for (i = 0; i < entry->n_key_data; i++) {
+        kdata = &entry->key_data[i];
+        bin_put16(buf, kdata->key_data_ver);
+        bin_put16(buf, kdata->key_data_kvno);
+        for (j = 0; j < kdata->key_data_ver; j++) {
+            bin_put16(buf, kdata->key_data_type[j]);
+            bin_put_octets(buf, kdata->key_data_contents[j],
+                           kdata->key_data_length[j]);
+        }
+    }
+    bin_put_octets(buf, entry->e_data, entry->e_length);
+    bin_end_record(buf, lenpos);
+    return (k5_buf_data(buf) == NULL) ? ENOMEM : 0;
+}
+
+/* Write out the current block of a binary dump if it has reached the target
+ * size, or if force is true and it contains any records. */
+static krb5_error_code
+bin_flush_block(struct dump_args *args, krb5_boolean force)
+{
+    krb5_error_code ret;
+    ssize_t len = k5_buf_len(&args->block);
+
+    if (len < 0)
+        return ENOMEM;
+    if (len == BIN_HEADER_LEN || (!force && len < BIN_BLOCK_SIZE))
+        return 0;
+    ret = bin_finish_block(args->context, &args->block);
+    if (ret)
+        return ret;
+    if (fwrite(k5_buf_data(&args->block), 1, len, args->ofile) != (size_t)len)
+        return errno;
+    bin_start_block(&args->block);
+    return 0;
+}
+
+/* Write out any remaining records of a binary dump and the end marker. */
+static krb5_error_code
+bin_finish_dump(struct dump_args *args)
+{
+    krb5_error_code ret;
+    char header[BIN_HEADER_LEN];
+
+    ret = bin_flush_block(args, TRUE);
+    if (ret)
+        return ret;
+    memset(header, 0, sizeof(header));
+    if (fwrite(header, 1, sizeof(header), args->ofile) != sizeof(header))
+        return errno;
+    return 0;
+}
+
+static void
+dump_binary_policy(void *data, osa_policy_ent_t entry)
+{
+    struct dump_args *arg = data;
+    struct k5buf *buf = &arg->block;
+    size_t lenpos;
+
+    if (arg->block_err)
+        return;
+    lenpos = bin_start_record(buf, BIN_RECORD_POLICY);
+    bin_put_string(buf, entry->name);
+    bin_put32(buf, entry->pw_min_life);
+    bin_put32(buf, entry->pw_max_life);
+    bin_put32(buf, entry->pw_min_length);
+    bin_put32(buf, entry->pw_min_classes);
+    bin_put32(buf, entry->pw_history_num);
+    bin_put32(buf, entry->pw_max_fail);
+    bin_put32(buf, entry->pw_failcnt_interval);
+    bin_put32(buf, entry->pw_lockout_duration);
+    bin_put32(buf, entry->attributes);
+    bin_put32(buf, entry->max_life);
+    bin_put32(buf, entry->max_renewable_life);
+    bin_put_string(buf, entry->allowed_keysalts);
+    bin_put16(buf, entry->n_tl_data);
+    bin_put_tl_data(buf, entry->tl_data);
+    bin_end_record(buf, lenpos);
+    arg->block_err = bin_flush_block(arg, FALSE);
+}
+
 static void
 print_key_data(FILE *f, krb5_key_data *kd)
 {
@@ -539,6 +792,157 @@ dump_ov_princ(krb5_context context, krb5_db_entry *entry, const char *name,
     return 0;
 }
 
+#ifdef PARALLEL_DUMP
+
+struct dump_batch {
+    int count;
+    krb5_db_entry *entries[BATCH_SIZE];
+    char *names[BATCH_SIZE];
+    krb5_error_code ret;
+    char *text;
+    size_t len;
+};
+
+static void
+free_dump_batch(struct dump_batch *batch)
+{
+    int i;
+
+    if (batch == NULL)
+        return;
+    for (i = 0; i < batch->count; i++) {
+        krb5int_free_db_entry(batch->entries[i]);
+        free(batch->names[i]);
+    }
+    free(batch->text);
+    free(batch);
+}
+
+/* Pipeline function: format the entries of a batch into memory. */
+static void
+format_dump_batch(void *arg, void *item)
+{
+    struct dump_args *args = arg;
+    struct dump_batch *batch = item;
+    struct k5buf buf;
+    FILE *fp;
+    int i;
+
+    /* Each batch of a binary dump becomes one block. */
+    if (args->dump->binary) {
+        k5_buf_init_dynamic(&buf);
+        bin_start_block(&buf);
+        for (i = 0; i < batch->count && !batch->ret; i++) {
+            batch->ret = bin_add_princ(batch->entries[i], batch->names[i],
+                                       args->omit_nra, &buf);
+        }
+        if (!batch->ret)
+            batch->ret = bin_finish_block(args->context, &buf);
+        if (!batch->ret) {
+            batch->len = k5_buf_len(&buf);
+            batch->text = k5_buf_data(&buf);
+        } else {
+            k5_free_buf(&buf);
+        }
+        return;
+    }
+
+    fp = open_memstream(&batch->text, &batch->len);
+    if (fp == NULL) {
+        batch->ret = errno;
+        return;
+    }
+    for (i = 0; i < batch->count && !batch->ret; i++) {
+        batch->ret = args->dump->dump_princ(args->context, batch->entries[i],
+                                            batch->names[i], fp, FALSE,
+                                            args->omit_nra);
+    }
+    if (fclose(fp) != 0 && !batch->ret)
+        batch->ret = errno;
+}
+
+/* Write out a formatted batch and free it. */
+static krb5_error_code
+write_dump_batch(struct dump_args *args, struct dump_batch *batch)
+{
+    krb5_error_code ret = batch->ret;
+    int i;
+
+    if (!ret && fwrite(batch->text, 1, batch->len, args->ofile) != batch->len)
+        ret = errno;
+    /* Only the beta 7 style formats display principal names. */
+    if (!ret && args->verbose && args->dump->dump_princ != dump_ov_princ) {
+        for (i = 0; i < batch->count; i++)
+            fprintf(stderr, "%s\n", batch->names[i]);
+    }
+    free_dump_batch(batch);
+    return ret;
+}
+
+/* Submit the current batch, first writing out finished batches as needed to
+ * make room for it. */
+static krb5_error_code
+submit_dump_batch(struct dump_args *args)
+{
+    krb5_error_code ret;
+
+    while (pipeline_full(args->pl)) {
+        ret = write_dump_batch(args, pipeline_next(args->pl));
+        if (ret)
+            return ret;
+    }
+    pipeline_submit(args->pl, args->batch);
+    args->batch = NULL;
+    return 0;
+}
+
+/* Add a copy of entry to the current batch, taking ownership of name. */
+static krb5_error_code
+queue_dump_entry(struct dump_args *args, krb5_db_entry *entry, char *name)
+{
+    krb5_error_code ret;
+    struct dump_batch *batch = args->batch;
+
+    if (batch == NULL) {
+        batch = k5alloc(sizeof(*batch), &ret);
+        if (batch == NULL) {
+            free(name);
+            return ret;
+        }
+        args->batch = batch;
+    }
+    ret = krb5int_copy_db_entry(args->context, entry,
+                                &batch->entries[batch->count]);
+    if (ret) {
+        free(name);
+        return ret;
+    }
+    batch->names[batch->count++] = name;
+    return (batch->count == BATCH_SIZE) ? submit_dump_batch(args) : 0;
+}
+
+/* Write out all remaining entries, or discard them if ret is nonzero.  Return
+ * the first error encountered. */
+static krb5_error_code
+finish_dump_batches(struct dump_args *args, krb5_error_code ret)
+{
+    struct dump_batch *batch;
+
+    if (!ret && args->batch != NULL)
+        ret = submit_dump_batch(args);
+    free_dump_batch(args->batch);
+    args->batch = NULL;
+    while ((batch = pipeline_next(args->pl)) != NULL) {
+        if (ret)
+            free_dump_batch(batch);
+        else
+            ret = write_dump_batch(args, batch);
+    }
+    return ret;
+}
+
+#endif /* PARALLEL_DUMP */
+
 static krb5_error_code
 dump_iterator(void *ptr, krb5_db_entry *entry)
 {
@@ -566,6 +970,20 @@ dump_iterator(void *ptr, krb5_db_entry *entry)
     if (args->nnames > 0 && !name_matches(name, args))
         goto cleanup;
 
+#ifdef PARALLEL_DUMP
+    if (args->pl != NULL)
+        return queue_dump_entry(args, entry, name);
+#endif
+
+    if (args->dump->binary) {
+        ret = bin_add_princ(entry, name, args->omit_nra, &args->block);
+        if (!ret)
+            ret = bin_flush_block(args, FALSE);
+        if (!ret && args->verbose)
+            fprintf(stderr, "%s\n", name);
+        goto cleanup;
+    }
+
     ret = args->dump->dump_princ(args->context, entry, name, args->ofile,
                                  args->verbose, args->omit_nra);
 
@@ -698,11 +1116,50 @@ process_tl_data(const char *fname, FILE *filep, int lineno,
     return 0;
 }
 
-/* Read a beta 7 entry and add it to the database.  Return -1 for end of file,
- * 0 for success and 1 for failure. */
+/* Set the mask of a principal entry read from a dump according to the fields
+ * it contains. */
+static void
+set_load_mask(krb5_db_entry *dbentry)
+{
+    krb5_tl_data *tl;
+    XDR xdrs;
+    osa_princ_ent_rec osa_princ_ent;
+
+    dbentry->mask = KADM5_LOAD | KADM5_PRINCIPAL | KADM5_ATTRIBUTES |
+        KADM5_MAX_LIFE | KADM5_MAX_RLIFE |
+        KADM5_PRINC_EXPIRE_TIME | KADM5_LAST_SUCCESS |
+        KADM5_LAST_FAILED | KADM5_FAIL_AUTH_COUNT;
+
+    for (tl = dbentry->tl_data; tl; tl = tl->tl_data_next) {
+        /* test to set mask fields */
+        if (tl->tl_data_type == KRB5_TL_KADM_DATA) {
+            /* Assuming aux_attributes will always be there */
+            dbentry->mask |= KADM5_AUX_ATTRIBUTES;
+
+            /* test for an actual policy reference */
+            memset(&osa_princ_ent, 0, sizeof(osa_princ_ent));
+            xdrmem_create(&xdrs, (char *)tl->tl_data_contents,
+                          tl->tl_data_length, XDR_DECODE);
+            if (xdr_osa_princ_ent_rec(&xdrs, &osa_princ_ent)) {
+                if ((osa_princ_ent.aux_attributes & KADM5_POLICY) &&
+                    osa_princ_ent.policy != NULL)
+                    dbentry->mask |= KADM5_POLICY;
+                kdb_free_entry(NULL, NULL, &osa_princ_ent);
+            }
+            xdr_destroy(&xdrs);
+        }
+    }
+    if (dbentry->n_tl_data)
+        dbentry->mask |= KADM5_TL_DATA;
+    if (dbentry->n_key_data)
+        dbentry->mask |= KADM5_KEY_DATA;
+}
+
+/* Read a beta 7 entry into *entry_out and its name into *name_out.  Return -1
+ * for end of file, 0 for success and 1 for failure. */
 static int
-process_k5beta7_princ(krb5_context context, const char *fname, FILE *filep,
-                      krb5_boolean verbose, int *linenop)
+read_k5beta7_princ(krb5_context context, const char *fname, FILE *filep,
+                   int *linenop, krb5_db_entry **entry_out, char **name_out)
 {
     int retval, nread, i, j;
     krb5_db_entry *dbentry;
@@ -710,7 +1167,6 @@ process_k5beta7_princ(krb5_context context, const char *fname, FILE *filep,
     unsigned int u1, u2, u3, u4, u5;
     char *name = NULL;
     krb5_key_data *kp = NULL, *kd;
-    krb5_tl_data *tl;
     krb5_error_code ret;
 
     dbentry = krb5_db_alloc(context, NULL, sizeof(*dbentry));
@@ -777,41 +1233,11 @@ process_k5beta7_princ(krb5_context context, const char *fname, FILE *filep,
     dbentry->last_success = t6;
     dbentry->last_failed = t7;
     dbentry->fail_auth_count = u1;
-    dbentry->mask = KADM5_LOAD | KADM5_PRINCIPAL | KADM5_ATTRIBUTES |
-        KADM5_MAX_LIFE | KADM5_MAX_RLIFE |
-        KADM5_PRINC_EXPIRE_TIME | KADM5_LAST_SUCCESS |
-        KADM5_LAST_FAILED | KADM5_FAIL_AUTH_COUNT;
 
     /* Read tagged data. */
     if (dbentry->n_tl_data) {
         if (process_tl_data(fname, filep, *linenop, dbentry->tl_data))
             goto fail;
-        for (tl = dbentry->tl_data; tl; tl = tl->tl_data_next) {
-            /* test to set mask fields */
-            if (tl->tl_data_type == KRB5_TL_KADM_DATA) {
-                XDR xdrs;
-                osa_princ_ent_rec osa_princ_ent;
-
-                /*
-                 * Assuming aux_attributes will always be
-                 * there
-                 */
-                dbentry->mask |= KADM5_AUX_ATTRIBUTES;
-
-                /* test for an actual policy reference */
-                memset(&osa_princ_ent, 0, sizeof(osa_princ_ent));
-                xdrmem_create(&xdrs, (char *)tl->tl_data_contents,
-                              tl->tl_data_length, XDR_DECODE);
-                if (xdr_osa_princ_ent_rec(&xdrs, &osa_princ_ent)) {
-                    if ((osa_princ_ent.aux_attributes & KADM5_POLICY) &&
-                        osa_princ_ent.policy != NULL)
-                        dbentry->mask |= KADM5_POLICY;
-                    kdb_free_entry(NULL, NULL, &osa_princ_ent);
-                }
-                xdr_destroy(&xdrs);
-            }
-        }
-        dbentry->mask |= KADM5_TL_DATA;
     }
 
     /* Get the key data. */
@@ -841,8 +1267,6 @@ process_k5beta7_princ(krb5_context context, const char *fname, FILE *filep,
             }
         }
     }
-    if (dbentry->n_key_data)
-        dbentry->mask |= KADM5_KEY_DATA;
 
     /* Get the extra data */
     if (read_octets_or_minus1(filep, dbentry->e_length, &dbentry->e_data)) {
@@ -853,14 +1277,11 @@ process_k5beta7_princ(krb5_context context, const char *fname, FILE *filep,
     /* Finally, find the end of the record. */
     read_record_end(filep, fname, *linenop);
 
-    ret = krb5_db_put_principal(context, dbentry);
-    if (ret) {
-        com_err(progname, ret, _("while storing %s"), name);
-        goto fail;
-    }
-
-    if (verbose)
-        fprintf(stderr, "%s\n", name);
+    set_load_mask(dbentry);
+    *entry_out = dbentry;
+    dbentry = NULL;
+    *name_out = name;
+    name = NULL;
     retval = 0;
 
 cleanup:
@@ -874,6 +1295,44 @@ fail:
     goto cleanup;
 }
 
+/* Store a principal entry read from a dump.  Return 0 for success and 1 for
+ * failure. */
+static int
+store_princ(krb5_context context, krb5_db_entry *dbentry, const char *name,
+            krb5_boolean verbose)
+{
+    krb5_error_code ret;
+
+    ret = krb5_db_put_principal(context, dbentry);
+    if (ret) {
+        com_err(progname, ret, _("while storing %s"), name);
+        return 1;
+    }
+    if (verbose)
+        fprintf(stderr, "%s\n", name);
+    return 0;
+}
+
+/* Read a beta 7 entry and add it to the database.  Return -1 for end of file,
+ * 0 for success and 1 for failure. */
+static int
+process_k5beta7_princ(krb5_context context, const char *fname, FILE *filep,
+                      krb5_boolean verbose, int *linenop)
+{
+    krb5_db_entry *dbentry;
+    char *name;
+    int retval;
+
+    retval = read_k5beta7_princ(context, fname, filep, linenop, &dbentry,
+                                &name);
+    if (retval)
+        return retval;
+    retval = store_princ(context, dbentry, name, verbose);
+    krb5_db_free_principal(context, dbentry);
+    free(name);
+    return retval;
+}
+
 static int
 process_k5beta7_policy(krb5_context context, const char *fname, FILE *filep,
                        krb5_boolean verbose, int *linenop)
@@ -1072,39 +1531,422 @@ process_r1_11_record(krb5_context context, const char *fname, FILE *filep,
                           process_k5beta7_princ, process_r1_11_policy);
 }
 
-dump_version beta7_version = {
-    "Kerberos version 5",
-    "kdb5_util load_dump version 4\n",
-    0,
-    0,
-    0,
-    dump_k5beta7_princ,
-    dump_k5beta7_policy,
-    process_k5beta7_record,
-};
-dump_version ov_version = {
-    "OpenV*Secure V1.0",
-    "OpenV*Secure V1.0\t",
-    1,
-    0,
-    0,
-    dump_ov_princ,
-    dump_k5beta7_policy,
-    process_ov_record
-};
-dump_version r1_3_version = {
-    "Kerberos version 5 release 1.3",
-    "kdb5_util load_dump version 5\n",
-    0,
-    0,
-    0,
-    dump_k5beta7_princ_withpolicy,
-    dump_k5beta7_policy,
-    process_k5beta7_record,
+/* Input for decoding the records of a binary dump block. */
+struct bin_input {
+    const unsigned char *ptr;
+    size_t len;
+    krb5_boolean bad;
 };
-dump_version r1_8_version = {
-    "Kerberos version 5 release 1.8",
-    "kdb5_util load_dump version 6\n",
+
+/* Return a pointer to the next len bytes of in, or NULL (marking in as bad)
+ * if there aren't that many. */
+static const unsigned char *
+bin_get_bytes(struct bin_input *in, size_t len)
+{
+    const unsigned char *p = in->ptr;
+
+    if (in->bad || len > in->len) {
+        in->bad = TRUE;
+        return NULL;
+    }
+    in->ptr += len;
+    in->len -= len;
+    return p;
+}
+
+static unsigned int
+bin_get8(struct bin_input *in)
+{
+    const unsigned char *p = bin_get_bytes(in, 1);
+
+    return (p == NULL) ? 0 : *p;
+}
+
+static unsigned int
+bin_get16(struct bin_input *in)
+{
+    const unsigned char *p = bin_get_bytes(in, 2);
+
+    return (p == NULL) ? 0 : load_16_be(p);
+}
+
+static uint32_t
+bin_get32(struct bin_input *in)
+{
+    const unsigned char *p = bin_get_bytes(in, 4);
+
+    return (p == NULL) ? 0 : load_32_be(p);
+}
+
+/* Read a string with a four-byte length into *str_out, or set it to NULL if
+ * the string is empty. */
+static krb5_error_code
+bin_get_string(struct bin_input *in, char **str_out)
+{
+    krb5_error_code ret;
+    size_t len = bin_get32(in);
+    const unsigned char *p = bin_get_bytes(in, len);
+
+    *str_out = NULL;
+    if (p == NULL)
+        return KRB5_KDB_TRUNCATED_RECORD;
+    if (len == 0)
+        return 0;
+    *str_out = k5memdup0(p, len, &ret);
+    return ret;
+}
+
+/* Read a byte string with a two-byte length into *data_out and *len_out. */
+static krb5_error_code
+bin_get_octets(struct bin_input *in, krb5_octet **data_out, krb5_ui_2 *len_out)
+{
+    krb5_error_code ret;
+    unsigned int len = bin_get16(in);
+    const unsigned char *p = bin_get_bytes(in, len);
+
+    *data_out = NULL;
+    *len_out = 0;
+    if (p == NULL)
+        return KRB5_KDB_TRUNCATED_RECORD;
+    if (len == 0)
+        return 0;
+    *data_out = k5memdup(p, len, &ret);
+    if (*data_out == NULL)
+        return ret;
+    *len_out = len;
+    return 0;
+}
+
+/* Read a count of tl-data items and the items themselves. */
+static krb5_error_code
+bin_get_tl_data(struct bin_input *in, krb5_int16 *n_out, krb5_tl_data **tl_out)
+{
+    krb5_error_code ret;
+    krb5_tl_data *tl;
+    unsigned int n = bin_get16(in);
+
+    if (in->bad || n > 0x7FFF)
+        return KRB5_KDB_TRUNCATED_RECORD;
+    *n_out = n;
+    ret = alloc_tl_data(n, tl_out);
+    if (ret)
+        return ret;
+    for (tl = *tl_out; tl != NULL; tl = tl->tl_data_next) {
+        tl->tl_data_type = bin_get16(in);
+        ret = bin_get_octets(in, &tl->tl_data_contents, &tl->tl_data_length);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/* Decode a principal record into *entry_out and its name into *name_out. */
+static krb5_error_code
+bin_get_princ(krb5_context context, struct bin_input *in,
+              krb5_db_entry **entry_out, char **name_out)
+{
+    krb5_error_code ret;
+    krb5_db_entry *dbentry;
+    krb5_key_data *kd;
+    char *name = NULL;
+    unsigned int n;
+    int i, j;
+
+    *entry_out = NULL;
+    *name_out = NULL;
+    dbentry = krb5_db_alloc(context, NULL, sizeof(*dbentry));
+    if (dbentry == NULL)
+        return ENOMEM;
+    memset(dbentry, 0, sizeof(*dbentry));
+
+    dbentry->len = bin_get16(in);
+    ret = bin_get_string(in, &name);
+    if (!ret && name == NULL)
+        ret = KRB5_KDB_TRUNCATED_RECORD;
+    if (ret)
+        goto cleanup;
+    ret = krb5_parse_name(context, name, &dbentry->princ);
+    if (ret)
+        goto cleanup;
+
+    dbentry->attributes = bin_get32(in);
+    dbentry->max_life = bin_get32(in);
+    dbentry->max_renewable_life = bin_get32(in);
+    dbentry->expiration = bin_get32(in);
+    dbentry->pw_expiration = bin_get32(in);
+    dbentry->last_success = bin_get32(in);
+    dbentry->last_failed = bin_get32(in);
+    dbentry->fail_auth_count = bin_get32(in);
+
+    ret = bin_get_tl_data(in, &dbentry->n_tl_data, &dbentry->tl_data);
+    if (ret)
+        goto cleanup;
+
+    n = bin_get16(in);
+    if (n > 0x7FFF) {
+        ret = KRB5_KDB_TRUNCATED_RECORD;
+        goto cleanup;
+    }
+    if (n > 0) {
+        dbentry->key_data = k5calloc(n, sizeof(*dbentry->key_data), &ret);
+        if (dbentry->key_data == NULL)
+            goto cleanup;
+        dbentry->n_key_data = n;
+    }
+    for (i = 0; i < dbentry->n_key_data; i++) {
+        kd = &dbentry->key_data[i];
+        kd->key_data_ver = bin_get16(in);
+        kd->key_data_kvno = bin_get16(in);
+        if (kd->key_data_ver > KRB5_KDB_V1_KEY_DATA_ARRAY) {
+            ret = KRB5_KDB_TRUNCATED_RECORD;
+            goto cleanup;
+        }
+        for (j = 0; j < kd->key_data_ver; j++) {
+            kd->key_data_type[j] = bin_get16(in);
+            ret = bin_get_octets(in, &kd->key_data_contents[j],
+                                 &kd->key_data_length[j]);
+            if (ret)
+                goto cleanup;
+        }
+    }
+
+    ret = bin_get_octets(in, &dbentry->e_data, &dbentry->e_length);
+    if (ret)
+        goto cleanup;
+    if (in->bad) {
+        ret = KRB5_KDB_TRUNCATED_RECORD;
+        goto cleanup;
+    }
+
+    set_load_mask(dbentry);
+    *entry_out = dbentry;
+    dbentry = NULL;
+    *name_out = name;
+    name = NULL;
+
+cleanup:
+    krb5_db_free_principal(context, dbentry);
+    free(name);
+    return ret;
+}
+
+/* Decode a principal record and add it to the database.  Return 0 for success
+ * and 1 for failure. */
+static int
+bin_load_princ(krb5_context context, struct bin_input *in,
+               krb5_boolean verbose)
+{
+    krb5_error_code ret;
+    krb5_db_entry *dbentry;
+    char *name;
+    int retval;
+
+    ret = bin_get_princ(context, in, &dbentry, &name);
+    if (ret) {
+        com_err(progname, ret, _("while reading principal record"));
+        return 1;
+    }
+    retval = store_princ(context, dbentry, name, verbose);
+    krb5_db_free_principal(context, dbentry);
+    free(name);
+    return retval;
+}
+
+/* Decode a policy record and add it to the database.  Return 0 for success and
+ * 1 for failure. */
+static int
+bin_load_policy(krb5_context context, struct bin_input *in,
+                krb5_boolean verbose)
+{
+    krb5_error_code ret;
+    osa_policy_ent_rec rec;
+    krb5_tl_data *tl, *tl_next;
+
+    memset(&rec, 0, sizeof(rec));
+    ret = bin_get_string(in, &rec.name);
+    if (!ret && rec.name == NULL)
+        ret = KRB5_KDB_TRUNCATED_RECORD;
+    if (ret)
+        goto cleanup;
+    rec.pw_min_life = bin_get32(in);
+    rec.pw_max_life = bin_get32(in);
+    rec.pw_min_length = bin_get32(in);
+    rec.pw_min_classes = bin_get32(in);
+    rec.pw_history_num = bin_get32(in);
+    rec.pw_max_fail = bin_get32(in);
+    rec.pw_failcnt_interval = bin_get32(in);
+    rec.pw_lockout_duration = bin_get32(in);
+    rec.attributes = bin_get32(in);
+    rec.max_life = bin_get32(in);
+    rec.max_renewable_life = bin_get32(in);
+    ret = bin_get_string(in, &rec.allowed_keysalts);
+    if (ret)
+        goto cleanup;
+    ret = bin_get_tl_data(in, &rec.n_tl_data, &rec.tl_data);
+    if (ret)
+        goto cleanup;
+    if (in->bad) {
+        ret = KRB5_KDB_TRUNCATED_RECORD;
+        goto cleanup;
+    }
+
+    ret = krb5_db_create_policy(context, &rec);
+    if (ret)
+        ret = krb5_db_put_policy(context, &rec);
+    if (ret)
+        goto cleanup;
+    if (verbose)
+        fprintf(stderr, "created policy %s\n", rec.name);
+
+cleanup:
+    if (ret)
+        com_err(progname, ret, _("while creating policy"));
+    free(rec.name);
+    free(rec.allowed_keysalts);
+    for (tl = rec.tl_data; tl; tl = tl_next) {
+        tl_next = tl->tl_data_next;
+        free(tl->tl_data_contents);
+        free(tl);
+    }
+    return ret ? 1 : 0;
+}
+
+/* Read the next block of a binary dump into *buf, growing it as needed, and
+ * verify its checksum.  Set *len_out to 0 at the end of the dump. */
+static krb5_error_code
+bin_read_block(krb5_context context, FILE *fp, unsigned char **buf,
+               size_t *bufsize, size_t *len_out)
+{
+    krb5_error_code ret;
+    unsigned char header[BIN_HEADER_LEN], *newbuf;
+    uint32_t len;
+    krb5_data d;
+    krb5_checksum cksum;
+    krb5_boolean valid;
+
+    *len_out = 0;
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header))
+        return ferror(fp) ? errno : KRB5_KDB_TRUNCATED_RECORD;
+    len = load_32_be(header);
+    if (len == 0)
+        return 0;
+    if (load_32_be(header + 4) != 0)
+        return KRB5_KDB_BAD_VERSION;
+    if (len > BIN_MAX_BLOCK_SIZE)
+        return KRB5_KDB_DB_CORRUPT;
+    if (len > *bufsize) {
+        newbuf = realloc(*buf, len);
+        if (newbuf == NULL)
+            return ENOMEM;
+        *buf = newbuf;
+        *bufsize = len;
+    }
+    if (fread(*buf, 1, len, fp) != len)
+        return ferror(fp) ? errno : KRB5_KDB_TRUNCATED_RECORD;
+
+    d = make_data(*buf, len);
+    ret = krb5_c_make_checksum(context, CKSUMTYPE_CRC32, NULL, 0, &d, &cksum);
+    if (ret)
+        return ret;
+    valid = (cksum.length == 4 && memcmp(cksum.contents, header + 8, 4) == 0);
+    krb5_free_checksum_contents(context, &cksum);
+    if (!valid)
+        return KRB5_KDB_DB_CORRUPT;
+    *len_out = len;
+    return 0;
+}
+
+/* Restore the database from a binary dump file. */
+static int
+restore_binary_dump(krb5_context context, char *dumpfile, FILE *f,
+                    krb5_boolean verbose)
+{
+    krb5_error_code ret;
+    unsigned char *buf = NULL;
+    size_t bufsize = 0, len;
+    struct bin_input in, rec;
+    unsigned int type;
+    int err = 0, recno = 0;
+
+    for (;;) {
+        ret = bin_read_block(context, f, &buf, &bufsize, &len);
+        if (ret) {
+            com_err(progname, ret, _("while reading %s after record %d"),
+                    dumpfile, recno);
+            err = 1;
+            break;
+        }
+        if (len == 0)
+            break;
+
+        in.ptr = buf;
+        in.len = len;
+        in.bad = FALSE;
+        while (!err && in.len > 0) {
+            recno++;
+            type = bin_get8(&in);
+            rec.len = bin_get32(&in);
+            rec.ptr = bin_get_bytes(&in, rec.len);
+            rec.bad = in.bad;
+            if (in.bad) {
+                com_err(progname, KRB5_KDB_TRUNCATED_RECORD,
+                        _("while reading record"));
+                err = 1;
+            } else if (type == BIN_RECORD_PRINC) {
+                err = bin_load_princ(context, &rec, verbose);
+            } else if (type == BIN_RECORD_POLICY) {
+                err = bin_load_policy(context, &rec, verbose);
+            }
+            /* Records of other types are skipped. */
+        }
+        if (err) {
+            fprintf(stderr, _("%s: error processing record %d of %s\n"),
+                    progname, recno, dumpfile);
+            break;
+        }
+    }
+
+    free(buf);
+    return err;
+}
+
+dump_version beta7_version = {
+    "Kerberos version 5",
+    "kdb5_util load_dump version 4\n",
+    0,
+    0,
+    0,
+    0,
+    dump_k5beta7_princ,
+    dump_k5beta7_policy,
+    process_k5beta7_record,
+};
+dump_version ov_version = {
+    "OpenV*Secure V1.0",
+    "OpenV*Secure V1.0\t",
+    1,
+    0,
+    0,
+    0,
+    dump_ov_princ,
+    dump_k5beta7_policy,
+    process_ov_record
+};
+dump_version r1_3_version = {
+    "Kerberos version 5 release 1.3",
+    "kdb5_util load_dump version 5\n",
+    0,
+    0,
+    0,
+    0,
+    dump_k5beta7_princ_withpolicy,
+    dump_k5beta7_policy,
+    process_k5beta7_record,
+};
+dump_version r1_8_version = {
+    "Kerberos version 5 release 1.8",
+    "kdb5_util load_dump version 6\n",
+    0,
     0,
     0,
     0,
@@ -1118,6 +1960,7 @@ dump_version r1_11_version = {
     0,
     0,
     0,
+    0,
     dump_k5beta7_princ_withpolicy,
     dump_r1_11_policy,
     process_r1_11_record,
@@ -1128,6 +1971,7 @@ dump_version iprop_version = {
     0,
     1,
     0,
+    0,
     dump_k5beta7_princ_withpolicy,
     dump_k5beta7_policy,
     process_k5beta7_record,
@@ -1138,10 +1982,33 @@ dump_version ipropx_1_version = {
     0,
     1,
     1,
+    0,
     dump_k5beta7_princ_withpolicy,
     dump_r1_11_policy,
     process_r1_11_record,
 };
+dump_version binary_version = {
+    "Kerberos version 5 binary",
+    "kdb5_util load_dump binary version 1\n",
+    0,
+    0,
+    0,
+    1,
+    NULL,
+    dump_binary_policy,
+    NULL,
+};
+dump_version ipropx_2_version = {
+    "Kerberos iprop binary version",
+    "ipropx",
+    0,
+    1,
+    2,
+    1,
+    NULL,
+    dump_binary_policy,
+    NULL,
+};
 
 /* Read the dump header.  Return 1 on success, 0 if the file is not a
  * recognized iprop dump format. */
@@ -1165,6 +2032,8 @@ parse_iprop_header(char *buf, dump_version **dv, uint32_t *last_sno,
             *dv = &iprop_version;
         } else if (u[0] == IPROPX_VERSION_1) {
             *dv = &ipropx_1_version;
+        } else if (u[0] == IPROPX_VERSION_2) {
+            *dv = &ipropx_2_version;
         } else {
             fprintf(stderr, _("%s: Unknown iprop dump version %d\n"), progname,
                     u[0]);
@@ -1187,11 +2056,13 @@ parse_iprop_header(char *buf, dump_version **dv, uint32_t *last_sno,
 }
 
 /* Return 1 if the {sno, timestamp} in an existing dump file is in the
- * ulog, else return 0. */
+ * ulog and the file can be used in place of a dump in format dump, else
+ * return 0. */
 static int
-current_dump_sno_in_ulog(char *ifile, kdb_log_context *log_ctx)
+current_dump_sno_in_ulog(char *ifile, dump_version *dump,
+                         kdb_log_context *log_ctx)
 {
-    dump_version *junk;
+    dump_version *dv;
     uint32_t last_sno, last_seconds, last_useconds;
     char buf[BUFSIZ];
     FILE *f;
@@ -1200,9 +2071,6 @@ current_dump_sno_in_ulog(char *ifile, kdb_log_context *log_ctx)
     kdb_hlog_t *ulog = log_ctx->ulog;
     kdb_ent_header_t *indx_log;
 
-    if (ulog->kdb_last_sno == 0)
-        return 0;              /* nothing in ulog */
-
     f = fopen(ifile, "r");
     if (f == NULL)
         return 0;              /* aliasing other errors to ENOENT here is OK */
@@ -1211,10 +2079,22 @@ current_dump_sno_in_ulog(char *ifile, kdb_log_context *log_ctx)
         return errno ? -1 : 0;
     fclose(f);
 
-    if (!parse_iprop_header(buf, &junk, &last_sno, &last_seconds,
+    if (!parse_iprop_header(buf, &dv, &last_sno, &last_seconds,
                             &last_useconds))
         return 0;
 
+    /* The requester may not understand a later dump version. */
+    if (dv->ipropx > dump->ipropx)
+        return 0;
+
+    /* An empty ulog (such as one just reinitialized) only matches a dump
+     * taken since it was reset, which carries the reset timestamp. */
+    if (ulog->kdb_last_sno == 0) {
+        return last_sno == 0 &&
+            last_seconds == ulog->kdb_last_time.seconds &&
+            last_useconds == ulog->kdb_last_time.useconds;
+    }
+
     /* Quick sanity check */
     if (ulog->kdb_first_sno > last_sno ||
         ulog->kdb_first_time.seconds > last_seconds ||
@@ -1262,7 +2142,7 @@ dump_db(int argc, char **argv)
     char *ofile = NULL, *tmpofile = NULL, *new_mkey_file = NULL;
     krb5_error_code ret, retval;
     dump_version *dump;
-    int aindex, ok_fd = -1;
+    int aindex, ok_fd = -1, nthreads = 1;
     bool_t dump_sno = FALSE;
     kdb_log_context *log_ctx;
     unsigned int ipropx_version = IPROPX_VERSION_0;
@@ -1273,6 +2153,10 @@ dump_db(int argc, char **argv)
     dump = &r1_11_version;
     args.verbose = FALSE;
     args.omit_nra = FALSE;
+    args.ofile = NULL;
+    args.pl = NULL;
+    args.batch = NULL;
+    args.block_err = 0;
     mkey_convert = FALSE;
     log_ctx = util_context->kdblog_context;
 
@@ -1288,11 +2172,18 @@ dump_db(int argc, char **argv)
             dump = &r1_3_version;
         } else if (!strcmp(argv[aindex], "-r18")) {
             dump = &r1_8_version;
+        } else if (!strcmp(argv[aindex], "-binary")) {
+            dump = &binary_version;
         } else if (!strncmp(argv[aindex], "-i", 2)) {
             if (log_ctx && log_ctx->iproprole) {
                 /* ipropx_version is the maximum version acceptable. */
                 ipropx_version = atoi(argv[aindex] + 2);
-                dump = ipropx_version ? &ipropx_1_version : &iprop_version;
+                if (ipropx_version >= IPROPX_VERSION_2)
+                    dump = &ipropx_2_version;
+                else if (ipropx_version == IPROPX_VERSION_1)
+                    dump = &ipropx_1_version;
+                else
+                    dump = &iprop_version;
                 /*
                  * dump_sno is used to indicate if the serial number should be
                  * populated in the output file to be used later by iprop for
@@ -1310,6 +2201,10 @@ dump_db(int argc, char **argv)
             conditional = 1;
         } else if (!strcmp(argv[aindex], "-verbose")) {
             args.verbose = TRUE;
+        } else if (!strcmp(argv[aindex], "-threads") && aindex + 1 < argc) {
+            nthreads = atoi(argv[++aindex]);
+            if (nthreads < 1)
+                usage();
         } else if (!strcmp(argv[aindex], "-mkey_convert")) {
             mkey_convert = 1;
         } else if (!strcmp(argv[aindex], "-new_mkey_file")) {
@@ -1335,17 +2230,25 @@ dump_db(int argc, char **argv)
         }
     }
 
-    /* If a conditional ipropx dump we check if the existing dump is
-     * good enough. */
-    if (ofile != NULL && conditional) {
+    /*
+     * If a conditional ipropx dump we check if the existing dump is
+     * good enough.  Hold the "ok" file lock while checking, so that when
+     * many slaves request a full resync at once, one of them makes the dump
+     * and the rest wait for it and then reuse it.
+     */
+    if (ofile != NULL && strcmp(ofile, "-") != 0 && conditional) {
         if (!dump->iprop) {
             com_err(progname, 0,
                     _("Conditional dump is an undocumented option for "
                       "use only for iprop dumps"));
             goto error;
         }
-        if (current_dump_sno_in_ulog(ofile, log_ctx))
+        if (!prep_ok_file(util_context, ofile, &ok_fd))
+            return;             /* prep_ok_file() bumps exit_status */
+        if (current_dump_sno_in_ulog(ofile, dump, log_ctx)) {
+            update_ok_file(util_context, ok_fd);
             return;
+        }
     }
 
     /*
@@ -1416,7 +2319,7 @@ dump_db(int argc, char **argv)
         /* Discourage accidental dumping to filenames beginning with '-'. */
         if (ofile[0] == '-')
             usage();
-        if (!prep_ok_file(util_context, ofile, &ok_fd))
+        if (ok_fd == -1 && !prep_ok_file(util_context, ofile, &ok_fd))
             return;             /* prep_ok_file() bumps exit_status */
         f = create_ofile(ofile, &tmpofile);
         if (f == NULL) {
@@ -1430,6 +2333,8 @@ dump_db(int argc, char **argv)
     args.ofile = f;
     args.context = util_context;
     args.dump = dump;
+    k5_buf_init_dynamic(&args.block);
+    bin_start_block(&args.block);
     fprintf(args.ofile, "%s", dump->header);
 
     /* We grab the lock twice (once again in the iterator call), but that's ok
@@ -1441,8 +2346,8 @@ dump_db(int argc, char **argv)
     }
 
     if (dump_sno) {
-        if (ipropx_version)
-            fprintf(f, " %u", IPROPX_VERSION);
+        if (dump->ipropx)
+            fprintf(f, " %u", dump->ipropx);
         fprintf(f, " %u", log_ctx->ulog->kdb_last_sno);
         fprintf(f, " %u", log_ctx->ulog->kdb_last_time.seconds);
         fprintf(f, " %u", log_ctx->ulog->kdb_last_time.useconds);
@@ -1451,7 +2356,24 @@ dump_db(int argc, char **argv)
     if (dump->header[strlen(dump->header)-1] != '\n')
         fputc('\n', args.ofile);
 
+#ifdef PARALLEL_DUMP
+    if (nthreads > 1) {
+        ret = pipeline_create(nthreads, format_dump_batch, &args, &args.pl);
+        if (ret) {
+            com_err(progname, ret, _("while starting dump threads"));
+            goto error;
+        }
+    }
+#endif
+
     ret = krb5_db_iterate(util_context, NULL, dump_iterator, &args);
+#ifdef PARALLEL_DUMP
+    if (args.pl != NULL) {
+        ret = finish_dump_batches(&args, ret);
+        pipeline_free(args.pl);
+        args.pl = NULL;
+    }
+#endif
     if (ret) {
         com_err(progname, ret, _("performing %s dump"), dump->name);
         goto error;
@@ -1459,11 +2381,22 @@ dump_db(int argc, char **argv)
 
     if (dump->dump_policy != NULL) {
         ret = krb5_db_iter_policy(util_context, "*", dump->dump_policy, &args);
+        if (!ret)
+            ret = args.block_err;
+        if (ret) {
+            com_err(progname, ret, _("performing %s dump"), dump->name);
+            goto error;
+        }
+    }
+
+    if (dump->binary) {
+        ret = bin_finish_dump(&args);
         if (ret) {
             com_err(progname, ret, _("performing %s dump"), dump->name);
             goto error;
         }
     }
+    k5_free_buf(&args.block);
 
     if (f != stdout) {
         fclose(f);
@@ -1473,6 +2406,8 @@ dump_db(int argc, char **argv)
     return;
 
 error:
+    if (args.ofile != NULL)
+        k5_free_buf(&args.block);
     krb5_db_unlock(util_context);
     if (tmpofile != NULL)
         unlink(tmpofile);
@@ -1480,14 +2415,268 @@ error:
     exit_status++;
 }
 
+#ifdef PARALLEL_DUMP
+
+struct load_record {
+    char *line;
+    int lineno;
+    int status;                 /* result of parsing a principal record */
+    krb5_db_entry *entry;
+    char *name;
+};
+
+struct load_batch {
+    int count;
+    struct load_record recs[BATCH_SIZE];
+};
+
+struct load_args {
+    krb5_context context;
+    const char *dumpfile;
+};
+
+static void
+free_load_batch(krb5_context context, struct load_batch *batch)
+{
+    int i;
+
+    if (batch == NULL)
+        return;
+    for (i = 0; i < batch->count; i++) {
+        free(batch->recs[i].line);
+        krb5_db_free_principal(context, batch->recs[i].entry);
+        free(batch->recs[i].name);
+    }
+    free(batch);
+}
+
+/* Pipeline function: parse the principal records of a batch. */
+static void
+parse_load_batch(void *arg, void *item)
+{
+    struct load_args *largs = arg;
+    struct load_batch *batch = item;
+    struct load_record *rec;
+    FILE *fp;
+    int i, lineno;
+
+    for (i = 0; i < batch->count; i++) {
+        rec = &batch->recs[i];
+        if (strncmp(rec->line, "princ\t", 6) != 0)
+            continue;
+        fp = fmemopen(rec->line + 6, strlen(rec->line + 6), "r");
+        if (fp == NULL) {
+            com_err(progname, errno, _("while parsing line %d"), rec->lineno);
+            rec->status = 1;
+            continue;
+        }
+        lineno = rec->lineno - 1;
+        rec->status = read_k5beta7_princ(largs->context, largs->dumpfile, fp,
+                                         &lineno, &rec->entry, &rec->name);
+        fclose(fp);
+    }
+}
+
+/*
+ * Store the records of a parsed batch in order, processing records other than
+ * principals here.  Return -1 if the records end the dump, 0 for success, or 1
+ * for failure with the line number of the failing record in *lineno_out.
+ */
+static int
+store_load_batch(krb5_context context, const char *dumpfile,
+                 dump_version *dump, krb5_boolean verbose,
+                 struct load_batch *batch, int *lineno_out)
+{
+    struct load_record *rec;
+    FILE *fp;
+    int i, err, lineno;
+
+    for (i = 0; i < batch->count; i++) {
+        rec = &batch->recs[i];
+        if (rec->entry != NULL) {
+            err = store_princ(context, rec->entry, rec->name, verbose);
+        } else if (rec->status != 0) {
+            err = rec->status;
+        } else {
+            fp = fmemopen(rec->line, strlen(rec->line), "r");
+            if (fp == NULL) {
+                com_err(progname, errno, _("while parsing line %d"),
+                        rec->lineno);
+                err = 1;
+            } else {
+                lineno = rec->lineno - 1;
+                err = dump->load_record(context, dumpfile, fp, verbose,
+                                        &lineno);
+                fclose(fp);
+            }
+        }
+        if (err) {
+            *lineno_out = rec->lineno;
+            return err;
+        }
+    }
+    return 0;
+}
+
+/* Read a line of any length from f into *line_out, which is set to NULL at end
+ * of file. */
+static krb5_error_code
+read_line(FILE *f, char **line_out)
+{
+    struct k5buf buf;
+    char chunk[BUFSIZ];
+    size_t len;
+
+    *line_out = NULL;
+    k5_buf_init_dynamic(&buf);
+    while (fgets(chunk, sizeof(chunk), f) != NULL) {
+        k5_buf_add(&buf, chunk);
+        len = strlen(chunk);
+        if (len > 0 && chunk[len - 1] == '\n')
+            break;
+    }
+    if (ferror(f)) {
+        k5_free_buf(&buf);
+        return errno;
+    }
+    if (k5_buf_data(&buf) == NULL)
+        return ENOMEM;
+    if (k5_buf_len(&buf) == 0) {
+        k5_free_buf(&buf);
+        return 0;
+    }
+    *line_out = k5_buf_data(&buf);
+    return 0;
+}
+
+/* Submit a batch of records, first storing parsed batches as needed to make
+ * room for it. */
+static int
+submit_load_batch(krb5_context context, const char *dumpfile,
+                  dump_version *dump, krb5_boolean verbose,
+                  struct pipeline *pl, struct load_batch *batch,
+                  int *lineno_out)
+{
+    struct load_batch *done;
+    int err;
+
+    while (pipeline_full(pl)) {
+        done = pipeline_next(pl);
+        err = store_load_batch(context, dumpfile, dump, verbose, done,
+                               lineno_out);
+        free_load_batch(context, done);
+        if (err) {
+            free_load_batch(context, batch);
+            return err;
+        }
+    }
+    pipeline_submit(pl, batch);
+    return 0;
+}
+
+/* Restore the database from a dump file, parsing principal records with
+ * nthreads worker threads.  Records must each fit on a single line. */
+static int
+restore_dump_threads(krb5_context context, char *dumpfile, FILE *f,
+                     krb5_boolean verbose, dump_version *dump, int nthreads)
+{
+    krb5_error_code ret;
+    struct load_args largs;
+    struct pipeline *pl;
+    struct load_batch *batch = NULL, *done;
+    char *line;
+    int err = 0, lineno = 1, errline = 0;
+
+    largs.context = context;
+    largs.dumpfile = dumpfile;
+    ret = pipeline_create(nthreads, parse_load_batch, &largs, &pl);
+    if (ret) {
+        com_err(progname, ret, _("while starting load threads"));
+        return 1;
+    }
+
+    while (!err) {
+        ret = read_line(f, &line);
+        if (ret) {
+            com_err(progname, ret, _("while reading %s"), dumpfile);
+            err = 1;
+            break;
+        }
+        if (line == NULL)
+            break;
+        lineno++;
+
+        /* Skip blank lines as the record parsers do. */
+        if (line[strspn(line, " \t\r\n")] == '\0') {
+            free(line);
+            continue;
+        }
+
+        if (batch == NULL) {
+            batch = k5alloc(sizeof(*batch), &ret);
+            if (batch == NULL) {
+                free(line);
+                com_err(progname, ret, _("while reading %s"), dumpfile);
+                err = 1;
+                break;
+            }
+        }
+        batch->recs[batch->count].line = line;
+        batch->recs[batch->count].lineno = lineno;
+        if (++batch->count == BATCH_SIZE) {
+            err = submit_load_batch(context, dumpfile, dump, verbose, pl,
+                                    batch, &errline);
+            batch = NULL;
+        }
+    }
+
+    if (!err && batch != NULL) {
+        err = submit_load_batch(context, dumpfile, dump, verbose, pl, batch,
+                                &errline);
+        batch = NULL;
+    }
+    while (!err && (done = pipeline_next(pl)) != NULL) {
+        err = store_load_batch(context, dumpfile, dump, verbose, done,
+                               &errline);
+        free_load_batch(context, done);
+    }
+
+    /* Discard anything left over after an error or the end of the dump. */
+    free_load_batch(context, batch);
+    while ((done = pipeline_next(pl)) != NULL)
+        free_load_batch(context, done);
+    pipeline_free(pl);
+
+    if (err > 0) {
+        if (errline != 0) {
+            fprintf(stderr, _("%s: error processing line %d of %s\n"),
+                    progname, errline, dumpfile);
+        }
+        return err;
+    }
+    return 0;
+}
+
+#endif /* PARALLEL_DUMP */
+
 /* Restore the database from any version dump file. */
 static int
 restore_dump(krb5_context context, char *dumpfile, FILE *f,
-             krb5_boolean verbose, dump_version *dump)
+             krb5_boolean verbose, dump_version *dump, int nthreads)
 {
     int err = 0;
     int lineno = 1;
 
+    if (dump->binary)
+        return restore_binary_dump(context, dumpfile, f, verbose);
+
+#ifdef PARALLEL_DUMP
+    /* The ov format's principal records aren't handled by the threads. */
+    if (nthreads > 1 && dump->load_record != process_ov_record)
+        return restore_dump_threads(context, dumpfile, f, verbose, dump,
+                                    nthreads);
+#endif
+
     /* Process the records. */
     while (!(err = dump->load_record(context, dumpfile, f, verbose, &lineno)));
     if (err != -1) {
@@ -1511,7 +2700,7 @@ load_db(int argc, char **argv)
     extern int optind;
     char *dumpfile = NULL, *dbname, buf[BUFSIZ];
     dump_version *load = NULL;
-    int aindex;
+    int aindex, nthreads = 1;
     kdb_log_context *log_ctx;
     krb5_boolean db_locked = FALSE, temp_db_created = FALSE;
     krb5_boolean verbose = FALSE, update = FALSE, iprop_load = FALSE;
@@ -1544,6 +2733,10 @@ load_db(int argc, char **argv)
             verbose = TRUE;
         } else if (!strcmp(argv[aindex], "-update")){
             update = TRUE;
+        } else if (!strcmp(argv[aindex], "-threads") && aindex + 1 < argc) {
+            nthreads = atoi(argv[++aindex]);
+            if (nthreads < 1)
+                usage();
         } else if (!strcmp(argv[aindex], "-hash")) {
             if (!add_db_arg("hash=true")) {
                 com_err(progname, ENOMEM, _("while parsing options"));
@@ -1592,6 +2785,8 @@ load_db(int argc, char **argv)
             load = &r1_8_version;
         } else if (strcmp(buf, r1_11_version.header) == 0) {
             load = &r1_11_version;
+        } else if (strcmp(buf, binary_version.header) == 0) {
+            load = &binary_version;
         } else if (strncmp(buf, ov_version.header,
                            strlen(ov_version.header)) == 0) {
             load = &ov_version;
@@ -1681,7 +2876,7 @@ load_db(int argc, char **argv)
     }
 
     if (restore_dump(util_context, dumpfile ? dumpfile : _("standard input"),
-                     f, verbose, load)) {
+                     f, verbose, load, nthreads)) {
         fprintf(stderr, _("%s: %s restore failed\n"), progname, load->name);
         goto error;
     }
@@ -85,11 +85,12 @@ void usage()
               "\tcreate  [-s]\n"
               "\tdestroy [-f]\n"
               "\tstash   [-f keyfile]\n"
-              "\tdump    [-old|-ov|-b6|-b7|-r13|-r18] [-verbose]\n"
+              "\tdump    [-old|-ov|-b6|-b7|-r13|-r18|-binary] [-verbose]\n"
               "\t        [-mkey_convert] [-new_mkey_file mkey_file]\n"
-              "\t        [-rev] [-recurse] [filename [princs...]]\n"
+              "\t        [-threads n] [-rev] [-recurse] [filename [princs...]]\n"
               "\tload    [-old|-ov|-b6|-b7|-r13|-r18] [-verbose] [-update] "
-              "filename\n"
+              "[-threads n]\n"
+              "\t        filename\n"
               "\tark     [-e etype_list] principal\n"
               "\tadd_mkey [-e etype] [-s]\n"
               "\tuse_mkey kvno [time]\n"
@@ -98,6 +99,7 @@ void usage()
     fprintf(stderr,
             _("\tupdate_princ_encryption [-f] [-n] [-v] [princ-pattern]\n"
               "\tpurge_mkeys [-f] [-n] [-v]\n"
+              "\tcompile filename\n"
               "\nwhere,\n\t[-x db_args]* - any number of database specific "
               "arguments.\n"
               "\t\t\tLook at each database documentation for supported "
@@ -118,6 +120,7 @@ krb5_boolean dbactive = FALSE;
 static int open_db_and_mkey(void);
 
 static void add_random_key(int, char **);
+static void compile_db(int, char **);
 
 typedef void (*cmd_func)(int, char **);
 
@@ -137,6 +140,7 @@ struct _cmd_table {
     {"list_mkeys", kdb5_list_mkeys, 1},
     {"update_princ_encryption", kdb5_update_princ_encryption, 1},
     {"purge_mkeys", kdb5_purge_mkeys, 1},
+    {"compile", compile_db, 1},
     {NULL, NULL, 0},
 };
 
@@ -643,3 +647,18 @@ add_random_key(argc, argv)
     }
     printf(_("%s changed\n"), pr_str);
 }
+
+/* Write a read-only compiled copy of the database for the KDC. */
+static void
+compile_db(int argc, char **argv)
+{
+    krb5_error_code ret;
+
+    if (argc != 2)
+        usage();
+    ret = krb5_db_compile(util_context, argv[1]);
+    if (ret) {
+        com_err(progname, ret, _("while compiling database to %s"), argv[1]);
+        exit_status++;
+    }
+}
@@ -95,3 +95,13 @@ extern krb5_error_code add_new_mkey(krb5_context, krb5_db_entry *,
 extern krb5_kvno get_next_kvno(krb5_context, krb5_db_entry *);
 
 void usage (void);
+
+/* pipeline.c */
+struct pipeline;
+typedef void (*pipeline_fn)(void *arg, void *item);
+krb5_error_code pipeline_create(int nthreads, pipeline_fn fn, void *arg,
+                                struct pipeline **pl_out);
+krb5_boolean pipeline_full(struct pipeline *pl);
+void pipeline_submit(struct pipeline *pl, void *item);
+void *pipeline_next(struct pipeline *pl);
+void pipeline_free(struct pipeline *pl);
@@ -0,0 +1,231 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* kadmin/dbutil/pipeline.c - Ordered worker threads for dump and load */
+/*
+ * Copyright (C) 2014 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A pipeline applies a function to a sequence of items on worker threads,
+ * and hands the items back to the submitting thread in the order they were
+ * submitted.  Only the submitting thread calls pipeline_submit() and
+ * pipeline_next(); it must collect an item with pipeline_next() whenever
+ * pipeline_full() is true, which bounds the number of items in flight.
+ *
+ * Without thread support, pipeline_submit() applies the function
+ * immediately, so callers work the same way either way.
+ */
+
+#include <k5-int.h>
+#include <kadm5/admin.h>
+#include "kdb5_util.h"
+
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+struct pipeline {
+    pipeline_fn fn;
+    void *fnarg;
+    void **items;
+    unsigned char *done;
+    size_t nslots;
+    size_t head;                /* Next item to return */
+    size_t claim;               /* Next item for a worker to process */
+    size_t tail;                /* Next slot to fill */
+#ifdef ENABLE_THREADS
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;     /* Signaled on submit and on shutdown */
+    pthread_cond_t done_cv;     /* Signaled when an item is processed */
+    pthread_t *threads;
+    int nthreads;
+    int stopping;
+#endif
+};
+
+#ifdef ENABLE_THREADS
+
+static void *
+worker_main(void *arg)
+{
+    struct pipeline *pl = arg;
+    size_t slot;
+
+    pthread_mutex_lock(&pl->lock);
+    for (;;) {
+        while (!pl->stopping && pl->claim == pl->tail)
+            pthread_cond_wait(&pl->work_cv, &pl->lock);
+        if (pl->claim == pl->tail)
+            break;
+        slot = pl->claim++ % pl->nslots;
+        pthread_mutex_unlock(&pl->lock);
+
+        pl->fn(pl->fnarg, pl->items[slot]);
+
+        pthread_mutex_lock(&pl->lock);
+        pl->done[slot] = 1;
+        pthread_cond_broadcast(&pl->done_cv);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+#endif /* ENABLE_THREADS */
+
+krb5_error_code
+pipeline_create(int nthreads, pipeline_fn fn, void *fnarg,
+                struct pipeline **pl_out)
+{
+    krb5_error_code ret;
+    struct pipeline *pl;
+
+    *pl_out = NULL;
+    pl = k5alloc(sizeof(*pl), &ret);
+    if (pl == NULL)
+        return ret;
+    pl->fn = fn;
+    pl->fnarg = fnarg;
+    /* Allow a few items per thread so that the workers don't wait for the
+     * submitting thread. */
+    pl->nslots = (nthreads > 0 ? nthreads : 1) * 4;
+    pl->items = k5calloc(pl->nslots, sizeof(*pl->items), &ret);
+    if (pl->items == NULL)
+        goto error;
+    pl->done = k5calloc(pl->nslots, 1, &ret);
+    if (pl->done == NULL)
+        goto error;
+
+#ifdef ENABLE_THREADS
+    pl->threads = k5calloc(nthreads, sizeof(*pl->threads), &ret);
+    if (pl->threads == NULL)
+        goto error;
+    ret = pthread_mutex_init(&pl->lock, NULL);
+    if (ret)
+        goto error;
+    ret = pthread_cond_init(&pl->work_cv, NULL);
+    if (ret) {
+        pthread_mutex_destroy(&pl->lock);
+        goto error;
+    }
+    ret = pthread_cond_init(&pl->done_cv, NULL);
+    if (ret) {
+        pthread_cond_destroy(&pl->work_cv);
+        pthread_mutex_destroy(&pl->lock);
+        goto error;
+    }
+    for (pl->nthreads = 0; pl->nthreads < nthreads; pl->nthreads++) {
+        ret = pthread_create(&pl->threads[pl->nthreads], NULL, worker_main,
+                             pl);
+        if (ret) {
+            pipeline_free(pl);
+            return ret;
+        }
+    }
+#endif
+
+    *pl_out = pl;
+    return 0;
+
+error:
+#ifdef ENABLE_THREADS
+    free(pl->threads);
+#endif
+    free(pl->done);
+    free(pl->items);
+    free(pl);
+    return ret;
+}
+
+krb5_boolean
+pipeline_full(struct pipeline *pl)
+{
+    return pl->tail - pl->head == pl->nslots;
+}
+
+void
+pipeline_submit(struct pipeline *pl, void *item)
+{
+    size_t slot = pl->tail % pl->nslots;
+
+    assert(!pipeline_full(pl));
+    pl->items[slot] = item;
+    pl->done[slot] = 0;
+#ifdef ENABLE_THREADS
+    pthread_mutex_lock(&pl->lock);
+    pl->tail++;
+    pthread_cond_signal(&pl->work_cv);
+    pthread_mutex_unlock(&pl->lock);
+#else
+    pl->tail++;
+    pl->fn(pl->fnarg, item);
+    pl->done[slot] = 1;
+#endif
+}
+
+void *
+pipeline_next(struct pipeline *pl)
+{
+    size_t slot = pl->head % pl->nslots;
+
+    if (pl->head == pl->tail)
+        return NULL;
+#ifdef ENABLE_THREADS
+    pthread_mutex_lock(&pl->lock);
+    while (!pl->done[slot])
+        pthread_cond_wait(&pl->done_cv, &pl->lock);
+    pthread_mutex_unlock(&pl->lock);
+#endif
+    pl->head++;
+    return pl->items[slot];
+}
+
+void
+pipeline_free(struct pipeline *pl)
+{
+#ifdef ENABLE_THREADS
+    int i;
+#endif
+
+    if (pl == NULL)
+        return;
+#ifdef ENABLE_THREADS
+    pthread_mutex_lock(&pl->lock);
+    pl->stopping = 1;
+    pthread_cond_broadcast(&pl->work_cv);
+    pthread_mutex_unlock(&pl->lock);
+    for (i = 0; i < pl->nthreads; i++)
+        pthread_join(pl->threads[i], NULL);
+    pthread_cond_destroy(&pl->done_cv);
+    pthread_cond_destroy(&pl->work_cv);
+    pthread_mutex_destroy(&pl->lock);
+    free(pl->threads);
+#endif
+    free(pl->done);
+    free(pl->items);
+    free(pl);
+}
@@ -349,7 +349,11 @@ ipropx_resync(uint32_t vers, struct svc_req *rqstp)
      * ulog.  This allows us to share a single global dump with all
      * slaves, since it's OK to share an older dump, as long as its sno
      * and timestamp are in the ulog (then the slaves can get the
-     * subsequent updates very iprop).
+     * subsequent updates very iprop).  kdb5_util holds the dump's "ok"
+     * file lock while it decides, so when many slaves resync at once
+     * (e.g. after the ulog is reinitialized) the first request makes
+     * the dump and the children for the others wait for it and then
+     * send it unchanged.
      */
     if (asprintf(&ubuf, "%s dump -i%d -c %s",
 		 kdb5_util, vers, dump_file) < 0) {
@@ -45,6 +45,11 @@ struct dispatch_state {
     int is_tcp;
     kdc_realm_t *active_realm;
     krb5_context kdc_err_context;
+    const krb5_fulladdr *from;
+    krb5_error_code code;       /* Result of threaded processing */
+    krb5_data *response;        /* Result of threaded processing */
+    struct kdc_timing timing;
+    krb5_boolean shed;          /* Request waited too long in the queue */
 };
 
 static void
@@ -54,6 +59,7 @@ finish_dispatch(struct dispatch_state *state, krb5_error_code code,
     loop_respond_fn oldrespond = state->respond;
     void *oldarg = state->arg;
     kdc_realm_t *kdc_active_realm = state->active_realm;
+    struct kdc_timing timing = state->timing;
 
     if (state->is_tcp == 0 && response &&
         response->length > (unsigned int)max_dgram_reply_size) {
@@ -67,7 +73,10 @@ finish_dispatch(struct dispatch_state *state, krb5_error_code code,
     }
 
     free(state);
+    kdc_phase_begin(&timing, KDC_PHASE_SEND);
     (*oldrespond)(oldarg, code, response);
+    kdc_phase_end(&timing, KDC_PHASE_SEND);
+    kdc_timing_finish(&timing);
 }
 
 static void
@@ -90,6 +99,38 @@ finish_dispatch_cache(void *arg, krb5_error_code code, krb5_data *response)
     finish_dispatch(state, code, response);
 }
 
+/* Process a TGS request on a worker thread, using the thread's handle. */
+static void
+tgs_work(struct server_handle *handle, void *arg)
+{
+    struct dispatch_state *state = arg;
+
+    kdc_phase_end(&state->timing, KDC_PHASE_QUEUE);
+
+    /* Don't bother answering a UDP request the client has probably given up
+     * on or retransmitted by now. */
+    if (!state->is_tcp && kdc_queue_expired(&state->timing)) {
+        state->shed = TRUE;
+        return;
+    }
+    state->code = process_tgs_req(handle, state->request, state->from,
+                                  &state->timing, &state->response);
+}
+
+/* Finish a TGS request processed by a worker thread. */
+static void
+tgs_done(void *arg)
+{
+    struct dispatch_state *state = arg;
+
+    if (state->shed) {
+        kdc_count_shed();
+        finish_dispatch_cache(state, 0, NULL);
+        return;
+    }
+    finish_dispatch_cache(state, state->code, state->response);
+}
+
 static void
 reseed_random(krb5_context kdc_err_context)
 {
@@ -140,6 +181,13 @@ dispatch(void *cb, struct sockaddr *local_saddr,
     state->request = pkt;
     state->is_tcp = is_tcp;
     state->kdc_err_context = kdc_err_context;
+    kdc_timing_start(&state->timing, from);
+
+    /* Silently drop the request if its source is over its rate limit. */
+    if (kdc_ratelimit_addr(from)) {
+        finish_dispatch(state, 0, NULL);
+        return;
+    }
 
     /* decode incoming packet, and dispatch */
 
@@ -177,9 +225,29 @@ dispatch(void *cb, struct sockaddr *local_saddr,
     /* try TGS_REQ first; they are more common! */
 
     if (krb5_is_tgs_req(pkt)) {
-        retval = process_tgs_req(handle, pkt, from, &response);
+        /* Hand the request to a worker thread if we have them, and process it
+         * here if that fails. */
+        state->from = from;
+        state->timing.req_type = KDC_REQ_TGS;
+        if (kdc_threads_active()) {
+            kdc_phase_begin(&state->timing, KDC_PHASE_QUEUE);
+            if (kdc_threads_submit(tgs_work, tgs_done, state) == 0)
+                return;
+            kdc_phase_end(&state->timing, KDC_PHASE_QUEUE);
+        }
+        retval = process_tgs_req(handle, pkt, from, &state->timing,
+                                 &response);
     } else if (krb5_is_as_req(pkt)) {
-        if (!(retval = decode_krb5_as_req(pkt, &as_req))) {
+        state->timing.req_type = KDC_REQ_AS;
+        kdc_phase_begin(&state->timing, KDC_PHASE_DECODE);
+        retval = decode_krb5_as_req(pkt, &as_req);
+        kdc_phase_end(&state->timing, KDC_PHASE_DECODE);
+        if (!retval && kdc_ratelimit_princ(kdc_err_context, as_req->client)) {
+            krb5_free_kdc_req(kdc_err_context, as_req);
+            finish_dispatch_cache(state, 0, NULL);
+            return;
+        }
+        if (!retval) {
             /*
              * setup_server_realm() sets up the global realm-specific data
              * pointer.
@@ -187,8 +255,9 @@ dispatch(void *cb, struct sockaddr *local_saddr,
              */
             state->active_realm = setup_server_realm(handle, as_req->server);
             if (state->active_realm != NULL) {
-                process_as_req(as_req, pkt, from, state->active_realm, vctx,
-                               finish_dispatch_cache, state);
+                process_as_req(as_req, pkt, from, state->active_realm,
+                               &state->timing, vctx, finish_dispatch_cache,
+                               state);
                 return;
             } else {
                 retval = KRB5KDC_ERR_WRONG_REALM;
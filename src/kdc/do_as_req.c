@@ -98,6 +98,7 @@ struct as_req_state {
     krb5_enc_tkt_part enc_tkt_reply;
     krb5_enc_kdc_rep_part reply_encpart;
     krb5_ticket ticket_reply;
+    krb5_key server_key;
     krb5_keyblock server_keyblock;
     krb5_keyblock client_keyblock;
     krb5_db_entry *client;
@@ -123,6 +124,7 @@ struct as_req_state {
 
     kdc_realm_t *active_realm;
     krb5_audit_state *au_state;
+    struct kdc_timing *timing;
 };
 
 static void
@@ -177,10 +179,14 @@ finish_process_as_req(struct as_req_state *state, krb5_error_code errcode)
      *
      *  server_keyblock is later used to generate auth data signatures
      */
-    if ((errcode = krb5_dbe_decrypt_key_data(kdc_context, NULL,
-                                             server_key,
-                                             &state->server_keyblock,
-                                             NULL))) {
+    if ((errcode = kdc_get_cached_key(kdc_active_realm, server_key, -1,
+                                      &state->server_key))) {
+        state->status = "DECRYPT_SERVER_KEY";
+        goto egress;
+    }
+    if ((errcode = krb5_copy_keyblock_contents(kdc_context,
+                                               &state->server_key->keyblock,
+                                               &state->server_keyblock))) {
         state->status = "DECRYPT_SERVER_KEY";
         goto egress;
     }
@@ -256,6 +262,7 @@ finish_process_as_req(struct as_req_state *state, krb5_error_code errcode)
         goto egress;
     }
 
+    kdc_phase_begin(state->timing, KDC_PHASE_AUTHDATA);
     errcode = handle_authdata(kdc_context,
                               state->c_flags,
                               state->client,
@@ -269,6 +276,7 @@ finish_process_as_req(struct as_req_state *state, krb5_error_code errcode)
                               NULL, /* for_user_princ */
                               NULL, /* enc_tkt_request */
                               &state->enc_tkt_reply);
+    kdc_phase_end(state->timing, KDC_PHASE_AUTHDATA);
     if (errcode) {
         krb5_klog_syslog(LOG_INFO, _("AS_REQ : handle_authdata (%d)"),
                          errcode);
@@ -276,8 +284,10 @@ finish_process_as_req(struct as_req_state *state, krb5_error_code errcode)
         goto egress;
     }
 
-    errcode = krb5_encrypt_tkt_part(kdc_context, &state->server_keyblock,
-                                    &state->ticket_reply);
+    kdc_phase_begin(state->timing, KDC_PHASE_TICKET);
+    errcode = kdc_encrypt_tkt_part(kdc_context, state->server_key,
+                                   &state->ticket_reply);
+    kdc_phase_end(state->timing, KDC_PHASE_TICKET);
     if (errcode) {
         state->status = "ENCRYPTING_TICKET";
         goto egress;
@@ -320,10 +330,12 @@ finish_process_as_req(struct as_req_state *state, krb5_error_code errcode)
 
     if (kdc_fast_hide_client(state->rstate))
         state->reply.client = (krb5_principal)krb5_anonymous_principal();
+    kdc_phase_begin(state->timing, KDC_PHASE_REPLY);
     errcode = krb5_encode_kdc_rep(kdc_context, KRB5_AS_REP,
                                   &state->reply_encpart, 0,
                                   as_encrypting_key,
                                   &state->reply, &response);
+    kdc_phase_end(state->timing, KDC_PHASE_REPLY);
     if (client_key != NULL)
         state->reply.enc_part.kvno = client_key->key_data_kvno;
     if (errcode) {
@@ -389,6 +401,7 @@ egress:
     if (state->enc_tkt_reply.authorization_data != NULL)
         krb5_free_authdata(kdc_context,
                            state->enc_tkt_reply.authorization_data);
+    krb5_k_free_key(kdc_context, state->server_key);
     if (state->server_keyblock.contents != NULL)
         krb5_free_keyblock_contents(kdc_context, &state->server_keyblock);
     if (state->client_keyblock.contents != NULL)
@@ -436,6 +449,7 @@ finish_preauth(void *arg, krb5_error_code code)
     struct as_req_state *state = arg;
     krb5_error_code real_code = code;
 
+    kdc_phase_end(state->timing, KDC_PHASE_AUTH);
     if (code) {
         if (vague_errors)
             code = KRB5KRB_ERR_GENERIC;
@@ -469,7 +483,8 @@ finish_preauth(void *arg, krb5_error_code code)
 void
 process_as_req(krb5_kdc_req *request, krb5_data *req_pkt,
                const krb5_fulladdr *from, kdc_realm_t *kdc_active_realm,
-               verto_ctx *vctx, loop_respond_fn respond, void *arg)
+               struct kdc_timing *timing, verto_ctx *vctx,
+               loop_respond_fn respond, void *arg)
 {
     krb5_error_code errcode;
     unsigned int s_flags = 0;
@@ -489,6 +504,7 @@ process_as_req(krb5_kdc_req *request, krb5_data *req_pkt,
     state->req_pkt = req_pkt;
     state->from = from;
     state->active_realm = kdc_active_realm;
+    state->timing = timing;
 
     errcode = kdc_make_rstate(kdc_active_realm, &state->rstate);
     if (errcode != 0) {
@@ -586,8 +602,10 @@ process_as_req(krb5_kdc_req *request, krb5_data *req_pkt,
     if (include_pac_p(kdc_context, state->request)) {
         setflag(state->c_flags, KRB5_KDB_FLAG_INCLUDE_PAC);
     }
+    kdc_phase_begin(state->timing, KDC_PHASE_DB);
     errcode = krb5_db_get_principal(kdc_context, state->request->client,
                                     state->c_flags, &state->client);
+    kdc_phase_end(state->timing, KDC_PHASE_DB);
     if (errcode == KRB5_KDB_CANTLOCK_DB)
         errcode = KRB5KDC_ERR_SVC_UNAVAILABLE;
     if (errcode == KRB5_KDB_NOENTRY) {
@@ -622,8 +640,10 @@ process_as_req(krb5_kdc_req *request, krb5_data *req_pkt,
     if (isflagset(state->request->kdc_options, KDC_OPT_CANONICALIZE)) {
         setflag(s_flags, KRB5_KDB_FLAG_CANONICALIZE);
     }
+    kdc_phase_begin(state->timing, KDC_PHASE_DB);
     errcode = krb5_db_get_principal(kdc_context, state->request->server,
                                     s_flags, &state->server);
+    kdc_phase_end(state->timing, KDC_PHASE_DB);
     if (errcode == KRB5_KDB_CANTLOCK_DB)
         errcode = KRB5KDC_ERR_SVC_UNAVAILABLE;
     if (errcode == KRB5_KDB_NOENTRY) {
@@ -773,6 +793,7 @@ process_as_req(krb5_kdc_req *request, krb5_data *req_pkt,
     /*
      * Check the preauthentication if it is there.
      */
+    kdc_phase_begin(state->timing, KDC_PHASE_AUTH);
     if (state->request->padata) {
         check_padata(kdc_context, &state->rock, state->req_pkt,
                      state->request, &state->enc_tkt_reply, &state->pa_context,
@@ -99,7 +99,8 @@ search_sprinc(kdc_realm_t *, krb5_kdc_req *, krb5_flags,
 /*ARGSUSED*/
 krb5_error_code
 process_tgs_req(struct server_handle *handle, krb5_data *pkt,
-                const krb5_fulladdr *from, krb5_data **response)
+                const krb5_fulladdr *from, struct kdc_timing *timing,
+                krb5_data **response)
 {
     krb5_keyblock * subkey = 0;
     krb5_keyblock * tgskey = 0;
@@ -114,6 +115,7 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
     int newtransited = 0;
     krb5_error_code retval = 0;
     krb5_keyblock encrypting_key;
+    krb5_key server_kkey = NULL;
     krb5_timestamp kdc_time, authtime = 0;
     krb5_keyblock session_key;
     krb5_keyblock *reply_key = NULL;
@@ -144,7 +146,9 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
     memset(&enc_tkt_reply, 0, sizeof(enc_tkt_reply));
     session_key.contents = NULL;
 
+    kdc_phase_begin(timing, KDC_PHASE_DECODE);
     retval = decode_krb5_tgs_req(pkt, &request);
+    kdc_phase_end(timing, KDC_PHASE_DECODE);
     if (retval)
         return retval;
     /* Save pointer to client-requested service principal, in case of
@@ -179,9 +183,11 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
     /* Seed the audit trail with the request ID and basic information. */
     kau_tgs_req(kdc_context, TRUE, au_state);
 
+    kdc_phase_begin(timing, KDC_PHASE_AUTH);
     errcode = kdc_process_tgs_req(kdc_active_realm,
                                   request, from, pkt, &header_ticket,
                                   &krbtgt, &tgskey, &subkey, &pa_tgs_req);
+    kdc_phase_end(timing, KDC_PHASE_AUTH);
     if (header_ticket && header_ticket->enc_part2)
         cprinc = header_ticket->enc_part2->client;
 
@@ -241,8 +247,10 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
         setflag(s_flags, KRB5_KDB_FLAG_CANONICALIZE);
     }
 
+    kdc_phase_begin(timing, KDC_PHASE_DB);
     errcode = search_sprinc(kdc_active_realm, request, s_flags, &server,
                             &status);
+    kdc_phase_end(timing, KDC_PHASE_DB);
     if (errcode != 0)
         goto cleanup;
     sprinc = server->princ;
@@ -554,9 +562,14 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
          * Convert server.key into a real key
          * (it may be encrypted in the database)
          */
-        if ((errcode = krb5_dbe_decrypt_key_data(kdc_context, NULL,
-                                                 server_key, &encrypting_key,
-                                                 NULL))) {
+        if ((errcode = kdc_get_cached_key(kdc_active_realm, server_key, -1,
+                                          &server_kkey))) {
+            status = "DECRYPT_SERVER_KEY";
+            goto cleanup;
+        }
+        if ((errcode = krb5_copy_keyblock_contents(kdc_context,
+                                                   &server_kkey->keyblock,
+                                                   &encrypting_key))) {
             status = "DECRYPT_SERVER_KEY";
             goto cleanup;
         }
@@ -587,8 +600,10 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
 
             assert(client == NULL); /* should not have been set already */
 
+            kdc_phase_begin(timing, KDC_PHASE_DB);
             errcode = krb5_db_get_principal(kdc_context, subject_tkt->client,
                                             c_flags, &client);
+            kdc_phase_end(timing, KDC_PHASE_DB);
         }
     }
 
@@ -602,6 +617,7 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
     enc_tkt_reply.transited.tr_type = KRB5_DOMAIN_X500_COMPRESS;
     enc_tkt_reply.transited.tr_contents = empty_string; /* equivalent of "" */
 
+    kdc_phase_begin(timing, KDC_PHASE_AUTHDATA);
     errcode = handle_authdata(kdc_context, c_flags, client, server, krbtgt,
                               subkey != NULL ? subkey :
                               header_ticket->enc_part2->session,
@@ -613,6 +629,7 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
                               s4u_x509_user->user_id.user : NULL,
                               subject_tkt,
                               &enc_tkt_reply);
+    kdc_phase_end(timing, KDC_PHASE_AUTHDATA);
     if (errcode) {
         krb5_klog_syslog(LOG_INFO, _("TGS_REQ : handle_authdata (%d)"),
                          errcode);
@@ -717,10 +734,16 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
         ticket_kvno = server_key->key_data_kvno;
     }
 
-    errcode = krb5_encrypt_tkt_part(kdc_context, &encrypting_key,
-                                    &ticket_reply);
-    if (!isflagset(request->kdc_options, KDC_OPT_ENC_TKT_IN_SKEY))
+    kdc_phase_begin(timing, KDC_PHASE_TICKET);
+    if (isflagset(request->kdc_options, KDC_OPT_ENC_TKT_IN_SKEY)) {
+        errcode = krb5_encrypt_tkt_part(kdc_context, &encrypting_key,
+                                        &ticket_reply);
+    } else {
+        errcode = kdc_encrypt_tkt_part(kdc_context, server_kkey,
+                                       &ticket_reply);
         krb5_free_keyblock_contents(kdc_context, &encrypting_key);
+    }
+    kdc_phase_end(timing, KDC_PHASE_TICKET);
     if (errcode) {
         status = "TKT_ENCRYPT";
         goto cleanup;
@@ -806,10 +829,12 @@ process_tgs_req(struct server_handle *handle, krb5_data *pkt,
 
     if (kdc_fast_hide_client(state))
         reply.client = (krb5_principal)krb5_anonymous_principal();
+    kdc_phase_begin(timing, KDC_PHASE_REPLY);
     errcode = krb5_encode_kdc_rep(kdc_context, KRB5_TGS_REP, &reply_encpart,
                                   subkey ? 1 : 0,
                                   reply_key,
                                   &reply, response);
+    kdc_phase_end(timing, KDC_PHASE_REPLY);
     if (errcode) {
         status = "ENCODE_KDC_REP";
     } else {
@@ -829,6 +854,7 @@ cleanup:
     assert(status != NULL);
     if (reply_key)
         krb5_free_keyblock(kdc_context, reply_key);
+    krb5_k_free_key(kdc_context, server_kkey);
     if (errcode)
         emsg = krb5_get_error_message (kdc_context, errcode);
 
@@ -1258,8 +1284,9 @@ search_sprinc(kdc_realm_t *kdc_active_realm, krb5_kdc_req *req,
 {
     krb5_error_code ret;
     krb5_principal princ = req->server;
-    krb5_principal reftgs = NULL;
-    krb5_boolean allow_referral;
+    krb5_principal reftgs = NULL, cached = NULL;
+    krb5_boolean allow_referral, alternate = FALSE, remember = FALSE;
+    krb5_flags options;
 
     /* Do not allow referrals for u2u or ticket modification requests, because
      * the server is supposed to match an already-issued ticket. */
@@ -1267,8 +1294,27 @@ search_sprinc(kdc_realm_t *kdc_active_realm, krb5_kdc_req *req,
     if (!allow_referral)
         flags &= ~KRB5_KDB_FLAG_CANONICALIZE;
 
+    /* If a recent search for this principal did not find it, repeat only the
+     * lookup which succeeded, if any. */
+    options = req->kdc_options & (KDC_OPT_CANONICALIZE | NO_REFERRAL_OPTION);
+    if (kdc_lookup_cache_get(kdc_active_realm, req->server, flags, options,
+                             &cached, &alternate)) {
+        ret = KRB5_KDB_NOENTRY;
+        if (cached != NULL) {
+            /* find_alternate_tgs() looks up TGS principals without flags. */
+            ret = db_get_svc_princ(kdc_context, cached, alternate ? 0 : flags,
+                                   server, status);
+            if (ret == 0 && alternate)
+                log_tgs_alt_tgt(kdc_context, (*server)->princ);
+        }
+        goto cleanup;
+    }
+
     ret = db_get_svc_princ(kdc_context, princ, flags, server, status);
-    if (ret == 0 || ret != KRB5_KDB_NOENTRY || !allow_referral)
+    if (ret != KRB5_KDB_NOENTRY)
+        goto cleanup;
+    remember = TRUE;
+    if (!allow_referral)
         goto cleanup;
 
     if (!is_cross_tgs_principal(req->server)) {
@@ -1282,13 +1328,23 @@ search_sprinc(kdc_realm_t *kdc_active_realm, krb5_kdc_req *req,
         princ = reftgs;
     }
     ret = find_alternate_tgs(kdc_active_realm, princ, server, status);
+    alternate = TRUE;
 
 cleanup:
+    if (remember && ret == 0 && *server != NULL) {
+        kdc_lookup_cache_put(kdc_active_realm, req->server, flags, options,
+                             (*server)->princ, alternate);
+    } else if (remember && (ret == KRB5_KDB_NOENTRY ||
+                            ret == KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN)) {
+        kdc_lookup_cache_put(kdc_active_realm, req->server, flags, options,
+                             NULL, FALSE);
+    }
     if (ret != 0 && ret != KRB5KDC_ERR_SVC_UNAVAILABLE) {
         ret = KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN;
         if (*status == NULL)
             *status = "LOOKING_UP_SERVER";
     }
     krb5_free_principal(kdc_context, reftgs);
+    krb5_free_principal(kdc_context, cached);
     return ret;
 }
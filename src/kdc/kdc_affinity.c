@@ -0,0 +1,149 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* kdc/kdc_affinity.c - CPU affinity for KDC worker processes */
+/*
+ * Copyright (C) 2014 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#define _GNU_SOURCE /* For the CPU_SET macros */
+#include "k5-int.h"
+#include "kdc_util.h"
+
+#ifdef HAVE_SCHED_SETAFFINITY
+
+#include <sched.h>
+
+#define NODE_DIR "/sys/devices/system/node"
+
+/* Return the number of NUMA nodes listed in sysfs. */
+static int
+count_nodes(void)
+{
+    char path[64];
+    int n;
+
+    for (n = 0; ; n++) {
+        snprintf(path, sizeof(path), NODE_DIR "/node%d", n);
+        if (access(path, F_OK) != 0)
+            return n;
+    }
+}
+
+/* Set *mask to the CPUs belonging to NUMA node, as listed in sysfs. */
+static krb5_error_code
+get_node_cpus(int node, cpu_set_t *mask)
+{
+    char path[64], buf[1024], *p, *end;
+    FILE *fp;
+    long lo, hi;
+
+    snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", node);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return errno;
+    set_cloexec_file(fp);
+    p = fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+    if (p == NULL)
+        return EINVAL;
+
+    /* The list looks like "0-3,8-11". */
+    CPU_ZERO(mask);
+    while (*p != '\0' && *p != '\n') {
+        lo = hi = strtol(p, &end, 10);
+        if (end == p || lo < 0)
+            return EINVAL;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p)
+                return EINVAL;
+        }
+        for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+            CPU_SET(lo, mask);
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return 0;
+}
+
+/*
+ * Bind the calling worker process, number worker, to CPUs according to mode.
+ * With "cpu", each worker is bound to one of the CPUs the KDC may run on, in
+ * turn.  With "node", each worker is bound to the CPUs of one NUMA node, in
+ * turn.
+ */
+krb5_error_code
+kdc_set_worker_affinity(int worker, const char *mode)
+{
+    krb5_error_code ret;
+    cpu_set_t allowed, mask;
+    int i, n, nnodes;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return errno;
+
+    CPU_ZERO(&mask);
+    if (strcmp(mode, "cpu") == 0) {
+        if (CPU_COUNT(&allowed) == 0)
+            return EINVAL;
+        n = worker % CPU_COUNT(&allowed);
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (CPU_ISSET(i, &allowed) && n-- == 0) {
+                CPU_SET(i, &mask);
+                break;
+            }
+        }
+    } else if (strcmp(mode, "node") == 0) {
+        nnodes = count_nodes();
+        if (nnodes == 0)
+            return ENOENT;
+        ret = get_node_cpus(worker % nnodes, &mask);
+        if (ret)
+            return ret;
+        CPU_AND(&mask, &mask, &allowed);
+    } else {
+        return EINVAL;
+    }
+    if (CPU_COUNT(&mask) == 0)
+        return EINVAL;
+
+    if (sched_setaffinity(0, sizeof(mask), &mask) != 0)
+        return errno;
+    return 0;
+}
+
+#else /* HAVE_SCHED_SETAFFINITY */
+
+krb5_error_code
+kdc_set_worker_affinity(int worker, const char *mode)
+{
+    return EINVAL;
+}
+
+#endif /* HAVE_SCHED_SETAFFINITY */
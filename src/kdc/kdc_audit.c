@@ -45,6 +45,785 @@ typedef struct audit_module_handle_st *audit_module_handle;
 
 static audit_module_handle *handles = NULL;
 
+/*
+ * If audit_queue_length is set in [kdcdefaults], audit events are not passed
+ * to the modules by the thread processing the request.  Instead, that thread
+ * copies the parts of the audit state which the modules can see into a
+ * fixed-layout record in a ring buffer of its own, without allocating memory
+ * or taking locks.  A consumer thread passes the records to the modules in
+ * batches, so the JSON encoding and writing done by the modules happens off
+ * the request path.  Each ring has a single producer and a single consumer,
+ * so only memory barriers are needed to hand over records.  Events arriving
+ * while a ring is full are dropped and counted; events which do not fit in a
+ * record are passed to the modules directly.
+ */
+
+enum audit_event {
+    AUDIT_EV_KDC_START,
+    AUDIT_EV_KDC_STOP,
+    AUDIT_EV_AS_REQ,
+    AUDIT_EV_TGS_REQ,
+    AUDIT_EV_S4U2SELF,
+    AUDIT_EV_S4U2PROXY,
+    AUDIT_EV_U2U
+};
+
+/* Pass an event to the corresponding entry point of each audit module. */
+static void
+call_modules(int event, krb5_boolean ev_success, krb5_audit_state *state)
+{
+    audit_module_handle *hp, hdl;
+
+    for (hp = handles; *hp != NULL; hp++) {
+        hdl = *hp;
+        switch (event) {
+        case AUDIT_EV_KDC_START:
+            if (hdl->vt.kdc_start != NULL)
+                hdl->vt.kdc_start(hdl->auctx, ev_success);
+            break;
+        case AUDIT_EV_KDC_STOP:
+            if (hdl->vt.kdc_stop != NULL)
+                hdl->vt.kdc_stop(hdl->auctx, ev_success);
+            break;
+        case AUDIT_EV_AS_REQ:
+            if (hdl->vt.as_req != NULL)
+                hdl->vt.as_req(hdl->auctx, ev_success, state);
+            break;
+        case AUDIT_EV_TGS_REQ:
+            if (hdl->vt.tgs_req != NULL)
+                hdl->vt.tgs_req(hdl->auctx, ev_success, state);
+            break;
+        case AUDIT_EV_S4U2SELF:
+            if (hdl->vt.tgs_s4u2self != NULL)
+                hdl->vt.tgs_s4u2self(hdl->auctx, ev_success, state);
+            break;
+        case AUDIT_EV_S4U2PROXY:
+            if (hdl->vt.tgs_s4u2proxy != NULL)
+                hdl->vt.tgs_s4u2proxy(hdl->auctx, ev_success, state);
+            break;
+        case AUDIT_EV_U2U:
+            if (hdl->vt.tgs_u2u != NULL)
+                hdl->vt.tgs_u2u(hdl->auctx, ev_success, state);
+            break;
+        }
+    }
+}
+
+#ifdef ENABLE_THREADS
+
+#include <pthread.h>
+#include <signal.h>
+
+#ifdef __GNUC__
+#define ATOMIC_ADD(p, n) ((void)__sync_add_and_fetch(p, n))
+#define MEMORY_BARRIER() __sync_synchronize()
+#else
+/* Without compiler atomics, use a mutex for the barriers and drop counter. */
+static pthread_mutex_t atomic_lock = PTHREAD_MUTEX_INITIALIZER;
+#define ATOMIC_ADD(p, n) (pthread_mutex_lock(&atomic_lock), *(p) += (n), \
+                          pthread_mutex_unlock(&atomic_lock))
+#define MEMORY_BARRIER() (pthread_mutex_lock(&atomic_lock),             \
+                          pthread_mutex_unlock(&atomic_lock))
+#endif
+
+#define REC_DATA_SIZE 1024      /* Inline storage for variable-length fields */
+#define REC_MAX_COMPS 4         /* Principal components */
+#define REC_MAX_LIST 16         /* Enctypes, padata types, and addresses */
+
+/* Record flags */
+#define REC_STATE               0x01
+#define REC_REQUEST             0x02
+#define REC_SECOND_TICKET       0x04
+#define REC_REPLY               0x08
+#define REC_TICKET              0x10
+#define REC_TICKET_PART2        0x20
+
+/* A region of a record's data area; off is -1 if the field is absent. */
+struct rec_span {
+    int off;
+    unsigned int len;
+};
+
+struct rec_princ {
+    int ncomps;                 /* -1 if the principal is absent */
+    krb5_int32 type;
+    struct rec_span realm;
+    struct rec_span comps[REC_MAX_COMPS];
+};
+
+struct rec_addr {
+    krb5_addrtype addrtype;
+    struct rec_span contents;
+};
+
+struct audit_rec {
+    int event;
+    krb5_boolean ev_success;
+    int flags;
+
+    /* Audit state */
+    int stage;
+    int violation;
+    krb5_ui_4 cl_port;
+    char req_id[REQID_LEN];
+    struct rec_span status;
+    struct rec_span tkt_in_id;
+    struct rec_span tkt_out_id;
+    struct rec_span evid_tkt_id;
+    struct rec_span cl_realm;
+    struct rec_addr cl_addr;
+    struct rec_princ s4u2self_user;
+
+    /* Request */
+    struct rec_princ client;
+    struct rec_princ server;
+    krb5_flags kdc_options;
+    krb5_timestamp from;
+    krb5_timestamp till;
+    krb5_timestamp rtime;
+    int nktypes;
+    krb5_enctype ktypes[REC_MAX_LIST];
+    int npatypes;               /* -1 if there is no padata list */
+    krb5_preauthtype patypes[REC_MAX_LIST];
+    int naddrs;                 /* -1 if there is no address list */
+    struct rec_addr addrs[REC_MAX_LIST];
+    struct rec_princ st_client;
+    krb5_enctype st_session_enctype;
+
+    /* Reply */
+    krb5_enctype rep_enctype;
+    int nrep_patypes;
+    krb5_preauthtype rep_patypes[REC_MAX_LIST];
+    struct rec_princ tkt_server;
+    krb5_enctype tkt_enctype;
+    struct rec_princ tkt_client;
+    krb5_flags tkt_flags;
+    krb5_enctype tkt_session_enctype;
+    krb5_ticket_times tkt_times;
+    struct rec_span transited;
+
+    unsigned int used;
+    char data[REC_DATA_SIZE];
+};
+
+/* A ring of records with one producing thread. */
+struct audit_ring {
+    struct audit_ring *next;
+    volatile unsigned int head; /* Next slot to fill; set by the producer */
+    volatile unsigned int tail; /* Next slot to pass on; set by the consumer */
+    struct audit_rec *recs;
+};
+
+/* Audit structures reconstructed from a record for the modules. */
+struct view_princ {
+    krb5_principal_data princ;
+    krb5_data comps[REC_MAX_COMPS];
+};
+
+struct audit_view {
+    krb5_audit_state state;
+    krb5_kdc_req req;
+    krb5_kdc_rep rep;
+    krb5_ticket tkt;
+    krb5_enc_tkt_part part2;
+    krb5_keyblock session;
+    krb5_ticket st;
+    krb5_ticket *st_list[2];
+    krb5_enc_tkt_part st_part2;
+    krb5_keyblock st_session;
+    krb5_data cl_realm;
+    krb5_address cl_addr;
+    krb5_address addrs[REC_MAX_LIST];
+    krb5_address *addr_list[REC_MAX_LIST + 1];
+    krb5_pa_data pa[REC_MAX_LIST];
+    krb5_pa_data *pa_list[REC_MAX_LIST + 1];
+    krb5_pa_data rep_pa[REC_MAX_LIST];
+    krb5_pa_data *rep_pa_list[REC_MAX_LIST + 1];
+    struct view_princ s4u2self_user;
+    struct view_princ client;
+    struct view_princ server;
+    struct view_princ st_client;
+    struct view_princ tkt_server;
+    struct view_princ tkt_client;
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_t consumer;
+static struct audit_ring *rings;
+static unsigned int queue_mask;
+static krb5_boolean queue_running;
+static krb5_boolean queue_stopping;
+static volatile krb5_boolean consumer_idle;
+static unsigned long queue_dropped;
+
+/* Copy len bytes into the data area of rec, recording their location in
+ * span.  Return false if they do not fit. */
+static krb5_boolean
+put_bytes(struct audit_rec *rec, const void *p, size_t len,
+          struct rec_span *span)
+{
+    if (len > sizeof(rec->data) - rec->used)
+        return FALSE;
+    if (len > 0)
+        memcpy(rec->data + rec->used, p, len);
+    span->off = rec->used;
+    span->len = len;
+    rec->used += len;
+    return TRUE;
+}
+
+static krb5_boolean
+put_string(struct audit_rec *rec, const char *s, struct rec_span *span)
+{
+    span->off = -1;
+    return (s == NULL) ? TRUE : put_bytes(rec, s, strlen(s) + 1, span);
+}
+
+static krb5_boolean
+put_data(struct audit_rec *rec, const krb5_data *d, struct rec_span *span)
+{
+    span->off = -1;
+    return (d == NULL) ? TRUE : put_bytes(rec, d->data, d->length, span);
+}
+
+static krb5_boolean
+put_addr(struct audit_rec *rec, const krb5_address *a, struct rec_addr *ra)
+{
+    ra->contents.off = -1;
+    if (a == NULL)
+        return TRUE;
+    ra->addrtype = a->addrtype;
+    return put_bytes(rec, a->contents, a->length, &ra->contents);
+}
+
+static krb5_boolean
+put_princ(struct audit_rec *rec, krb5_const_principal princ,
+          struct rec_princ *rp)
+{
+    int i;
+
+    rp->ncomps = -1;
+    if (princ == NULL || princ->data == NULL)
+        return TRUE;
+    if (princ->length > REC_MAX_COMPS)
+        return FALSE;
+    rp->ncomps = princ->length;
+    rp->type = princ->type;
+    if (!put_data(rec, &princ->realm, &rp->realm))
+        return FALSE;
+    for (i = 0; i < princ->length; i++) {
+        if (!put_data(rec, &princ->data[i], &rp->comps[i]))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static krb5_boolean
+put_patypes(krb5_pa_data *const *padata, krb5_preauthtype *types, int *count)
+{
+    int n;
+
+    *count = -1;
+    if (padata == NULL)
+        return TRUE;
+    for (n = 0; padata[n] != NULL; n++) {
+        if (n == REC_MAX_LIST)
+            return FALSE;
+        types[n] = padata[n]->pa_type;
+    }
+    *count = n;
+    return TRUE;
+}
+
+static krb5_boolean
+put_request(struct audit_rec *rec, const krb5_kdc_req *req)
+{
+    const krb5_enc_tkt_part *part2;
+    int i;
+
+    rec->flags |= REC_REQUEST;
+    rec->kdc_options = req->kdc_options;
+    rec->from = req->from;
+    rec->till = req->till;
+    rec->rtime = req->rtime;
+    if (req->nktypes > REC_MAX_LIST)
+        return FALSE;
+    rec->nktypes = req->nktypes;
+    for (i = 0; i < req->nktypes; i++)
+        rec->ktypes[i] = req->ktype[i];
+    if (!put_princ(rec, req->client, &rec->client) ||
+        !put_princ(rec, req->server, &rec->server) ||
+        !put_patypes(req->padata, rec->patypes, &rec->npatypes))
+        return FALSE;
+
+    rec->naddrs = -1;
+    if (req->addresses != NULL) {
+        for (i = 0; req->addresses[i] != NULL; i++) {
+            if (i == REC_MAX_LIST ||
+                !put_addr(rec, req->addresses[i], &rec->addrs[i]))
+                return FALSE;
+        }
+        rec->naddrs = i;
+    }
+
+    if (req->second_ticket != NULL && req->second_ticket[0] != NULL &&
+        req->second_ticket[0]->enc_part2 != NULL) {
+        part2 = req->second_ticket[0]->enc_part2;
+        rec->flags |= REC_SECOND_TICKET;
+        rec->st_session_enctype = (part2->session != NULL) ?
+            part2->session->enctype : ENCTYPE_NULL;
+        if (!put_princ(rec, part2->client, &rec->st_client))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static krb5_boolean
+put_reply(struct audit_rec *rec, const krb5_kdc_rep *rep)
+{
+    const krb5_ticket *tkt = rep->ticket;
+    const krb5_enc_tkt_part *part2;
+
+    rec->flags |= REC_REPLY;
+    rec->rep_enctype = rep->enc_part.enctype;
+    if (!put_patypes(rep->padata, rec->rep_patypes, &rec->nrep_patypes))
+        return FALSE;
+    if (tkt == NULL)
+        return TRUE;
+
+    rec->flags |= REC_TICKET;
+    rec->tkt_enctype = tkt->enc_part.enctype;
+    if (!put_princ(rec, tkt->server, &rec->tkt_server))
+        return FALSE;
+    part2 = tkt->enc_part2;
+    if (part2 == NULL)
+        return TRUE;
+
+    rec->flags |= REC_TICKET_PART2;
+    rec->tkt_flags = part2->flags;
+    rec->tkt_session_enctype = (part2->session != NULL) ?
+        part2->session->enctype : ENCTYPE_NULL;
+    rec->tkt_times = part2->times;
+    return put_princ(rec, part2->client, &rec->tkt_client) &&
+        put_data(rec, &part2->transited.tr_contents, &rec->transited);
+}
+
+/* Copy the parts of an audit event which the modules can see into rec.
+ * Return false if they do not fit. */
+static krb5_boolean
+put_event(struct audit_rec *rec, int event, krb5_boolean ev_success,
+          const krb5_audit_state *state)
+{
+    rec->event = event;
+    rec->ev_success = ev_success;
+    rec->flags = 0;
+    rec->used = 0;
+    if (state == NULL)
+        return TRUE;
+
+    rec->flags |= REC_STATE;
+    rec->stage = state->stage;
+    rec->violation = state->violation;
+    rec->cl_port = state->cl_port;
+    memcpy(rec->req_id, state->req_id, sizeof(rec->req_id));
+    if (!put_string(rec, state->status, &rec->status) ||
+        !put_string(rec, state->tkt_in_id, &rec->tkt_in_id) ||
+        !put_string(rec, state->tkt_out_id, &rec->tkt_out_id) ||
+        !put_string(rec, state->evid_tkt_id, &rec->evid_tkt_id) ||
+        !put_data(rec, state->cl_realm, &rec->cl_realm) ||
+        !put_addr(rec, state->cl_addr, &rec->cl_addr) ||
+        !put_princ(rec, state->s4u2self_user, &rec->s4u2self_user))
+        return FALSE;
+    if (state->request != NULL && !put_request(rec, state->request))
+        return FALSE;
+    if (state->reply != NULL && !put_reply(rec, state->reply))
+        return FALSE;
+    return TRUE;
+}
+
+static char *
+view_string(struct audit_rec *rec, const struct rec_span *span)
+{
+    return (span->off < 0) ? NULL : rec->data + span->off;
+}
+
+static krb5_data *
+view_data(struct audit_rec *rec, const struct rec_span *span, krb5_data *d)
+{
+    if (span->off < 0)
+        return NULL;
+    *d = make_data(rec->data + span->off, span->len);
+    return d;
+}
+
+static krb5_address *
+view_addr(struct audit_rec *rec, const struct rec_addr *ra, krb5_address *a)
+{
+    if (ra->contents.off < 0)
+        return NULL;
+    a->magic = KV5M_ADDRESS;
+    a->addrtype = ra->addrtype;
+    a->length = ra->contents.len;
+    a->contents = (krb5_octet *)rec->data + ra->contents.off;
+    return a;
+}
+
+static krb5_principal
+view_princ(struct audit_rec *rec, const struct rec_princ *rp,
+           struct view_princ *vp)
+{
+    int i;
+
+    if (rp->ncomps < 0)
+        return NULL;
+    vp->princ.magic = KV5M_PRINCIPAL;
+    vp->princ.type = rp->type;
+    vp->princ.length = rp->ncomps;
+    vp->princ.data = vp->comps;
+    (void)view_data(rec, &rp->realm, &vp->princ.realm);
+    for (i = 0; i < rp->ncomps; i++)
+        (void)view_data(rec, &rp->comps[i], &vp->comps[i]);
+    return &vp->princ;
+}
+
+static krb5_pa_data **
+view_patypes(const krb5_preauthtype *types, int count, krb5_pa_data *pa,
+             krb5_pa_data **list)
+{
+    int i;
+
+    if (count < 0)
+        return NULL;
+    for (i = 0; i < count; i++) {
+        pa[i].magic = KV5M_PA_DATA;
+        pa[i].pa_type = types[i];
+        list[i] = &pa[i];
+    }
+    list[count] = NULL;
+    return list;
+}
+
+static void
+view_request(struct audit_rec *rec, struct audit_view *v)
+{
+    krb5_kdc_req *req = &v->req;
+    int i;
+
+    req->magic = KV5M_KDC_REQ;
+    req->kdc_options = rec->kdc_options;
+    req->from = rec->from;
+    req->till = rec->till;
+    req->rtime = rec->rtime;
+    req->nktypes = rec->nktypes;
+    req->ktype = rec->ktypes;
+    req->client = view_princ(rec, &rec->client, &v->client);
+    req->server = view_princ(rec, &rec->server, &v->server);
+    req->padata = view_patypes(rec->patypes, rec->npatypes, v->pa,
+                               v->pa_list);
+    if (rec->naddrs >= 0) {
+        for (i = 0; i < rec->naddrs; i++)
+            v->addr_list[i] = view_addr(rec, &rec->addrs[i], &v->addrs[i]);
+        v->addr_list[rec->naddrs] = NULL;
+        req->addresses = v->addr_list;
+    }
+    if (rec->flags & REC_SECOND_TICKET) {
+        v->st_session.enctype = rec->st_session_enctype;
+        v->st_part2.session = &v->st_session;
+        v->st_part2.client = view_princ(rec, &rec->st_client, &v->st_client);
+        v->st.enc_part2 = &v->st_part2;
+        v->st_list[0] = &v->st;
+        v->st_list[1] = NULL;
+        req->second_ticket = v->st_list;
+    }
+    v->state.request = req;
+}
+
+static void
+view_reply(struct audit_rec *rec, struct audit_view *v)
+{
+    krb5_kdc_rep *rep = &v->rep;
+
+    rep->magic = KV5M_KDC_REP;
+    rep->enc_part.enctype = rec->rep_enctype;
+    rep->padata = view_patypes(rec->rep_patypes, rec->nrep_patypes,
+                               v->rep_pa, v->rep_pa_list);
+    if (rec->flags & REC_TICKET) {
+        v->tkt.magic = KV5M_TICKET;
+        v->tkt.server = view_princ(rec, &rec->tkt_server, &v->tkt_server);
+        v->tkt.enc_part.enctype = rec->tkt_enctype;
+        rep->ticket = &v->tkt;
+    }
+    if (rec->flags & REC_TICKET_PART2) {
+        v->session.enctype = rec->tkt_session_enctype;
+        v->part2.session = &v->session;
+        v->part2.client = view_princ(rec, &rec->tkt_client, &v->tkt_client);
+        v->part2.flags = rec->tkt_flags;
+        v->part2.times = rec->tkt_times;
+        (void)view_data(rec, &rec->transited, &v->part2.transited.tr_contents);
+        v->tkt.enc_part2 = &v->part2;
+    }
+    v->state.reply = rep;
+}
+
+/* Reconstruct the audit state from rec and pass it to the modules. */
+static void
+dispatch_record(struct audit_rec *rec)
+{
+    struct audit_view v;
+    krb5_audit_state *state = &v.state;
+
+    if (!(rec->flags & REC_STATE)) {
+        call_modules(rec->event, rec->ev_success, NULL);
+        return;
+    }
+
+    memset(&v, 0, sizeof(v));
+    state->cl_addr = view_addr(rec, &rec->cl_addr, &v.cl_addr);
+    state->cl_port = rec->cl_port;
+    state->stage = rec->stage;
+    state->status = view_string(rec, &rec->status);
+    state->tkt_in_id = view_string(rec, &rec->tkt_in_id);
+    state->tkt_out_id = view_string(rec, &rec->tkt_out_id);
+    state->evid_tkt_id = view_string(rec, &rec->evid_tkt_id);
+    memcpy(state->req_id, rec->req_id, sizeof(state->req_id));
+    state->cl_realm = view_data(rec, &rec->cl_realm, &v.cl_realm);
+    state->s4u2self_user = view_princ(rec, &rec->s4u2self_user,
+                                      &v.s4u2self_user);
+    state->violation = rec->violation;
+    if (rec->flags & REC_REQUEST)
+        view_request(rec, &v);
+    if (rec->flags & REC_REPLY)
+        view_reply(rec, &v);
+    call_modules(rec->event, rec->ev_success, state);
+}
+
+/* Return true if any ring has records waiting.  queue_lock must be held. */
+static krb5_boolean
+rings_pending(void)
+{
+    struct audit_ring *ring;
+
+    for (ring = rings; ring != NULL; ring = ring->next) {
+        if (ring->head != ring->tail)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Pass the waiting records of each ring to the modules.  Return the number of
+ * records passed. */
+static unsigned int
+drain_rings(void)
+{
+    struct audit_ring *ring, *list;
+    unsigned int head, tail, count = 0;
+
+    /* Rings are only added at the front of the list while we run. */
+    pthread_mutex_lock(&queue_lock);
+    list = rings;
+    pthread_mutex_unlock(&queue_lock);
+
+    for (ring = list; ring != NULL; ring = ring->next) {
+        head = ring->head;
+        MEMORY_BARRIER();
+        for (tail = ring->tail; tail != head; tail++)
+            dispatch_record(&ring->recs[tail & queue_mask]);
+        count += head - ring->tail;
+        MEMORY_BARRIER();
+        ring->tail = head;
+    }
+    return count;
+}
+
+/* Log the number of events dropped since the last report, at most once a
+ * minute unless final is set. */
+static void
+report_drops(krb5_boolean final)
+{
+    static unsigned long reported;
+    static time_t last_report;
+    unsigned long dropped = queue_dropped;
+    time_t now = time(NULL);
+
+    if (dropped == reported || (!final && now - last_report < 60))
+        return;
+    krb5_klog_syslog(LOG_WARNING, _("audit queue full; %lu events dropped"),
+                     dropped - reported);
+    reported = dropped;
+    last_report = now;
+}
+
+static void *
+consumer_main(void *arg)
+{
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        /* Producers check consumer_idle after publishing a record, so we
+         * cannot miss one between checking the rings and waiting. */
+        consumer_idle = TRUE;
+        MEMORY_BARRIER();
+        while (!queue_stopping && !rings_pending())
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        consumer_idle = FALSE;
+        if (queue_stopping)
+            break;
+        pthread_mutex_unlock(&queue_lock);
+        while (drain_rings() > 0);
+        report_drops(FALSE);
+        pthread_mutex_lock(&queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    /* All producers have finished by the time the queue is stopped. */
+    drain_rings();
+    report_drops(TRUE);
+    return NULL;
+}
+
+/* Get the calling thread's ring, creating it if necessary. */
+static struct audit_ring *
+get_ring(void)
+{
+    struct audit_ring *ring;
+
+    ring = pthread_getspecific(ring_key);
+    if (ring != NULL)
+        return ring;
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+        return NULL;
+    ring->recs = calloc(queue_mask + 1, sizeof(*ring->recs));
+    if (ring->recs == NULL || pthread_setspecific(ring_key, ring) != 0) {
+        free(ring->recs);
+        free(ring);
+        return NULL;
+    }
+    pthread_mutex_lock(&queue_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&queue_lock);
+    return ring;
+}
+
+/* Queue an event for the consumer thread.  Return false if the caller must
+ * pass the event to the modules itself. */
+static krb5_boolean
+queue_event(int event, krb5_boolean ev_success, krb5_audit_state *state)
+{
+    struct audit_ring *ring;
+    unsigned int head;
+
+    if (!queue_running)
+        return FALSE;
+    ring = get_ring();
+    if (ring == NULL)
+        return FALSE;
+
+    head = ring->head;
+    if (head - ring->tail > queue_mask) {
+        ATOMIC_ADD(&queue_dropped, 1);
+        return TRUE;
+    }
+    /* Don't overwrite the slot before the consumer is done with it. */
+    MEMORY_BARRIER();
+    if (!put_event(&ring->recs[head & queue_mask], event, ev_success, state))
+        return FALSE;
+    MEMORY_BARRIER();
+    ring->head = head + 1;
+    MEMORY_BARRIER();
+    if (consumer_idle) {
+        pthread_mutex_lock(&queue_lock);
+        pthread_cond_signal(&queue_cond);
+        pthread_mutex_unlock(&queue_lock);
+    }
+    return TRUE;
+}
+
+/* Start the consumer thread if audit_queue_length is configured. */
+static krb5_error_code
+start_queue(krb5_context context)
+{
+    krb5_error_code ret;
+    unsigned int size;
+    sigset_t all, old;
+    int length;
+
+    ret = profile_get_integer(context->profile, KRB5_CONF_KDCDEFAULTS,
+                              KRB5_CONF_AUDIT_QUEUE_LENGTH, NULL, 0, &length);
+    if (ret)
+        return ret;
+    if (length < 0)
+        return EINVAL;
+    if (length == 0 || handles[0] == NULL)
+        return 0;
+
+    /* Round the ring size up to a power of two. */
+    for (size = 1; size < (unsigned int)length && size < (1U << 30);
+         size <<= 1);
+    queue_mask = size - 1;
+
+    ret = pthread_key_create(&ring_key, NULL);
+    if (ret)
+        return ret;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    ret = pthread_create(&consumer, NULL, consumer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret) {
+        pthread_key_delete(ring_key);
+        return ret;
+    }
+    queue_running = TRUE;
+    return 0;
+}
+
+/* Pass on all queued events and stop the consumer thread. */
+static void
+stop_queue(void)
+{
+    struct audit_ring *ring, *next;
+
+    if (!queue_running)
+        return;
+    pthread_mutex_lock(&queue_lock);
+    queue_stopping = TRUE;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    pthread_join(consumer, NULL);
+
+    for (ring = rings; ring != NULL; ring = next) {
+        next = ring->next;
+        free(ring->recs);
+        free(ring);
+    }
+    rings = NULL;
+    pthread_key_delete(ring_key);
+    queue_running = queue_stopping = FALSE;
+}
+
+#else /* ENABLE_THREADS */
+
+static krb5_boolean
+queue_event(int event, krb5_boolean ev_success, krb5_audit_state *state)
+{
+    return FALSE;
+}
+
+static krb5_error_code
+start_queue(krb5_context context)
+{
+    return 0;
+}
+
+static void
+stop_queue(void)
+{
+}
+
+#endif /* ENABLE_THREADS */
+
 static void
 free_handles(audit_module_handle *list)
 {
@@ -120,7 +899,14 @@ load_audit_modules(krb5_context context)
     list[count] = NULL;
     handles = list;
     list = NULL;
-    ret = 0;
+
+    /* Without a queue, events are passed to the modules synchronously. */
+    ret = start_queue(context);
+    if (ret) {
+        krb5_klog_syslog(LOG_ERR, _("cannot start audit queue: %s"),
+                         error_message(ret));
+        ret = 0;
+    }
 
 cleanup:
     free(hdl);
@@ -133,7 +919,9 @@ cleanup:
 void
 unload_audit_modules(krb5_context context)
 {
+    stop_queue();
     free_handles(handles);
+    handles = NULL;
 }
 
 /*
@@ -213,36 +1001,29 @@ kau_free_kdc_req(krb5_audit_state *state)
     free(state);
 }
 
-/* Call the KDC start/stop audit plugin entry points. */
 
-void
-kau_kdc_stop(krb5_context context, const krb5_boolean ev_success)
+/* Pass an event to the audit modules, or queue it for the consumer thread. */
+static void
+audit_event(int event, krb5_boolean ev_success, krb5_audit_state *state)
 {
-    audit_module_handle *hp, hdl;
-
     if (handles == NULL)
         return;
+    if (!queue_event(event, ev_success, state))
+        call_modules(event, ev_success, state);
+}
 
-    for (hp = handles; *hp != NULL; hp++) {
-        hdl = *hp;
-        if (hdl->vt.kdc_stop != NULL)
-            hdl->vt.kdc_stop(hdl->auctx, ev_success);
-    }
+/* Call the KDC start/stop audit plugin entry points. */
+
+void
+kau_kdc_stop(krb5_context context, const krb5_boolean ev_success)
+{
+    audit_event(AUDIT_EV_KDC_STOP, ev_success, NULL);
 }
 
 void
 kau_kdc_start(krb5_context context, const krb5_boolean ev_success)
 {
-    audit_module_handle *hp, hdl;
-
-    if (handles == NULL)
-        return;
-
-    for (hp = handles; *hp != NULL; hp++) {
-        hdl = *hp;
-        if (hdl->vt.kdc_start != NULL)
-            hdl->vt.kdc_start(hdl->auctx, ev_success);
-    }
+    audit_event(AUDIT_EV_KDC_START, ev_success, NULL);
 }
 
 /* Call the AS-REQ audit plugin entry point. */
@@ -250,16 +1031,7 @@ void
 kau_as_req(krb5_context context, const krb5_boolean ev_success,
            krb5_audit_state *state)
 {
-    audit_module_handle *hp, hdl;
-
-    if (handles == NULL)
-        return;
-
-    for (hp = handles; *hp != NULL; hp++) {
-        hdl = *hp;
-        if (hdl->vt.as_req != NULL)
-            hdl->vt.as_req(hdl->auctx, ev_success, state);
-    }
+    audit_event(AUDIT_EV_AS_REQ, ev_success, state);
 }
 
 /* Call the TGS-REQ audit plugin entry point. */
@@ -267,16 +1039,7 @@ void
 kau_tgs_req(krb5_context context, const krb5_boolean ev_success,
             krb5_audit_state *state)
 {
-    audit_module_handle *hp, hdl;
-
-    if (handles == NULL)
-        return;
-
-    for (hp = handles; *hp != NULL; hp++) {
-        hdl = *hp;
-        if (hdl->vt.tgs_req != NULL)
-            hdl->vt.tgs_req(hdl->auctx, ev_success, state);
-    }
+    audit_event(AUDIT_EV_TGS_REQ, ev_success, state);
 }
 
 /* Call the S4U2Self audit plugin entry point. */
@@ -284,16 +1047,7 @@ void
 kau_s4u2self(krb5_context context, const krb5_boolean ev_success,
              krb5_audit_state *state)
 {
-    audit_module_handle *hp, hdl;
-
-    if (handles == NULL)
-        return;
-
-    for (hp = handles; *hp != NULL; hp++) {
-        hdl = *hp;
-        if (hdl->vt.tgs_s4u2self != NULL)
-            hdl->vt.tgs_s4u2self(hdl->auctx, ev_success, state);
-    }
+    audit_event(AUDIT_EV_S4U2SELF, ev_success, state);
 }
 
 /* Call the S4U2Proxy audit plugin entry point. */
@@ -301,16 +1055,7 @@ void
 kau_s4u2proxy(krb5_context context,const krb5_boolean ev_success,
               krb5_audit_state *state)
 {
-    audit_module_handle *hp, hdl;
-
-    if (handles == NULL)
-        return;
-
-    for (hp = handles; *hp != NULL; hp++) {
-        hdl = *hp;
-        if (hdl->vt.tgs_s4u2proxy != NULL)
-            hdl->vt.tgs_s4u2proxy(hdl->auctx, ev_success, state);
-    }
+    audit_event(AUDIT_EV_S4U2PROXY, ev_success, state);
 }
 
 /* Call the U2U audit plugin entry point. */
@@ -318,14 +1063,5 @@ void
 kau_u2u(krb5_context context, const krb5_boolean ev_success,
         krb5_audit_state *state)
 {
-    audit_module_handle *hp, hdl;
-
-    if (handles == NULL)
-        return;
-
-    for (hp = handles; *hp != NULL; hp++) {
-        hdl = *hp;
-        if (hdl->vt.tgs_u2u != NULL)
-            hdl->vt.tgs_u2u(hdl->auctx, ev_success, state);
-    }
+    audit_event(AUDIT_EV_U2U, ev_success, state);
 }
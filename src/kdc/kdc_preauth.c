@@ -77,6 +77,7 @@
  */
 
 #include "k5-int.h"
+#include "k5-queue.h"
 #include "kdc_util.h"
 #include "extern.h"
 #include <stdio.h>
@@ -221,6 +222,10 @@ static preauth_system static_preauth_systems[] = {
 static preauth_system *preauth_systems;
 static size_t n_preauth_systems;
 
+/* Counts of hint lists made with and without cached salt information. */
+static k5_mutex_t edata_stats_lock = K5_MUTEX_PARTIAL_INITIALIZER;
+static unsigned long edata_cache_hits, edata_cache_misses;
+
 /* Get all available kdcpreauth vtables and a count of preauth types they
  * support.  Return an empty list on failure. */
 static void
@@ -298,6 +303,9 @@ load_preauth_plugins(struct server_handle *handle, krb5_context context,
     const char **realm_names = NULL, *emsg;
     preauth_system *sys;
 
+    if (k5_mutex_finish_init(&edata_stats_lock) != 0)
+        return;
+
     /* Get all available kdcpreauth vtables. */
     get_plugin_vtables(context, &vtables, &n_tables, &n_systems);
 
@@ -559,8 +567,84 @@ have_client_keys(krb5_context context, krb5_kdcpreauth_rock rock)
     return FALSE;
 }
 
+/* State for a computation running on a worker thread. */
+struct offload_state {
+    krb5_context context;
+    const char *realm_name;
+    krb5_kdcpreauth_compute_fn compute;
+    krb5_kdcpreauth_compute_done_fn done;
+    void *arg;
+    krb5_error_code code;
+    char *errmsg;
+};
+
+/* Run an offloaded computation using the worker's copy of the realm. */
+static void
+offload_work(struct server_handle *handle, void *arg)
+{
+    struct offload_state *state = arg;
+    kdc_realm_t *realm;
+    const char *msg;
+
+    realm = find_realm_data(handle, (char *)state->realm_name,
+                            strlen(state->realm_name));
+    if (realm == NULL) {
+        state->code = KRB5KDC_ERR_WRONG_REALM;
+        return;
+    }
+    state->code = (*state->compute)(realm->realm_context, state->arg);
+    if (state->code) {
+        /* Carry the error message back to the loop thread. */
+        msg = krb5_get_error_message(realm->realm_context, state->code);
+        state->errmsg = strdup(msg);
+        krb5_free_error_message(realm->realm_context, msg);
+        krb5_clear_error_message(realm->realm_context);
+    }
+}
+
+static void
+offload_done(void *arg)
+{
+    struct offload_state *state = arg;
+    krb5_kdcpreauth_compute_done_fn done = state->done;
+    void *donearg = state->arg;
+    krb5_error_code code = state->code;
+
+    if (state->errmsg != NULL) {
+        krb5_set_error_message(state->context, code, "%s", state->errmsg);
+        free(state->errmsg);
+    }
+    free(state);
+    (*done)(donearg, code);
+}
+
+static void
+offload(krb5_context context, krb5_kdcpreauth_rock rock,
+        krb5_kdcpreauth_compute_fn compute,
+        krb5_kdcpreauth_compute_done_fn done, void *arg)
+{
+    struct offload_state *state;
+
+    if (kdc_threads_active()) {
+        state = calloc(1, sizeof(*state));
+        if (state != NULL) {
+            state->context = context;
+            state->realm_name = rock->rstate->realm_data->realm_name;
+            state->compute = compute;
+            state->done = done;
+            state->arg = arg;
+            if (kdc_threads_submit(offload_work, offload_done, state) == 0)
+                return;
+            free(state);
+        }
+    }
+
+    /* Run the computation here if we couldn't hand it off. */
+    (*done)(arg, (*compute)(context, arg));
+}
+
 static struct krb5_kdcpreauth_callbacks_st callbacks = {
-    2,
+    3,
     max_time_skew,
     client_keys,
     free_keys,
@@ -570,7 +654,8 @@ static struct krb5_kdcpreauth_callbacks_st callbacks = {
     free_string,
     client_entry,
     event_context,
-    have_client_keys
+    have_client_keys,
+    offload
 };
 
 static krb5_error_code
@@ -732,6 +817,294 @@ const char *missing_required_preauth(krb5_db_entry *client,
     return 0;
 }
 
+/*
+ * Unless the request uses FAST, the salt information (ETYPE-INFO and
+ * ETYPE-INFO2) in the hint list sent with a PREAUTH_REQUIRED error depends
+ * only on the client principal, the enctypes, versions and salts of its keys,
+ * the requested enctypes, and whether hardware preauth is required.  Recently
+ * computed salt information is kept in a per-realm cache keyed on those
+ * values, so that the first leg of a login does not have to compute it again.
+ * A key change with a new salt or version yields a different key, so stale
+ * entries are never used; they are evicted in LRU order.  Preauth modules
+ * are still asked for their hints on every request, since these may vary
+ * (a SAM challenge, for instance, carries a fresh nonce).
+ */
+
+#define EDATA_CACHE_BUCKETS 256
+#define EDATA_CACHE_MAX_ENTRIES 4096
+
+struct edata_cache_ent {
+    LIST_ENTRY(edata_cache_ent) hash_links;
+    TAILQ_ENTRY(edata_cache_ent) lru_links;
+    unsigned int hash;
+    krb5_principal client;
+    krb5_data key;
+    krb5_pa_data **salt_info;
+};
+
+LIST_HEAD(edata_cache_bucket, edata_cache_ent);
+TAILQ_HEAD(edata_cache_lru, edata_cache_ent);
+
+struct edata_cache {
+    struct edata_cache_bucket buckets[EDATA_CACHE_BUCKETS];
+    struct edata_cache_lru lru;
+    int num_entries;
+};
+
+static void
+add32(struct k5buf *buf, krb5_int32 val)
+{
+    unsigned char b[4];
+
+    store_32_be(val, b);
+    k5_buf_add_len(buf, (char *)b, 4);
+}
+
+/* Marshal the inputs of the hint list other than the client name into
+ * buf. */
+static void
+edata_cache_key(struct k5buf *buf, krb5_kdc_req *request,
+                krb5_db_entry *client, int hw_only)
+{
+    krb5_key_data *kd;
+    int i;
+
+    add32(buf, hw_only);
+    add32(buf, request->nktypes);
+    for (i = 0; i < request->nktypes; i++)
+        add32(buf, request->ktype[i]);
+    add32(buf, client->n_key_data);
+    for (i = 0; i < client->n_key_data; i++) {
+        kd = &client->key_data[i];
+        add32(buf, kd->key_data_kvno);
+        add32(buf, kd->key_data_type[0]);
+        if (kd->key_data_ver > 1) {
+            add32(buf, kd->key_data_type[1]);
+            add32(buf, kd->key_data_length[1]);
+            k5_buf_add_len(buf, (char *)kd->key_data_contents[1],
+                           kd->key_data_length[1]);
+        } else {
+            add32(buf, KRB5_KDB_SALTTYPE_NORMAL);
+            add32(buf, 0);
+        }
+    }
+}
+
+static unsigned int
+edata_cache_hash(krb5_const_principal client, const krb5_data *key)
+{
+    unsigned int h = 2166136261U;
+    const krb5_data *d;
+    krb5_int32 i;
+    unsigned int j;
+
+    for (i = -2; i < client->length; i++) {
+        d = (i == -2) ? key : (i == -1) ? &client->realm : &client->data[i];
+        for (j = 0; j < d->length; j++)
+            h = (h ^ (unsigned char)d->data[j]) * 16777619U;
+        h = (h ^ 0xff) * 16777619U;
+    }
+    return h;
+}
+
+static void
+edata_cache_discard(krb5_context context, struct edata_cache *cache,
+                    struct edata_cache_ent *ent)
+{
+    LIST_REMOVE(ent, hash_links);
+    TAILQ_REMOVE(&cache->lru, ent, lru_links);
+    cache->num_entries--;
+    krb5_free_principal(context, ent->client);
+    krb5_free_data_contents(context, &ent->key);
+    krb5_free_pa_data(context, ent->salt_info);
+    free(ent);
+}
+
+void
+kdc_free_edata_cache(kdc_realm_t *kdc_active_realm)
+{
+    struct edata_cache *cache = kdc_active_realm->realm_edatacache;
+    struct edata_cache_ent *ent;
+
+    if (cache == NULL)
+        return;
+    while ((ent = TAILQ_FIRST(&cache->lru)) != NULL)
+        edata_cache_discard(kdc_context, cache, ent);
+    free(cache);
+    kdc_active_realm->realm_edatacache = NULL;
+}
+
+static struct edata_cache_ent *
+edata_cache_find(krb5_context context, struct edata_cache *cache,
+                 krb5_const_principal client, const krb5_data *key,
+                 unsigned int hash)
+{
+    struct edata_cache_ent *ent;
+
+    LIST_FOREACH(ent, &cache->buckets[hash % EDATA_CACHE_BUCKETS],
+                 hash_links) {
+        if (ent->hash == hash && data_eq(ent->key, *key) &&
+            krb5_principal_compare(context, ent->client, client))
+            return ent;
+    }
+    return NULL;
+}
+
+static void
+count_edata_cache(krb5_boolean hit)
+{
+    k5_mutex_lock(&edata_stats_lock);
+    if (hit)
+        edata_cache_hits++;
+    else
+        edata_cache_misses++;
+    k5_mutex_unlock(&edata_stats_lock);
+}
+
+void
+kdc_log_preauth_stats(void)
+{
+    unsigned long hits, misses;
+
+    k5_mutex_lock(&edata_stats_lock);
+    hits = edata_cache_hits;
+    misses = edata_cache_misses;
+    k5_mutex_unlock(&edata_stats_lock);
+    krb5_klog_syslog(LOG_INFO, _("preauth hint cache: %lu hits, %lu misses"),
+                     hits, misses);
+}
+
+/* Return true if ap's hint is salt information which may be cached. */
+static krb5_boolean
+is_salt_info(preauth_system *ap)
+{
+    return ap->get_edata == get_etype_info || ap->get_edata == get_etype_info2;
+}
+
+static krb5_error_code
+copy_pa_data(krb5_context context, const krb5_pa_data *in,
+             krb5_pa_data **out)
+{
+    krb5_error_code ret;
+    krb5_pa_data *pa;
+
+    *out = NULL;
+    pa = k5alloc(sizeof(*pa), &ret);
+    if (pa == NULL)
+        return ret;
+    *pa = *in;
+    pa->contents = NULL;
+    if (in->length > 0) {
+        pa->contents = k5alloc(in->length, &ret);
+        if (pa->contents == NULL) {
+            free(pa);
+            return ret;
+        }
+        memcpy(pa->contents, in->contents, in->length);
+    }
+    *out = pa;
+    return 0;
+}
+
+/* Copy the first n hints in list into a new null-terminated list. */
+static krb5_error_code
+copy_pa_list(krb5_context context, krb5_pa_data *const *list, size_t n,
+             krb5_pa_data ***copy_out)
+{
+    krb5_error_code ret;
+    krb5_pa_data **copy;
+    size_t i;
+
+    *copy_out = NULL;
+    copy = k5alloc((n + 1) * sizeof(*copy), &ret);
+    if (copy == NULL)
+        return ret;
+    for (i = 0; i < n; i++) {
+        ret = copy_pa_data(context, list[i], &copy[i]);
+        if (ret) {
+            krb5_free_pa_data(context, copy);
+            return ret;
+        }
+    }
+    *copy_out = copy;
+    return 0;
+}
+
+/* If there is cached salt information for client and key, return true and
+ * set *salt_info_out to a copy of the hints making it up (possibly none). */
+static krb5_boolean
+edata_cache_get(kdc_realm_t *kdc_active_realm, krb5_const_principal client,
+                const krb5_data *key, krb5_pa_data ***salt_info_out)
+{
+    struct edata_cache *cache = kdc_active_realm->realm_edatacache;
+    struct edata_cache_ent *ent;
+    size_t n;
+
+    *salt_info_out = NULL;
+    if (cache == NULL)
+        return FALSE;
+    ent = edata_cache_find(kdc_context, cache, client, key,
+                           edata_cache_hash(client, key));
+    if (ent == NULL)
+        return FALSE;
+    for (n = 0; ent->salt_info[n] != NULL; n++);
+    if (copy_pa_list(kdc_context, ent->salt_info, n, salt_info_out) != 0)
+        return FALSE;
+    TAILQ_REMOVE(&cache->lru, ent, lru_links);
+    TAILQ_INSERT_TAIL(&cache->lru, ent, lru_links);
+    return TRUE;
+}
+
+/* Remember the n salt information hints in salt_info for client and key.
+ * Failures are not reported; the information is just not cached. */
+static void
+edata_cache_put(kdc_realm_t *kdc_active_realm, krb5_const_principal client,
+                const krb5_data *key, krb5_pa_data *const *salt_info,
+                size_t n)
+{
+    struct edata_cache *cache = kdc_active_realm->realm_edatacache;
+    struct edata_cache_ent *ent, *old;
+    int i;
+
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(*cache));
+        if (cache == NULL)
+            return;
+        for (i = 0; i < EDATA_CACHE_BUCKETS; i++)
+            LIST_INIT(&cache->buckets[i]);
+        TAILQ_INIT(&cache->lru);
+        kdc_active_realm->realm_edatacache = cache;
+    }
+
+    ent = calloc(1, sizeof(*ent));
+    if (ent == NULL)
+        return;
+    if (krb5_copy_principal(kdc_context, client, &ent->client) != 0 ||
+        krb5int_copy_data_contents(kdc_context, key, &ent->key) != 0 ||
+        copy_pa_list(kdc_context, salt_info, n, &ent->salt_info) != 0)
+        goto error;
+    ent->hash = edata_cache_hash(client, key);
+
+    old = edata_cache_find(kdc_context, cache, client, key, ent->hash);
+    if (old != NULL)
+        edata_cache_discard(kdc_context, cache, old);
+    LIST_INSERT_HEAD(&cache->buckets[ent->hash % EDATA_CACHE_BUCKETS], ent,
+                     hash_links);
+    TAILQ_INSERT_TAIL(&cache->lru, ent, lru_links);
+    if (++cache->num_entries > EDATA_CACHE_MAX_ENTRIES)
+        edata_cache_discard(kdc_context, cache, TAILQ_FIRST(&cache->lru));
+    return;
+
+error:
+    krb5_free_principal(kdc_context, ent->client);
+    krb5_free_data_contents(kdc_context, &ent->key);
+    krb5_free_pa_data(kdc_context, ent->salt_info);
+    free(ent);
+}
+
+/* The salt information systems; see is_salt_info(). */
+#define MAX_SALT_INFO 2
+
 struct hint_state {
     kdc_hint_respond_fn respond;
     void *arg;
@@ -740,6 +1113,11 @@ struct hint_state {
     krb5_kdcpreauth_rock rock;
     krb5_kdc_req *request;
     krb5_pa_data ***e_data_out;
+    krb5_boolean cacheable;
+    struct k5buf cache_key;
+    krb5_pa_data **cached_salt_info;
+    krb5_pa_data *salt_info[MAX_SALT_INFO];
+    size_t n_salt_info;
 
     int hw_only;
     preauth_system *ap;
@@ -753,6 +1131,7 @@ hint_list_finish(struct hint_state *state, krb5_error_code code)
     kdc_hint_respond_fn oldrespond = state->respond;
     void *oldarg = state->arg;
     kdc_realm_t *kdc_active_realm = state->realm;
+    krb5_data key;
 
     if (!code) {
         if (state->pa_data[0] == 0) {
@@ -764,11 +1143,20 @@ hint_list_finish(struct hint_state *state, krb5_error_code code)
          * continue with the response. */
         kdc_preauth_get_cookie(state->rock->rstate, state->pa_cur);
 
+        if (state->cacheable && state->cached_salt_info == NULL &&
+            k5_buf_len(&state->cache_key) >= 0) {
+            key = make_data(k5_buf_data(&state->cache_key),
+                            k5_buf_len(&state->cache_key));
+            edata_cache_put(kdc_active_realm, state->rock->client->princ,
+                            &key, state->salt_info, state->n_salt_info);
+        }
         *state->e_data_out = state->pa_data;
         state->pa_data = NULL;
     }
 
     krb5_free_pa_data(kdc_context, state->pa_data);
+    krb5_free_pa_data(kdc_context, state->cached_salt_info);
+    k5_free_buf(&state->cache_key);
     free(state);
     (*oldrespond)(oldarg);
 }
@@ -788,6 +1176,8 @@ finish_get_edata(void *arg, krb5_error_code code, krb5_pa_data *pa)
             pa->magic = KV5M_PA_DATA;
             pa->pa_type = state->pa_type;
         }
+        if (is_salt_info(state->ap) && state->n_salt_info < MAX_SALT_INFO)
+            state->salt_info[state->n_salt_info++] = pa;
         *state->pa_cur++ = pa;
     }
 
@@ -795,6 +1185,24 @@ finish_get_edata(void *arg, krb5_error_code code, krb5_pa_data *pa)
     hint_list_next(state);
 }
 
+/* Move the cached hint for the salt information system ap, if there is one,
+ * into the hint list. */
+static void
+use_cached_salt_info(struct hint_state *state, preauth_system *ap)
+{
+    krb5_pa_data **pp;
+
+    for (pp = state->cached_salt_info; *pp != NULL; pp++) {
+        if ((*pp)->pa_type == ap->type) {
+            *state->pa_cur++ = *pp;
+            /* Close up the list, so that it still owns what remains. */
+            for (; *pp != NULL; pp++)
+                *pp = *(pp + 1);
+            return;
+        }
+    }
+}
+
 static void
 hint_list_next(struct hint_state *state)
 {
@@ -811,6 +1219,11 @@ hint_list_next(struct hint_state *state)
     if (ap->flags & PA_PSEUDO)
         goto next;
 
+    if (state->cached_salt_info != NULL && is_salt_info(ap)) {
+        use_cached_salt_info(state, ap);
+        goto next;
+    }
+
     state->pa_type = ap->type;
     if (ap->get_edata) {
         ap->get_edata(kdc_context, state->request, &callbacks, state->rock,
@@ -830,6 +1243,7 @@ get_preauth_hint_list(krb5_kdc_req *request, krb5_kdcpreauth_rock rock,
                       void *arg)
 {
     struct hint_state *state;
+    krb5_data key;
 
     *e_data_out = NULL;
 
@@ -856,6 +1270,23 @@ get_preauth_hint_list(krb5_kdc_req *request, krb5_kdcpreauth_rock rock,
         return;
     }
 
+    k5_buf_init_dynamic(&state->cache_key);
+
+    /* Without FAST, use the cached salt information for the client if there
+     * is any. */
+    if (rock->rstate->armor_key == NULL) {
+        edata_cache_key(&state->cache_key, request, rock->client,
+                        state->hw_only);
+        if (k5_buf_len(&state->cache_key) >= 0) {
+            key = make_data(k5_buf_data(&state->cache_key),
+                            k5_buf_len(&state->cache_key));
+            state->cacheable = TRUE;
+            count_edata_cache(edata_cache_get(state->realm,
+                                              rock->client->princ, &key,
+                                              &state->cached_salt_info));
+        }
+    }
+
     state->pa_cur = state->pa_data;
     state->ap = preauth_systems;
     hint_list_next(state);
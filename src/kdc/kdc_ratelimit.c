@@ -0,0 +1,429 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* kdc/kdc_ratelimit.c - Per-source admission control for the KDC */
+/*
+ * Copyright (C) 2014 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Requests can be rate-limited by client address (masked to a configurable
+ * prefix length) and, for AS requests, by client principal.  Each source gets
+ * a token bucket, kept in the "virtual scheduling" form of the generic cell
+ * rate algorithm: a bucket only records the time at which it would next be
+ * full, and a request is admitted if that time is no more than the burst
+ * allowance into the future.  Requests which are not admitted are dropped
+ * without a reply, so that a flooding client gets nothing it can use.
+ *
+ * The buckets live in a hash table with a least-recently-used list, so that
+ * the table size is bounded however many sources we see.  All of the bucket
+ * functions are called from the event loop thread, so they need no locking.
+ *
+ * Separately, UDP requests which have waited for a worker thread for longer
+ * than udp_max_queue_time are shed, since the client will have retransmitted
+ * or given up by the time we could answer.  kdc_queue_expired() is called
+ * from worker threads and only reads configuration set at startup.
+ */
+
+#include "k5-int.h"
+#include "k5-queue.h"
+#include <syslog.h>
+#include <arpa/inet.h>
+#include "kdc_util.h"
+#include "adm_proto.h"
+
+#ifndef RATELIMIT_MAX_ENTRIES
+#define RATELIMIT_MAX_ENTRIES 65536
+#endif
+
+/* Log drops for a bucket at most this often, in microseconds. */
+#define DROP_LOG_INTERVAL (60 * 1000000)
+
+/* Number of buckets to report in kdc_ratelimit_log_stats(). */
+#define NUM_TOP 10
+
+struct bucket {
+    LIST_ENTRY(bucket) hash_links;
+    TAILQ_ENTRY(bucket) lru_links;
+    krb5_ui_4 hash;
+    krb5_ui_8 tat;              /* When the bucket will next be full */
+    krb5_ui_8 last_log;         /* When we last logged a drop */
+    unsigned long dropped;      /* Total drops for this bucket */
+    unsigned long unlogged;     /* Drops since last_log */
+    unsigned int keylen;
+    unsigned char key[1];       /* Actually keylen bytes */
+};
+
+LIST_HEAD(bucket_list, bucket);
+TAILQ_HEAD(bucket_queue, bucket);
+
+struct limiter {
+    const char *desc;
+    krb5_ui_8 cost;             /* Microseconds per request */
+    krb5_ui_8 tolerance;        /* How far ahead tat may be, in usec */
+    struct bucket_list *table;
+    size_t nbuckets;
+    struct bucket_queue lru;
+    size_t num_entries;
+    unsigned long dropped;
+    unsigned long evictions;
+};
+
+static struct limiter addr_limiter = { "address" };
+static struct limiter princ_limiter = { "principal" };
+static int ipv4_prefix = 32, ipv6_prefix = 128;
+static krb5_ui_4 seed;
+
+/* Maximum UDP queue time in microseconds, or 0 for no limit. */
+static krb5_ui_8 max_queue_time;
+static unsigned long num_shed;
+
+/* Return a seeded FNV-1a hash of key. */
+static krb5_ui_4
+hash_key(const unsigned char *key, unsigned int len)
+{
+    krb5_ui_4 h = 2166136261U ^ seed;
+    unsigned int i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ key[i]) * 16777619U;
+    return h;
+}
+
+static krb5_error_code
+init_limiter(krb5_context context, struct limiter *l, const char *rate_name,
+             const char *burst_name)
+{
+    krb5_error_code ret;
+    size_t i;
+    int rate, burst;
+
+    ret = profile_get_integer(context->profile, KRB5_CONF_KDCDEFAULTS,
+                              rate_name, NULL, 0, &rate);
+    if (ret)
+        return ret;
+    ret = profile_get_integer(context->profile, KRB5_CONF_KDCDEFAULTS,
+                              burst_name, NULL, rate, &burst);
+    if (ret)
+        return ret;
+    if (rate < 0 || burst < 0 || rate > 1000000)
+        return EINVAL;
+
+    TAILQ_INIT(&l->lru);
+    l->num_entries = l->dropped = l->evictions = 0;
+    if (rate == 0)
+        return 0;
+    if (burst == 0)
+        burst = 1;
+    l->cost = 1000000 / rate;
+    l->tolerance = (krb5_ui_8)(burst - 1) * l->cost;
+
+    l->nbuckets = RATELIMIT_MAX_ENTRIES / 2;
+    l->table = calloc(l->nbuckets, sizeof(*l->table));
+    if (l->table == NULL)
+        return ENOMEM;
+    for (i = 0; i < l->nbuckets; i++)
+        LIST_INIT(&l->table[i]);
+    return 0;
+}
+
+static void
+free_limiter(struct limiter *l)
+{
+    struct bucket *b;
+
+    while ((b = TAILQ_FIRST(&l->lru)) != NULL) {
+        TAILQ_REMOVE(&l->lru, b, lru_links);
+        free(b);
+    }
+    free(l->table);
+    l->table = NULL;
+    l->num_entries = 0;
+}
+
+krb5_error_code
+kdc_ratelimit_init(krb5_context context)
+{
+    krb5_error_code ret;
+    krb5_data d;
+    int queue_ms;
+
+    ret = init_limiter(context, &addr_limiter, KRB5_CONF_CLIENT_RATE_LIMIT,
+                       KRB5_CONF_CLIENT_RATE_BURST);
+    if (ret)
+        goto cleanup;
+    ret = init_limiter(context, &princ_limiter,
+                       KRB5_CONF_PRINCIPAL_RATE_LIMIT,
+                       KRB5_CONF_PRINCIPAL_RATE_BURST);
+    if (ret)
+        goto cleanup;
+
+    ret = profile_get_integer(context->profile, KRB5_CONF_KDCDEFAULTS,
+                              KRB5_CONF_CLIENT_RATE_IPV4_PREFIX, NULL, 32,
+                              &ipv4_prefix);
+    if (ret)
+        goto cleanup;
+    ret = profile_get_integer(context->profile, KRB5_CONF_KDCDEFAULTS,
+                              KRB5_CONF_CLIENT_RATE_IPV6_PREFIX, NULL, 128,
+                              &ipv6_prefix);
+    if (ret)
+        goto cleanup;
+    if (ipv4_prefix < 0 || ipv4_prefix > 32 || ipv6_prefix < 0 ||
+        ipv6_prefix > 128) {
+        ret = EINVAL;
+        goto cleanup;
+    }
+
+    ret = profile_get_integer(context->profile, KRB5_CONF_KDCDEFAULTS,
+                              KRB5_CONF_UDP_MAX_QUEUE_TIME, NULL, 0,
+                              &queue_ms);
+    if (ret)
+        goto cleanup;
+    if (queue_ms < 0) {
+        ret = EINVAL;
+        goto cleanup;
+    }
+    max_queue_time = (krb5_ui_8)queue_ms * 1000;
+    num_shed = 0;
+
+    /* Seed the hash so that clients can't choose colliding keys. */
+    d = make_data(&seed, sizeof(seed));
+    ret = krb5_c_random_make_octets(context, &d);
+
+cleanup:
+    if (ret)
+        kdc_ratelimit_fini();
+    return ret;
+}
+
+void
+kdc_ratelimit_fini(void)
+{
+    free_limiter(&addr_limiter);
+    free_limiter(&princ_limiter);
+}
+
+/* Find or create the bucket for key in l, and make it the most recently
+ * used.  Return NULL on allocation failure. */
+static struct bucket *
+get_bucket(struct limiter *l, const unsigned char *key, unsigned int keylen,
+           krb5_ui_8 now)
+{
+    krb5_ui_4 hash = hash_key(key, keylen);
+    struct bucket_list *chain = &l->table[hash % l->nbuckets];
+    struct bucket *b;
+
+    LIST_FOREACH(b, chain, hash_links) {
+        if (b->hash == hash && b->keylen == keylen &&
+            memcmp(b->key, key, keylen) == 0) {
+            TAILQ_REMOVE(&l->lru, b, lru_links);
+            TAILQ_INSERT_HEAD(&l->lru, b, lru_links);
+            return b;
+        }
+    }
+
+    /* Recycle the least recently used bucket if the table is full. */
+    if (l->num_entries >= RATELIMIT_MAX_ENTRIES) {
+        b = TAILQ_LAST(&l->lru, bucket_queue);
+        LIST_REMOVE(b, hash_links);
+        TAILQ_REMOVE(&l->lru, b, lru_links);
+        free(b);
+        l->num_entries--;
+        l->evictions++;
+    }
+
+    b = malloc(sizeof(*b) + keylen);
+    if (b == NULL)
+        return NULL;
+    b->hash = hash;
+    b->tat = now;
+    b->last_log = 0;
+    b->dropped = b->unlogged = 0;
+    b->keylen = keylen;
+    memcpy(b->key, key, keylen);
+    LIST_INSERT_HEAD(chain, b, hash_links);
+    TAILQ_INSERT_HEAD(&l->lru, b, lru_links);
+    l->num_entries++;
+    return b;
+}
+
+/* Format the key of b for logging.  Address keys consist of the address type
+ * and prefix length followed by the masked address; principal keys are the
+ * unparsed principal name. */
+static const char *
+key_name(struct limiter *l, struct bucket *b, char *buf, size_t len)
+{
+    char addrbuf[46];
+    const char *name;
+    int family;
+
+    if (l == &princ_limiter) {
+        snprintf(buf, len, "%.*s", (int)b->keylen, b->key);
+        return buf;
+    }
+    family = (b->key[0] == 4) ? AF_INET : AF_INET6;
+    name = inet_ntop(family, b->key + 2, addrbuf, sizeof(addrbuf));
+    if (name == NULL)
+        return "[unknown address type]";
+    snprintf(buf, len, "%s/%d", name, b->key[1]);
+    return buf;
+}
+
+/* Charge one request to the bucket for key in l, returning true if the
+ * request should be dropped. */
+static krb5_boolean
+limit(struct limiter *l, const unsigned char *key, unsigned int keylen)
+{
+    krb5_ui_8 now = kdc_now_usec(), tat;
+    struct bucket *b;
+    char buf[256];
+
+    b = get_bucket(l, key, keylen, now);
+    if (b == NULL)
+        return FALSE;
+
+    tat = (b->tat > now) ? b->tat : now;
+    if (tat - now <= l->tolerance) {
+        b->tat = tat + l->cost;
+        return FALSE;
+    }
+
+    b->dropped++;
+    b->unlogged++;
+    l->dropped++;
+    if (b->last_log == 0 || now - b->last_log >= DROP_LOG_INTERVAL) {
+        krb5_klog_syslog(LOG_WARNING, _("rate limiting requests from %s %s "
+                                        "(%lu dropped)"), l->desc,
+                         key_name(l, b, buf, sizeof(buf)), b->unlogged);
+        b->last_log = now;
+        b->unlogged = 0;
+    }
+    return TRUE;
+}
+
+krb5_boolean
+kdc_ratelimit_addr(const krb5_fulladdr *from)
+{
+    unsigned char key[2 + 16];
+    const krb5_address *addr = from->address;
+    unsigned int len, prefix, i;
+
+    if (addr_limiter.table == NULL)
+        return FALSE;
+
+    if (addr->addrtype == ADDRTYPE_INET && addr->length == 4) {
+        key[0] = 4;
+        prefix = ipv4_prefix;
+    } else if (addr->addrtype == ADDRTYPE_INET6 && addr->length == 16) {
+        key[0] = 6;
+        prefix = ipv6_prefix;
+    } else {
+        return FALSE;
+    }
+    key[1] = prefix;
+    len = addr->length;
+    memcpy(key + 2, addr->contents, len);
+
+    /* Clear the bits beyond the prefix. */
+    for (i = prefix / 8; i < len; i++)
+        key[2 + i] &= (i == prefix / 8) ? ~(0xFF >> (prefix % 8)) : 0;
+
+    return limit(&addr_limiter, key, 2 + len);
+}
+
+krb5_boolean
+kdc_ratelimit_princ(krb5_context context, krb5_const_principal client)
+{
+    krb5_boolean result;
+    char *name;
+
+    if (princ_limiter.table == NULL || client == NULL)
+        return FALSE;
+    if (krb5_unparse_name(context, client, &name) != 0)
+        return FALSE;
+    result = limit(&princ_limiter, (unsigned char *)name, strlen(name));
+    krb5_free_unparsed_name(context, name);
+    return result;
+}
+
+krb5_boolean
+kdc_queue_expired(const struct kdc_timing *t)
+{
+    return max_queue_time > 0 && kdc_now_usec() - t->start > max_queue_time;
+}
+
+void
+kdc_count_shed(void)
+{
+    num_shed++;
+}
+
+/* Log the total drops for l and the buckets with the most drops. */
+static void
+log_limiter(struct limiter *l)
+{
+    struct bucket *b, *top[NUM_TOP];
+    char buf[256];
+    int i, j, ntop = 0;
+
+    if (l->table == NULL)
+        return;
+    krb5_klog_syslog(LOG_INFO, _("%s rate limit: %lu dropped, %lu sources, "
+                                 "%lu evictions"), l->desc, l->dropped,
+                     (unsigned long)l->num_entries, l->evictions);
+
+    /* Keep top[] sorted by decreasing drop count. */
+    TAILQ_FOREACH(b, &l->lru, lru_links) {
+        if (b->dropped == 0)
+            continue;
+        if (ntop == NUM_TOP && b->dropped <= top[NUM_TOP - 1]->dropped)
+            continue;
+        for (i = (ntop < NUM_TOP) ? ntop++ : NUM_TOP - 1; i > 0; i--) {
+            if (top[i - 1]->dropped >= b->dropped)
+                break;
+            top[i] = top[i - 1];
+        }
+        top[i] = b;
+    }
+    for (j = 0; j < ntop; j++) {
+        krb5_klog_syslog(LOG_INFO, _("  %s: %lu dropped"),
+                         key_name(l, top[j], buf, sizeof(buf)),
+                         top[j]->dropped);
+    }
+}
+
+void
+kdc_ratelimit_log_stats(void)
+{
+    log_limiter(&addr_limiter);
+    log_limiter(&princ_limiter);
+    if (max_queue_time > 0) {
+        krb5_klog_syslog(LOG_INFO, _("shed %lu UDP requests which waited "
+                                     "too long for a worker thread"),
+                         num_shed);
+    }
+}
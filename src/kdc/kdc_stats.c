@@ -0,0 +1,240 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* kdc/kdc_stats.c - Request latency statistics for the KDC */
+/*
+ * Copyright (C) 2014 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Each request carries a struct kdc_timing from dispatch until its response
+ * has been handed to the network code.  The processing code brackets the
+ * interesting parts of request handling with kdc_phase_begin() and
+ * kdc_phase_end(), which may be called from a worker thread.  The totals are
+ * folded into power-of-two latency histograms by kdc_timing_finish(), which
+ * is only called on the event loop thread, so the histograms need no locking.
+ * The histograms are logged on SIGUSR1, and requests slower than the
+ * configured slow_request_threshold are logged with their phase breakdown.
+ */
+
+#include "k5-int.h"
+#include <syslog.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include "kdc_util.h"
+#include "adm_proto.h"
+
+/* Bucket i counts latencies of less than 2^i microseconds (and at least
+ * 2^(i-1) for i > 0).  The last bucket also counts anything longer. */
+#define NUM_BUCKETS 32
+
+struct histogram {
+    unsigned long count;
+    krb5_ui_8 total;
+    krb5_ui_8 max;
+    unsigned long buckets[NUM_BUCKETS];
+};
+
+/* One histogram per phase, plus one for the whole request. */
+static struct histogram hists[KDC_NUM_REQ_TYPES][KDC_NUM_PHASES + 1];
+
+/* Slow request threshold in microseconds; 0 means don't log. */
+static krb5_ui_8 slow_threshold;
+
+static const char *const type_names[KDC_NUM_REQ_TYPES] = {
+    "AS", "TGS", "other"
+};
+
+static const char *const phase_names[KDC_NUM_PHASES] = {
+    "decode", "queue", "db", "auth", "authdata", "ticket", "reply", "send"
+};
+
+/* Return a monotonic time in microseconds. */
+krb5_ui_8
+kdc_now_usec(void)
+{
+    struct timeval tv;
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (krb5_ui_8)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    (void)gettimeofday(&tv, NULL);
+    return (krb5_ui_8)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+krb5_error_code
+kdc_stats_init(krb5_context context)
+{
+    krb5_error_code ret;
+    int threshold;
+
+    ret = profile_get_integer(context->profile, KRB5_CONF_KDCDEFAULTS,
+                              KRB5_CONF_SLOW_REQUEST_THRESHOLD, NULL, 0,
+                              &threshold);
+    if (ret)
+        return ret;
+    if (threshold < 0)
+        return EINVAL;
+    slow_threshold = (krb5_ui_8)threshold * 1000;
+    memset(hists, 0, sizeof(hists));
+    return 0;
+}
+
+void
+kdc_timing_start(struct kdc_timing *t, const krb5_fulladdr *from)
+{
+    memset(t, 0, sizeof(*t));
+    t->req_type = KDC_REQ_OTHER;
+    t->start = kdc_now_usec();
+    t->addrtype = from->address->addrtype;
+    t->addrlen = from->address->length;
+    if (t->addrlen > sizeof(t->addr))
+        t->addrlen = 0;
+    memcpy(t->addr, from->address->contents, t->addrlen);
+}
+
+void
+kdc_phase_begin(struct kdc_timing *t, enum kdc_phase phase)
+{
+    if (t != NULL)
+        t->begin[phase] = kdc_now_usec();
+}
+
+void
+kdc_phase_end(struct kdc_timing *t, enum kdc_phase phase)
+{
+    if (t == NULL || t->begin[phase] == 0)
+        return;
+    t->usec[phase] += kdc_now_usec() - t->begin[phase];
+    t->begin[phase] = 0;
+    t->used |= 1 << phase;
+}
+
+static void
+record(struct histogram *h, krb5_ui_8 usec)
+{
+    int i;
+
+    for (i = 0; i < NUM_BUCKETS - 1 && usec >= ((krb5_ui_8)1 << i); i++);
+    h->buckets[i]++;
+    h->count++;
+    h->total += usec;
+    if (usec > h->max)
+        h->max = usec;
+}
+
+/* Log a request which took longer than slow_request_threshold. */
+static void
+log_slow_request(struct kdc_timing *t, krb5_ui_8 total)
+{
+    struct k5buf buf;
+    char addrbuf[46];
+    const char *name = NULL;
+    int i;
+
+    if (t->addrlen > 0) {
+        name = inet_ntop(ADDRTYPE2FAMILY(t->addrtype), t->addr, addrbuf,
+                         sizeof(addrbuf));
+    }
+    if (name == NULL)
+        name = "[unknown address type]";
+
+    k5_buf_init_dynamic(&buf);
+    for (i = 0; i < KDC_NUM_PHASES; i++) {
+        if (t->used & (1 << i)) {
+            k5_buf_add_fmt(&buf, "%s%s %lu", k5_buf_len(&buf) ? ", " : "",
+                           phase_names[i], (unsigned long)t->usec[i]);
+        }
+    }
+    krb5_klog_syslog(LOG_NOTICE, _("slow %s request from %s: %lu us (%s)"),
+                     type_names[t->req_type], name, (unsigned long)total,
+                     k5_buf_data(&buf) != NULL ? k5_buf_data(&buf) : "");
+    k5_free_buf(&buf);
+}
+
+void
+kdc_timing_finish(struct kdc_timing *t)
+{
+    struct histogram *h = hists[t->req_type];
+    krb5_ui_8 total;
+    int i;
+
+    total = kdc_now_usec() - t->start;
+    for (i = 0; i < KDC_NUM_PHASES; i++) {
+        if (t->used & (1 << i))
+            record(&h[i], t->usec[i]);
+    }
+    record(&h[KDC_NUM_PHASES], total);
+
+    if (slow_threshold > 0 && total >= slow_threshold)
+        log_slow_request(t, total);
+}
+
+/* Return the upper bound of the bucket containing the pct percentile. */
+static unsigned long
+percentile(struct histogram *h, int pct)
+{
+    unsigned long want, seen = 0;
+    int i;
+
+    want = (h->count * pct + 99) / 100;
+    for (i = 0; i < NUM_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if (seen >= want)
+            break;
+    }
+    return 1UL << i;
+}
+
+static void
+log_histogram(const char *type, const char *phase, struct histogram *h)
+{
+    if (h->count == 0)
+        return;
+    krb5_klog_syslog(LOG_INFO, _("latency %s %s: %lu requests, mean %lu us, "
+                                 "p50 < %lu us, p90 < %lu us, p99 < %lu us, "
+                                 "max %lu us"), type, phase, h->count,
+                     (unsigned long)(h->total / h->count), percentile(h, 50),
+                     percentile(h, 90), percentile(h, 99),
+                     (unsigned long)h->max);
+}
+
+/* Log the latency histograms for each request type and phase. */
+void
+kdc_log_stats(void)
+{
+    int type, phase;
+
+    for (type = 0; type < KDC_NUM_REQ_TYPES; type++) {
+        log_histogram(type_names[type], "total", &hists[type][KDC_NUM_PHASES]);
+        for (phase = 0; phase < KDC_NUM_PHASES; phase++)
+            log_histogram(type_names[type], phase_names[phase],
+                          &hists[type][phase]);
+    }
+}
@@ -0,0 +1,271 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* kdc/kdc_threads.c - Worker thread pool for the KDC */
+/*
+ * Copyright (C) 2014 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The KDC's network code and event loop run in a single thread.  When
+ * krb5kdc is started with -t, requests which can be processed without the
+ * event loop are handed to a pool of worker threads.  Each worker thread has
+ * its own server handle, with its own realm contexts and database handles,
+ * since krb5 contexts may not be used by more than one thread at a time.
+ * Work items are completed back on the event loop thread, which is the only
+ * thread allowed to touch the network code or the lookaside cache.
+ */
+
+#include "k5-int.h"
+#include "k5-queue.h"
+#include <syslog.h>
+#include "kdc_util.h"
+#include "adm_proto.h"
+
+#ifdef ENABLE_THREADS
+
+#include <pthread.h>
+#include <signal.h>
+
+struct work_item {
+    TAILQ_ENTRY(work_item) links;
+    kdc_work_fn work;
+    kdc_done_fn done;
+    void *arg;
+};
+
+TAILQ_HEAD(work_queue, work_item);
+
+struct worker {
+    pthread_t tid;
+    struct server_handle *handle;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct work_queue pending = TAILQ_HEAD_INITIALIZER(pending);
+static struct work_queue completed = TAILQ_HEAD_INITIALIZER(completed);
+static krb5_boolean shutting_down;
+
+static struct worker *workers;
+static int num_workers;
+static int wakeup_fds[2] = { -1, -1 };
+static verto_ev *wakeup_ev;
+
+/* Run work items from the pending queue until the pool is shut down. */
+static void *
+worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct work_item *item;
+    krb5_boolean notify;
+    char c = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (!shutting_down && TAILQ_EMPTY(&pending))
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        if (shutting_down)
+            break;
+        item = TAILQ_FIRST(&pending);
+        TAILQ_REMOVE(&pending, item, links);
+        pthread_mutex_unlock(&pool_lock);
+
+        item->work(w->handle, item->arg);
+
+        pthread_mutex_lock(&pool_lock);
+        /* Only wake up the event loop if it isn't already due to run. */
+        notify = TAILQ_EMPTY(&completed);
+        TAILQ_INSERT_TAIL(&completed, item, links);
+        if (notify)
+            (void)write(wakeup_fds[1], &c, 1);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+/* Run the completion callbacks of finished work items on the loop thread. */
+static void
+process_completions(verto_ctx *ctx, verto_ev *ev)
+{
+    struct work_queue done;
+    struct work_item *item, *next;
+    char buf[64];
+
+    while (read(wakeup_fds[0], buf, sizeof(buf)) > 0);
+
+    TAILQ_INIT(&done);
+    pthread_mutex_lock(&pool_lock);
+    TAILQ_CONCAT(&done, &completed, links);
+    pthread_mutex_unlock(&pool_lock);
+
+    TAILQ_FOREACH_SAFE(item, &done, links, next) {
+        item->done(item->arg);
+        free(item);
+    }
+}
+
+krb5_error_code
+kdc_threads_init(verto_ctx *ctx, struct server_handle **handles, int nthreads)
+{
+    krb5_error_code ret;
+    sigset_t all, old;
+    int i;
+
+    if (pipe(wakeup_fds) != 0)
+        return errno;
+    set_cloexec_fd(wakeup_fds[0]);
+    set_cloexec_fd(wakeup_fds[1]);
+    if (fcntl(wakeup_fds[0], F_SETFL, O_NONBLOCK) != 0) {
+        ret = errno;
+        goto error;
+    }
+    wakeup_ev = verto_add_io(ctx, VERTO_EV_FLAG_PERSIST |
+                             VERTO_EV_FLAG_IO_READ, process_completions,
+                             wakeup_fds[0]);
+    if (wakeup_ev == NULL) {
+        ret = ENOMEM;
+        goto error;
+    }
+
+    workers = calloc(nthreads, sizeof(*workers));
+    if (workers == NULL) {
+        ret = ENOMEM;
+        goto error;
+    }
+
+    /* Leave signal handling to the event loop thread. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (i = 0; i < nthreads; i++) {
+        workers[i].handle = handles[i];
+        ret = pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+        if (ret)
+            break;
+        num_workers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret)
+        goto error;
+
+    krb5_klog_syslog(LOG_INFO, _("created %d worker threads"), nthreads);
+    return 0;
+
+error:
+    kdc_threads_fini();
+    return ret;
+}
+
+krb5_boolean
+kdc_threads_active(void)
+{
+    return num_workers > 0;
+}
+
+krb5_error_code
+kdc_threads_submit(kdc_work_fn work, kdc_done_fn done, void *arg)
+{
+    struct work_item *item;
+
+    if (num_workers == 0)
+        return KRB5_PLUGIN_NO_HANDLE;
+    item = malloc(sizeof(*item));
+    if (item == NULL)
+        return ENOMEM;
+    item->work = work;
+    item->done = done;
+    item->arg = arg;
+
+    pthread_mutex_lock(&pool_lock);
+    TAILQ_INSERT_TAIL(&pending, item, links);
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+void
+kdc_threads_fini(void)
+{
+    struct work_item *item, *next;
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    shutting_down = TRUE;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    for (i = 0; i < num_workers; i++)
+        pthread_join(workers[i].tid, NULL);
+    free(workers);
+    workers = NULL;
+    num_workers = 0;
+
+    /* Discard work which will never be completed.  The loop is no longer
+     * running, so there is nobody to respond to. */
+    TAILQ_FOREACH_SAFE(item, &pending, links, next)
+        free(item);
+    TAILQ_FOREACH_SAFE(item, &completed, links, next)
+        free(item);
+    TAILQ_INIT(&pending);
+    TAILQ_INIT(&completed);
+
+    if (wakeup_ev != NULL)
+        verto_del(wakeup_ev);
+    wakeup_ev = NULL;
+    if (wakeup_fds[0] != -1)
+        close(wakeup_fds[0]);
+    if (wakeup_fds[1] != -1)
+        close(wakeup_fds[1]);
+    wakeup_fds[0] = wakeup_fds[1] = -1;
+    shutting_down = FALSE;
+}
+
+#else /* ENABLE_THREADS */
+
+krb5_error_code
+kdc_threads_init(verto_ctx *ctx, struct server_handle **handles, int nthreads)
+{
+    return EINVAL;
+}
+
+krb5_boolean
+kdc_threads_active(void)
+{
+    return FALSE;
+}
+
+krb5_error_code
+kdc_threads_submit(kdc_work_fn work, kdc_done_fn done, void *arg)
+{
+    return KRB5_PLUGIN_NO_HANDLE;
+}
+
+void
+kdc_threads_fini(void)
+{
+}
+
+#endif /* ENABLE_THREADS */
@@ -52,8 +52,10 @@
  */
 
 #include "k5-int.h"
+#include "k5-queue.h"
 #include "kdc_util.h"
 #include "extern.h"
+#include "kdb_log.h"
 #include <stdio.h>
 #include <ctype.h>
 #include <syslog.h>
@@ -78,6 +80,12 @@ static krb5_error_code find_server_key(krb5_context,
                                        krb5_db_entry *, krb5_enctype,
                                        krb5_kvno, krb5_keyblock **,
                                        krb5_kvno *);
+static krb5_error_code find_server_key_k(kdc_realm_t *, krb5_db_entry *,
+                                         krb5_enctype, krb5_kvno, krb5_key *,
+                                         krb5_kvno *);
+static krb5_error_code tkt_cache_get(kdc_realm_t *, krb5_ticket *, krb5_key,
+                                     krb5_boolean *);
+static void tkt_cache_put(kdc_realm_t *, krb5_ticket *, krb5_key);
 
 /*
  * concatenate first two authdata arrays, returning an allocated replacement.
@@ -375,6 +383,8 @@ kdc_rd_ap_req(kdc_realm_t *kdc_active_realm,
     krb5_enctype        search_enctype = apreq->ticket->enc_part.enctype;
     krb5_boolean        match_enctype = 1;
     krb5_kvno           kvno;
+    krb5_key            key = NULL;
+    krb5_boolean        cached;
     size_t              tries = 3;
 
     /*
@@ -399,24 +409,51 @@ kdc_rd_ap_req(kdc_realm_t *kdc_active_realm,
     kvno = apreq->ticket->enc_part.kvno;
     do {
         krb5_free_keyblock(kdc_context, *tgskey);
-        retval = find_server_key(kdc_context,
-                                 *server, search_enctype, kvno, tgskey, &kvno);
+        *tgskey = NULL;
+        krb5_k_free_key(kdc_context, key);
+        key = NULL;
+        retval = find_server_key_k(kdc_active_realm, *server, search_enctype,
+                                   kvno, &key, &kvno);
         if (retval)
             continue;
+        retval = krb5_k_key_keyblock(kdc_context, key, tgskey);
+        if (retval)
+            break;
 
-        /* Make the TGS key available to krb5_rd_req_decoded_anyflag() */
-        retval = krb5_auth_con_setuseruserkey(kdc_context, auth_context,
-                                              *tgskey);
+        /* If this ticket was recently decrypted with the same key, use the
+         * cached result instead of decrypting it again. */
+        retval = tkt_cache_get(kdc_active_realm, apreq->ticket, key, &cached);
         if (retval)
-            return retval;
+            break;
+
+        /*
+         * Make the TGS key available to krb5_rd_req_decoded_anyflag(), unless
+         * the ticket is already decrypted.  The cached key object is shared,
+         * so that the derived keys it accumulates are kept for later
+         * requests.
+         */
+        retval = krb5_auth_con_setuseruserkey_k(kdc_context, auth_context,
+                                                cached ? NULL : key);
+        if (retval)
+            break;
 
-        retval = krb5_rd_req_decoded_anyflag(kdc_context, &auth_context, apreq,
-                                             apreq->ticket->server,
-                                             kdc_active_realm->realm_keytab,
-                                             NULL, ticket);
+        if (cached) {
+            retval = k5_rd_req_decoded_decrypted(kdc_context, &auth_context,
+                                                 apreq, apreq->ticket->server,
+                                                 kdc_active_realm->realm_keytab,
+                                                 NULL, ticket);
+        } else {
+            retval = krb5_rd_req_decoded_anyflag(kdc_context, &auth_context,
+                                                 apreq, apreq->ticket->server,
+                                                 kdc_active_realm->realm_keytab,
+                                                 NULL, ticket);
+        }
+        if (retval == 0 && !cached)
+            tkt_cache_put(kdc_active_realm, apreq->ticket, key);
     } while (retval && apreq->ticket->enc_part.kvno == 0 && kvno-- > 1 &&
              --tries > 0);
 
+    krb5_k_free_key(kdc_context, key);
     return retval;
 }
 
@@ -528,6 +565,609 @@ errout:
     return retval;
 }
 
+/*
+ * Decrypted server keys are kept in a per-realm cache of krb5_key objects, so
+ * that the derived keys and cipher state built up while processing one
+ * request are reused by the next.  Entries are found by the encrypted key
+ * data from the database entry rather than by principal name.  A new key
+ * (from a password change, key rollover, or master key change) has different
+ * encrypted contents, so it can never match a stale entry; stale entries are
+ * simply not used again and age out of the cache.  Key objects are zeroed by
+ * krb5_k_free_key() when the last reference goes away.
+ *
+ * A realm structure is used by only one thread at a time, so the cache needs
+ * no locking.
+ */
+
+#define KEY_CACHE_BUCKETS 256
+#define KEY_CACHE_MAX_ENTRIES 1024
+
+struct key_cache_ent {
+    LIST_ENTRY(key_cache_ent) hash_links;
+    TAILQ_ENTRY(key_cache_ent) lru_links;
+    unsigned int hash;
+    krb5_int16 kvno;            /* As in krb5_key_data */
+    krb5_enctype db_enctype;    /* Enctype of the stored key */
+    krb5_enctype enctype;       /* Enctype of the key object */
+    krb5_data enc_contents;     /* Encrypted key data from the DB entry */
+    krb5_key key;
+};
+
+LIST_HEAD(key_cache_bucket, key_cache_ent);
+TAILQ_HEAD(key_cache_lru, key_cache_ent);
+
+struct key_cache {
+    struct key_cache_bucket buckets[KEY_CACHE_BUCKETS];
+    struct key_cache_lru lru;
+    int num_entries;
+};
+
+/* FNV-1a hash of d. */
+static unsigned int
+data_hash(const krb5_data *d)
+{
+    unsigned int h = 2166136261U;
+    unsigned int i;
+
+    for (i = 0; i < d->length; i++) {
+        h ^= (unsigned char)d->data[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void
+key_cache_discard(krb5_context context, struct key_cache *cache,
+                  struct key_cache_ent *ent)
+{
+    LIST_REMOVE(ent, hash_links);
+    TAILQ_REMOVE(&cache->lru, ent, lru_links);
+    cache->num_entries--;
+    krb5_k_free_key(context, ent->key);
+    free(ent->enc_contents.data);
+    free(ent);
+}
+
+void
+kdc_free_key_cache(kdc_realm_t *kdc_active_realm)
+{
+    struct key_cache *cache = kdc_active_realm->realm_keycache;
+    struct key_cache_ent *ent;
+
+    if (cache == NULL)
+        return;
+    while ((ent = TAILQ_FIRST(&cache->lru)) != NULL)
+        key_cache_discard(kdc_context, cache, ent);
+    free(cache);
+    kdc_active_realm->realm_keycache = NULL;
+}
+
+/*
+ * Set *key_out to a key object for key_data, with its enctype changed to
+ * enctype if enctype is not -1.  The caller must release the result with
+ * krb5_k_free_key().
+ */
+krb5_error_code
+kdc_get_cached_key(kdc_realm_t *kdc_active_realm, krb5_key_data *key_data,
+                   krb5_enctype enctype, krb5_key *key_out)
+{
+    krb5_error_code ret;
+    struct key_cache *cache = kdc_active_realm->realm_keycache;
+    struct key_cache_ent *ent;
+    struct key_cache_bucket *bucket;
+    krb5_keyblock kb;
+    krb5_data enc;
+    unsigned int hash;
+    int i;
+
+    *key_out = NULL;
+    enc = make_data(key_data->key_data_contents[0],
+                    key_data->key_data_length[0]);
+    hash = data_hash(&enc);
+
+    if (cache == NULL) {
+        cache = k5alloc(sizeof(*cache), &ret);
+        if (cache == NULL)
+            return ret;
+        for (i = 0; i < KEY_CACHE_BUCKETS; i++)
+            LIST_INIT(&cache->buckets[i]);
+        TAILQ_INIT(&cache->lru);
+        kdc_active_realm->realm_keycache = cache;
+    }
+
+    bucket = &cache->buckets[hash % KEY_CACHE_BUCKETS];
+    LIST_FOREACH(ent, bucket, hash_links) {
+        if (ent->hash == hash && ent->kvno == key_data->key_data_kvno &&
+            ent->db_enctype == key_data->key_data_type[0] &&
+            ent->enctype == (enctype == -1 ? ent->db_enctype : enctype) &&
+            data_eq(ent->enc_contents, enc)) {
+            /* Move the entry to the most recently used end. */
+            TAILQ_REMOVE(&cache->lru, ent, lru_links);
+            TAILQ_INSERT_TAIL(&cache->lru, ent, lru_links);
+            krb5_k_reference_key(kdc_context, ent->key);
+            *key_out = ent->key;
+            return 0;
+        }
+    }
+
+    ret = krb5_dbe_decrypt_key_data(kdc_context, NULL, key_data, &kb, NULL);
+    if (ret)
+        return ret;
+    if (enctype != -1)
+        kb.enctype = enctype;
+    ret = krb5_k_create_key(kdc_context, &kb, key_out);
+    krb5_free_keyblock_contents(kdc_context, &kb);
+    if (ret)
+        return ret;
+
+    /* Failing to cache the key is not an error. */
+    ent = calloc(1, sizeof(*ent));
+    if (ent == NULL)
+        return 0;
+    if (krb5int_copy_data_contents(kdc_context, &enc,
+                                   &ent->enc_contents) != 0) {
+        free(ent);
+        return 0;
+    }
+    ent->hash = hash;
+    ent->kvno = key_data->key_data_kvno;
+    ent->db_enctype = key_data->key_data_type[0];
+    ent->enctype = (*key_out)->keyblock.enctype;
+    ent->key = *key_out;
+    krb5_k_reference_key(kdc_context, ent->key);
+    LIST_INSERT_HEAD(bucket, ent, hash_links);
+    TAILQ_INSERT_TAIL(&cache->lru, ent, lru_links);
+    if (++cache->num_entries > KEY_CACHE_MAX_ENTRIES)
+        key_cache_discard(kdc_context, cache, TAILQ_FIRST(&cache->lru));
+    return 0;
+}
+
+/*
+ * The decrypted parts of recently used header tickets (normally TGTs) are kept
+ * in a per-realm cache, so that a client making a series of TGS requests with
+ * the same TGT only pays for decrypting and decoding it once; later requests
+ * only need their authenticators checked.  Entries are found by the ticket
+ * ciphertext, and hold a reference to the key object which decrypted it.  An
+ * entry is only used if that key object is still the one chosen for the
+ * ticket, so a change to the server key (including purging old keys) takes
+ * effect at once.  Entries are discarded once the ticket has expired.
+ */
+
+#define TKT_CACHE_BUCKETS 256
+#define TKT_CACHE_MAX_ENTRIES 1024
+
+struct tkt_cache_ent {
+    LIST_ENTRY(tkt_cache_ent) hash_links;
+    TAILQ_ENTRY(tkt_cache_ent) lru_links;
+    unsigned int hash;
+    krb5_key key;
+    krb5_ticket *ticket;
+};
+
+LIST_HEAD(tkt_cache_bucket, tkt_cache_ent);
+TAILQ_HEAD(tkt_cache_lru, tkt_cache_ent);
+
+struct tkt_cache {
+    struct tkt_cache_bucket buckets[TKT_CACHE_BUCKETS];
+    struct tkt_cache_lru lru;
+    int num_entries;
+};
+
+static void
+tkt_cache_discard(krb5_context context, struct tkt_cache *cache,
+                  struct tkt_cache_ent *ent)
+{
+    LIST_REMOVE(ent, hash_links);
+    TAILQ_REMOVE(&cache->lru, ent, lru_links);
+    cache->num_entries--;
+    krb5_k_free_key(context, ent->key);
+    krb5_free_ticket(context, ent->ticket);
+    free(ent);
+}
+
+void
+kdc_free_tkt_cache(kdc_realm_t *kdc_active_realm)
+{
+    struct tkt_cache *cache = kdc_active_realm->realm_tktcache;
+    struct tkt_cache_ent *ent;
+
+    if (cache == NULL)
+        return;
+    while ((ent = TAILQ_FIRST(&cache->lru)) != NULL)
+        tkt_cache_discard(kdc_context, cache, ent);
+    free(cache);
+    kdc_active_realm->realm_tktcache = NULL;
+}
+
+/*
+ * If ticket was previously decrypted with key, set ticket->enc_part2 to a copy
+ * of the result and set *cached_out to true.  Otherwise leave ticket alone and
+ * set *cached_out to false.
+ */
+static krb5_error_code
+tkt_cache_get(kdc_realm_t *kdc_active_realm, krb5_ticket *ticket,
+              krb5_key key, krb5_boolean *cached_out)
+{
+    krb5_error_code ret;
+    struct tkt_cache *cache = kdc_active_realm->realm_tktcache;
+    struct tkt_cache_ent *ent;
+    struct tkt_cache_bucket *bucket;
+    krb5_ticket *copy;
+    krb5_timestamp now;
+    unsigned int hash;
+
+    *cached_out = FALSE;
+    if (cache == NULL)
+        return 0;
+
+    hash = data_hash(&ticket->enc_part.ciphertext);
+    bucket = &cache->buckets[hash % TKT_CACHE_BUCKETS];
+    LIST_FOREACH(ent, bucket, hash_links) {
+        if (ent->hash == hash &&
+            ent->ticket->enc_part.enctype == ticket->enc_part.enctype &&
+            data_eq(ent->ticket->enc_part.ciphertext,
+                    ticket->enc_part.ciphertext))
+            break;
+    }
+    if (ent == NULL || ent->key != key)
+        return 0;
+
+    ret = krb5_timeofday(kdc_context, &now);
+    if (ret)
+        return ret;
+    if (ent->ticket->enc_part2->times.endtime < now) {
+        tkt_cache_discard(kdc_context, cache, ent);
+        return 0;
+    }
+
+    ret = krb5_copy_ticket(kdc_context, ent->ticket, &copy);
+    if (ret)
+        return ret;
+    krb5_free_enc_tkt_part(kdc_context, ticket->enc_part2);
+    ticket->enc_part2 = copy->enc_part2;
+    copy->enc_part2 = NULL;
+    krb5_free_ticket(kdc_context, copy);
+
+    TAILQ_REMOVE(&cache->lru, ent, lru_links);
+    TAILQ_INSERT_TAIL(&cache->lru, ent, lru_links);
+    *cached_out = TRUE;
+    return 0;
+}
+
+/* Remember the decrypted part of ticket, which was decrypted with key.
+ * Failures are not reported; the ticket is just not cached. */
+static void
+tkt_cache_put(kdc_realm_t *kdc_active_realm, krb5_ticket *ticket,
+              krb5_key key)
+{
+    struct tkt_cache *cache = kdc_active_realm->realm_tktcache;
+    struct tkt_cache_ent *ent, *old;
+    struct tkt_cache_bucket *bucket;
+    krb5_timestamp now;
+    int i;
+
+    if (krb5_timeofday(kdc_context, &now) != 0 ||
+        ticket->enc_part2->times.endtime < now)
+        return;
+
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(*cache));
+        if (cache == NULL)
+            return;
+        for (i = 0; i < TKT_CACHE_BUCKETS; i++)
+            LIST_INIT(&cache->buckets[i]);
+        TAILQ_INIT(&cache->lru);
+        kdc_active_realm->realm_tktcache = cache;
+    }
+
+    ent = calloc(1, sizeof(*ent));
+    if (ent == NULL)
+        return;
+    if (krb5_copy_ticket(kdc_context, ticket, &ent->ticket) != 0) {
+        free(ent);
+        return;
+    }
+    ent->hash = data_hash(&ticket->enc_part.ciphertext);
+    ent->key = key;
+    krb5_k_reference_key(kdc_context, key);
+
+    /* Replace any entry for the same ticket made with a different key. */
+    bucket = &cache->buckets[ent->hash % TKT_CACHE_BUCKETS];
+    LIST_FOREACH(old, bucket, hash_links) {
+        if (old->hash == ent->hash &&
+            data_eq(old->ticket->enc_part.ciphertext,
+                    ticket->enc_part.ciphertext)) {
+            tkt_cache_discard(kdc_context, cache, old);
+            break;
+        }
+    }
+
+    LIST_INSERT_HEAD(bucket, ent, hash_links);
+    TAILQ_INSERT_TAIL(&cache->lru, ent, lru_links);
+    if (++cache->num_entries > TKT_CACHE_MAX_ENTRIES)
+        tkt_cache_discard(kdc_context, cache, TAILQ_FIRST(&cache->lru));
+}
+
+/*
+ * The results of recent server principal searches which did not find the
+ * requested principal itself are kept in a per-realm cache: either that no
+ * principal was found, or which referral or alternate TGS principal was found
+ * in its place.  This lets the KDC answer repeated requests for nonexistent
+ * services without repeating the failed lookups.  The cache is emptied
+ * whenever the database's age or update log serial number changes, and
+ * entries expire after a minute, since referral results also depend on the
+ * host realm mapping.
+ */
+
+#define LOOKUP_CACHE_BUCKETS 256
+#define LOOKUP_CACHE_MAX_ENTRIES 4096
+#define LOOKUP_CACHE_LIFETIME 60
+
+struct lookup_cache_ent {
+    LIST_ENTRY(lookup_cache_ent) hash_links;
+    TAILQ_ENTRY(lookup_cache_ent) lru_links;
+    unsigned int hash;
+    krb5_flags flags;
+    krb5_flags options;
+    krb5_timestamp expires;
+    krb5_principal princ;
+    krb5_principal result;      /* NULL if nothing was found */
+    krb5_boolean alternate;
+};
+
+LIST_HEAD(lookup_cache_bucket, lookup_cache_ent);
+TAILQ_HEAD(lookup_cache_lru, lookup_cache_ent);
+
+struct lookup_cache {
+    struct lookup_cache_bucket buckets[LOOKUP_CACHE_BUCKETS];
+    struct lookup_cache_lru lru;
+    int num_entries;
+    time_t age;
+    kdb_sno_t sno;
+};
+
+static unsigned int
+princ_hash(krb5_const_principal princ)
+{
+    unsigned int h = data_hash(&princ->realm);
+    krb5_int32 i;
+
+    for (i = 0; i < princ->length; i++)
+        h = h * 31 + data_hash(&princ->data[i]);
+    return h * 31 + princ->type;
+}
+
+static void
+lookup_cache_discard(krb5_context context, struct lookup_cache *cache,
+                     struct lookup_cache_ent *ent)
+{
+    LIST_REMOVE(ent, hash_links);
+    TAILQ_REMOVE(&cache->lru, ent, lru_links);
+    cache->num_entries--;
+    krb5_free_principal(context, ent->princ);
+    krb5_free_principal(context, ent->result);
+    free(ent);
+}
+
+static void
+lookup_cache_flush(krb5_context context, struct lookup_cache *cache)
+{
+    struct lookup_cache_ent *ent;
+
+    while ((ent = TAILQ_FIRST(&cache->lru)) != NULL)
+        lookup_cache_discard(context, cache, ent);
+}
+
+void
+kdc_free_lookup_cache(kdc_realm_t *kdc_active_realm)
+{
+    struct lookup_cache *cache = kdc_active_realm->realm_lookupcache;
+
+    if (cache == NULL)
+        return;
+    lookup_cache_flush(kdc_context, cache);
+    free(cache);
+    kdc_active_realm->realm_lookupcache = NULL;
+}
+
+/* Empty cache if the database has changed since it was last checked.  Return
+ * false if the database's generation can't be determined. */
+static krb5_boolean
+lookup_cache_check(krb5_context context, struct lookup_cache *cache)
+{
+    kdb_log_context *log_ctx = context->kdblog_context;
+    kdb_sno_t sno = 0;
+    time_t age;
+
+    if (krb5_db_get_age(context, NULL, &age) != 0 || age == (time_t)-1) {
+        lookup_cache_flush(context, cache);
+        return FALSE;
+    }
+    if (log_ctx != NULL && log_ctx->ulog != NULL)
+        sno = log_ctx->ulog->kdb_last_sno;
+    if (age != cache->age || sno != cache->sno)
+        lookup_cache_flush(context, cache);
+    cache->age = age;
+    cache->sno = sno;
+    return TRUE;
+}
+
+static struct lookup_cache_ent *
+lookup_cache_find(krb5_context context, struct lookup_cache *cache,
+                  krb5_const_principal princ, unsigned int hash,
+                  krb5_flags flags, krb5_flags options)
+{
+    struct lookup_cache_ent *ent;
+
+    LIST_FOREACH(ent, &cache->buckets[hash % LOOKUP_CACHE_BUCKETS],
+                 hash_links) {
+        if (ent->hash == hash && ent->flags == flags &&
+            ent->options == options && ent->princ->type == princ->type &&
+            krb5_principal_compare(context, ent->princ, princ))
+            return ent;
+    }
+    return NULL;
+}
+
+/*
+ * Look for a cached search result for princ with the given lookup flags and
+ * request options.  If one is found, return true and set *result_out to a
+ * copy of the principal found in its place (or to NULL if nothing was found)
+ * and *alternate_out to whether it was an alternate TGS principal.
+ */
+krb5_boolean
+kdc_lookup_cache_get(kdc_realm_t *kdc_active_realm, krb5_const_principal princ,
+                     krb5_flags flags, krb5_flags options,
+                     krb5_principal *result_out, krb5_boolean *alternate_out)
+{
+    struct lookup_cache *cache = kdc_active_realm->realm_lookupcache;
+    struct lookup_cache_ent *ent;
+    krb5_timestamp now;
+
+    *result_out = NULL;
+    *alternate_out = FALSE;
+    if (cache == NULL || cache->num_entries == 0 ||
+        !lookup_cache_check(kdc_context, cache))
+        return FALSE;
+
+    ent = lookup_cache_find(kdc_context, cache, princ, princ_hash(princ),
+                            flags, options);
+    if (ent == NULL)
+        return FALSE;
+    if (krb5_timeofday(kdc_context, &now) != 0 || ent->expires < now) {
+        lookup_cache_discard(kdc_context, cache, ent);
+        return FALSE;
+    }
+    if (ent->result != NULL &&
+        krb5_copy_principal(kdc_context, ent->result, result_out) != 0)
+        return FALSE;
+    *alternate_out = ent->alternate;
+
+    TAILQ_REMOVE(&cache->lru, ent, lru_links);
+    TAILQ_INSERT_TAIL(&cache->lru, ent, lru_links);
+    return TRUE;
+}
+
+/* Remember the result of a search for princ: result is the principal found in
+ * its place, or NULL if nothing was found.  Failures are not reported; the
+ * result is just not cached. */
+void
+kdc_lookup_cache_put(kdc_realm_t *kdc_active_realm, krb5_const_principal princ,
+                     krb5_flags flags, krb5_flags options,
+                     krb5_const_principal result, krb5_boolean alternate)
+{
+    struct lookup_cache *cache = kdc_active_realm->realm_lookupcache;
+    struct lookup_cache_ent *ent, *old;
+    krb5_timestamp now;
+    int i;
+
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(*cache));
+        if (cache == NULL)
+            return;
+        for (i = 0; i < LOOKUP_CACHE_BUCKETS; i++)
+            LIST_INIT(&cache->buckets[i]);
+        TAILQ_INIT(&cache->lru);
+        kdc_active_realm->realm_lookupcache = cache;
+    }
+    if (!lookup_cache_check(kdc_context, cache) ||
+        krb5_timeofday(kdc_context, &now) != 0)
+        return;
+
+    ent = calloc(1, sizeof(*ent));
+    if (ent == NULL)
+        return;
+    if (krb5_copy_principal(kdc_context, princ, &ent->princ) != 0 ||
+        (result != NULL &&
+         krb5_copy_principal(kdc_context, result, &ent->result) != 0)) {
+        krb5_free_principal(kdc_context, ent->princ);
+        free(ent);
+        return;
+    }
+    ent->hash = princ_hash(princ);
+    ent->flags = flags;
+    ent->options = options;
+    ent->expires = now + LOOKUP_CACHE_LIFETIME;
+    ent->alternate = alternate;
+
+    old = lookup_cache_find(kdc_context, cache, princ, ent->hash, flags,
+                            options);
+    if (old != NULL)
+        lookup_cache_discard(kdc_context, cache, old);
+    LIST_INSERT_HEAD(&cache->buckets[ent->hash % LOOKUP_CACHE_BUCKETS], ent,
+                     hash_links);
+    TAILQ_INSERT_TAIL(&cache->lru, ent, lru_links);
+    if (++cache->num_entries > LOOKUP_CACHE_MAX_ENTRIES)
+        lookup_cache_discard(kdc_context, cache, TAILQ_FIRST(&cache->lru));
+}
+
+/* As find_server_key(), but return a shared key object from the realm's key
+ * cache. */
+static krb5_error_code
+find_server_key_k(kdc_realm_t *kdc_active_realm, krb5_db_entry *server,
+                  krb5_enctype enctype, krb5_kvno kvno, krb5_key *key_out,
+                  krb5_kvno *kvno_out)
+{
+    krb5_error_code retval;
+    krb5_key_data *server_key;
+    krb5_boolean similar;
+
+    *key_out = NULL;
+    retval = krb5_dbe_find_enctype(kdc_context, server, enctype, -1,
+                                   kvno ? (krb5_int32)kvno : -1, &server_key);
+    if (retval)
+        return retval;
+    if (!server_key)
+        return KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN;
+    if (enctype != -1) {
+        retval = krb5_c_enctype_compare(kdc_context, enctype,
+                                        server_key->key_data_type[0],
+                                        &similar);
+        if (retval)
+            return retval;
+        if (!similar)
+            return KRB5_KDB_NO_PERMITTED_KEY;
+    }
+    retval = kdc_get_cached_key(kdc_active_realm, server_key, enctype,
+                                key_out);
+    if (retval)
+        return retval;
+    if (kvno_out)
+        *kvno_out = server_key->key_data_kvno;
+    return 0;
+}
+
+/* Encrypt ticket->enc_part2 into ticket->enc_part using key. */
+krb5_error_code
+kdc_encrypt_tkt_part(krb5_context context, krb5_key key, krb5_ticket *ticket)
+{
+    krb5_error_code ret;
+    krb5_data *der;
+    size_t len;
+
+    ret = encode_krb5_enc_tkt_part(ticket->enc_part2, &der);
+    if (ret)
+        return ret;
+    ret = krb5_c_encrypt_length(context, key->keyblock.enctype, der->length,
+                                &len);
+    if (ret)
+        goto cleanup;
+    ret = alloc_data(&ticket->enc_part.ciphertext, len);
+    if (ret)
+        goto cleanup;
+    ret = krb5_k_encrypt(context, key, KRB5_KEYUSAGE_KDC_REP_TICKET, NULL, der,
+                         &ticket->enc_part);
+    if (ret) {
+        free(ticket->enc_part.ciphertext.data);
+        ticket->enc_part.ciphertext = empty_data();
+    }
+
+cleanup:
+    zapfree(der->data, der->length);
+    free(der);
+    return ret;
+}
+
 /* This probably wants to be updated if you support last_req stuff */
 
 static krb5_last_req_entry nolrentry = { KV5M_LAST_REQ_ENTRY, KRB5_LRQ_NONE, 0 };
@@ -2032,4 +2672,7 @@ void reset_for_hangup(void *ctx)
 
     for (k = 0; k < h->kdc_numrealms; k++)
         krb5_db_refresh_config(h->kdc_realmlist[k]->realm_context);
+#ifndef NOCACHE
+    kdc_log_lookaside_stats();
+#endif
 }
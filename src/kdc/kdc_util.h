@@ -36,6 +36,8 @@
 #include "realm_data.h"
 #include "reqstate.h"
 
+struct kdc_timing;
+
 krb5_error_code check_hot_list (krb5_ticket *);
 krb5_boolean is_local_principal(kdc_realm_t *kdc_active_realm,
                                 krb5_const_principal princ1);
@@ -75,6 +77,32 @@ kdc_get_server_key (krb5_context, krb5_ticket *, unsigned int,
                     krb5_boolean match_enctype,
                     krb5_db_entry **, krb5_keyblock **, krb5_kvno *);
 
+krb5_error_code
+kdc_get_cached_key(kdc_realm_t *kdc_active_realm, krb5_key_data *key_data,
+                   krb5_enctype enctype, krb5_key *key_out);
+
+void
+kdc_free_key_cache(kdc_realm_t *kdc_active_realm);
+
+void
+kdc_free_tkt_cache(kdc_realm_t *kdc_active_realm);
+
+krb5_boolean
+kdc_lookup_cache_get(kdc_realm_t *kdc_active_realm, krb5_const_principal princ,
+                     krb5_flags flags, krb5_flags options,
+                     krb5_principal *result_out, krb5_boolean *alternate_out);
+
+void
+kdc_lookup_cache_put(kdc_realm_t *kdc_active_realm, krb5_const_principal princ,
+                     krb5_flags flags, krb5_flags options,
+                     krb5_const_principal result, krb5_boolean alternate);
+
+void
+kdc_free_lookup_cache(kdc_realm_t *kdc_active_realm);
+
+krb5_error_code
+kdc_encrypt_tkt_part(krb5_context context, krb5_key key, krb5_ticket *ticket);
+
 int
 validate_as_request (kdc_realm_t *, krb5_kdc_req *, krb5_db_entry,
                      krb5_db_entry, krb5_timestamp,
@@ -111,12 +139,12 @@ rep_etypes2str(char *s, size_t len, krb5_kdc_rep *rep);
 void
 process_as_req (krb5_kdc_req *, krb5_data *,
                 const krb5_fulladdr *, kdc_realm_t *,
-                verto_ctx *, loop_respond_fn, void *);
+                struct kdc_timing *, verto_ctx *, loop_respond_fn, void *);
 
 /* do_tgs_req.c */
 krb5_error_code
 process_tgs_req (struct server_handle *, krb5_data *,
-                 const krb5_fulladdr *,
+                 const krb5_fulladdr *, struct kdc_timing *,
                  krb5_data ** );
 /* dispatch.c */
 void
@@ -161,6 +189,10 @@ get_preauth_hint_list(krb5_kdc_req *request,
                       krb5_kdcpreauth_rock rock, krb5_pa_data ***e_data_out,
                       kdc_hint_respond_fn respond, void *arg);
 void
+kdc_free_edata_cache(kdc_realm_t *kdc_active_realm);
+void
+kdc_log_preauth_stats(void);
+void
 load_preauth_plugins(struct server_handle * handle, krb5_context context,
                      verto_ctx *ctx);
 void
@@ -221,12 +253,93 @@ handle_authdata (krb5_context context,
                  krb5_enc_tkt_part *enc_tkt_reply);
 
 /* replay.c */
+struct kdc_lookaside_stats {
+    unsigned long calls;        /* Requests looked up in the cache */
+    unsigned long hits;         /* Requests found in the cache */
+    unsigned long evictions;    /* Entries discarded to stay within size */
+    unsigned long expirations;  /* Entries discarded for being stale */
+    unsigned long resizes;      /* Times the hash table has grown */
+    int max_hits_per_entry;     /* Most hits seen for a discarded entry */
+    int num_entries;            /* Entries currently in the cache */
+    int num_pending;            /* Entries for requests being processed */
+    size_t total_size;          /* Approximate size of current entries */
+    size_t num_buckets;         /* Current number of hash buckets */
+};
+
 krb5_error_code kdc_init_lookaside(krb5_context context);
+void kdc_lookaside_stats(struct kdc_lookaside_stats *stats_out);
+void kdc_log_lookaside_stats(void);
 krb5_boolean kdc_check_lookaside (krb5_context, krb5_data *, krb5_data **);
 void kdc_insert_lookaside (krb5_context, krb5_data *, krb5_data *);
 void kdc_remove_lookaside (krb5_context kcontext, krb5_data *);
 void kdc_free_lookaside(krb5_context);
 
+/* kdc_threads.c */
+typedef void (*kdc_work_fn)(struct server_handle *handle, void *arg);
+typedef void (*kdc_done_fn)(void *arg);
+
+krb5_error_code
+kdc_threads_init(verto_ctx *ctx, struct server_handle **handles,
+                 int nthreads);
+krb5_boolean kdc_threads_active(void);
+krb5_error_code
+kdc_threads_submit(kdc_work_fn work, kdc_done_fn done, void *arg);
+void kdc_threads_fini(void);
+
+/* kdc_affinity.c */
+krb5_error_code
+kdc_set_worker_affinity(int worker, const char *mode);
+
+/* kdc_stats.c */
+enum kdc_req_type {
+    KDC_REQ_AS,
+    KDC_REQ_TGS,
+    KDC_REQ_OTHER,
+    KDC_NUM_REQ_TYPES
+};
+
+enum kdc_phase {
+    KDC_PHASE_DECODE,           /* Decoding the request */
+    KDC_PHASE_QUEUE,            /* Waiting for a worker thread */
+    KDC_PHASE_DB,               /* Principal lookups */
+    KDC_PHASE_AUTH,             /* Preauth or TGT verification */
+    KDC_PHASE_AUTHDATA,         /* Authorization data handling */
+    KDC_PHASE_TICKET,           /* Encrypting the ticket */
+    KDC_PHASE_REPLY,            /* Encoding and encrypting the reply */
+    KDC_PHASE_SEND,             /* Handing the reply to the network code */
+    KDC_NUM_PHASES
+};
+
+/* Monotonic timings of a single request, in microseconds. */
+struct kdc_timing {
+    enum kdc_req_type req_type;
+    krb5_ui_8 start;
+    krb5_ui_8 begin[KDC_NUM_PHASES];
+    krb5_ui_8 usec[KDC_NUM_PHASES];
+    unsigned int used;          /* Bitmask of phases entered */
+    krb5_addrtype addrtype;
+    unsigned int addrlen;
+    unsigned char addr[16];
+};
+
+krb5_error_code kdc_stats_init(krb5_context context);
+krb5_ui_8 kdc_now_usec(void);
+void kdc_timing_start(struct kdc_timing *t, const krb5_fulladdr *from);
+void kdc_phase_begin(struct kdc_timing *t, enum kdc_phase phase);
+void kdc_phase_end(struct kdc_timing *t, enum kdc_phase phase);
+void kdc_timing_finish(struct kdc_timing *t);
+void kdc_log_stats(void);
+
+/* kdc_ratelimit.c */
+krb5_error_code kdc_ratelimit_init(krb5_context context);
+krb5_boolean kdc_ratelimit_addr(const krb5_fulladdr *from);
+krb5_boolean kdc_ratelimit_princ(krb5_context context,
+                                 krb5_const_principal client);
+krb5_boolean kdc_queue_expired(const struct kdc_timing *t);
+void kdc_count_shed(void);
+void kdc_ratelimit_log_stats(void);
+void kdc_ratelimit_fini(void);
+
 /* kdc_util.c */
 void reset_for_hangup(void *);
 
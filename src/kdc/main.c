@@ -61,11 +61,15 @@ static void finish_realms (void);
 
 static int nofork = 0;
 static int workers = 0;
+static int threads = 0;
+static krb5_boolean worker_reuseport = FALSE;
+static char *worker_affinity = NULL;
 static int time_offset = 0;
 static const char *pid_file = NULL;
 static int rkey_init_done = 0;
 static volatile int signal_received = 0;
 static volatile int sighup_received = 0;
+static volatile int sigusr1_received = 0;
 
 #define KRB5_KDC_MAX_REALMS     32
 
@@ -77,6 +81,12 @@ static const char *kdc_progname;
  */
 static struct server_handle shandle;
 
+/* Server handles for worker threads, if we have any. */
+static struct server_handle **thread_handles;
+
+/* Serializes use of shandle.kdc_err_context by kdc_err(). */
+static k5_mutex_t kdc_err_lock = K5_MUTEX_PARTIAL_INITIALIZER;
+
 /*
  * We use krb5_klog_init to set up a com_err callback to log error
  * messages.  The callback also pulls the error message out of the
@@ -92,11 +102,13 @@ kdc_err(krb5_context call_context, errcode_t code, const char *fmt, ...)
 {
     va_list ap;
 
+    k5_mutex_lock(&kdc_err_lock);
     if (call_context)
         krb5_copy_error_message(shandle.kdc_err_context, call_context);
     va_start(ap, fmt);
     com_err_va(kdc_progname, code, fmt, ap);
     va_end(ap);
+    k5_mutex_unlock(&kdc_err_lock);
 }
 
 /*
@@ -138,6 +150,43 @@ setup_server_realm(struct server_handle *handle, krb5_principal sprinc)
         return kdc_realmlist[0];
 }
 
+static void
+free_db_args(char **db_args)
+{
+    char **p;
+
+    if (db_args == NULL)
+        return;
+    for (p = db_args; *p != NULL; p++)
+        free(*p);
+    free(db_args);
+}
+
+/* Make a deep copy of a null-terminated list of database arguments. */
+static krb5_error_code
+copy_db_args(char **db_args, char ***args_out)
+{
+    char **args;
+    size_t i, count;
+
+    *args_out = NULL;
+    if (db_args == NULL)
+        return 0;
+    for (count = 0; db_args[count] != NULL; count++);
+    args = calloc(count + 1, sizeof(*args));
+    if (args == NULL)
+        return ENOMEM;
+    for (i = 0; i < count; i++) {
+        args[i] = strdup(db_args[i]);
+        if (args[i] == NULL) {
+            free_db_args(args);
+            return ENOMEM;
+        }
+    }
+    *args_out = args;
+    return 0;
+}
+
 static void
 finish_realm(kdc_realm_t *rdp)
 {
@@ -147,6 +196,7 @@ finish_realm(kdc_realm_t *rdp)
         free(rdp->realm_mpname);
     if (rdp->realm_stash)
         free(rdp->realm_stash);
+    free_db_args(rdp->realm_db_args);
     if (rdp->realm_ports)
         free(rdp->realm_ports);
     if (rdp->realm_tcp_ports)
@@ -158,6 +208,10 @@ finish_realm(kdc_realm_t *rdp)
     if (rdp->realm_no_referral)
         free(rdp->realm_no_referral);
     if (rdp->realm_context) {
+        kdc_free_tkt_cache(rdp);
+        kdc_free_lookup_cache(rdp);
+        kdc_free_edata_cache(rdp);
+        kdc_free_key_cache(rdp);
         if (rdp->realm_mprinc)
             krb5_free_principal(rdp->realm_context, rdp->realm_mprinc);
         if (rdp->realm_mkey.length && rdp->realm_mkey.contents) {
@@ -228,6 +282,10 @@ init_realm(kdc_realm_t *rdp, krb5_pointer aprof, char *realm, char *def_mpname,
         kret = ENOMEM;
         goto whoops;
     }
+    /* Remember the database arguments for worker thread realm copies. */
+    kret = copy_db_args(db_args, &rdp->realm_db_args);
+    if (kret)
+        goto whoops;
     kret = krb5int_init_context_kdc(&rdp->realm_context);
     if (kret) {
         kdc_err(NULL, kret, _("while getting context for realm %s"), realm);
@@ -415,6 +473,155 @@ whoops:
     return(kret);
 }
 
+/*
+ * Make a copy of an initialized realm for use by a worker thread.  The copy
+ * has its own context and database handle, but reuses the master key already
+ * read for the original, so the administrator is not prompted again.
+ */
+static krb5_error_code
+copy_realm(kdc_realm_t *src, kdc_realm_t **realm_out)
+{
+    krb5_error_code kret;
+    kdc_realm_t *rdp;
+    krb5_context ctx;
+
+    *realm_out = NULL;
+    rdp = k5alloc(sizeof(*rdp), &kret);
+    if (rdp == NULL)
+        return kret;
+
+    rdp->realm_maxlife = src->realm_maxlife;
+    rdp->realm_maxrlife = src->realm_maxrlife;
+    rdp->realm_reject_bad_transit = src->realm_reject_bad_transit;
+    rdp->realm_restrict_anon = src->realm_restrict_anon;
+    rdp->realm_assume_des_crc_sess = src->realm_assume_des_crc_sess;
+
+    rdp->realm_name = strdup(src->realm_name);
+    if (rdp->realm_name == NULL) {
+        kret = ENOMEM;
+        goto cleanup;
+    }
+    if (src->realm_hostbased != NULL) {
+        rdp->realm_hostbased = strdup(src->realm_hostbased);
+        if (rdp->realm_hostbased == NULL) {
+            kret = ENOMEM;
+            goto cleanup;
+        }
+    }
+    if (src->realm_no_referral != NULL) {
+        rdp->realm_no_referral = strdup(src->realm_no_referral);
+        if (rdp->realm_no_referral == NULL) {
+            kret = ENOMEM;
+            goto cleanup;
+        }
+    }
+
+    kret = krb5int_init_context_kdc(&rdp->realm_context);
+    if (kret)
+        goto cleanup;
+    ctx = rdp->realm_context;
+    if (time_offset != 0)
+        (void)krb5_set_time_offsets(ctx, time_offset, 0);
+    kret = krb5_set_default_realm(ctx, src->realm_name);
+    if (kret)
+        goto cleanup;
+    kret = krb5_db_open(ctx, src->realm_db_args,
+                        KRB5_KDB_OPEN_RW | KRB5_KDB_SRV_TYPE_KDC);
+    if (kret)
+        goto cleanup;
+    kret = krb5_copy_principal(ctx, src->realm_mprinc, &rdp->realm_mprinc);
+    if (kret)
+        goto cleanup;
+    kret = krb5_copy_keyblock_contents(ctx, &src->realm_mkey,
+                                       &rdp->realm_mkey);
+    if (kret)
+        goto cleanup;
+    kret = krb5_db_fetch_mkey_list(ctx, rdp->realm_mprinc, &rdp->realm_mkey);
+    if (kret)
+        goto cleanup;
+    kret = krb5_ktkdb_resolve(ctx, NULL, &rdp->realm_keytab);
+    if (kret)
+        goto cleanup;
+    kret = krb5_copy_principal(ctx, src->realm_tgsprinc,
+                               &rdp->realm_tgsprinc);
+    if (kret)
+        goto cleanup;
+
+    *realm_out = rdp;
+    rdp = NULL;
+
+cleanup:
+    if (kret) {
+        kdc_err(rdp->realm_context, kret,
+                _("while copying realm %s for worker thread"),
+                src->realm_name);
+        finish_realm(rdp);
+    }
+    return kret;
+}
+
+static void
+free_thread_handles(void)
+{
+    struct server_handle *h;
+    int i, j;
+
+    if (thread_handles == NULL)
+        return;
+    for (i = 0; i < threads; i++) {
+        h = thread_handles[i];
+        if (h == NULL)
+            continue;
+        for (j = 0; j < h->kdc_numrealms; j++)
+            finish_realm(h->kdc_realmlist[j]);
+        free(h->kdc_realmlist);
+        if (h->kdc_err_context != NULL)
+            krb5_free_context(h->kdc_err_context);
+        free(h);
+    }
+    free(thread_handles);
+    thread_handles = NULL;
+}
+
+/* Create a server handle for each worker thread, copying the realms of the
+ * main server handle. */
+static krb5_error_code
+create_thread_handles(void)
+{
+    krb5_error_code retval;
+    struct server_handle *h;
+    int i, j;
+
+    thread_handles = k5alloc(threads * sizeof(*thread_handles), &retval);
+    if (thread_handles == NULL)
+        return retval;
+    for (i = 0; i < threads; i++) {
+        h = k5alloc(sizeof(*h), &retval);
+        if (h == NULL)
+            goto error;
+        thread_handles[i] = h;
+        h->kdc_realmlist = k5alloc(shandle.kdc_numrealms *
+                                   sizeof(*h->kdc_realmlist), &retval);
+        if (h->kdc_realmlist == NULL)
+            goto error;
+        retval = krb5int_init_context_kdc(&h->kdc_err_context);
+        if (retval)
+            goto error;
+        for (j = 0; j < shandle.kdc_numrealms; j++) {
+            retval = copy_realm(shandle.kdc_realmlist[j],
+                                &h->kdc_realmlist[j]);
+            if (retval)
+                goto error;
+            h->kdc_numrealms++;
+        }
+    }
+    return 0;
+
+error:
+    free_thread_handles();
+    return retval;
+}
+
 static krb5_sigtype
 on_monitor_signal(int signo)
 {
@@ -439,6 +646,18 @@ on_monitor_sighup(int signo)
 #endif
 }
 
+static krb5_sigtype
+on_monitor_sigusr1(int signo)
+{
+    sigusr1_received = 1;
+
+#ifdef POSIX_SIGTYPE
+    return;
+#else
+    return(0);
+#endif
+}
+
 /*
  * Kill the worker subprocesses given by pids[0..bound-1], skipping any which
  * are set to -1, and wait for them to exit (so that we know the ports are no
@@ -494,11 +713,14 @@ create_workers(verto_ctx *ctx, int num)
     (void) sigaction(SIGQUIT, &s_action, (struct sigaction *) NULL);
     s_action.sa_handler = on_monitor_sighup;
     (void) sigaction(SIGHUP, &s_action, (struct sigaction *) NULL);
+    s_action.sa_handler = on_monitor_sigusr1;
+    (void) sigaction(SIGUSR1, &s_action, (struct sigaction *) NULL);
 #else  /* POSIX_SIGNALS */
     signal(SIGINT, on_monitor_signal);
     signal(SIGTERM, on_monitor_signal);
     signal(SIGQUIT, on_monitor_signal);
     signal(SIGHUP, on_monitor_sighup);
+    signal(SIGUSR1, on_monitor_sigusr1);
 #endif /* POSIX_SIGNALS */
 
     /* Create child worker processes; return in each child. */
@@ -522,6 +744,30 @@ create_workers(verto_ctx *ctx, int num)
                 return retval;
             }
 
+            /* Replace the inherited listener sockets with our own, so that
+             * the kernel spreads requests across the worker processes. */
+            if (worker_reuseport) {
+                retval = loop_setup_network(ctx, &shandle, kdc_progname);
+                if (retval) {
+                    krb5_klog_syslog(LOG_ERR, _("Unable to set up network "
+                                                "in worker %d"), i);
+                    return retval;
+                }
+            }
+
+            if (worker_affinity != NULL &&
+                strcmp(worker_affinity, "none") != 0) {
+                retval = kdc_set_worker_affinity(i, worker_affinity);
+                if (retval) {
+                    krb5_klog_syslog(LOG_ERR, _("Unable to set CPU affinity "
+                                                "of worker %d: %s"), i,
+                                     error_message(retval));
+                } else {
+                    krb5_klog_syslog(LOG_INFO, _("worker %d bound to CPUs "
+                                                 "by %s"), i, worker_affinity);
+                }
+            }
+
             /* Avoid race condition */
             if (signal_received)
                 exit(0);
@@ -569,6 +815,15 @@ create_workers(verto_ctx *ctx, int num)
                     kill(pids[i], SIGHUP);
             }
         }
+
+        /* Likewise for USR1, which asks for latency statistics. */
+        if (sigusr1_received) {
+            sigusr1_received = 0;
+            for (i = 0; i < num; i++) {
+                if (pids[i] != -1)
+                    kill(pids[i], SIGUSR1);
+            }
+        }
     }
     if (signal_received)
         krb5_klog_syslog(LOG_INFO, _("signal %d received in supervisor"),
@@ -579,6 +834,15 @@ create_workers(verto_ctx *ctx, int num)
     exit(0);
 }
 
+/* Log the request latency statistics on SIGUSR1. */
+static void
+on_sigusr1(verto_ctx *ctx, verto_ev *ev)
+{
+    kdc_log_stats();
+    kdc_ratelimit_log_stats();
+    kdc_log_preauth_stats();
+}
+
 static krb5_error_code
 setup_sam(void)
 {
@@ -593,7 +857,7 @@ usage(char *name)
             _("usage: %s [-x db_args]* [-d dbpathname] [-r dbrealmname]\n"
               "\t\t[-R replaycachename] [-m] [-k masterenctype]\n"
               "\t\t[-M masterkeyname] [-p port] [-P pid_file]\n"
-              "\t\t[-n] [-w numworkers] [/]\n\n"
+              "\t\t[-n] [-w numworkers] [-t numthreads] [/]\n\n"
               "where,\n"
               "\t[-x db_args]* - Any number of database specific arguments.\n"
               "\t\t\tLook at each database module documentation for "
@@ -647,6 +911,13 @@ initialize_realms(krb5_context kcontext, int argc, char **argv)
         hierarchy[1] = KRB5_CONF_HOST_BASED_SERVICES;
         if (krb5_aprof_get_string_all(aprof, hierarchy, &hostbased))
             hostbased = 0;
+        hierarchy[1] = KRB5_CONF_WORKER_REUSEPORT;
+        if (krb5_aprof_get_boolean(aprof, hierarchy, TRUE, &worker_reuseport))
+            worker_reuseport = FALSE;
+        free(worker_affinity);
+        hierarchy[1] = KRB5_CONF_WORKER_AFFINITY;
+        if (krb5_aprof_get_string(aprof, hierarchy, TRUE, &worker_affinity))
+            worker_affinity = NULL;
     }
 
     if (default_udp_ports == 0) {
@@ -668,7 +939,7 @@ initialize_realms(krb5_context kcontext, int argc, char **argv)
      * Loop through the option list.  Each time we encounter a realm name,
      * use the previously scanned options to fill in for defaults.
      */
-    while ((c = getopt(argc, argv, "x:r:d:mM:k:R:e:P:p:s:nw:4:T:X3")) != -1) {
+    while ((c = getopt(argc, argv, "x:r:d:mM:k:R:e:P:p:s:nw:t:4:T:X3")) != -1) {
         switch(c) {
         case 'x':
             db_args_size++;
@@ -756,6 +1027,11 @@ initialize_realms(krb5_context kcontext, int argc, char **argv)
             if (workers <= 0)
                 usage(argv[0]);
             break;
+        case 't':                       /* create worker threads */
+            threads = atoi(optarg);
+            if (threads <= 0)
+                usage(argv[0]);
+            break;
         case 'k':                       /* enctype for master key */
             if (krb5_string_to_enctype(optarg, &menctype))
                 com_err(argv[0], 0, _("invalid enctype %s"), optarg);
@@ -926,6 +1202,7 @@ int main(int argc, char **argv)
         com_err(argv[0], retval, _("while initializing krb5"));
         exit(1);
     }
+    k5_mutex_finish_init(&kdc_err_lock);
     krb5_klog_init(kcontext, "kdc", argv[0], 1);
     shandle.kdc_err_context = kcontext;
     kdc_progname = argv[0];
@@ -950,6 +1227,20 @@ int main(int argc, char **argv)
     }
 #endif
 
+    retval = kdc_stats_init(kcontext);
+    if (retval) {
+        kdc_err(kcontext, retval, _("while initializing request statistics"));
+        finish_realms();
+        return 1;
+    }
+
+    retval = kdc_ratelimit_init(kcontext);
+    if (retval) {
+        kdc_err(kcontext, retval, _("while initializing rate limits"));
+        finish_realms();
+        return 1;
+    }
+
     ctx = loop_init(VERTO_EV_TYPE_NONE);
     if (!ctx) {
         kdc_err(kcontext, ENOMEM, _("while creating main loop"));
@@ -1019,6 +1310,22 @@ int main(int argc, char **argv)
             return 1;
         }
     }
+    if (worker_affinity != NULL && strcmp(worker_affinity, "none") != 0 &&
+        strcmp(worker_affinity, "cpu") != 0 &&
+        strcmp(worker_affinity, "node") != 0) {
+        kdc_err(kcontext, EINVAL, _("while parsing worker_affinity value %s"),
+                worker_affinity);
+        finish_realms();
+        return 1;
+    }
+    if (workers > 0 && worker_reuseport) {
+        retval = loop_enable_reuseport();
+        if (retval) {
+            kdc_err(kcontext, retval, _("while enabling SO_REUSEPORT"));
+            finish_realms();
+            return 1;
+        }
+    }
     if ((retval = loop_setup_network(ctx, &shandle, kdc_progname))) {
     net_init_error:
         kdc_err(kcontext, retval, _("while initializing network"));
@@ -1056,14 +1363,40 @@ int main(int argc, char **argv)
         finish_realms();
         return 1;
     }
+    if (verto_add_signal(ctx, VERTO_EV_FLAG_PERSIST, on_sigusr1,
+                         SIGUSR1) == NULL) {
+        kdc_err(kcontext, ENOMEM, _("while initializing signal handlers"));
+        finish_realms();
+        return 1;
+    }
+    if (threads > 0) {
+        retval = create_thread_handles();
+        if (!retval)
+            retval = kdc_threads_init(ctx, thread_handles, threads);
+        if (retval) {
+            kdc_err(kcontext, retval, _("while creating worker threads"));
+            free_thread_handles();
+            finish_realms();
+            return 1;
+        }
+    }
     krb5_klog_syslog(LOG_INFO, _("commencing operation"));
     if (nofork)
         fprintf(stderr, _("%s: starting...\n"), kdc_progname);
     kau_kdc_start(kcontext, TRUE);
 
     verto_run(ctx);
+    kdc_threads_fini();
+    free_thread_handles();
     loop_free(ctx);
     kau_kdc_stop(kcontext, TRUE);
+#ifndef NOCACHE
+    kdc_log_lookaside_stats();
+#endif
+    kdc_log_stats();
+    kdc_ratelimit_log_stats();
+    kdc_log_preauth_stats();
+    kdc_ratelimit_fini();
     krb5_klog_syslog(LOG_INFO, _("shutting down"));
     unload_preauth_plugins(kcontext);
     unload_authdata_plugins(kcontext);
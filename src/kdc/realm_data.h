@@ -44,6 +44,10 @@ typedef struct __kdc_realm_data {
  * cannot span multiple realms -- proven */
     krb5_context        realm_context;  /* Context to be used for realm     */
     krb5_keytab         realm_keytab;   /* keytab to be used for this realm */
+    struct key_cache    *realm_keycache; /* decrypted server keys */
+    struct tkt_cache    *realm_tktcache; /* decrypted TGS header tickets */
+    struct lookup_cache *realm_lookupcache; /* failed server searches */
+    struct edata_cache  *realm_edatacache; /* PREAUTH_REQUIRED hint lists */
     char *              realm_hostbased; /* referral services for NT-UNKNOWN */
     char *              realm_no_referral; /* non-referral services         */
     /*
@@ -51,6 +55,7 @@ typedef struct __kdc_realm_data {
      */
     char *              realm_stash;    /* Stash file name for realm        */
     char *              realm_mpname;   /* Master principal name for realm  */
+    char **             realm_db_args;  /* Database arguments for realm     */
     krb5_principal      realm_mprinc;   /* Master principal for realm       */
     /*
      * Note realm_mkey is mkey read from stash or keyboard and may not be the
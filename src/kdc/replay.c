@@ -28,12 +28,25 @@
 #include "k5-queue.h"
 #include "kdc_util.h"
 #include "extern.h"
+#include "adm_proto.h"
+#include <syslog.h>
 
 #ifndef NOCACHE
 
+#if defined(ENABLE_THREADS) && defined(_POSIX_THREAD_PROCESS_SHARED) && \
+    defined(HAVE_PTHREAD_MUTEXATTR_SETROBUST)
+#define USE_SHARED_LOOKASIDE
+#include <pthread.h>
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
 struct entry {
     LIST_ENTRY(entry) bucket_links;
     TAILQ_ENTRY(entry) expire_links;
+    krb5_ui_4 hash;
     int num_hits;
     krb5_timestamp timein;
     krb5_data req_packet;
@@ -46,22 +59,42 @@ struct entry {
 #ifndef LOOKASIDE_MAX_SIZE
 #define LOOKASIDE_MAX_SIZE (10 * 1024 * 1024)
 #endif
+#ifndef LOOKASIDE_STALE_TIME
+#define LOOKASIDE_STALE_TIME (2 * 60)   /* two minutes */
+#endif
+
+/* Grow the hash table when it holds this many entries per bucket. */
+#define MAX_LOAD_FACTOR 2
+/* Don't grow the hash table past this many buckets. */
+#define MAX_HASH_SIZE (1UL << 24)
+/* Number of buckets to move to the new table per lookup while growing. */
+#define REHASH_STEP 8
 
 LIST_HEAD(entry_list, entry);
 TAILQ_HEAD(entry_queue, entry);
 
-static struct entry_list hash_table[LOOKASIDE_HASH_SIZE];
+struct hash_table {
+    struct entry_list *buckets;
+    size_t nbuckets;
+};
+
+/*
+ * While the table is growing, old_table holds the buckets which have not yet
+ * been moved into hash_table; buckets before rehash_pos have been moved.
+ * Each lookup moves a few more, so that no single request pays for
+ * rehashing the whole cache.
+ */
+static struct hash_table hash_table, old_table;
+static size_t rehash_pos;
 static struct entry_queue expiration_queue;
 
-static int hits = 0;
-static int calls = 0;
-static int max_hits_per_entry = 0;
-static int num_entries = 0;
-static size_t total_size = 0;
+static size_t max_size = LOOKASIDE_MAX_SIZE;
+static krb5_deltat stale_time = LOOKASIDE_STALE_TIME;
+
+static struct kdc_lookaside_stats stats;
 static krb5_ui_4 seed;
 
-#define STALE_TIME      (2*60)            /* two minutes */
-#define STALE(ptr, now) (abs((ptr)->timein - (now)) >= STALE_TIME)
+#define STALE(ptr, now) (abs((ptr)->timein - (now)) >= stale_time)
 
 /* Return x rotated to the left by r bits. */
 static inline krb5_ui_4
@@ -72,10 +105,9 @@ rotl32(krb5_ui_4 x, int r)
 
 /*
  * Return a non-cryptographic hash of data, seeded by seed (the global
- * variable), using the MurmurHash3 algorithm by Austin Appleby.  Return the
- * result modulo LOOKASIDE_HASH_SIZE.
+ * variable), using the MurmurHash3 algorithm by Austin Appleby.
  */
-static int
+static krb5_ui_4
 murmurhash3(const krb5_data *data)
 {
     const krb5_ui_4 c1 = 0xcc9e2d51, c2 = 0x1b873593;
@@ -99,7 +131,7 @@ murmurhash3(const krb5_data *data)
     h = (h ^ (h >> 16)) * 0x85ebca6b;
     h = (h ^ (h >> 13)) * 0xc2b2ae35;
     h ^= h >> 16;
-    return h % LOOKASIDE_HASH_SIZE;
+    return h;
 }
 
 /* Return the rough memory footprint of an entry containing req and rep. */
@@ -114,7 +146,10 @@ entry_size(const krb5_data *req, const krb5_data *rep)
 static void
 discard_entry(krb5_context context, struct entry *entry)
 {
-    total_size -= entry_size(&entry->req_packet, &entry->reply_packet);
+    stats.total_size -= entry_size(&entry->req_packet, &entry->reply_packet);
+    stats.num_entries--;
+    if (entry->reply_packet.data == NULL)
+        stats.num_pending--;
     LIST_REMOVE(entry, bucket_links);
     TAILQ_REMOVE(&expiration_queue, entry, expire_links);
     krb5_free_data_contents(context, &entry->req_packet);
@@ -122,31 +157,500 @@ discard_entry(krb5_context context, struct entry *entry)
     free(entry);
 }
 
+static krb5_error_code
+alloc_table(struct hash_table *table, size_t nbuckets)
+{
+    size_t i;
+
+    table->buckets = calloc(nbuckets, sizeof(*table->buckets));
+    if (table->buckets == NULL)
+        return ENOMEM;
+    for (i = 0; i < nbuckets; i++)
+        LIST_INIT(&table->buckets[i]);
+    table->nbuckets = nbuckets;
+    return 0;
+}
+
+/* Move up to REHASH_STEP buckets from the old table into the current one,
+ * and discard the old table once it is empty. */
+static void
+rehash_step(void)
+{
+    struct entry_list *bucket;
+    struct entry *e;
+    int i;
+
+    if (old_table.buckets == NULL)
+        return;
+    for (i = 0; i < REHASH_STEP && rehash_pos < old_table.nbuckets; i++) {
+        bucket = &old_table.buckets[rehash_pos++];
+        while ((e = LIST_FIRST(bucket)) != NULL) {
+            LIST_REMOVE(e, bucket_links);
+            LIST_INSERT_HEAD(&hash_table.buckets[e->hash %
+                                                 hash_table.nbuckets],
+                             e, bucket_links);
+        }
+    }
+    if (rehash_pos == old_table.nbuckets) {
+        free(old_table.buckets);
+        old_table.buckets = NULL;
+        old_table.nbuckets = 0;
+    }
+}
+
+/* Start doubling the size of the hash table if it has become too full.
+ * Failure to grow is not an error; lookups just get slower. */
+static void
+maybe_grow(void)
+{
+    struct hash_table newtable;
+
+    if (old_table.buckets != NULL || hash_table.nbuckets >= MAX_HASH_SIZE ||
+        (size_t)stats.num_entries <= hash_table.nbuckets * MAX_LOAD_FACTOR)
+        return;
+    if (alloc_table(&newtable, hash_table.nbuckets * 2) != 0)
+        return;
+    old_table = hash_table;
+    hash_table = newtable;
+    rehash_pos = 0;
+    stats.num_buckets = hash_table.nbuckets;
+    stats.resizes++;
+}
+
 /* Return the entry for req_packet, or NULL if we don't have one. */
 static struct entry *
 find_entry(krb5_data *req_packet)
 {
     krb5_ui_4 hash = murmurhash3(req_packet);
+    struct entry_list *bucket;
     struct entry *e;
-
-    LIST_FOREACH(e, &hash_table[hash], bucket_links) {
+    size_t i;
+
+    if (old_table.buckets != NULL) {
+        i = hash % old_table.nbuckets;
+        if (i >= rehash_pos) {
+            LIST_FOREACH(e, &old_table.buckets[i], bucket_links) {
+                if (data_eq(e->req_packet, *req_packet))
+                    return e;
+            }
+        }
+    }
+    bucket = &hash_table.buckets[hash % hash_table.nbuckets];
+    LIST_FOREACH(e, bucket, bucket_links) {
         if (data_eq(e->req_packet, *req_packet))
             return e;
     }
     return NULL;
 }
 
-/* Initialize the lookaside cache structures and randomize the hash seed. */
+#ifdef USE_SHARED_LOOKASIDE
+
+/*
+ * If lookaside_shared is set in [kdcdefaults], the cache is kept in an
+ * anonymous shared mapping created before any worker processes are forked, so
+ * that a retransmitted request can be answered by whichever worker receives
+ * it.  The mapping holds a fixed number of fixed-size slots, grouped into sets
+ * of SHM_WAYS slots.  A request can only be cached in the set selected by its
+ * hash, so inserting into a full set evicts the oldest entry in that set.
+ * Each set is protected by its own process-shared mutex, and the statistics
+ * by another.  Requests whose request and reply do not fit in a slot are not
+ * cached.
+ *
+ * The mutexes are robust.  If a worker exits while holding one, the next
+ * process to take it discards the whole cache, since the dead worker may have
+ * left a slot or the statistics half updated.  Each set is emptied the next
+ * time it is locked after the reset.
+ */
+
+#define SHM_WAYS 4
+#define SHM_SLOT_DATA 4096
+
+enum slot_state { SLOT_EMPTY = 0, SLOT_PENDING, SLOT_FULL };
+
+struct shm_slot {
+    enum slot_state state;
+    krb5_ui_4 hash;
+    krb5_timestamp timein;
+    int num_hits;
+    unsigned int req_len;
+    unsigned int rep_len;
+    unsigned char data[SHM_SLOT_DATA];
+};
+
+struct shm_set {
+    pthread_mutex_t lock;
+    unsigned int gen;           /* reset generation of the slot contents */
+    struct shm_slot slots[SHM_WAYS];
+};
+
+struct shm_region {
+    pthread_mutex_t stats_lock;
+    unsigned int gen;           /* incremented when the cache is reset */
+    struct kdc_lookaside_stats stats;
+    size_t nsets;
+    struct shm_set sets[1];
+};
+
+static struct shm_region *shm;
+static size_t shm_len;
+
+static krb5_error_code
+init_process_shared_mutex(pthread_mutex_t *lock)
+{
+    pthread_mutexattr_t attr;
+    int ret;
+
+    ret = pthread_mutexattr_init(&attr);
+    if (ret)
+        return ret;
+    ret = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (!ret)
+        ret = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (!ret)
+        ret = pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return ret;
+}
+
+/* Create the shared mapping for the cache. */
+static krb5_error_code
+shm_init(void)
+{
+    size_t i, nsets;
+    krb5_error_code ret;
+    void *addr;
+
+    nsets = max_size / sizeof(struct shm_set);
+    if (nsets == 0)
+        nsets = 1;
+    shm_len = sizeof(struct shm_region) + (nsets - 1) * sizeof(struct shm_set);
+    addr = mmap(NULL, shm_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        return errno;
+    /* The mapping is zero-filled, so all slots start out empty. */
+    shm = addr;
+    shm->nsets = nsets;
+    shm->stats.num_buckets = nsets;
+    ret = init_process_shared_mutex(&shm->stats_lock);
+    for (i = 0; i < nsets && !ret; i++)
+        ret = init_process_shared_mutex(&shm->sets[i].lock);
+    if (ret) {
+        munmap(addr, shm_len);
+        shm = NULL;
+    }
+    return ret;
+}
+
+/* Discard the cache contents and statistics after a worker died holding one
+ * of the cache's locks.  The statistics lock must be held. */
+static void
+shm_reset(void)
+{
+    size_t nbuckets = shm->stats.num_buckets;
+
+    shm->gen++;
+    memset(&shm->stats, 0, sizeof(shm->stats));
+    shm->stats.num_buckets = nbuckets;
+    krb5_klog_syslog(LOG_ERR, _("Discarding shared lookaside cache after a "
+                                "worker exited while holding its lock"));
+}
+
+/* Lock the statistics, resetting the cache if the previous holder died. */
+static void
+shm_lock_stats(void)
+{
+    if (pthread_mutex_lock(&shm->stats_lock) == EOWNERDEAD) {
+        shm_reset();
+        pthread_mutex_consistent(&shm->stats_lock);
+    }
+}
+
+/* Return the set for hash, locked.  Empty the set first if the cache has been
+ * reset since it was last used. */
+static struct shm_set *
+shm_lock_set(krb5_ui_4 hash)
+{
+    struct shm_set *set = &shm->sets[hash % shm->nsets];
+
+    if (pthread_mutex_lock(&set->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&set->lock);
+        shm_lock_stats();
+        shm_reset();
+        pthread_mutex_unlock(&shm->stats_lock);
+    }
+    if (set->gen != shm->gen) {
+        memset(set->slots, 0, sizeof(set->slots));
+        set->gen = shm->gen;
+    }
+    return set;
+}
+
+/* Return the slot in set holding req_packet, or NULL if there isn't one.  The
+ * set must be locked. */
+static struct shm_slot *
+shm_find_slot(struct shm_set *set, krb5_ui_4 hash, krb5_data *req_packet)
+{
+    struct shm_slot *slot;
+    int i;
+
+    for (i = 0; i < SHM_WAYS; i++) {
+        slot = &set->slots[i];
+        if (slot->state != SLOT_EMPTY && slot->hash == hash &&
+            slot->req_len == req_packet->length &&
+            memcmp(slot->data, req_packet->data, req_packet->length) == 0)
+            return slot;
+    }
+    return NULL;
+}
+
+/* Empty slot, updating the statistics and incrementing *counter if it is not
+ * NULL.  The slot's set must be locked. */
+static void
+shm_clear_slot(struct shm_slot *slot, unsigned long *counter)
+{
+    shm_lock_stats();
+    if (counter != NULL)
+        (*counter)++;
+    if (slot->state == SLOT_PENDING)
+        shm->stats.num_pending--;
+    shm->stats.num_entries--;
+    shm->stats.total_size -= slot->req_len + slot->rep_len;
+    shm->stats.max_hits_per_entry = max(shm->stats.max_hits_per_entry,
+                                        slot->num_hits);
+    pthread_mutex_unlock(&shm->stats_lock);
+    slot->state = SLOT_EMPTY;
+}
+
+static krb5_boolean
+shm_check(krb5_context kcontext, krb5_data *req_packet,
+          krb5_data **reply_packet_out)
+{
+    krb5_ui_4 hash = murmurhash3(req_packet);
+    struct shm_set *set;
+    struct shm_slot *slot;
+    krb5_timestamp timenow;
+    krb5_data rep;
+    krb5_boolean found = FALSE;
+
+    if (krb5_timeofday(kcontext, &timenow))
+        return FALSE;
+
+    set = shm_lock_set(hash);
+    slot = shm_find_slot(set, hash, req_packet);
+    if (slot != NULL && STALE(slot, timenow)) {
+        shm_clear_slot(slot, &shm->stats.expirations);
+        slot = NULL;
+    }
+    if (slot != NULL) {
+        slot->num_hits++;
+        found = TRUE;
+        if (slot->state == SLOT_FULL) {
+            rep = make_data(slot->data + slot->req_len, slot->rep_len);
+            if (krb5_copy_data(kcontext, &rep, reply_packet_out) != 0)
+                found = FALSE;
+        }
+    }
+    pthread_mutex_unlock(&set->lock);
+
+    shm_lock_stats();
+    shm->stats.calls++;
+    if (found)
+        shm->stats.hits++;
+    pthread_mutex_unlock(&shm->stats_lock);
+    return found;
+}
+
+static void
+shm_insert(krb5_context kcontext, krb5_data *req_packet,
+           krb5_data *reply_packet)
+{
+    krb5_ui_4 hash = murmurhash3(req_packet);
+    unsigned int rep_len = (reply_packet == NULL) ? 0 : reply_packet->length;
+    struct shm_set *set;
+    struct shm_slot *slot, *victim;
+    krb5_timestamp timenow;
+    int i;
+
+    if (req_packet->length > SHM_SLOT_DATA ||
+        rep_len > SHM_SLOT_DATA - req_packet->length)
+        return;
+    if (krb5_timeofday(kcontext, &timenow))
+        return;
+
+    /* Use the slot already holding this request, or else an empty slot, or
+     * else evict the oldest entry in the set. */
+    set = shm_lock_set(hash);
+    victim = shm_find_slot(set, hash, req_packet);
+    for (i = 0; i < SHM_WAYS && victim == NULL; i++) {
+        if (set->slots[i].state == SLOT_EMPTY)
+            victim = &set->slots[i];
+    }
+    if (victim == NULL) {
+        victim = &set->slots[0];
+        for (i = 1; i < SHM_WAYS; i++) {
+            slot = &set->slots[i];
+            if (slot->timein < victim->timein)
+                victim = slot;
+        }
+    }
+    if (victim->state != SLOT_EMPTY) {
+        shm_clear_slot(victim, STALE(victim, timenow) ?
+                       &shm->stats.expirations : &shm->stats.evictions);
+    }
+
+    victim->hash = hash;
+    victim->timein = timenow;
+    victim->num_hits = 0;
+    victim->req_len = req_packet->length;
+    victim->rep_len = rep_len;
+    memcpy(victim->data, req_packet->data, req_packet->length);
+    if (rep_len > 0)
+        memcpy(victim->data + req_packet->length, reply_packet->data, rep_len);
+    victim->state = (reply_packet == NULL) ? SLOT_PENDING : SLOT_FULL;
+    pthread_mutex_unlock(&set->lock);
+
+    shm_lock_stats();
+    if (reply_packet == NULL)
+        shm->stats.num_pending++;
+    shm->stats.num_entries++;
+    shm->stats.total_size += req_packet->length + rep_len;
+    pthread_mutex_unlock(&shm->stats_lock);
+}
+
+static void
+shm_remove(krb5_data *req_packet)
+{
+    krb5_ui_4 hash = murmurhash3(req_packet);
+    struct shm_set *set;
+    struct shm_slot *slot;
+
+    set = shm_lock_set(hash);
+    slot = shm_find_slot(set, hash, req_packet);
+    if (slot != NULL)
+        shm_clear_slot(slot, NULL);
+    pthread_mutex_unlock(&set->lock);
+}
+
+#endif /* USE_SHARED_LOOKASIDE */
+
+/* Read the cache parameters from the [kdcdefaults] section of the profile,
+ * returning the initial number of hash buckets in *nbuckets_out. */
+static krb5_error_code
+read_config(krb5_context context, size_t *nbuckets_out)
+{
+    krb5_error_code ret;
+    int nbuckets, size;
+    char *str = NULL;
+
+    ret = profile_get_integer(context->profile, KRB5_CONF_KDCDEFAULTS,
+                              KRB5_CONF_LOOKASIDE_BUCKETS, NULL,
+                              LOOKASIDE_HASH_SIZE, &nbuckets);
+    if (ret)
+        return ret;
+    if (nbuckets <= 0 || (unsigned long)nbuckets > MAX_HASH_SIZE)
+        return EINVAL;
+    *nbuckets_out = nbuckets;
+
+    ret = profile_get_integer(context->profile, KRB5_CONF_KDCDEFAULTS,
+                              KRB5_CONF_LOOKASIDE_MAX_SIZE, NULL,
+                              LOOKASIDE_MAX_SIZE, &size);
+    if (ret)
+        return ret;
+    if (size < 0)
+        return EINVAL;
+    max_size = size;
+
+    ret = profile_get_string(context->profile, KRB5_CONF_KDCDEFAULTS,
+                             KRB5_CONF_LOOKASIDE_STALE_TIME, NULL, NULL,
+                             &str);
+    if (ret)
+        return ret;
+    if (str != NULL) {
+        ret = krb5_string_to_deltat(str, &stale_time);
+        profile_release_string(str);
+        if (ret)
+            return ret;
+        if (stale_time <= 0)
+            return EINVAL;
+    }
+    return 0;
+}
+
+/*
+ * Initialize the lookaside cache structures and randomize the hash seed.
+ * This must be called before any worker processes are created, so that the
+ * workers share the seed and, if configured, the cache contents.
+ */
 krb5_error_code
 kdc_init_lookaside(krb5_context context)
 {
     krb5_data d = make_data(&seed, sizeof(seed));
-    int i;
-
-    for (i = 0; i < LOOKASIDE_HASH_SIZE; i++)
-        LIST_INIT(&hash_table[i]);
+    krb5_error_code ret;
+    int shared;
+    size_t nbuckets;
+
+    ret = read_config(context, &nbuckets);
+    if (ret)
+        return ret;
+    ret = alloc_table(&hash_table, nbuckets);
+    if (ret)
+        return ret;
+    stats.num_buckets = nbuckets;
     TAILQ_INIT(&expiration_queue);
-    return krb5_c_random_make_octets(context, &d);
+    ret = krb5_c_random_make_octets(context, &d);
+    if (ret)
+        return ret;
+
+    ret = profile_get_boolean(context->profile, KRB5_CONF_KDCDEFAULTS,
+                              KRB5_CONF_LOOKASIDE_SHARED, NULL, FALSE,
+                              &shared);
+    if (ret || !shared)
+        return ret;
+#ifdef USE_SHARED_LOOKASIDE
+    ret = shm_init();
+    if (ret)
+        return ret;
+    krb5_klog_syslog(LOG_INFO, _("using shared lookaside cache"));
+    return 0;
+#else
+    krb5_klog_syslog(LOG_ERR, _("shared lookaside cache is not supported on "
+                                "this platform"));
+    return 0;
+#endif
+}
+
+/* Fill in *stats_out with the lookaside cache statistics.  If the cache is
+ * shared, the statistics cover all processes using it. */
+void
+kdc_lookaside_stats(struct kdc_lookaside_stats *stats_out)
+{
+#ifdef USE_SHARED_LOOKASIDE
+    if (shm != NULL) {
+        shm_lock_stats();
+        *stats_out = shm->stats;
+        pthread_mutex_unlock(&shm->stats_lock);
+        return;
+    }
+#endif
+    *stats_out = stats;
+}
+
+/* Log the lookaside cache statistics. */
+void
+kdc_log_lookaside_stats(void)
+{
+    struct kdc_lookaside_stats st;
+
+    kdc_lookaside_stats(&st);
+    krb5_klog_syslog(LOG_INFO, _("lookaside cache: %lu lookups, %lu hits, "
+                                 "%lu evictions, %lu expirations, %d entries "
+                                 "(%d pending) using %lu bytes in %lu "
+                                 "buckets"),
+                     st.calls, st.hits, st.evictions, st.expirations,
+                     st.num_entries, st.num_pending,
+                     (unsigned long)st.total_size,
+                     (unsigned long)st.num_buckets);
 }
 
 /* Remove the lookaside cache entry for a packet. */
@@ -155,6 +659,12 @@ kdc_remove_lookaside(krb5_context kcontext, krb5_data *req_packet)
 {
     struct entry *e;
 
+#ifdef USE_SHARED_LOOKASIDE
+    if (shm != NULL) {
+        shm_remove(req_packet);
+        return;
+    }
+#endif
     e = find_entry(req_packet);
     if (e != NULL)
         discard_entry(kcontext, e);
@@ -169,14 +679,23 @@ kdc_check_lookaside(krb5_context kcontext, krb5_data *req_packet,
     struct entry *e;
 
     *reply_packet_out = NULL;
-    calls++;
+#ifdef USE_SHARED_LOOKASIDE
+    if (shm != NULL)
+        return shm_check(kcontext, req_packet, reply_packet_out);
+#endif
+    stats.calls++;
+    rehash_step();
 
     e = find_entry(req_packet);
     if (e == NULL)
         return FALSE;
 
     e->num_hits++;
-    hits++;
+    stats.hits++;
+    /* Leave *reply_packet_out NULL if the request is still being
+     * processed. */
+    if (e->reply_packet.data == NULL)
+        return TRUE;
     return (krb5_copy_data(kcontext, &e->reply_packet,
                            reply_packet_out) == 0);
 }
@@ -192,14 +711,25 @@ kdc_insert_lookaside(krb5_context kcontext, krb5_data *req_packet,
     krb5_ui_4 hash = murmurhash3(req_packet);
     size_t esize = entry_size(req_packet, reply_packet);
 
+#ifdef USE_SHARED_LOOKASIDE
+    if (shm != NULL) {
+        shm_insert(kcontext, req_packet, reply_packet);
+        return;
+    }
+#endif
     if (krb5_timeofday(kcontext, &timenow))
         return;
 
     /* Purge stale entries and limit the total size of the entries. */
     TAILQ_FOREACH_SAFE(e, &expiration_queue, expire_links, next) {
-        if (!STALE(e, timenow) && total_size + esize <= LOOKASIDE_MAX_SIZE)
+        if (STALE(e, timenow))
+            stats.expirations++;
+        else if (stats.total_size + esize > max_size)
+            stats.evictions++;
+        else
             break;
-        max_hits_per_entry = max(max_hits_per_entry, e->num_hits);
+        stats.max_hits_per_entry = max(stats.max_hits_per_entry,
+                                       e->num_hits);
         discard_entry(kcontext, e);
     }
 
@@ -208,6 +738,7 @@ kdc_insert_lookaside(krb5_context kcontext, krb5_data *req_packet,
     if (e == NULL)
         return;
     e->timein = timenow;
+    e->hash = hash;
     if (krb5int_copy_data_contents(kcontext, req_packet, &e->req_packet)) {
         free(e);
         return;
@@ -221,10 +752,14 @@ kdc_insert_lookaside(krb5_context kcontext, krb5_data *req_packet,
     }
 
     TAILQ_INSERT_TAIL(&expiration_queue, e, expire_links);
-    LIST_INSERT_HEAD(&hash_table[hash], e, bucket_links);
-    num_entries++;
-    total_size += esize;
-    return;
+    LIST_INSERT_HEAD(&hash_table.buckets[hash % hash_table.nbuckets], e,
+                     bucket_links);
+    stats.num_entries++;
+    if (reply_packet == NULL)
+        stats.num_pending++;
+    stats.total_size += esize;
+    maybe_grow();
+    rehash_step();
 }
 
 /* Free all entries in the lookaside cache. */
@@ -233,9 +768,20 @@ kdc_free_lookaside(krb5_context kcontext)
 {
     struct entry *e, *next;
 
+#ifdef USE_SHARED_LOOKASIDE
+    /* Other processes may still be using the mapping, so just detach. */
+    if (shm != NULL) {
+        munmap(shm, shm_len);
+        shm = NULL;
+    }
+#endif
     TAILQ_FOREACH_SAFE(e, &expiration_queue, expire_links, next) {
         discard_entry(kcontext, e);
     }
+    free(old_table.buckets);
+    free(hash_table.buckets);
+    old_table.buckets = hash_table.buckets = NULL;
+    old_table.nbuckets = hash_table.nbuckets = 0;
 }
 
 #endif /* NOCACHE */
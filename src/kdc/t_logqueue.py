@@ -0,0 +1,43 @@
+#!/usr/bin/python
+from k5test import *
+
+def read_log(realm):
+    f = open(os.path.join(realm.testdir, 'kdc.log'))
+    log = f.read()
+    f.close()
+    return log
+
+# With a log queue, routine messages are written by a background
+# thread.  The worker processes are forked after the log is opened,
+# so each must start its own queue thread.  With the block overflow
+# policy, no messages should be lost.
+conf = {'logging': {'queue_length': '2', 'queue_overflow': 'block'}}
+realm = K5Realm(start_kdc=False, create_host=False, kdc_conf=conf)
+realm.start_kdc(['-w', '2'])
+for i in range(10):
+    realm.kinit(realm.user_princ, password('user'))
+realm.stop_kdc()
+log = read_log(realm)
+if log.count('AS_REQ') != 10:
+    fail('Queued AS_REQ messages missing from KDC log')
+if log.count('commencing operation') != 2:
+    fail('Startup messages missing from KDC log')
+realm.stop()
+
+# Messages queued by worker threads should all reach the log by the
+# time the KDC has shut down.
+conf = {'logging': {'queue_length': '1024'}}
+realm = K5Realm(start_kdc=False, kdc_conf=conf)
+realm.start_kdc(['-t', '2'])
+realm.kinit(realm.user_princ, password('user'))
+for i in range(5):
+    realm.run([kvno, realm.host_princ])
+    realm.run([kdestroy])
+    realm.kinit(realm.user_princ, password('user'))
+realm.stop_kdc()
+log = read_log(realm)
+if log.count('TGS_REQ') != 5 or 'shutting down' not in log:
+    fail('Queued TGS_REQ messages missing from KDC log')
+realm.stop()
+
+success('KDC log queue')
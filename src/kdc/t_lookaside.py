@@ -0,0 +1,38 @@
+#!/usr/bin/python
+from k5test import *
+import re
+
+def lookaside_stats(realm):
+    f = open(os.path.join(realm.testdir, 'kdc.log'))
+    log = f.read()
+    f.close()
+    pattern = (r'lookaside cache: (\d+) lookups, (\d+) hits, (\d+) evictions, '
+               r'(\d+) expirations, (\d+) entries \((\d+) pending\) using '
+               r'(\d+) bytes in (\d+) buckets')
+    m = re.findall(pattern, log)
+    if not m:
+        fail('No lookaside cache statistics in KDC log')
+    return [int(x) for x in m[-1]]
+
+# Start with a single bucket so that the table has to grow, and a tiny byte
+# budget so that entries have to be evicted.
+conf = {'kdcdefaults': {'lookaside_buckets': '1',
+                        'lookaside_max_size': '4000',
+                        'lookaside_stale_time': '1h'}}
+realm = K5Realm(kdc_conf=conf, create_host=False, get_creds=False)
+for i in range(10):
+    realm.kinit(realm.user_princ, password('user'))
+
+realm.stop_kdc()
+lookups, hits, evictions, expirations, entries, pending, size, buckets = \
+    lookaside_stats(realm)
+if lookups < 10 or hits != 0 or pending != 0:
+    fail('Unexpected lookaside cache lookup statistics')
+if evictions == 0 or size > 4000:
+    fail('Lookaside cache byte budget not enforced')
+if expirations != 0:
+    fail('Unexpected lookaside cache expirations')
+if buckets < 2:
+    fail('Lookaside cache hash table did not grow')
+
+success('KDC lookaside cache')
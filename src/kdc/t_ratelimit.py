@@ -0,0 +1,75 @@
+#!/usr/bin/python
+from k5test import *
+import time
+
+def read_log(realm):
+    f = open(os.path.join(realm.testdir, 'kdc.log'))
+    log = f.read()
+    f.close()
+    return log
+
+def wait_for_log(realm, text):
+    for i in range(50):
+        if text in read_log(realm):
+            return
+        time.sleep(0.1)
+    fail('Expected KDC log message not seen: ' + text)
+
+def sigusr1(realm, pidfile):
+    f = open(pidfile)
+    pid = int(f.read())
+    f.close()
+    os.kill(pid, signal.SIGUSR1)
+
+# Only listen on TCP at the client's KDC port, so that dropped requests fail
+# quickly instead of timing out.
+krb5_conf = {'libdefaults': {'udp_preference_limit': '1'}}
+tcp_only = {'realms': {'$realm': {'kdc_ports': '$port9'}}}
+
+# With a rate of one request per second and a burst of two, the third of
+# three quick kinits from the same address should be dropped.
+conf = {'kdcdefaults': {'client_rate_limit': '1', 'client_rate_burst': '2'}}
+conf.update(tcp_only)
+realm = K5Realm(krb5_conf=krb5_conf, kdc_conf=conf, start_kdc=False,
+                create_host=False, get_creds=False)
+pidfile = os.path.join(realm.testdir, 'kdc.pid')
+realm.start_kdc(['-P', pidfile])
+realm.kinit(realm.user_princ, password('user'))
+realm.kinit(realm.user_princ, password('user'))
+realm.kinit(realm.user_princ, password('user'), expected_code=1)
+wait_for_log(realm, 'rate limiting requests from address 127.0.0.1/32')
+sigusr1(realm, pidfile)
+wait_for_log(realm, '127.0.0.1/32: 1 dropped')
+if 'address rate limit: 1 dropped' not in read_log(realm):
+    fail('Expected rate limit statistics not logged')
+
+# The bucket refills at the configured rate.
+time.sleep(2.5)
+realm.kinit(realm.user_princ, password('user'))
+realm.stop()
+
+# Principal limits apply to AS requests for each client principal, and
+# address prefixes group clients together.
+conf = {'kdcdefaults': {'principal_rate_limit': '1',
+                        'principal_rate_burst': '1',
+                        'client_rate_limit': '100',
+                        'client_rate_ipv4_prefix': '8'}}
+conf.update(tcp_only)
+realm = K5Realm(krb5_conf=krb5_conf, kdc_conf=conf, create_host=False,
+                get_creds=False)
+realm.kinit(realm.user_princ, password('user'))
+realm.kinit(realm.user_princ, password('user'), expected_code=1)
+realm.kinit(realm.admin_princ, password('admin'))
+realm.stop()
+wait_for_log(realm, 'rate limiting requests from principal ' +
+             realm.user_princ)
+if 'address rate limit: 0 dropped' not in read_log(realm):
+    fail('Expected address statistics not logged')
+
+# Invalid prefix lengths should be reported at startup.
+conf = {'kdcdefaults': {'client_rate_ipv4_prefix': '33'}}
+realm = K5Realm(start_kdc=False, create_host=False, kdc_conf=conf)
+realm.run([krb5kdc, '-n'], expected_code=1)
+realm.stop()
+
+success('KDC rate limiting')
@@ -0,0 +1,55 @@
+#!/usr/bin/python
+from k5test import *
+import re
+import time
+
+def read_log(realm):
+    f = open(os.path.join(realm.testdir, 'kdc.log'))
+    log = f.read()
+    f.close()
+    return log
+
+def latency_stats(log, type, phase):
+    pattern = (r'latency %s %s: (\d+) requests, mean (\d+) us, p50 < (\d+) us, '
+               r'p90 < (\d+) us, p99 < (\d+) us, max (\d+) us' % (type, phase))
+    return [[int(x) for x in m] for m in re.findall(pattern, log)]
+
+# The KDC should log its latency histograms when it receives SIGUSR1.
+conf = {'kdcdefaults': {'slow_request_threshold': '60000'}}
+realm = K5Realm(start_kdc=False, kdc_conf=conf)
+pidfile = os.path.join(realm.testdir, 'kdc.pid')
+realm.start_kdc(['-P', pidfile])
+realm.kinit(realm.user_princ, password('user'))
+realm.run([kvno, realm.host_princ])
+f = open(pidfile)
+pid = int(f.read())
+f.close()
+os.kill(pid, signal.SIGUSR1)
+for i in range(50):
+    if latency_stats(read_log(realm), 'TGS', 'total'):
+        break
+    time.sleep(0.1)
+log = read_log(realm)
+as_total = latency_stats(log, 'AS', 'total')
+tgs_total = latency_stats(log, 'TGS', 'total')
+if len(as_total) != 1 or len(tgs_total) != 1:
+    fail('No latency statistics after SIGUSR1')
+count, mean, p50, p90, p99, max = as_total[0]
+if count < 1 or p50 > p90 or p90 > p99 or mean > max:
+    fail('Unexpected AS latency statistics')
+if tgs_total[0][0] != 1:
+    fail('Unexpected TGS request count')
+for phase in ('decode', 'db', 'auth', 'ticket', 'reply', 'send'):
+    if not latency_stats(log, 'TGS', phase):
+        fail('No TGS latency statistics for %s phase' % phase)
+if 'slow ' in log:
+    fail('Unexpected slow request log')
+realm.stop()
+
+# A negative slow request threshold should be reported at startup.
+conf = {'kdcdefaults': {'slow_request_threshold': '-1'}}
+realm = K5Realm(start_kdc=False, create_host=False, kdc_conf=conf)
+realm.run([krb5kdc, '-n'], expected_code=1)
+realm.stop()
+
+success('KDC latency statistics')
@@ -0,0 +1,23 @@
+#!/usr/bin/python
+from k5test import *
+
+realm = K5Realm(start_kdc=False)
+realm.start_kdc(['-t', '4'])
+realm.kinit(realm.user_princ, password('user'))
+for i in range(20):
+    realm.run([kvno, realm.host_princ])
+realm.klist(realm.user_princ, realm.host_princ)
+
+# TGS requests for unknown servers should still produce errors.
+output = realm.run([kvno, 'nonexistent@' + realm.realm], expected_code=1)
+if 'not found in Kerberos database' not in output:
+    fail('Expected error message not seen for unknown server')
+realm.stop_kdc()
+
+# Worker threads can be combined with worker processes.
+realm.start_kdc(['-w', '2', '-t', '2'])
+realm.kinit(realm.user_princ, password('user'))
+realm.run([kvno, realm.host_princ])
+realm.klist(realm.user_princ, realm.host_princ)
+
+success('KDC worker threads')
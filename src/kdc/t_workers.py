@@ -1,8 +1,53 @@
 #!/usr/bin/python
 from k5test import *
+import re
 
 realm = K5Realm(start_kdc=False, create_host=False)
 realm.start_kdc(['-w', '3'])
 realm.kinit(realm.user_princ, password('user'))
 realm.klist(realm.user_princ)
+realm.stop_kdc()
+realm.stop()
+
+# With a shared lookaside cache, each worker should report statistics
+# covering the requests seen by all of the workers.
+conf = {'kdcdefaults': {'lookaside_shared': 'true'}}
+realm = K5Realm(start_kdc=False, create_host=False, kdc_conf=conf)
+realm.start_kdc(['-w', '3'])
+for i in range(4):
+    realm.kinit(realm.user_princ, password('user'))
+realm.klist(realm.user_princ)
+realm.stop_kdc()
+f = open(os.path.join(realm.testdir, 'kdc.log'))
+log = f.read()
+f.close()
+if 'using shared lookaside cache' not in log:
+    fail('Shared lookaside cache not used')
+lookups = set(re.findall(r'lookaside cache: (\d+) lookups', log))
+if len(lookups) != 1 or int(lookups.pop()) < 4:
+    fail('Unexpected lookaside cache statistics from worker processes')
+
+# Each worker can listen on its own SO_REUSEPORT sockets, and can be
+# bound to a CPU.
+conf = {'kdcdefaults': {'worker_reuseport': 'true',
+                        'worker_affinity': 'cpu'}}
+realm = K5Realm(start_kdc=False, create_host=False, kdc_conf=conf)
+realm.start_kdc(['-w', '2'])
+for i in range(4):
+    realm.kinit(realm.user_princ, password('user'))
+realm.klist(realm.user_princ)
+realm.stop_kdc()
+f = open(os.path.join(realm.testdir, 'kdc.log'))
+log = f.read()
+f.close()
+if 'worker 1 bound to CPUs by cpu' not in log:
+    fail('Worker process not bound to a CPU')
+realm.stop()
+
+# An unknown affinity mode should be reported at startup.
+conf = {'kdcdefaults': {'worker_affinity': 'socket'}}
+realm = K5Realm(start_kdc=False, create_host=False, kdc_conf=conf)
+realm.run([krb5kdc, '-n', '-w', '2'], expected_code=1)
+realm.stop()
+
 success('KDC worker processes')
@@ -23,6 +23,7 @@
  * or implied warranty.
  */
 
+#define _GNU_SOURCE /* For recvmmsg() and sendmmsg() */
 #include "k5-int.h"
 #include "adm_proto.h"
 #include <sys/ioctl.h>
@@ -104,6 +105,14 @@ setreuseaddr(int sock, int value)
     return setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
 }
 
+#ifdef SO_REUSEPORT
+static int
+setreuseport(int sock, int value)
+{
+    return setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value));
+}
+#endif
+
 #if defined(IPV6_V6ONLY)
 static int
 setv6only(int sock, int value)
@@ -259,6 +268,11 @@ static SET(unsigned short) udp_port_data, tcp_port_data;
 static SET(struct rpc_svc_data) rpc_svc_data;
 static SET(verto_ev *) events;
 
+#ifdef SO_REUSEPORT
+/* Set by loop_enable_reuseport(). */
+static int reuseport;
+#endif
+
 verto_ctx *
 loop_init(verto_ev_type types)
 {
@@ -323,6 +337,22 @@ loop_setup_signals(verto_ctx *ctx, void *handle, void (*reset)())
     return 0;
 }
 
+/*
+ * Create all listener sockets with SO_REUSEPORT, so that several processes
+ * can each call loop_setup_network() and listen on the same addresses, with
+ * the kernel dividing incoming traffic between them.
+ */
+krb5_error_code
+loop_enable_reuseport(void)
+{
+#ifdef SO_REUSEPORT
+    reuseport = 1;
+    return 0;
+#else
+    return EINVAL;
+#endif
+}
+
 krb5_error_code
 loop_add_udp_port(int port)
 {
@@ -596,6 +626,16 @@ create_server_socket(struct socksetup *data, struct sockaddr *addr, int type)
                 _("Cannot enable SO_REUSEADDR on fd %d"), sock);
     }
 
+#ifdef SO_REUSEPORT
+    if (reuseport && setreuseport(sock, 1) < 0) {
+        data->retval = errno;
+        com_err(data->prog, errno,
+                _("Cannot enable SO_REUSEPORT on fd %d"), sock);
+        close(sock);
+        return -1;
+    }
+#endif
+
     if (addr->sa_family == AF_INET6) {
 #ifdef IPV6_V6ONLY
         if (setv6only(sock, 1))
@@ -1255,56 +1295,24 @@ union aux_addressing_info {
     int ipv6_ifindex;
 };
 
-static int
-recv_from_to(int s, void *buf, size_t len, int flags,
-             struct sockaddr *from, socklen_t *fromlen,
-             struct sockaddr *to, socklen_t *tolen,
-             union aux_addressing_info *auxaddr)
+#if (defined(IP_PKTINFO) || defined(IPV6_PKTINFO)) && defined(CMSG_SPACE)
+/*
+ * Set *to to the local address a datagram was received on, using the packet
+ * information control data in msg, or set *tolen to 0 if that information is
+ * not available.
+ */
+static void
+get_pktinfo_addr(struct msghdr *msg, struct sockaddr *to, socklen_t *tolen,
+                 union aux_addressing_info *auxaddr)
 {
-#if (!defined(IP_PKTINFO) && !defined(IPV6_PKTINFO)) || !defined(CMSG_SPACE)
-    if (to && tolen) {
-        /* Clobber with something recognizeable in case we try to use
-           the address.  */
-        memset(to, 0x40, *tolen);
-        *tolen = 0;
-    }
-
-    return recvfrom(s, buf, len, flags, from, fromlen);
-#else
-    int r;
-    struct iovec iov;
-    char cmsg[CMSG_SPACE(sizeof(union pktinfo))];
     struct cmsghdr *cmsgptr;
-    struct msghdr msg;
-
-    if (!to || !tolen)
-        return recvfrom(s, buf, len, flags, from, fromlen);
-
-    /* Clobber with something recognizeable in case we can't extract
-       the address but try to use it anyways.  */
-    memset(to, 0x40, *tolen);
-
-    iov.iov_base = buf;
-    iov.iov_len = len;
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = from;
-    msg.msg_namelen = *fromlen;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = cmsg;
-    msg.msg_controllen = sizeof(cmsg);
-
-    r = recvmsg(s, &msg, flags);
-    if (r < 0)
-        return r;
-    *fromlen = msg.msg_namelen;
 
     /* On Darwin (and presumably all *BSD with KAME stacks),
        CMSG_FIRSTHDR doesn't check for a non-zero controllen.  RFC
        3542 recommends making this check, even though the (new) spec
        for CMSG_FIRSTHDR says it's supposed to do the check.  */
-    if (msg.msg_controllen) {
-        cmsgptr = CMSG_FIRSTHDR(&msg);
+    if (msg->msg_controllen) {
+        cmsgptr = CMSG_FIRSTHDR(msg);
         while (cmsgptr) {
 #ifdef IP_PKTINFO
             if (cmsgptr->cmsg_level == IPPROTO_IP
@@ -1316,7 +1324,7 @@ recv_from_to(int s, void *buf, size_t len, int flags,
                 ((struct sockaddr_in *)to)->sin_addr = pktinfo->ipi_addr;
                 ((struct sockaddr_in *)to)->sin_family = AF_INET;
                 *tolen = sizeof(struct sockaddr_in);
-                return r;
+                return;
             }
 #endif
 #if defined(IPV6_PKTINFO) && defined(HAVE_STRUCT_IN6_PKTINFO)
@@ -1330,60 +1338,40 @@ recv_from_to(int s, void *buf, size_t len, int flags,
                 ((struct sockaddr_in6 *)to)->sin6_family = AF_INET6;
                 *tolen = sizeof(struct sockaddr_in6);
                 auxaddr->ipv6_ifindex = pktinfo->ipi6_ifindex;
-                return r;
+                return;
             }
 #endif
-            cmsgptr = CMSG_NXTHDR(&msg, cmsgptr);
+            cmsgptr = CMSG_NXTHDR(msg, cmsgptr);
         }
     }
     /* No info about destination addr was available.  */
     *tolen = 0;
-    return r;
-#endif
 }
 
+/*
+ * Add packet information control data to msg so that it will be sent from
+ * the local address from.  msg->msg_control must point to a buffer of
+ * msg->msg_controllen bytes, at least CMSG_SPACE(sizeof(union pktinfo)).
+ * Return 0 if from cannot be expressed this way, in which case the message
+ * should be sent without control data.
+ */
 static int
-send_to_from(int s, void *buf, size_t len, int flags,
-             const struct sockaddr *to, socklen_t tolen,
-             const struct sockaddr *from, socklen_t fromlen,
-             union aux_addressing_info *auxaddr)
+set_pktinfo_addr(struct msghdr *msg, const struct sockaddr *from,
+                 socklen_t fromlen, union aux_addressing_info *auxaddr)
 {
-#if (!defined(IP_PKTINFO) && !defined(IPV6_PKTINFO)) || !defined(CMSG_SPACE)
-    return sendto(s, buf, len, flags, to, tolen);
-#else
-    struct iovec iov;
-    struct msghdr msg;
     struct cmsghdr *cmsgptr;
-    char cbuf[CMSG_SPACE(sizeof(union pktinfo))];
-
-    if (from == 0 || fromlen == 0 || from->sa_family != to->sa_family) {
-    use_sendto:
-        return sendto(s, buf, len, flags, to, tolen);
-    }
 
-    iov.iov_base = buf;
-    iov.iov_len = len;
-    /* Truncation?  */
-    if (iov.iov_len != len)
-        return EINVAL;
-    memset(cbuf, 0, sizeof(cbuf));
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = (void *) to;
-    msg.msg_namelen = tolen;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = cbuf;
+    memset(msg->msg_control, 0, msg->msg_controllen);
     /* CMSG_FIRSTHDR needs a non-zero controllen, or it'll return NULL
        on Linux.  */
-    msg.msg_controllen = sizeof(cbuf);
-    cmsgptr = CMSG_FIRSTHDR(&msg);
-    msg.msg_controllen = 0;
+    cmsgptr = CMSG_FIRSTHDR(msg);
+    msg->msg_controllen = 0;
 
     switch (from->sa_family) {
 #if defined(IP_PKTINFO)
     case AF_INET:
         if (fromlen != sizeof(struct sockaddr_in))
-            goto use_sendto;
+            return 0;
         cmsgptr->cmsg_level = IPPROTO_IP;
         cmsgptr->cmsg_type = IP_PKTINFO;
         cmsgptr->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
@@ -1392,13 +1380,13 @@ send_to_from(int s, void *buf, size_t len, int flags,
             const struct sockaddr_in *from4 = (const struct sockaddr_in *)from;
             p->ipi_spec_dst = from4->sin_addr;
         }
-        msg.msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
-        break;
+        msg->msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+        return 1;
 #endif
 #if defined(IPV6_PKTINFO) && defined(HAVE_STRUCT_IN6_PKTINFO)
     case AF_INET6:
         if (fromlen != sizeof(struct sockaddr_in6))
-            goto use_sendto;
+            return 0;
         cmsgptr->cmsg_level = IPPROTO_IPV6;
         cmsgptr->cmsg_type = IPV6_PKTINFO;
         cmsgptr->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
@@ -1419,16 +1407,101 @@ send_to_from(int s, void *buf, size_t len, int flags,
                 p->ipi6_ifindex = auxaddr->ipv6_ifindex;
             /* otherwise, already zero */
         }
-        msg.msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
-        break;
+        msg->msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
+        return 1;
 #endif
     default:
-        goto use_sendto;
+        return 0;
     }
+}
+#endif
+
+static int
+recv_from_to(int s, void *buf, size_t len, int flags,
+             struct sockaddr *from, socklen_t *fromlen,
+             struct sockaddr *to, socklen_t *tolen,
+             union aux_addressing_info *auxaddr)
+{
+#if (!defined(IP_PKTINFO) && !defined(IPV6_PKTINFO)) || !defined(CMSG_SPACE)
+    if (to && tolen) {
+        /* Clobber with something recognizeable in case we try to use
+           the address.  */
+        memset(to, 0x40, *tolen);
+        *tolen = 0;
+    }
+
+    return recvfrom(s, buf, len, flags, from, fromlen);
+#else
+    int r;
+    struct iovec iov;
+    char cmsg[CMSG_SPACE(sizeof(union pktinfo))];
+    struct msghdr msg;
+
+    if (!to || !tolen)
+        return recvfrom(s, buf, len, flags, from, fromlen);
+
+    /* Clobber with something recognizeable in case we can't extract
+       the address but try to use it anyways.  */
+    memset(to, 0x40, *tolen);
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = from;
+    msg.msg_namelen = *fromlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg;
+    msg.msg_controllen = sizeof(cmsg);
+
+    r = recvmsg(s, &msg, flags);
+    if (r < 0)
+        return r;
+    *fromlen = msg.msg_namelen;
+    get_pktinfo_addr(&msg, to, tolen, auxaddr);
+    return r;
+#endif
+}
+
+static int
+send_to_from(int s, void *buf, size_t len, int flags,
+             const struct sockaddr *to, socklen_t tolen,
+             const struct sockaddr *from, socklen_t fromlen,
+             union aux_addressing_info *auxaddr)
+{
+#if (!defined(IP_PKTINFO) && !defined(IPV6_PKTINFO)) || !defined(CMSG_SPACE)
+    return sendto(s, buf, len, flags, to, tolen);
+#else
+    struct iovec iov;
+    struct msghdr msg;
+    char cbuf[CMSG_SPACE(sizeof(union pktinfo))];
+
+    if (from == 0 || fromlen == 0 || from->sa_family != to->sa_family)
+        return sendto(s, buf, len, flags, to, tolen);
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    /* Truncation?  */
+    if (iov.iov_len != len)
+        return EINVAL;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *) to;
+    msg.msg_namelen = tolen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    if (!set_pktinfo_addr(&msg, from, fromlen, auxaddr))
+        return sendto(s, buf, len, flags, to, tolen);
     return sendmsg(s, &msg, flags);
 #endif
 }
 
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) &&                \
+    defined(HAVE_STRUCT_CMSGHDR) && defined(IP_PKTINFO) && defined(CMSG_SPACE)
+#define USE_MMSG
+#endif
+
 struct udp_dispatch_state {
     void *handle;
     const char *prog;
@@ -1441,48 +1514,87 @@ struct udp_dispatch_state {
     struct sockaddr_storage daddr;
     union aux_addressing_info auxaddr;
     krb5_data request;
+    krb5_data *response;
     char pktbuf[MAX_DGRAM_SIZE];
 };
 
+#ifdef USE_MMSG
+/*
+ * On systems with recvmmsg() and sendmmsg(), process_packet() receives up to
+ * UDP_BATCH_SIZE datagrams per wakeup.  Replies produced while the batch is
+ * being dispatched are collected in reply_batch and sent together afterwards;
+ * replies which complete later are sent individually as usual.  All of this
+ * state is only used by the event loop thread.
+ */
+#define UDP_BATCH_SIZE 32
+
+static struct udp_dispatch_state *spare_states[UDP_BATCH_SIZE];
+static struct udp_dispatch_state *reply_batch[UDP_BATCH_SIZE];
+static int num_batch_replies;
+static int batching_replies;
+static int mmsg_unsupported;
+#endif
+
+static void
+free_udp_dispatch_state(struct udp_dispatch_state *state)
+{
+    if (state->response != NULL)
+        krb5_free_data(get_context(state->handle), state->response);
+    free(state);
+}
+
+static void
+log_send_error(struct udp_dispatch_state *state, int e)
+{
+    /* Note that the local address (daddr*) has no port number
+     * info associated with it. */
+    char saddrbuf[NI_MAXHOST], sportbuf[NI_MAXSERV];
+    char daddrbuf[NI_MAXHOST];
+
+    if (getnameinfo((struct sockaddr *)&state->daddr, state->daddr_len,
+                    daddrbuf, sizeof(daddrbuf), 0, 0,
+                    NI_NUMERICHOST) != 0) {
+        strlcpy(daddrbuf, "?", sizeof(daddrbuf));
+    }
+
+    if (getnameinfo((struct sockaddr *)&state->saddr, state->saddr_len,
+                    saddrbuf, sizeof(saddrbuf), sportbuf, sizeof(sportbuf),
+                    NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
+        strlcpy(saddrbuf, "?", sizeof(saddrbuf));
+        strlcpy(sportbuf, "?", sizeof(sportbuf));
+    }
+
+    com_err(state->prog, e, _("while sending reply to %s/%s from %s"),
+            saddrbuf, sportbuf, daddrbuf);
+}
+
 static void
 process_packet_response(void *arg, krb5_error_code code, krb5_data *response)
 {
     struct udp_dispatch_state *state = arg;
     int cc;
 
+    state->response = response;
     if (code)
         com_err(state->prog ? state->prog : NULL, code,
                 _("while dispatching (udp)"));
     if (code || response == NULL)
         goto out;
 
+#ifdef USE_MMSG
+    if (batching_replies && num_batch_replies < UDP_BATCH_SIZE) {
+        reply_batch[num_batch_replies++] = state;
+        return;
+    }
+#endif
+
     cc = send_to_from(state->port_fd, response->data,
                       (socklen_t) response->length, 0,
                       (struct sockaddr *)&state->saddr, state->saddr_len,
                       (struct sockaddr *)&state->daddr, state->daddr_len,
                       &state->auxaddr);
     if (cc == -1) {
-        /* Note that the local address (daddr*) has no port number
-         * info associated with it. */
-        char saddrbuf[NI_MAXHOST], sportbuf[NI_MAXSERV];
-        char daddrbuf[NI_MAXHOST];
-        int e = errno;
-
-        if (getnameinfo((struct sockaddr *)&state->daddr, state->daddr_len,
-                        daddrbuf, sizeof(daddrbuf), 0, 0,
-                        NI_NUMERICHOST) != 0) {
-            strlcpy(daddrbuf, "?", sizeof(daddrbuf));
-        }
-
-        if (getnameinfo((struct sockaddr *)&state->saddr, state->saddr_len,
-                        saddrbuf, sizeof(saddrbuf), sportbuf, sizeof(sportbuf),
-                        NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
-            strlcpy(saddrbuf, "?", sizeof(saddrbuf));
-            strlcpy(sportbuf, "?", sizeof(sportbuf));
-        }
-
-        com_err(state->prog, e, _("while sending reply to %s/%s from %s"),
-                saddrbuf, sportbuf, daddrbuf);
+        log_send_error(state, errno);
         goto out;
     }
     if ((size_t)cc != response->length) {
@@ -1491,10 +1603,212 @@ process_packet_response(void *arg, krb5_error_code code, krb5_data *response)
     }
 
 out:
-    krb5_free_data(get_context(state->handle), response);
-    free(state);
+    free_udp_dispatch_state(state);
+}
+
+/* Dispatch a request of len bytes which has been received into state. */
+static void
+dispatch_packet(verto_ctx *ctx, struct connection *conn,
+                struct udp_dispatch_state *state, int len)
+{
+#if 0
+    if (state->daddr_len > 0) {
+        char addrbuf[100];
+        if (getnameinfo(ss2sa(&state->daddr), state->daddr_len,
+                        addrbuf, sizeof(addrbuf),
+                        0, 0, NI_NUMERICHOST))
+            strlcpy(addrbuf, "?", sizeof(addrbuf));
+        com_err(conn->prog, 0, _("pktinfo says local addr is %s"), addrbuf);
+    }
+#endif
+
+    if (state->daddr_len == 0 && conn->type == CONN_UDP) {
+        /*
+         * If the PKTINFO option isn't set, this socket should be bound to a
+         * specific local address.  This info probably should've been saved in
+         * our socket data structure at setup time.
+         */
+        state->daddr_len = sizeof(state->daddr);
+        if (getsockname(state->port_fd, (struct sockaddr *)&state->daddr,
+                        &state->daddr_len) != 0)
+            state->daddr_len = 0;
+        /* On failure, keep going anyways. */
+    }
+
+    state->request.length = len;
+    state->request.data = state->pktbuf;
+    state->faddr.address = &state->addr;
+    init_addr(&state->faddr, ss2sa(&state->saddr));
+    /* This address is in net order. */
+    dispatch(state->handle, ss2sa(&state->daddr), &state->faddr,
+             &state->request, 0, ctx, process_packet_response, state);
 }
 
+static void
+log_recv_error(struct connection *conn, int e)
+{
+    if (e != EINTR && e != EAGAIN
+        /*
+         * This is how Linux indicates that a previous transmission was
+         * refused, e.g., if the client timed out before getting the
+         * response packet.
+         */
+        && e != ECONNREFUSED
+    )
+        com_err(conn->prog, e, _("while receiving from network"));
+}
+
+#ifdef USE_MMSG
+
+/* Send the replies collected in reply_batch on fd. */
+static void
+flush_reply_batch(int fd)
+{
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iovs[UDP_BATCH_SIZE];
+    char cbufs[UDP_BATCH_SIZE][CMSG_SPACE(sizeof(union pktinfo))];
+    struct udp_dispatch_state *state;
+    struct msghdr *hdr;
+    int i, n, sent;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < num_batch_replies; i++) {
+        state = reply_batch[i];
+        hdr = &msgs[i].msg_hdr;
+        iovs[i].iov_base = state->response->data;
+        iovs[i].iov_len = state->response->length;
+        hdr->msg_name = &state->saddr;
+        hdr->msg_namelen = state->saddr_len;
+        hdr->msg_iov = &iovs[i];
+        hdr->msg_iovlen = 1;
+        hdr->msg_control = cbufs[i];
+        hdr->msg_controllen = sizeof(cbufs[i]);
+        if (state->daddr_len == 0 ||
+            state->daddr.ss_family != state->saddr.ss_family ||
+            !set_pktinfo_addr(hdr, ss2sa(&state->daddr), state->daddr_len,
+                              &state->auxaddr)) {
+            hdr->msg_control = NULL;
+            hdr->msg_controllen = 0;
+        }
+    }
+
+    sent = 0;
+    while (sent < num_batch_replies) {
+        n = sendmmsg(fd, msgs + sent, num_batch_replies - sent, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            /* sendmmsg() only fails if the first message can't be sent.
+             * Report it and carry on with the rest. */
+            log_send_error(reply_batch[sent], errno);
+            sent++;
+            continue;
+        }
+        for (i = sent; i < sent + n; i++) {
+            state = reply_batch[i];
+            if (msgs[i].msg_len != state->response->length) {
+                com_err(state->prog, 0, _("short reply write %d vs %d\n"),
+                        state->response->length, (int)msgs[i].msg_len);
+            }
+        }
+        sent += n;
+    }
+
+    for (i = 0; i < num_batch_replies; i++)
+        free_udp_dispatch_state(reply_batch[i]);
+    num_batch_replies = 0;
+}
+
+/*
+ * Receive and dispatch up to UDP_BATCH_SIZE datagrams from the socket of ev.
+ * Return 0 if recvmmsg() is not supported at runtime, so that the caller can
+ * fall back to receiving one datagram at a time.
+ */
+static int
+process_packet_batch(verto_ctx *ctx, verto_ev *ev)
+{
+    struct connection *conn = verto_get_private(ev);
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iovs[UDP_BATCH_SIZE];
+    char cbufs[UDP_BATCH_SIZE][CMSG_SPACE(sizeof(union pktinfo))];
+    struct udp_dispatch_state *state;
+    struct msghdr *hdr;
+    int fd = verto_get_fd(ev), i, n, nbufs;
+
+    assert(fd >= 0);
+
+    /* Make sure we have dispatch states to receive into.  States which are
+     * not used by this wakeup are kept for the next one. */
+    memset(msgs, 0, sizeof(msgs));
+    for (nbufs = 0; nbufs < UDP_BATCH_SIZE; nbufs++) {
+        if (spare_states[nbufs] == NULL) {
+            spare_states[nbufs] = malloc(sizeof(*state));
+            if (spare_states[nbufs] == NULL)
+                break;
+        }
+        state = spare_states[nbufs];
+        hdr = &msgs[nbufs].msg_hdr;
+        iovs[nbufs].iov_base = state->pktbuf;
+        iovs[nbufs].iov_len = sizeof(state->pktbuf);
+        hdr->msg_name = &state->saddr;
+        hdr->msg_namelen = sizeof(state->saddr);
+        hdr->msg_iov = &iovs[nbufs];
+        hdr->msg_iovlen = 1;
+        hdr->msg_control = cbufs[nbufs];
+        hdr->msg_controllen = sizeof(cbufs[nbufs]);
+    }
+    if (nbufs == 0) {
+        com_err(conn->prog, ENOMEM, _("while dispatching (udp)"));
+        return 1;
+    }
+
+    n = recvmmsg(fd, msgs, nbufs, MSG_DONTWAIT, NULL);
+    if (n == -1) {
+        if (errno == ENOSYS)
+            return 0;
+        log_recv_error(conn, errno);
+        return 1;
+    }
+
+    batching_replies = 1;
+    for (i = 0; i < n; i++) {
+        if (msgs[i].msg_len == 0) /* zero-length packet? */
+            continue;
+        state = spare_states[i];
+        spare_states[i] = NULL;
+        hdr = &msgs[i].msg_hdr;
+
+        state->handle = conn->handle;
+        state->prog = conn->prog;
+        state->port_fd = fd;
+        state->response = NULL;
+        state->saddr_len = hdr->msg_namelen;
+        state->daddr_len = sizeof(state->daddr);
+        memset(&state->daddr, 0x40, sizeof(state->daddr));
+        memset(&state->auxaddr, 0, sizeof(state->auxaddr));
+        get_pktinfo_addr(hdr, ss2sa(&state->daddr), &state->daddr_len,
+                         &state->auxaddr);
+        dispatch_packet(ctx, conn, state, msgs[i].msg_len);
+    }
+    batching_replies = 0;
+    if (num_batch_replies > 0)
+        flush_reply_batch(fd);
+    return 1;
+}
+
+static void
+free_spare_states(void)
+{
+    int i;
+
+    for (i = 0; i < UDP_BATCH_SIZE; i++) {
+        free(spare_states[i]);
+        spare_states[i] = NULL;
+    }
+}
+
+#endif /* USE_MMSG */
+
 static void
 process_packet(verto_ctx *ctx, verto_ev *ev)
 {
@@ -1502,6 +1816,14 @@ process_packet(verto_ctx *ctx, verto_ev *ev)
     struct connection *conn;
     struct udp_dispatch_state *state;
 
+#ifdef USE_MMSG
+    if (!mmsg_unsupported) {
+        if (process_packet_batch(ctx, ev))
+            return;
+        mmsg_unsupported = 1;
+    }
+#endif
+
     conn = verto_get_private(ev);
 
     state = malloc(sizeof(*state));
@@ -1513,6 +1835,7 @@ process_packet(verto_ctx *ctx, verto_ev *ev)
     state->handle = conn->handle;
     state->prog = conn->prog;
     state->port_fd = verto_get_fd(ev);
+    state->response = NULL;
     assert(state->port_fd >= 0);
 
     state->saddr_len = sizeof(state->saddr);
@@ -1523,15 +1846,7 @@ process_packet(verto_ctx *ctx, verto_ev *ev)
                       (struct sockaddr *)&state->daddr, &state->daddr_len,
                       &state->auxaddr);
     if (cc == -1) {
-        if (errno != EINTR && errno != EAGAIN
-            /*
-             * This is how Linux indicates that a previous transmission was
-             * refused, e.g., if the client timed out before getting the
-             * response packet.
-             */
-            && errno != ECONNREFUSED
-        )
-            com_err(conn->prog, errno, _("while receiving from network"));
+        log_recv_error(conn, errno);
         free(state);
         return;
     }
@@ -1540,37 +1855,7 @@ process_packet(verto_ctx *ctx, verto_ev *ev)
         return;
     }
 
-#if 0
-    if (state->daddr_len > 0) {
-        char addrbuf[100];
-        if (getnameinfo(ss2sa(&state->daddr), state->daddr_len,
-                        addrbuf, sizeof(addrbuf),
-                        0, 0, NI_NUMERICHOST))
-            strlcpy(addrbuf, "?", sizeof(addrbuf));
-        com_err(conn->prog, 0, _("pktinfo says local addr is %s"), addrbuf);
-    }
-#endif
-
-    if (state->daddr_len == 0 && conn->type == CONN_UDP) {
-        /*
-         * If the PKTINFO option isn't set, this socket should be bound to a
-         * specific local address.  This info probably should've been saved in
-         * our socket data structure at setup time.
-         */
-        state->daddr_len = sizeof(state->daddr);
-        if (getsockname(state->port_fd, (struct sockaddr *)&state->daddr,
-                        &state->daddr_len) != 0)
-            state->daddr_len = 0;
-        /* On failure, keep going anyways. */
-    }
-
-    state->request.length = cc;
-    state->request.data = state->pktbuf;
-    state->faddr.address = &state->addr;
-    init_addr(&state->faddr, ss2sa(&state->saddr));
-    /* This address is in net order. */
-    dispatch(state->handle, ss2sa(&state->daddr), &state->faddr,
-             &state->request, 0, ctx, process_packet_response, state);
+    dispatch_packet(ctx, conn, state, cc);
 }
 
 static int
@@ -1895,6 +2180,9 @@ void
 loop_free(verto_ctx *ctx)
 {
     verto_free(ctx);
+#ifdef USE_MMSG
+    free_spare_states();
+#endif
     FREE_SET_DATA(events);
     FREE_SET_DATA(udp_port_data);
     FREE_SET_DATA(tcp_port_data);
@@ -162,6 +162,423 @@ static struct log_entry def_log_entry;
 #define DEVICE_CLOSE(d)         fclose(d)
 
 
+/*
+ * write_entry()        - Write a formatted message to one logging
+ *                        specification.  syslogp points to the message
+ *                        after its header.
+ */
+static void
+write_entry(struct log_entry *le, int priority, char *outbuf, char *syslogp)
+{
+    switch (le->log_type) {
+    case K_LOG_FILE:
+    case K_LOG_STDERR:
+        /*
+         * Files/standard error.
+         */
+        if (fprintf(le->lfu_filep, "%s\n", outbuf) < 0) {
+            /* Attempt to report error */
+            fprintf(stderr, log_file_err, log_control.log_whoami,
+                    le->lfu_fname);
+        }
+        else {
+            fflush(le->lfu_filep);
+        }
+        break;
+    case K_LOG_CONSOLE:
+    case K_LOG_DEVICE:
+        /*
+         * Devices (may need special handling)
+         */
+        if (DEVICE_PRINT(le->ldu_filep, outbuf) < 0) {
+            /* Attempt to report error */
+            fprintf(stderr, log_device_err, log_control.log_whoami,
+                    le->ldu_devname);
+        }
+        break;
+#ifdef  HAVE_SYSLOG
+    case K_LOG_SYSLOG:
+        /*
+         * System log.
+         */
+
+        /* Log the message with our header trimmed off */
+        syslog(priority, "%s", syslogp);
+        break;
+#endif /* HAVE_SYSLOG */
+    default:
+        break;
+    }
+}
+
+static char *
+klog_format(char *outbuf, size_t bufsize, int priority, const char *format,
+            va_list arglist)
+#if !defined(__cplusplus) && (__GNUC__ > 2)
+    __attribute__((__format__(__printf__, 4, 0)))
+#endif
+    ;
+
+#ifdef ENABLE_THREADS
+/*
+ * Queued output.
+ *
+ * If [logging]->queue_length is set, messages less severe than LOG_WARNING
+ * are formatted by the caller and copied into a bounded queue, and a
+ * background thread writes them out, using one writev() call per batch of
+ * messages for files.  A slow log file or system log daemon then delays the
+ * queue thread rather than the caller.  If the queue is full, the message is
+ * dropped and counted, unless [logging]->queue_overflow is "block", in which
+ * case the caller waits for room.  More severe messages are written directly
+ * once the queue has been written out, so that they are not lost if the
+ * process exits.  The queue is also written out before the process forks.
+ */
+#include <signal.h>
+#include <sys/uio.h>
+
+#ifdef USE_PTHREAD_LOCK_ONLY_IF_LOADED
+# pragma weak pthread_atfork
+# pragma weak pthread_cond_broadcast
+# pragma weak pthread_cond_destroy
+# pragma weak pthread_cond_init
+# pragma weak pthread_cond_signal
+# pragma weak pthread_cond_wait
+# pragma weak pthread_create
+# pragma weak pthread_join
+# pragma weak pthread_sigmask
+#endif
+
+#define LOG_BATCH       32
+
+struct log_rec {
+    int         priority;
+    size_t      len;
+    size_t      msgoff;         /* Offset of the message after its header */
+    char        buf[KRB5_KLOG_MAX_ERRMSG_SIZE];
+};
+
+struct log_queue {
+    pthread_mutex_t     lock;           /* Protects the queue fields */
+    pthread_cond_t      avail;          /* Messages have been queued */
+    pthread_cond_t      space;          /* Messages have been written */
+    pthread_mutex_t     write_lock;     /* Serializes output to the entries */
+    struct log_rec      *recs;
+    size_t              size;
+    size_t              head;
+    size_t              count;          /* Including those being written */
+    krb5_boolean        block;
+    krb5_boolean        started;
+    krb5_boolean        stopping;
+    unsigned long       dropped;
+    unsigned long       reported;
+    pthread_t           thread;
+};
+
+static struct log_queue *log_queue;
+static krb5_boolean atfork_registered;
+
+/* Write n queued messages to each logging specification. */
+static void
+write_batch(struct log_rec *recs, size_t n)
+{
+    struct iovec        iov[LOG_BATCH * 2];
+    struct log_entry    *le;
+    ssize_t             total;
+    size_t              i;
+    int                 lindex;
+
+    for (lindex = 0; lindex < log_control.log_nentries; lindex++) {
+        le = &log_control.log_entries[lindex];
+        if (le->log_type != K_LOG_FILE && le->log_type != K_LOG_STDERR) {
+            for (i = 0; i < n; i++) {
+                write_entry(le, recs[i].priority, recs[i].buf,
+                            recs[i].buf + recs[i].msgoff);
+            }
+            continue;
+        }
+        total = 0;
+        for (i = 0; i < n; i++) {
+            iov[i * 2].iov_base = recs[i].buf;
+            iov[i * 2].iov_len = recs[i].len;
+            iov[i * 2 + 1].iov_base = (char *)"\n";
+            iov[i * 2 + 1].iov_len = 1;
+            total += recs[i].len + 1;
+        }
+        if (writev(fileno(le->lfu_filep), iov, n * 2) != total) {
+            fprintf(stderr, log_file_err, log_control.log_whoami,
+                    le->lfu_fname);
+        }
+    }
+}
+
+/* Format a message directly into a queue record. */
+static void
+format_rec(struct log_rec *rec, int priority, const char *format, ...)
+#if !defined(__cplusplus) && (__GNUC__ > 2)
+    __attribute__((__format__(__printf__, 3, 4)))
+#endif
+    ;
+
+static void
+format_rec(struct log_rec *rec, int priority, const char *format, ...)
+{
+    va_list     ap;
+    char        *syslogp;
+
+    va_start(ap, format);
+    syslogp = klog_format(rec->buf, sizeof(rec->buf), priority, format, ap);
+    va_end(ap);
+    rec->priority = priority;
+    rec->len = (syslogp == NULL) ? 0 : strlen(rec->buf);
+    rec->msgoff = (syslogp == NULL) ? 0 : syslogp - rec->buf;
+}
+
+/* Write out queued messages until the queue is stopped. */
+static void *
+queue_main(void *arg)
+{
+    struct log_queue    *q = arg;
+    struct log_rec      note;
+    unsigned long       dropped;
+    size_t              n;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (q->count == 0 && !q->stopping)
+            pthread_cond_wait(&q->avail, &q->lock);
+        if (q->count == 0)
+            break;
+
+        /* Write the oldest messages, up to the end of the ring.  Callers
+         * leave them alone until count is reduced. */
+        n = q->count;
+        if (n > LOG_BATCH)
+            n = LOG_BATCH;
+        if (n > q->size - q->head)
+            n = q->size - q->head;
+        dropped = q->dropped - q->reported;
+        q->reported = q->dropped;
+        pthread_mutex_unlock(&q->lock);
+
+        pthread_mutex_lock(&q->write_lock);
+        if (dropped > 0) {
+            format_rec(&note, LOG_WARNING,
+                       _("%lu log messages dropped because the log queue "
+                         "was full"), dropped);
+            if (note.len > 0)
+                write_batch(&note, 1);
+        }
+        write_batch(&q->recs[q->head], n);
+        pthread_mutex_unlock(&q->write_lock);
+
+        pthread_mutex_lock(&q->lock);
+        q->head = (q->head + n) % q->size;
+        q->count -= n;
+        pthread_cond_broadcast(&q->space);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+/* Wait for queued messages to be written out.  q->lock must be held. */
+static void
+wait_for_queue(struct log_queue *q)
+{
+    while (q->count > 0 && q->started)
+        pthread_cond_wait(&q->space, &q->lock);
+}
+
+/*
+ * Write out queued messages before forking, so that they are neither lost
+ * (daemon() exits the parent immediately) nor written twice.  The child
+ * starts a new queue thread when it next needs one.
+ */
+static void
+queue_fork_prepare(void)
+{
+    struct log_queue *q = log_queue;
+
+    if (q == NULL)
+        return;
+    pthread_mutex_lock(&q->lock);
+    wait_for_queue(q);
+    pthread_mutex_unlock(&q->lock);
+    pthread_mutex_lock(&q->write_lock);
+    pthread_mutex_lock(&q->lock);
+}
+
+static void
+queue_fork_parent(void)
+{
+    struct log_queue *q = log_queue;
+
+    if (q == NULL)
+        return;
+    pthread_mutex_unlock(&q->lock);
+    pthread_mutex_unlock(&q->write_lock);
+}
+
+static void
+queue_fork_child(void)
+{
+    struct log_queue *q = log_queue;
+
+    if (q == NULL)
+        return;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_mutex_init(&q->write_lock, NULL);
+    pthread_cond_init(&q->avail, NULL);
+    pthread_cond_init(&q->space, NULL);
+    q->head = q->count = 0;
+    q->started = FALSE;
+}
+
+/* Create the message queue if [logging]->queue_length is set. */
+static void
+init_queue(krb5_context kcontext)
+{
+    struct log_queue    *q;
+    char                *overflow;
+    int                 length;
+
+    if (!K5_PTHREADS_LOADED)
+        return;
+    if (profile_get_integer(kcontext->profile, KRB5_CONF_LOGGING,
+                            KRB5_CONF_QUEUE_LENGTH, NULL, 0, &length) ||
+        length <= 0)
+        return;
+    if (!atfork_registered) {
+        if (pthread_atfork(queue_fork_prepare, queue_fork_parent,
+                           queue_fork_child) != 0)
+            return;
+        atfork_registered = TRUE;
+    }
+
+    q = calloc(1, sizeof(*q));
+    if (q == NULL)
+        return;
+    q->recs = calloc(length, sizeof(*q->recs));
+    if (q->recs == NULL) {
+        free(q);
+        return;
+    }
+    q->size = length;
+    if (!profile_get_string(kcontext->profile, KRB5_CONF_LOGGING,
+                            KRB5_CONF_QUEUE_OVERFLOW, NULL, "drop",
+                            &overflow)) {
+        q->block = (strcasecmp(overflow, "block") == 0);
+        profile_release_string(overflow);
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_mutex_init(&q->write_lock, NULL);
+    pthread_cond_init(&q->avail, NULL);
+    pthread_cond_init(&q->space, NULL);
+    log_queue = q;
+}
+
+/* Write out queued messages and free the message queue. */
+static void
+fini_queue(void)
+{
+    struct log_queue *q = log_queue;
+
+    if (q == NULL)
+        return;
+    pthread_mutex_lock(&q->lock);
+    q->stopping = TRUE;
+    pthread_cond_signal(&q->avail);
+    pthread_mutex_unlock(&q->lock);
+    if (q->started)
+        pthread_join(q->thread, NULL);
+    pthread_mutex_destroy(&q->lock);
+    pthread_mutex_destroy(&q->write_lock);
+    pthread_cond_destroy(&q->avail);
+    pthread_cond_destroy(&q->space);
+    free(q->recs);
+    free(q);
+    log_queue = NULL;
+}
+
+/*
+ * Queue a formatted message for the queue thread, starting the thread if
+ * necessary.  Returns false if the caller should write the message itself.
+ */
+static krb5_boolean
+queue_message(int priority, char *outbuf, char *syslogp)
+{
+    struct log_queue    *q = log_queue;
+    struct log_rec      *rec;
+    sigset_t            all, old;
+    int                 ret;
+
+    if (q == NULL || (priority & LOG_PRIMASK) <= LOG_WARNING)
+        return FALSE;
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->started) {
+        /* Leave signal handling to the other threads. */
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        ret = pthread_create(&q->thread, NULL, queue_main, q);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (ret) {
+            pthread_mutex_unlock(&q->lock);
+            return FALSE;
+        }
+        q->started = TRUE;
+    }
+    while (q->block && q->count == q->size)
+        pthread_cond_wait(&q->space, &q->lock);
+    if (q->count == q->size) {
+        q->dropped++;
+        pthread_mutex_unlock(&q->lock);
+        return TRUE;
+    }
+    rec = &q->recs[(q->head + q->count) % q->size];
+    rec->priority = priority;
+    rec->len = strlen(outbuf);
+    rec->msgoff = syslogp - outbuf;
+    memcpy(rec->buf, outbuf, rec->len + 1);
+    if (q->count++ == 0)
+        pthread_cond_signal(&q->avail);
+    pthread_mutex_unlock(&q->lock);
+    return TRUE;
+}
+
+/*
+ * Wait for queued messages to be written out, and keep the queue thread from
+ * writing while the caller writes to the logging specifications directly.
+ */
+static void
+lock_output(void)
+{
+    struct log_queue *q = log_queue;
+
+    if (q == NULL)
+        return;
+    pthread_mutex_lock(&q->lock);
+    wait_for_queue(q);
+    pthread_mutex_unlock(&q->lock);
+    pthread_mutex_lock(&q->write_lock);
+}
+
+static void
+unlock_output(void)
+{
+    if (log_queue != NULL)
+        pthread_mutex_unlock(&log_queue->write_lock);
+}
+
+#else /* ENABLE_THREADS */
+
+#define init_queue(kcontext)
+#define fini_queue()
+#define queue_message(priority, outbuf, syslogp) FALSE
+#define lock_output()
+#define unlock_output()
+
+#endif /* ENABLE_THREADS */
+
 /*
  * klog_com_err_proc()  - Handle com_err(3) messages as specified by the
  *                        profile.
@@ -273,6 +690,7 @@ klog_com_err_proc(const char *whoami, long int code, const char *format, va_list
      * Now that we have the message formatted, perform the output to each
      * logging specification.
      */
+    lock_output();
     for (lindex = 0; lindex < log_control.log_nentries; lindex++) {
         switch (log_control.log_entries[lindex].log_type) {
         case K_LOG_FILE:
@@ -325,6 +743,7 @@ klog_com_err_proc(const char *whoami, long int code, const char *format, va_list
             break;
         }
     }
+    unlock_output();
 }
 
 /*
@@ -683,6 +1102,7 @@ krb5_klog_init(krb5_context kcontext, char *ename, char *whoami, krb5_boolean do
 #endif /* HAVE_OPENLOG */
         if (do_com_err)
             (void) set_com_err_hook(klog_com_err_proc);
+        init_queue(kcontext);
     }
     return((log_control.log_nentries) ? 0 : ENOENT);
 }
@@ -695,6 +1115,7 @@ krb5_klog_close(krb5_context kcontext)
 {
     int lindex;
     (void) reset_com_err_hook();
+    fini_queue();
     for (lindex = 0; lindex < log_control.log_nentries; lindex++) {
         switch (log_control.log_entries[lindex].log_type) {
         case K_LOG_FILE:
@@ -795,22 +1216,14 @@ severity2string(int severity)
 }
 
 /*
- * krb5_klog_syslog()   - Simulate the calling sequence of syslog(3), while
- *                        also performing the logging redirection as specified
- *                        by krb5_klog_init().
+ * klog_format()        - Format a syslog-esque message into outbuf.  Returns
+ *                        a pointer to the message after its header, or NULL
+ *                        on failure.
  */
-static int
-klog_vsyslog(int priority, const char *format, va_list arglist)
-#if !defined(__cplusplus) && (__GNUC__ > 2)
-    __attribute__((__format__(__printf__, 2, 0)))
-#endif
-    ;
-
-static int
-klog_vsyslog(int priority, const char *format, va_list arglist)
+static char *
+klog_format(char *outbuf, size_t bufsize, int priority, const char *format,
+            va_list arglist)
 {
-    char        outbuf[KRB5_KLOG_MAX_ERRMSG_SIZE];
-    int         lindex;
     char        *syslogp;
     char        *cp;
     time_t      now;
@@ -833,11 +1246,11 @@ klog_vsyslog(int priority, const char *format, va_list arglist)
     /*
      * Format the date: mon dd hh:mm:ss
      */
-    soff = strftime(outbuf, sizeof(outbuf), "%b %d %H:%M:%S", localtime(&now));
+    soff = strftime(outbuf, bufsize, "%b %d %H:%M:%S", localtime(&now));
     if (soff > 0)
         cp += soff;
     else
-        return(-1);
+        return(NULL);
 #else   /* HAVE_STRFTIME */
     /*
      * Format the date:
@@ -849,18 +1262,43 @@ klog_vsyslog(int priority, const char *format, va_list arglist)
     cp += 15;
 #endif  /* HAVE_STRFTIME */
 #ifdef VERBOSE_LOGS
-    snprintf(cp, sizeof(outbuf) - (cp-outbuf), " %s %s[%ld](%s): ",
+    snprintf(cp, bufsize - (cp-outbuf), " %s %s[%ld](%s): ",
              log_control.log_hostname ? log_control.log_hostname : "",
              log_control.log_whoami ? log_control.log_whoami : "",
              (long) getpid(),
              severity2string(priority));
 #else
-    snprintf(cp, sizeof(outbuf) - (cp-outbuf), " ");
+    snprintf(cp, bufsize - (cp-outbuf), " ");
 #endif
     syslogp = &outbuf[strlen(outbuf)];
 
     /* Now format the actual message */
-    vsnprintf(syslogp, sizeof(outbuf) - (syslogp - outbuf), format, arglist);
+    vsnprintf(syslogp, bufsize - (syslogp - outbuf), format, arglist);
+    return(syslogp);
+}
+
+/*
+ * krb5_klog_syslog()   - Simulate the calling sequence of syslog(3), while
+ *                        also performing the logging redirection as specified
+ *                        by krb5_klog_init().
+ */
+static int
+klog_vsyslog(int priority, const char *format, va_list arglist)
+#if !defined(__cplusplus) && (__GNUC__ > 2)
+    __attribute__((__format__(__printf__, 2, 0)))
+#endif
+    ;
+
+static int
+klog_vsyslog(int priority, const char *format, va_list arglist)
+{
+    char        outbuf[KRB5_KLOG_MAX_ERRMSG_SIZE];
+    int         lindex;
+    char        *syslogp;
+
+    syslogp = klog_format(outbuf, sizeof(outbuf), priority, format, arglist);
+    if (syslogp == NULL)
+        return(-1);
 
     /*
      * If the user did not use krb5_klog_init() instead of dropping
@@ -873,53 +1311,20 @@ klog_vsyslog(int priority, const char *format, va_list arglist)
     }
 #endif
 
+    /* Leave routine messages to the queue thread, if there is one. */
+    if (queue_message(priority, outbuf, syslogp))
+        return(0);
+
     /*
      * Now that we have the message formatted, perform the output to each
      * logging specification.
      */
+    lock_output();
     for (lindex = 0; lindex < log_control.log_nentries; lindex++) {
-        switch (log_control.log_entries[lindex].log_type) {
-        case K_LOG_FILE:
-        case K_LOG_STDERR:
-            /*
-             * Files/standard error.
-             */
-            if (fprintf(log_control.log_entries[lindex].lfu_filep, "%s\n",
-                        outbuf) < 0) {
-                /* Attempt to report error */
-                fprintf(stderr, log_file_err, log_control.log_whoami,
-                        log_control.log_entries[lindex].lfu_fname);
-            }
-            else {
-                fflush(log_control.log_entries[lindex].lfu_filep);
-            }
-            break;
-        case K_LOG_CONSOLE:
-        case K_LOG_DEVICE:
-            /*
-             * Devices (may need special handling)
-             */
-            if (DEVICE_PRINT(log_control.log_entries[lindex].ldu_filep,
-                             outbuf) < 0) {
-                /* Attempt to report error */
-                fprintf(stderr, log_device_err, log_control.log_whoami,
-                        log_control.log_entries[lindex].ldu_devname);
-            }
-            break;
-#ifdef  HAVE_SYSLOG
-        case K_LOG_SYSLOG:
-            /*
-             * System log.
-             */
-
-            /* Log the message with our header trimmed off */
-            syslog(priority, "%s", syslogp);
-            break;
-#endif /* HAVE_SYSLOG */
-        default:
-            break;
-        }
+        write_entry(&log_control.log_entries[lindex], priority, outbuf,
+                    syslogp);
     }
+    unlock_output();
     return(0);
 }
 
@@ -952,6 +1357,7 @@ krb5_klog_reopen(krb5_context kcontext)
      * Only logs which are actually files need to be closed
      * and reopened in response to a SIGHUP
      */
+    lock_output();
     for (lindex = 0; lindex < log_control.log_nentries; lindex++) {
         if (log_control.log_entries[lindex].log_type == K_LOG_FILE) {
             fclose(log_control.log_entries[lindex].lfu_filep);
@@ -970,4 +1376,5 @@ krb5_klog_reopen(krb5_context kcontext)
             }
         }
     }
+    unlock_output();
 }
@@ -40,6 +40,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <k5-int.h>
+#include <k5-queue.h>
 #include <osconf.h>
 #include "kdb5.h"
 #include "kdb_log.h"
@@ -549,6 +550,23 @@ clean_n_exit:
     return status;
 }
 
+/* Load the database module lib_name on behalf of another module which keeps
+ * its data in it.  Release the result with krb5int_db_unload_module(). */
+krb5_error_code
+krb5int_db_load_module(krb5_context kcontext, const char *lib_name,
+                       db_library *lib_out)
+{
+    *lib_out = NULL;
+    return kdb_find_library(kcontext, (char *)lib_name, lib_out);
+}
+
+void
+krb5int_db_unload_module(db_library lib)
+{
+    if (lib != NULL)
+        (void)kdb_free_library(lib);
+}
+
 krb5_error_code
 krb5_db_setup_lib_handle(krb5_context kcontext)
 {
@@ -588,11 +606,14 @@ clean_n_exit:
     return status;
 }
 
+static void princ_cache_free(krb5_context kcontext);
+
 static krb5_error_code
 kdb_free_lib_handle(krb5_context kcontext)
 {
     krb5_error_code status = 0;
 
+    princ_cache_free(kcontext);
     status = kdb_free_library(kcontext->dal_handle->lib_handle);
     if (status)
         return status;
@@ -619,6 +640,349 @@ get_vftabl(krb5_context kcontext, kdb_vftabl **vftabl_ptr)
     return 0;
 }
 
+/*
+ * Principal entry cache.  When the KDC opens the database, it keeps copies of
+ * the most recently used principal entries, so that lookups of hot principals
+ * such as krbtgt/REALM do not need to go to the database module and decode
+ * the entry each time.  The cache is discarded whenever the database's age
+ * (as reported by the module's get_age method) or the update log serial
+ * number changes, so modules which cannot report their age are never cached.
+ */
+
+#define PRINC_CACHE_DEFAULT_SIZE 1000
+
+struct princ_cache_ent {
+    LIST_ENTRY(princ_cache_ent) hash_links;
+    TAILQ_ENTRY(princ_cache_ent) lru_links;
+    krb5_ui_4 hash;
+    unsigned int flags;
+    krb5_db_entry *entry;
+};
+
+LIST_HEAD(princ_cache_bucket, princ_cache_ent);
+TAILQ_HEAD(princ_cache_lru, princ_cache_ent);
+
+struct princ_cache {
+    size_t max_entries;
+    size_t num_entries;
+    size_t nbuckets;
+    struct princ_cache_bucket *buckets;
+    struct princ_cache_lru lru;         /* Most recently used first */
+    krb5_boolean have_generation;
+    time_t age;
+    kdb_sno_t sno;
+};
+
+void
+krb5int_free_db_entry(krb5_db_entry *entry)
+{
+    krb5_tl_data *tl, *tl_next;
+    int i, j;
+
+    if (entry == NULL)
+        return;
+    if (entry->mask & KRB5_KDB_ENTRY_SINGLE_BLOCK) {
+        for (i = 0; i < entry->n_key_data; i++) {
+            for (j = 0; j < entry->key_data[i].key_data_ver; j++) {
+                zap(entry->key_data[i].key_data_contents[j],
+                    entry->key_data[i].key_data_length[j]);
+            }
+        }
+        free(entry);
+        return;
+    }
+    free(entry->e_data);
+    krb5_free_principal(NULL, entry->princ);
+    for (tl = entry->tl_data; tl != NULL; tl = tl_next) {
+        tl_next = tl->tl_data_next;
+        free(tl->tl_data_contents);
+        free(tl);
+    }
+    for (i = 0; i < entry->n_key_data && entry->key_data != NULL; i++) {
+        for (j = 0; j < entry->key_data[i].key_data_ver; j++) {
+            zapfree(entry->key_data[i].key_data_contents[j],
+                    entry->key_data[i].key_data_length[j]);
+        }
+    }
+    free(entry->key_data);
+    free(entry);
+}
+
+/* Make a deep copy of a principal entry, allocated the same way as the
+ * database modules allocate entries. */
+krb5_error_code
+krb5int_copy_db_entry(krb5_context kcontext, const krb5_db_entry *in,
+                      krb5_db_entry **out)
+{
+    krb5_error_code ret;
+    krb5_db_entry *entry;
+    krb5_tl_data *tl, **tlp;
+    krb5_key_data *kd;
+    int i, j;
+
+    *out = NULL;
+    entry = k5alloc(sizeof(*entry), &ret);
+    if (entry == NULL)
+        return ret;
+    *entry = *in;
+    entry->mask &= ~KRB5_KDB_ENTRY_SINGLE_BLOCK;
+    entry->e_data = NULL;
+    entry->princ = NULL;
+    entry->tl_data = NULL;
+    entry->key_data = NULL;
+    entry->n_key_data = 0;
+
+    if (in->e_length > 0 && in->e_data != NULL) {
+        entry->e_data = k5alloc(in->e_length, &ret);
+        if (entry->e_data == NULL)
+            goto error;
+        memcpy(entry->e_data, in->e_data, in->e_length);
+    }
+    ret = krb5_copy_principal(kcontext, in->princ, &entry->princ);
+    if (ret)
+        goto error;
+
+    tlp = &entry->tl_data;
+    for (tl = in->tl_data; tl != NULL; tl = tl->tl_data_next) {
+        *tlp = k5alloc(sizeof(**tlp), &ret);
+        if (*tlp == NULL)
+            goto error;
+        (*tlp)->tl_data_type = tl->tl_data_type;
+        (*tlp)->tl_data_length = tl->tl_data_length;
+        if (tl->tl_data_length > 0) {
+            (*tlp)->tl_data_contents = k5alloc(tl->tl_data_length, &ret);
+            if ((*tlp)->tl_data_contents == NULL)
+                goto error;
+            memcpy((*tlp)->tl_data_contents, tl->tl_data_contents,
+                   tl->tl_data_length);
+        }
+        tlp = &(*tlp)->tl_data_next;
+    }
+
+    if (in->n_key_data > 0) {
+        entry->key_data = k5alloc(in->n_key_data * sizeof(*kd), &ret);
+        if (entry->key_data == NULL)
+            goto error;
+        for (i = 0; i < in->n_key_data; i++) {
+            kd = &entry->key_data[i];
+            *kd = in->key_data[i];
+            entry->n_key_data++;
+            for (j = 0; j < kd->key_data_ver; j++) {
+                kd->key_data_contents[j] = NULL;
+                if (kd->key_data_length[j] == 0)
+                    continue;
+                kd->key_data_contents[j] = k5alloc(kd->key_data_length[j],
+                                                   &ret);
+                if (kd->key_data_contents[j] == NULL) {
+                    kd->key_data_length[j] = 0;
+                    goto error;
+                }
+                memcpy(kd->key_data_contents[j],
+                       in->key_data[i].key_data_contents[j],
+                       kd->key_data_length[j]);
+            }
+        }
+    }
+
+    *out = entry;
+    return 0;
+
+error:
+    krb5int_free_db_entry(entry);
+    return ret;
+}
+
+/* Return a hash of the realm and components of princ. */
+static krb5_ui_4
+princ_hash(krb5_const_principal princ)
+{
+    krb5_ui_4 h = 2166136261U;
+    const unsigned char *p, *end;
+    krb5_int32 i;
+
+    /* FNV-1a over each component, with a separator between components. */
+    for (i = -1; i < princ->length; i++) {
+        const krb5_data *d = (i < 0) ? &princ->realm : &princ->data[i];
+
+        end = (unsigned char *)d->data + d->length;
+        for (p = (unsigned char *)d->data; p < end; p++)
+            h = (h ^ *p) * 16777619U;
+        h = (h ^ 0xff) * 16777619U;
+    }
+    return h;
+}
+
+static void
+princ_cache_discard(struct princ_cache *cache, struct princ_cache_ent *ent)
+{
+    LIST_REMOVE(ent, hash_links);
+    TAILQ_REMOVE(&cache->lru, ent, lru_links);
+    krb5int_free_db_entry(ent->entry);
+    free(ent);
+    cache->num_entries--;
+}
+
+/* Discard all entries in the principal cache, if there is one. */
+static void
+princ_cache_flush(krb5_context kcontext)
+{
+    struct princ_cache *cache = kcontext->dal_handle->princ_cache;
+    struct princ_cache_ent *ent, *next;
+
+    if (cache == NULL)
+        return;
+    TAILQ_FOREACH_SAFE(ent, &cache->lru, lru_links, next)
+        princ_cache_discard(cache, ent);
+    cache->have_generation = FALSE;
+}
+
+static void
+princ_cache_free(krb5_context kcontext)
+{
+    struct princ_cache *cache = kcontext->dal_handle->princ_cache;
+
+    if (cache == NULL)
+        return;
+    princ_cache_flush(kcontext);
+    free(cache->buckets);
+    free(cache);
+    kcontext->dal_handle->princ_cache = NULL;
+}
+
+/* Create a principal cache for kcontext if one is configured and the module
+ * can tell us when the database changes. */
+static krb5_error_code
+princ_cache_init(krb5_context kcontext, const char *section)
+{
+    krb5_error_code ret;
+    struct princ_cache *cache;
+    kdb_vftabl *v = &kcontext->dal_handle->lib_handle->vftabl;
+    size_t i;
+    int size;
+    time_t age;
+
+    /* Modules whose age is not a real generation counter (such as LDAP,
+     * whose get_age method fails) would serve stale entries. */
+    if (v->get_age == NULL || v->get_age(kcontext, NULL, &age) != 0 ||
+        age == (time_t)-1)
+        return 0;
+    ret = profile_get_integer(kcontext->profile, KDB_MODULE_SECTION, section,
+                              KRB5_CONF_PRINCIPAL_CACHE_SIZE,
+                              PRINC_CACHE_DEFAULT_SIZE, &size);
+    if (ret || size <= 0)
+        return ret;
+
+    cache = k5alloc(sizeof(*cache), &ret);
+    if (cache == NULL)
+        return ret;
+    cache->max_entries = size;
+    cache->nbuckets = size;
+    cache->buckets = k5alloc(cache->nbuckets * sizeof(*cache->buckets), &ret);
+    if (cache->buckets == NULL) {
+        free(cache);
+        return ret;
+    }
+    for (i = 0; i < cache->nbuckets; i++)
+        LIST_INIT(&cache->buckets[i]);
+    TAILQ_INIT(&cache->lru);
+    kcontext->dal_handle->princ_cache = cache;
+    return 0;
+}
+
+/*
+ * Discard the cache contents if the database has changed since they were
+ * read.  Return false if the database's generation cannot be determined, in
+ * which case the cache should not be used.
+ */
+static krb5_boolean
+princ_cache_validate(krb5_context kcontext, struct princ_cache *cache)
+{
+    kdb_vftabl *v = &kcontext->dal_handle->lib_handle->vftabl;
+    kdb_log_context *log_ctx = kcontext->kdblog_context;
+    kdb_sno_t sno = 0;
+    time_t age;
+
+    if (v->get_age(kcontext, NULL, &age) != 0 || age == (time_t)-1) {
+        princ_cache_flush(kcontext);
+        return FALSE;
+    }
+    if (log_ctx != NULL && log_ctx->ulog != NULL)
+        sno = log_ctx->ulog->kdb_last_sno;
+    if (cache->have_generation && (age != cache->age || sno != cache->sno))
+        princ_cache_flush(kcontext);
+    cache->age = age;
+    cache->sno = sno;
+    cache->have_generation = TRUE;
+    return TRUE;
+}
+
+static struct princ_cache_ent *
+princ_cache_find(krb5_context kcontext, struct princ_cache *cache,
+                 krb5_const_principal princ, krb5_ui_4 hash,
+                 unsigned int flags)
+{
+    struct princ_cache_ent *ent;
+
+    LIST_FOREACH(ent, &cache->buckets[hash % cache->nbuckets], hash_links) {
+        if (ent->hash == hash && ent->flags == flags &&
+            krb5_principal_compare(kcontext, ent->entry->princ, princ))
+            return ent;
+    }
+    return NULL;
+}
+
+/* Discard any cached entries for princ, whatever flags they were looked up
+ * with. */
+static void
+princ_cache_forget(krb5_context kcontext, krb5_const_principal princ)
+{
+    struct princ_cache *cache = kcontext->dal_handle->princ_cache;
+    struct princ_cache_ent *ent, *next;
+    krb5_ui_4 hash;
+
+    if (cache == NULL || princ == NULL)
+        return;
+    hash = princ_hash(princ);
+    LIST_FOREACH_SAFE(ent, &cache->buckets[hash % cache->nbuckets],
+                      hash_links, next) {
+        if (ent->hash == hash &&
+            krb5_principal_compare(kcontext, ent->entry->princ, princ))
+            princ_cache_discard(cache, ent);
+    }
+}
+
+/* Add a copy of entry to the cache, evicting the least recently used entry if
+ * the cache is full.  Failure is not an error. */
+static void
+princ_cache_add(krb5_context kcontext, struct princ_cache *cache,
+                krb5_const_principal search_for, krb5_ui_4 hash,
+                unsigned int flags, krb5_db_entry *entry)
+{
+    struct princ_cache_ent *ent;
+    krb5_db_entry *copy;
+
+    /* Only cache entries found under the name they were looked up by, so
+     * that a hit returns exactly what the module would have. */
+    if (!krb5_principal_compare(kcontext, entry->princ, search_for))
+        return;
+    if (krb5int_copy_db_entry(kcontext, entry, &copy) != 0)
+        return;
+    ent = malloc(sizeof(*ent));
+    if (ent == NULL) {
+        krb5int_free_db_entry(copy);
+        return;
+    }
+    ent->hash = hash;
+    ent->flags = flags;
+    ent->entry = copy;
+    if (cache->num_entries >= cache->max_entries)
+        princ_cache_discard(cache, TAILQ_LAST(&cache->lru, princ_cache_lru));
+    LIST_INSERT_HEAD(&cache->buckets[hash % cache->nbuckets], ent,
+                     hash_links);
+    TAILQ_INSERT_HEAD(&cache->lru, ent, lru_links);
+    cache->num_entries++;
+}
+
 /*
  *      External functions... DAL API
  */
@@ -636,6 +1000,11 @@ krb5_db_open(krb5_context kcontext, char **db_args, int mode)
     if (status)
         return status;
     status = v->init_module(kcontext, section, db_args, mode);
+    if (status == 0 && (mode & KRB5_KDB_SRV_TYPE_KDC)) {
+        status = princ_cache_init(kcontext, section);
+        if (status)
+            (void)v->fini_module(kcontext);
+    }
     free(section);
     return status;
 }
@@ -754,6 +1123,9 @@ krb5_db_get_principal(krb5_context kcontext, krb5_const_principal search_for,
 {
     krb5_error_code status = 0;
     kdb_vftabl *v;
+    struct princ_cache *cache;
+    struct princ_cache_ent *ent;
+    krb5_ui_4 hash = 0;
 
     *entry = NULL;
     status = get_vftabl(kcontext, &v);
@@ -761,7 +1133,24 @@ krb5_db_get_principal(krb5_context kcontext, krb5_const_principal search_for,
         return status;
     if (v->get_principal == NULL)
         return KRB5_PLUGIN_OP_NOTSUPP;
-    return v->get_principal(kcontext, search_for, flags, entry);
+
+    cache = kcontext->dal_handle->princ_cache;
+    if (cache != NULL && !princ_cache_validate(kcontext, cache))
+        cache = NULL;
+    if (cache != NULL) {
+        hash = princ_hash(search_for);
+        ent = princ_cache_find(kcontext, cache, search_for, hash, flags);
+        if (ent != NULL) {
+            TAILQ_REMOVE(&cache->lru, ent, lru_links);
+            TAILQ_INSERT_HEAD(&cache->lru, ent, lru_links);
+            return krb5int_copy_db_entry(kcontext, ent->entry, entry);
+        }
+    }
+
+    status = v->get_principal(kcontext, search_for, flags, entry);
+    if (status == 0 && cache != NULL)
+        princ_cache_add(kcontext, cache, search_for, hash, flags, *entry);
+    return status;
 }
 
 void
@@ -872,6 +1261,7 @@ krb5int_put_principal_no_log(krb5_context kcontext, krb5_db_entry *entry)
                                           &db_args);
     if (status)
         return status;
+    princ_cache_flush(kcontext);
     status = v->put_principal(kcontext, entry, db_args);
     free_db_args(kcontext, db_args);
     return status;
@@ -922,6 +1312,7 @@ krb5_db_put_principal(krb5_context kcontext, krb5_db_entry *entry)
             goto cleanup;
     }
 
+    princ_cache_flush(kcontext);
     status = v->put_principal(kcontext, entry, db_args);
     if (status == 0 && ulog_locked)
         (void) ulog_finish_update(kcontext, upd);
@@ -946,6 +1337,7 @@ krb5int_delete_principal_no_log(krb5_context kcontext,
         return status;
     if (v->delete_principal == NULL)
         return KRB5_PLUGIN_OP_NOTSUPP;
+    princ_cache_flush(kcontext);
     return v->delete_principal(kcontext, search_for);
 }
 
@@ -984,6 +1376,7 @@ krb5_db_delete_principal(krb5_context kcontext, krb5_principal search_for)
             goto cleanup;
     }
 
+    princ_cache_flush(kcontext);
     status = v->delete_principal(kcontext, search_for);
     if (status == 0 && ulog_locked)
         (void) ulog_finish_update(kcontext, &upd);
@@ -2438,6 +2831,7 @@ krb5_db_promote(krb5_context kcontext, char **db_args)
     status = get_conf_section(kcontext, &section);
     if (status)
         return status;
+    princ_cache_flush(kcontext);
     status = v->promote_db(kcontext, section, db_args);
     free(section);
     return status;
@@ -2618,6 +3012,11 @@ krb5_db_audit_as_req(krb5_context kcontext, krb5_kdc_req *request,
     if (status || v->audit_as_req == NULL)
         return;
     v->audit_as_req(kcontext, request, client, server, authtime, error_code);
+
+    /* The module may have updated the client's lockout attributes without
+     * changing the database age, so don't serve the cached entry again. */
+    if (client != NULL)
+        princ_cache_forget(kcontext, client->princ);
 }
 
 void
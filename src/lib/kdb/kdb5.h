@@ -32,7 +32,49 @@ struct _kdb5_dal_handle
     db_library lib_handle;
     krb5_keylist_node *master_keylist;
     krb5_principal master_princ;
+    struct princ_cache *princ_cache;
 };
 /* typedef kdb5_dal_handle is in k5-int.h now */
 
+/* For database modules which keep their data in another module. */
+krb5_error_code
+krb5int_db_load_module(krb5_context kcontext, const char *lib_name,
+                       db_library *lib_out);
+
+void
+krb5int_db_unload_module(db_library lib);
+
+krb5_error_code
+krb5int_copy_db_entry(krb5_context kcontext, const krb5_db_entry *in,
+                      krb5_db_entry **out);
+
+void
+krb5int_free_db_entry(krb5_db_entry *entry);
+
+/* Set in the mask of an entry read from a compiled database file, which is
+ * allocated as a single block. */
+#define KRB5_KDB_ENTRY_SINGLE_BLOCK 0x80000000
+
+/* A mapped compiled database file; see kdb_compiled.c. */
+struct krb5int_compiled_db {
+    const unsigned char *map;
+    size_t len;
+    krb5_ui_4 count;
+    time_t age;                 /* Age of the database when compiled */
+    const unsigned char *index;
+    dev_t dev;
+    ino_t ino;
+};
+
+krb5_error_code
+krb5int_compiled_db_open(const char *filename,
+                         struct krb5int_compiled_db **out);
+
+void
+krb5int_compiled_db_close(struct krb5int_compiled_db *cdb);
+
+krb5_error_code
+krb5int_compiled_db_get(struct krb5int_compiled_db *cdb, const char *name,
+                        size_t namelen, krb5_db_entry **entry_out);
+
 #endif  /* end of _KRB5_KDB5_H_ */
@@ -0,0 +1,654 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/kdb/kdb_compiled.c - Compiled read-only principal database files */
+/*
+ * Copyright (C) 2014 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A compiled database file holds all of the principal entries of a database
+ * in a form which can be mapped into memory and searched in place.  All
+ * integers are big-endian.  The file begins with a 32-byte header:
+ *
+ *   bytes 0-7    magic "KDBCMP01"
+ *   bytes 8-11   number of entries
+ *   bytes 12-15  reserved (zero)
+ *   bytes 16-23  age of the database when it was compiled
+ *   bytes 24-31  offset of the index
+ *
+ * Each entry record begins with its key, the unparsed principal name, as a
+ * four-byte length followed by the name.  Then come the fixed-size entry
+ * fields, the principal name components, the tl-data list, and the key data,
+ * each variable-length field preceded by its length.  The index is an array
+ * of eight-byte record offsets sorted by key, so a lookup is a binary search
+ * of the index followed by a copy of one record into a single allocation.
+ */
+
+#include "k5-int.h"
+#include "kdb5.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CDB_MAGIC "KDBCMP01"
+#define CDB_HEADER_LEN 32
+
+struct index_ent {
+    char *key;
+    size_t keylen;
+    krb5_ui_8 offset;
+};
+
+struct compile_state {
+    krb5_context context;
+    FILE *fp;
+    krb5_ui_8 offset;
+    struct k5buf buf;
+    struct index_ent *index;
+    size_t count;
+    size_t space;
+};
+
+static void
+put16(struct k5buf *buf, unsigned int val)
+{
+    unsigned char b[2];
+
+    store_16_be(val, b);
+    k5_buf_add_len(buf, (char *)b, 2);
+}
+
+static void
+put32(struct k5buf *buf, krb5_ui_4 val)
+{
+    unsigned char b[4];
+
+    store_32_be(val, b);
+    k5_buf_add_len(buf, (char *)b, 4);
+}
+
+static void
+put_data32(struct k5buf *buf, const void *data, size_t len)
+{
+    put32(buf, len);
+    k5_buf_add_len(buf, data, len);
+}
+
+static void
+put_data16(struct k5buf *buf, const void *data, size_t len)
+{
+    put16(buf, len);
+    k5_buf_add_len(buf, data, len);
+}
+
+/* Marshal entry into buf as a record keyed by name. */
+static void
+encode_record(struct k5buf *buf, const char *name, const krb5_db_entry *entry)
+{
+    krb5_principal princ = entry->princ;
+    krb5_tl_data *tl;
+    krb5_key_data *kd;
+    unsigned int ntl;
+    int i, j;
+
+    put_data32(buf, name, strlen(name));
+    put32(buf, entry->attributes);
+    put32(buf, entry->max_life);
+    put32(buf, entry->max_renewable_life);
+    put32(buf, entry->expiration);
+    put32(buf, entry->pw_expiration);
+    put32(buf, entry->last_success);
+    put32(buf, entry->last_failed);
+    put32(buf, entry->fail_auth_count);
+    put16(buf, entry->len);
+    put_data16(buf, entry->e_data, (entry->e_data != NULL) ?
+               entry->e_length : 0);
+
+    put32(buf, princ->type);
+    put_data32(buf, princ->realm.data, princ->realm.length);
+    put32(buf, princ->length);
+    for (i = 0; i < princ->length; i++)
+        put_data32(buf, princ->data[i].data, princ->data[i].length);
+
+    for (ntl = 0, tl = entry->tl_data; tl != NULL; tl = tl->tl_data_next)
+        ntl++;
+    put16(buf, ntl);
+    for (tl = entry->tl_data; tl != NULL; tl = tl->tl_data_next) {
+        put16(buf, tl->tl_data_type);
+        put_data16(buf, tl->tl_data_contents, tl->tl_data_length);
+    }
+
+    put16(buf, entry->n_key_data);
+    for (i = 0; i < entry->n_key_data; i++) {
+        kd = &entry->key_data[i];
+        put16(buf, kd->key_data_ver);
+        put16(buf, kd->key_data_kvno);
+        for (j = 0; j < kd->key_data_ver; j++) {
+            put16(buf, kd->key_data_type[j]);
+            put_data16(buf, kd->key_data_contents[j],
+                       kd->key_data_length[j]);
+        }
+    }
+}
+
+static int
+compile_entry(krb5_pointer ptr, krb5_db_entry *entry)
+{
+    struct compile_state *st = ptr;
+    struct index_ent *ent, *newindex;
+    krb5_error_code ret;
+    char *name;
+    ssize_t len;
+    size_t newspace;
+    int i;
+
+    for (i = 0; i < entry->n_key_data; i++) {
+        if (entry->key_data[i].key_data_ver > KRB5_KDB_V1_KEY_DATA_ARRAY)
+            return KRB5_KDB_BAD_VERSION;
+    }
+
+    if (st->count == st->space) {
+        newspace = (st->space > 0) ? st->space * 2 : 1024;
+        newindex = realloc(st->index, newspace * sizeof(*st->index));
+        if (newindex == NULL)
+            return ENOMEM;
+        st->index = newindex;
+        st->space = newspace;
+    }
+
+    ret = krb5_unparse_name(st->context, entry->princ, &name);
+    if (ret)
+        return ret;
+    k5_buf_truncate(&st->buf, 0);
+    encode_record(&st->buf, name, entry);
+    len = k5_buf_len(&st->buf);
+    if (len < 0) {
+        free(name);
+        return ENOMEM;
+    }
+    if (fwrite(k5_buf_data(&st->buf), 1, len, st->fp) != (size_t)len) {
+        free(name);
+        return errno;
+    }
+
+    ent = &st->index[st->count++];
+    ent->key = name;
+    ent->keylen = strlen(name);
+    ent->offset = st->offset;
+    st->offset += len;
+    return 0;
+}
+
+static int
+compare_keys(const unsigned char *k1, size_t len1, const unsigned char *k2,
+             size_t len2)
+{
+    int cmp;
+
+    cmp = memcmp(k1, k2, (len1 < len2) ? len1 : len2);
+    if (cmp != 0)
+        return cmp;
+    return (len1 < len2) ? -1 : (len1 > len2) ? 1 : 0;
+}
+
+static int
+compare_index_ents(const void *a, const void *b)
+{
+    const struct index_ent *e1 = a, *e2 = b;
+
+    return compare_keys((unsigned char *)e1->key, e1->keylen,
+                        (unsigned char *)e2->key, e2->keylen);
+}
+
+/* Write the index and then the header to st->fp. */
+static krb5_error_code
+finish_file(struct compile_state *st, time_t age)
+{
+    unsigned char b[CDB_HEADER_LEN];
+    size_t i;
+
+    qsort(st->index, st->count, sizeof(*st->index), compare_index_ents);
+    for (i = 0; i < st->count; i++) {
+        store_64_be(st->index[i].offset, b);
+        if (fwrite(b, 1, 8, st->fp) != 8)
+            return errno;
+    }
+
+    memcpy(b, CDB_MAGIC, 8);
+    store_32_be(st->count, b + 8);
+    store_32_be(0, b + 12);
+    store_64_be(age, b + 16);
+    store_64_be(st->offset, b + 24);
+    if (fseek(st->fp, 0, SEEK_SET) != 0)
+        return errno;
+    if (fwrite(b, 1, CDB_HEADER_LEN, st->fp) != CDB_HEADER_LEN)
+        return errno;
+    if (fflush(st->fp) != 0 || fsync(fileno(st->fp)) != 0)
+        return errno;
+    return 0;
+}
+
+krb5_error_code
+krb5_db_compile(krb5_context kcontext, const char *filename)
+{
+    krb5_error_code ret;
+    struct compile_state st;
+    unsigned char header[CDB_HEADER_LEN];
+    char *tmpname = NULL;
+    time_t age;
+    size_t i;
+    int fd;
+
+    memset(&st, 0, sizeof(st));
+    st.context = kcontext;
+    k5_buf_init_dynamic(&st.buf);
+
+    /* Record the age first, so that any concurrent change makes the compiled
+     * file look out of date. */
+    ret = krb5_db_get_age(kcontext, NULL, &age);
+    if (ret)
+        goto cleanup;
+
+    if (asprintf(&tmpname, "%s.new", filename) < 0) {
+        tmpname = NULL;
+        ret = ENOMEM;
+        goto cleanup;
+    }
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        ret = errno;
+        goto cleanup;
+    }
+    st.fp = fdopen(fd, "w");
+    if (st.fp == NULL) {
+        ret = errno;
+        close(fd);
+        goto cleanup;
+    }
+    set_cloexec_file(st.fp);
+
+    /* Leave room for the header, which is written last. */
+    memset(header, 0, sizeof(header));
+    if (fwrite(header, 1, CDB_HEADER_LEN, st.fp) != CDB_HEADER_LEN) {
+        ret = errno;
+        goto cleanup;
+    }
+    st.offset = CDB_HEADER_LEN;
+
+    ret = krb5_db_iterate(kcontext, NULL, compile_entry, &st);
+    if (ret)
+        goto cleanup;
+    ret = finish_file(&st, age);
+    if (ret)
+        goto cleanup;
+    if (fclose(st.fp) != 0) {
+        st.fp = NULL;
+        ret = errno;
+        goto cleanup;
+    }
+    st.fp = NULL;
+    if (rename(tmpname, filename) != 0) {
+        ret = errno;
+        goto cleanup;
+    }
+
+cleanup:
+    if (st.fp != NULL)
+        fclose(st.fp);
+    if (ret && tmpname != NULL)
+        (void)unlink(tmpname);
+    free(tmpname);
+    for (i = 0; i < st.count; i++)
+        free(st.index[i].key);
+    free(st.index);
+    k5_free_buf(&st.buf);
+    return ret;
+}
+
+krb5_error_code
+krb5int_compiled_db_open(const char *filename, struct krb5int_compiled_db **out)
+{
+    krb5_error_code ret;
+    struct krb5int_compiled_db *cdb;
+    struct stat st;
+    unsigned char *map;
+    krb5_ui_8 index_off;
+    size_t len;
+    int fd;
+
+    *out = NULL;
+    fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return errno;
+    if (fstat(fd, &st) != 0) {
+        ret = errno;
+        close(fd);
+        return ret;
+    }
+    len = st.st_size;
+    if ((off_t)len != st.st_size || len < CDB_HEADER_LEN) {
+        close(fd);
+        return KRB5_KDB_DB_CORRUPT;
+    }
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    ret = errno;
+    close(fd);
+    if (map == MAP_FAILED)
+        return ret;
+
+    index_off = load_64_be(map + 24);
+    if (memcmp(map, CDB_MAGIC, 8) != 0 || index_off < CDB_HEADER_LEN ||
+        index_off > len || (len - index_off) / 8 < load_32_be(map + 8)) {
+        munmap(map, len);
+        return KRB5_KDB_DB_CORRUPT;
+    }
+
+    cdb = k5alloc(sizeof(*cdb), &ret);
+    if (cdb == NULL) {
+        munmap(map, len);
+        return ret;
+    }
+    cdb->map = map;
+    cdb->len = len;
+    cdb->count = load_32_be(map + 8);
+    cdb->age = load_64_be(map + 16);
+    cdb->index = map + index_off;
+    cdb->dev = st.st_dev;
+    cdb->ino = st.st_ino;
+    *out = cdb;
+    return 0;
+}
+
+void
+krb5int_compiled_db_close(struct krb5int_compiled_db *cdb)
+{
+    if (cdb == NULL)
+        return;
+    munmap((void *)cdb->map, cdb->len);
+    free(cdb);
+}
+
+struct reader {
+    const unsigned char *ptr;
+    const unsigned char *end;
+};
+
+static krb5_boolean
+get16(struct reader *r, unsigned int *val)
+{
+    if (r->end - r->ptr < 2)
+        return FALSE;
+    *val = load_16_be(r->ptr);
+    r->ptr += 2;
+    return TRUE;
+}
+
+static krb5_boolean
+get32(struct reader *r, krb5_ui_4 *val)
+{
+    if (r->end - r->ptr < 4)
+        return FALSE;
+    *val = load_32_be(r->ptr);
+    r->ptr += 4;
+    return TRUE;
+}
+
+static krb5_boolean
+get_bytes(struct reader *r, size_t len, const unsigned char **ptr)
+{
+    if ((size_t)(r->end - r->ptr) < len)
+        return FALSE;
+    *ptr = r->ptr;
+    r->ptr += len;
+    return TRUE;
+}
+
+/* Space within a single-block entry.  When measuring a record, only the
+ * counts are used. */
+struct layout {
+    size_t ncomps;
+    size_t ntl;
+    size_t nkeys;
+    size_t nbytes;
+    krb5_data *comps;
+    krb5_tl_data *tl;
+    krb5_key_data *keys;
+    char *bytes;
+};
+
+/* Copy len bytes from src into the byte area of l (with a terminator if nul
+ * is true) and return the copy, or count the bytes if l has no byte area
+ * yet. */
+static char *
+put_bytes(struct layout *l, const unsigned char *src, size_t len, int nul)
+{
+    char *dst = l->bytes;
+
+    if (dst == NULL) {
+        l->nbytes += len + (nul ? 1 : 0);
+        return NULL;
+    }
+    memcpy(dst, src, len);
+    if (nul)
+        dst[len] = '\0';
+    l->bytes += len + (nul ? 1 : 0);
+    return (len > 0 || nul) ? dst : NULL;
+}
+
+/*
+ * Walk the record in r.  If entry is NULL, check the record and count the
+ * space it needs in l.  Otherwise fill in entry and its principal, using the
+ * arrays and byte area in l.
+ */
+static krb5_error_code
+walk_record(struct reader *r, krb5_db_entry *entry, struct layout *l)
+{
+    krb5_ui_4 fields[8], type, len, ncomps, i;
+    unsigned int n, ntl, nkeys, ver, kvno, ktype, j;
+    const unsigned char *p;
+    krb5_principal princ;
+    krb5_tl_data *tl;
+    krb5_key_data *kd;
+    char *s;
+
+    for (i = 0; i < 8; i++) {
+        if (!get32(r, &fields[i]))
+            return KRB5_KDB_TRUNCATED_RECORD;
+    }
+    if (!get16(r, &n) || !get16(r, &j) || !get_bytes(r, j, &p))
+        return KRB5_KDB_TRUNCATED_RECORD;
+    s = put_bytes(l, p, j, 0);
+    if (entry != NULL) {
+        entry->magic = KRB5_KDB_MAGIC_NUMBER;
+        entry->len = n;
+        entry->mask = KRB5_KDB_ENTRY_SINGLE_BLOCK;
+        entry->attributes = fields[0];
+        entry->max_life = fields[1];
+        entry->max_renewable_life = fields[2];
+        entry->expiration = fields[3];
+        entry->pw_expiration = fields[4];
+        entry->last_success = fields[5];
+        entry->last_failed = fields[6];
+        entry->fail_auth_count = fields[7];
+        entry->e_length = j;
+        entry->e_data = (krb5_octet *)s;
+    }
+
+    if (!get32(r, &type) || !get32(r, &len) || !get_bytes(r, len, &p))
+        return KRB5_KDB_TRUNCATED_RECORD;
+    s = put_bytes(l, p, len, 1);
+    if (!get32(r, &ncomps) || ncomps > (size_t)(r->end - r->ptr) / 4)
+        return KRB5_KDB_TRUNCATED_RECORD;
+    princ = (entry != NULL) ? entry->princ : NULL;
+    if (princ != NULL) {
+        princ->magic = KV5M_PRINCIPAL;
+        princ->type = type;
+        princ->realm = make_data(s, len);
+        princ->length = ncomps;
+        princ->data = l->comps;
+    } else {
+        l->ncomps += ncomps;
+    }
+    for (i = 0; i < ncomps; i++) {
+        if (!get32(r, &len) || !get_bytes(r, len, &p))
+            return KRB5_KDB_TRUNCATED_RECORD;
+        s = put_bytes(l, p, len, 1);
+        if (princ != NULL)
+            princ->data[i] = make_data(s, len);
+    }
+
+    if (!get16(r, &ntl))
+        return KRB5_KDB_TRUNCATED_RECORD;
+    if (entry != NULL) {
+        entry->n_tl_data = ntl;
+        entry->tl_data = (ntl > 0) ? l->tl : NULL;
+    } else {
+        l->ntl += ntl;
+    }
+    for (i = 0; i < ntl; i++) {
+        if (!get16(r, &n) || !get16(r, &j) || !get_bytes(r, j, &p))
+            return KRB5_KDB_TRUNCATED_RECORD;
+        s = put_bytes(l, p, j, 0);
+        if (entry != NULL) {
+            tl = &l->tl[i];
+            tl->tl_data_next = (i + 1 < ntl) ? tl + 1 : NULL;
+            tl->tl_data_type = n;
+            tl->tl_data_length = j;
+            tl->tl_data_contents = (krb5_octet *)s;
+        }
+    }
+
+    if (!get16(r, &nkeys))
+        return KRB5_KDB_TRUNCATED_RECORD;
+    if (entry != NULL) {
+        entry->n_key_data = nkeys;
+        entry->key_data = (nkeys > 0) ? l->keys : NULL;
+    } else {
+        l->nkeys += nkeys;
+    }
+    for (i = 0; i < nkeys; i++) {
+        if (!get16(r, &ver) || !get16(r, &kvno) ||
+            ver > KRB5_KDB_V1_KEY_DATA_ARRAY)
+            return KRB5_KDB_TRUNCATED_RECORD;
+        kd = (entry != NULL) ? &l->keys[i] : NULL;
+        if (kd != NULL) {
+            memset(kd, 0, sizeof(*kd));
+            kd->key_data_ver = ver;
+            kd->key_data_kvno = kvno;
+        }
+        for (j = 0; j < ver; j++) {
+            if (!get16(r, &ktype) || !get16(r, &n) || !get_bytes(r, n, &p))
+                return KRB5_KDB_TRUNCATED_RECORD;
+            s = put_bytes(l, p, n, 0);
+            if (kd != NULL) {
+                kd->key_data_type[j] = ktype;
+                kd->key_data_length[j] = n;
+                kd->key_data_contents[j] = (krb5_octet *)s;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Copy the record at rec (of which len bytes are mapped) into a single-block
+ * entry. */
+static krb5_error_code
+read_record(const unsigned char *rec, size_t len, krb5_db_entry **entry_out)
+{
+    krb5_error_code ret;
+    struct reader r;
+    struct layout l;
+    krb5_db_entry *entry;
+    char *block;
+    size_t size;
+
+    /* All of the structures in the block contain pointers, so laying them
+     * out back to back keeps each of them aligned. */
+    memset(&l, 0, sizeof(l));
+    r.ptr = rec;
+    r.end = rec + len;
+    ret = walk_record(&r, NULL, &l);
+    if (ret)
+        return ret;
+    size = sizeof(krb5_db_entry) + sizeof(krb5_principal_data) +
+        l.ncomps * sizeof(krb5_data) + l.ntl * sizeof(krb5_tl_data) +
+        l.nkeys * sizeof(krb5_key_data) + l.nbytes;
+    block = k5alloc(size, &ret);
+    if (block == NULL)
+        return ret;
+
+    entry = (krb5_db_entry *)block;
+    block += sizeof(krb5_db_entry);
+    entry->princ = (krb5_principal)block;
+    block += sizeof(krb5_principal_data);
+    l.comps = (krb5_data *)block;
+    block += l.ncomps * sizeof(krb5_data);
+    l.tl = (krb5_tl_data *)block;
+    block += l.ntl * sizeof(krb5_tl_data);
+    l.keys = (krb5_key_data *)block;
+    block += l.nkeys * sizeof(krb5_key_data);
+    l.bytes = block;
+
+    r.ptr = rec;
+    (void)walk_record(&r, entry, &l);
+    *entry_out = entry;
+    return 0;
+}
+
+krb5_error_code
+krb5int_compiled_db_get(struct krb5int_compiled_db *cdb, const char *name,
+                        size_t namelen, krb5_db_entry **entry_out)
+{
+    const unsigned char *key;
+    krb5_ui_8 off;
+    krb5_ui_4 keylen, lo = 0, hi = cdb->count, mid;
+    size_t keyoff;
+    int cmp;
+
+    *entry_out = NULL;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        off = load_64_be(cdb->index + (size_t)mid * 8);
+        if (off < CDB_HEADER_LEN || off > cdb->len - 4)
+            return KRB5_KDB_DB_CORRUPT;
+        keylen = load_32_be(cdb->map + off);
+        keyoff = off + 4;
+        if (keylen > cdb->len - keyoff)
+            return KRB5_KDB_DB_CORRUPT;
+        key = cdb->map + keyoff;
+        cmp = compare_keys((const unsigned char *)name, namelen, key, keylen);
+        if (cmp == 0) {
+            return read_record(key + keylen, cdb->len - keyoff - keylen,
+                               entry_out);
+        }
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return KRB5_KDB_NOENTRY;
+}
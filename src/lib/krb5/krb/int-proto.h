@@ -368,4 +368,8 @@ k5_count_etypes(const krb5_enctype *list);
 krb5_error_code
 k5_copy_etypes(const krb5_enctype *old_list, krb5_enctype **new_list);
 
+krb5_error_code
+k5_decrypt_tkt_part_k(krb5_context context, krb5_key srv_key,
+                      krb5_ticket *ticket);
+
 #endif /* KRB5_INT_FUNC_PROTO__ */
@@ -248,7 +248,8 @@ static krb5_error_code
 rd_req_decoded_opt(krb5_context context, krb5_auth_context *auth_context,
                    const krb5_ap_req *req, krb5_const_principal server,
                    krb5_keytab keytab, krb5_flags *ap_req_options,
-                   krb5_ticket **ticket, int check_valid_flag)
+                   krb5_ticket **ticket, int check_valid_flag,
+                   krb5_boolean tkt_decrypted)
 {
     krb5_error_code       retval = 0;
     krb5_enctype         *desired_etypes = NULL;
@@ -260,20 +261,32 @@ rd_req_decoded_opt(krb5_context context, krb5_auth_context *auth_context,
 
     decrypt_key.enctype = ENCTYPE_NULL;
     decrypt_key.contents = NULL;
-    req->ticket->enc_part2 = NULL;
+    if (!tkt_decrypted)
+        req->ticket->enc_part2 = NULL;
 
     /* if (req->ap_options & AP_OPTS_USE_SESSION_KEY)
        do we need special processing here ?     */
 
     /* decrypt the ticket */
-    if ((*auth_context)->key) { /* User to User authentication */
-        if ((retval = krb5_decrypt_tkt_part(context,
-                                            &(*auth_context)->key->keyblock,
+    if (tkt_decrypted) {
+        /* The caller has already decrypted the ticket. */
+        if (req->ticket->enc_part2 == NULL || (*auth_context)->key != NULL)
+            return EINVAL;
+        server = req->ticket->server;
+    } else if ((*auth_context)->key) { /* User to User authentication */
+        /* Decrypt with the key object itself, so that a caller (such as the
+         * KDC) which keeps it across requests also keeps its derived keys. */
+        if ((retval = k5_decrypt_tkt_part_k(context, (*auth_context)->key,
                                             req->ticket)))
             goto cleanup;
         if (check_valid_flag) {
-            decrypt_key = (*auth_context)->key->keyblock;
-            (*auth_context)->key->keyblock.contents = NULL;
+            /* The key may be shared, so copy rather than steal the keyblock
+             * contents. */
+            retval = krb5_copy_keyblock_contents(context,
+                                                 &(*auth_context)->key->keyblock,
+                                                 &decrypt_key);
+            if (retval)
+                goto cleanup;
         }
         krb5_k_free_key(context, (*auth_context)->key);
         (*auth_context)->key = NULL;
@@ -592,7 +605,7 @@ krb5_rd_req_decoded(krb5_context context, krb5_auth_context *auth_context,
     retval = rd_req_decoded_opt(context, auth_context,
                                 req, server, keytab,
                                 ap_req_options, ticket,
-                                1); /* check_valid_flag */
+                                1, FALSE); /* check_valid_flag */
     return retval;
 }
 
@@ -607,10 +620,27 @@ krb5_rd_req_decoded_anyflag(krb5_context context,
     retval = rd_req_decoded_opt(context, auth_context,
                                 req, server, keytab,
                                 ap_req_options, ticket,
-                                0); /* don't check_valid_flag */
+                                0, FALSE); /* don't check_valid_flag */
     return retval;
 }
 
+/*
+ * As krb5_rd_req_decoded_anyflag, but req->ticket->enc_part2 already contains
+ * the decrypted ticket part (the KDC caches decrypted TGTs), so only the
+ * authenticator is decrypted.  No user-to-user key may be set in
+ * *auth_context.
+ */
+krb5_error_code
+k5_rd_req_decoded_decrypted(krb5_context context,
+                            krb5_auth_context *auth_context,
+                            const krb5_ap_req *req,
+                            krb5_const_principal server, krb5_keytab keytab,
+                            krb5_flags *ap_req_options, krb5_ticket **ticket)
+{
+    return rd_req_decoded_opt(context, auth_context, req, server, keytab,
+                              ap_req_options, ticket, 0, TRUE);
+}
+
 #ifndef LEAN_CLIENT
 static krb5_error_code
 decrypt_authenticator(krb5_context context, const krb5_ap_req *request,
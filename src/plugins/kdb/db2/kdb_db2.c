@@ -72,6 +72,12 @@
 #define SUFFIX_LOCK ".ok"
 #define SUFFIX_POLICY ".kadm5"
 #define SUFFIX_POLICY_LOCK ".kadm5.lock"
+#define SUFFIX_LOCKOUT ".lockout"
+
+/* Flush buffered entries for a temporary DB once they use this many bytes. */
+#ifndef BULK_MAX_SIZE
+#define BULK_MAX_SIZE (128 * 1024 * 1024)
+#endif
 
 /*
  * Locking:
@@ -115,6 +121,14 @@
  * update on the master would be somewhat more serious, but this would
  * likely be noticed by an administrator, who could fix the problem and
  * retry the operation.
+ *
+ * Because every update advances the lock file's modification time, a reader
+ * may keep its read-only DB handle open after releasing its shared lock
+ * (dbc->persistent, the default for the KDC).  On the next shared lock, the
+ * handle is reused only if the lock file's modification time and the DB
+ * file's identity still match what was recorded when the handle was opened;
+ * otherwise the DB is reopened.  This avoids a dbopen() and a cold page cache
+ * on every lookup.
  */
 
 /* Evaluate to true if the krb5_context c contains an initialized db2
@@ -160,6 +174,7 @@ ctx_clear(krb5_db2_context *dbc)
      */
     free(dbc->db_lf_name);
     free(dbc->db_name);
+    free(dbc->db_file_name);
     /*
      * Clear the structure and reset the defaults.
      */
@@ -168,8 +183,10 @@ ctx_clear(krb5_db2_context *dbc)
     dbc->db_lf_name = NULL;
     dbc->db_lf_file = -1;
     dbc->db_name = NULL;
+    dbc->db_file_name = NULL;
     dbc->db_nb_locks = FALSE;
     dbc->tempdb = FALSE;
+    dbc->lockout_fd = -1;
 }
 
 /* Set *dbc_out to the db2 database context for context.  If one does not
@@ -265,6 +282,13 @@ configure_context(krb5_context context, char *conf_section, char **db_args)
         goto cleanup;
     dbc->disable_lockout = bval;
 
+    status = profile_get_integer(profile, KDB_MODULE_SECTION, conf_section,
+                                 KRB5_CONF_LOCKOUT_TABLE_SIZE,
+                                 DEFAULT_LOCKOUT_TABLE_SIZE, &bval);
+    if (status != 0)
+        goto cleanup;
+    dbc->lockout_size = bval;
+
 cleanup:
     free(opt);
     free(val);
@@ -274,8 +298,8 @@ cleanup:
 
 /*
  * Set *out to one of the filenames used for the DB described by dbc.  sfx
- * should be one of SUFFIX_DB, SUFFIX_LOCK, SUFFIX_POLICY, or
- * SUFFIX_POLICY_LOCK.
+ * should be one of SUFFIX_DB, SUFFIX_LOCK, SUFFIX_POLICY, SUFFIX_POLICY_LOCK,
+ * or SUFFIX_LOCKOUT.
  */
 static krb5_error_code
 ctx_dbsuffix(krb5_db2_context *dbc, const char *sfx, char **out)
@@ -380,6 +404,43 @@ done:
     return db;
 }
 
+/* Record the generation of the DB handle just opened in dbc. */
+static void
+ctx_record_generation(krb5_db2_context *dbc)
+{
+    struct stat st;
+
+    dbc->db_pid = getpid();
+    dbc->db_age = (fstat(dbc->db_lf_file, &st) == 0) ? st.st_mtime : -1;
+    if (dbc->db_file_name != NULL && stat(dbc->db_file_name, &st) == 0) {
+        dbc->db_dev = st.st_dev;
+        dbc->db_ino = st.st_ino;
+    } else {
+        dbc->db_dev = 0;
+        dbc->db_ino = 0;
+    }
+}
+
+/*
+ * Return true if the DB handle in dbc was opened by this process and the
+ * database has not been modified or replaced since.  dbc's lock file must be
+ * locked.
+ */
+static krb5_boolean
+ctx_handle_current(krb5_db2_context *dbc)
+{
+    struct stat st;
+
+    if (dbc->db_file_name == NULL || dbc->db_pid != getpid())
+        return FALSE;
+    if (fstat(dbc->db_lf_file, &st) != 0 || st.st_mtime != dbc->db_age)
+        return FALSE;
+    if (stat(dbc->db_file_name, &st) != 0 || st.st_dev != dbc->db_dev ||
+        st.st_ino != dbc->db_ino)
+        return FALSE;
+    return TRUE;
+}
+
 static krb5_error_code
 ctx_unlock(krb5_context context, krb5_db2_context *dbc)
 {
@@ -393,8 +454,11 @@ ctx_unlock(krb5_context context, krb5_db2_context *dbc)
 
     db = dbc->db;
     if (--(dbc->db_locks_held) == 0) {
-        db->close(db);
-        dbc->db = NULL;
+        /* Keep a read-only handle open for reuse if configured to. */
+        if (!dbc->persistent || dbc->db_lock_mode != KRB5_LOCKMODE_SHARED) {
+            db->close(db);
+            dbc->db = NULL;
+        }
         dbc->db_lock_mode = 0;
 
         retval2 = krb5_lock_file(context, dbc->db_lf_file,
@@ -409,12 +473,23 @@ ctx_unlock(krb5_context context, krb5_db2_context *dbc)
     return retval;
 }
 
+static krb5_error_code bulk_flush(krb5_context context,
+                                  krb5_db2_context *dbc);
+static void bulk_free(struct db2_bulk *bulk);
+
 static krb5_error_code
 ctx_lock(krb5_context context, krb5_db2_context *dbc, int lockmode)
 {
     krb5_error_code retval;
     int kmode;
 
+    /* Write out any entries buffered for a load before using the DB. */
+    if (dbc->bulk != NULL) {
+        retval = bulk_flush(context, dbc);
+        if (retval)
+            return retval;
+    }
+
     if (lockmode == KRB5_DB_LOCKMODE_PERMANENT ||
         lockmode == KRB5_DB_LOCKMODE_EXCLUSIVE)
         kmode = KRB5_LOCKMODE_EXCLUSIVE;
@@ -434,20 +509,26 @@ ctx_lock(krb5_context context, krb5_db2_context *dbc, int lockmode)
         else if (retval)
             return retval;
 
-        /* Open the DB (or re-open it for read/write). */
-        if (dbc->db != NULL)
+        /* Open the DB (or re-open it for read/write), unless we can reuse a
+         * persistent read-only handle. */
+        if (dbc->db != NULL && (kmode != KRB5_LOCKMODE_SHARED ||
+                                !ctx_handle_current(dbc))) {
             dbc->db->close(dbc->db);
-        dbc->db = open_db(dbc,
-                          kmode == KRB5_LOCKMODE_SHARED ? O_RDONLY : O_RDWR,
-                          0600);
+            dbc->db = NULL;
+        }
         if (dbc->db == NULL) {
-            retval = errno;
-            dbc->db_locks_held = 0;
-            dbc->db_lock_mode = 0;
-            (void) osa_adb_release_lock(dbc->policy_db);
-            (void) krb5_lock_file(context, dbc->db_lf_file,
-                                  KRB5_LOCKMODE_UNLOCK);
-            return retval;
+            dbc->db = open_db(dbc, (kmode == KRB5_LOCKMODE_SHARED) ?
+                              O_RDONLY : O_RDWR, 0600);
+            if (dbc->db == NULL) {
+                retval = errno;
+                dbc->db_locks_held = 0;
+                dbc->db_lock_mode = 0;
+                (void) osa_adb_release_lock(dbc->policy_db);
+                (void) krb5_lock_file(context, dbc->db_lf_file,
+                                      KRB5_LOCKMODE_UNLOCK);
+                return retval;
+            }
+            ctx_record_generation(dbc);
         }
 
         dbc->db_lock_mode = kmode;
@@ -465,13 +546,13 @@ ctx_lock(krb5_context context, krb5_db2_context *dbc, int lockmode)
     return retval;
 }
 
-/* Initialize the lock file and policy database fields of dbc.  The db_name and
- * tempdb fields must already be set. */
+/* Initialize the lock file, policy database, and lockout table fields of dbc.
+ * The db_name and tempdb fields must already be set. */
 static krb5_error_code
-ctx_init(krb5_db2_context *dbc)
+ctx_init(krb5_context context, krb5_db2_context *dbc)
 {
     krb5_error_code retval;
-    char *polname = NULL, *plockname = NULL;
+    char *polname = NULL, *plockname = NULL, *lockoutname = NULL;
 
     retval = ctx_dbsuffix(dbc, SUFFIX_LOCK, &dbc->db_lf_name);
     if (retval)
@@ -490,6 +571,9 @@ ctx_init(krb5_db2_context *dbc)
     set_cloexec_fd(dbc->db_lf_file);
     dbc->db_inited++;
 
+    retval = ctx_dbsuffix(dbc, SUFFIX_DB, &dbc->db_file_name);
+    if (retval)
+        goto cleanup;
     retval = ctx_dbsuffix(dbc, SUFFIX_POLICY, &polname);
     if (retval)
         goto cleanup;
@@ -498,10 +582,17 @@ ctx_init(krb5_db2_context *dbc)
         goto cleanup;
     retval = osa_adb_init_db(&dbc->policy_db, polname, plockname,
                              OSA_ADB_POLICY_DB_MAGIC);
+    if (retval)
+        goto cleanup;
+
+    /* Without a lockout table, lockout counters go to the DB. */
+    if (!dbc->tempdb && ctx_dbsuffix(dbc, SUFFIX_LOCKOUT, &lockoutname) == 0)
+        krb5_db2_lockout_table_open(context, dbc, lockoutname);
 
 cleanup:
     free(polname);
     free(plockname);
+    free(lockoutname);
     if (retval)
         ctx_clear(dbc);
     return retval;
@@ -510,10 +601,15 @@ cleanup:
 static void
 ctx_fini(krb5_db2_context *dbc)
 {
+    /* A persistent handle may remain open after the last unlock. */
+    if (dbc->db != NULL && dbc->db_locks_held == 0)
+        dbc->db->close(dbc->db);
     if (dbc->db_lf_file != -1)
         (void) close(dbc->db_lf_file);
     if (dbc->policy_db)
         (void) osa_adb_fini_db(dbc->policy_db, OSA_ADB_POLICY_DB_MAGIC);
+    krb5_db2_lockout_table_close(dbc);
+    bulk_free(dbc->bulk);
     ctx_clear(dbc);
     free(dbc);
 }
@@ -675,6 +771,7 @@ ctx_create_db(krb5_context context, krb5_db2_context *dbc)
 {
     krb5_error_code retval = 0;
     char *dbname = NULL, *polname = NULL, *plockname = NULL;
+    char *lockoutname = NULL;
 
     retval = ctx_allfiles(dbc, &dbname, &dbc->db_lf_name, &polname,
                           &plockname);
@@ -704,6 +801,13 @@ ctx_create_db(krb5_context context, krb5_db2_context *dbc)
     }
 
     dbc->db = open_db(dbc, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (dbc->db != NULL && !dbc->tempdb) {
+        /* Lockout counters from a previous database don't apply. */
+        retval = ctx_dbsuffix(dbc, SUFFIX_LOCKOUT, &lockoutname);
+        if (retval)
+            goto cleanup;
+        (void) unlink(lockoutname);
+    }
     if (dbc->db == NULL) {
         retval = errno;
         goto cleanup;
@@ -738,6 +842,7 @@ cleanup:
     free(dbname);
     free(polname);
     free(plockname);
+    free(lockoutname);
     return retval;
 }
 
@@ -784,6 +889,8 @@ krb5_db2_get_principal(krb5_context context, krb5_const_principal searchfor,
         contdata.data = contents.data;
         contdata.length = contents.size;
         retval = krb5_decode_princ_entry(context, &contdata, entry);
+        if (retval == 0)
+            krb5_db2_lockout_table_fetch(context, dbc, *entry);
         break;
     }
 
@@ -799,6 +906,160 @@ krb5_db2_free_principal(krb5_context context, krb5_db_entry *entry)
     krb5_dbe_free(context, entry);
 }
 
+/*
+ * Entries put into a temporary DB, as by "kdb5_util load", are buffered in
+ * encoded form instead of being written one at a time.  Before the DB is used
+ * in any other way, and whenever the buffer grows past BULK_MAX_SIZE, the
+ * buffered entries are sorted by key and written in order.  The btree code
+ * recognizes sorted insertions: it appends to the last leaf page without
+ * searching the tree, and splits a full last page by starting a new empty
+ * page rather than moving half of the old one, so the tree is built from left
+ * to right with full pages.
+ */
+
+struct bulk_rec {
+    krb5_data key;
+    krb5_data contents;
+    size_t seq;                 /* Order of insertion */
+};
+
+struct db2_bulk {
+    struct bulk_rec *recs;
+    size_t count;
+    size_t alloc;
+    size_t size;                /* Total bytes of keys and contents */
+};
+
+/* Free the buffered entries of bulk, leaving it empty. */
+static void
+bulk_clear(struct db2_bulk *bulk)
+{
+    size_t i;
+
+    for (i = 0; i < bulk->count; i++) {
+        free(bulk->recs[i].key.data);
+        free(bulk->recs[i].contents.data);
+    }
+    bulk->count = 0;
+    bulk->size = 0;
+}
+
+static void
+bulk_free(struct db2_bulk *bulk)
+{
+    if (bulk == NULL)
+        return;
+    bulk_clear(bulk);
+    free(bulk->recs);
+    free(bulk);
+}
+
+/* Order records as the default btree comparison orders their keys, then by
+ * order of insertion. */
+static int
+bulk_cmp(const void *a, const void *b)
+{
+    const struct bulk_rec *r1 = a, *r2 = b;
+    unsigned int len;
+    int cmp;
+
+    len = (r1->key.length < r2->key.length) ? r1->key.length :
+        r2->key.length;
+    cmp = memcmp(r1->key.data, r2->key.data, len);
+    if (cmp != 0)
+        return cmp;
+    if (r1->key.length != r2->key.length)
+        return (r1->key.length < r2->key.length) ? -1 : 1;
+    return (r1->seq < r2->seq) ? -1 : (r1->seq > r2->seq);
+}
+
+/* Sort and write the entries buffered in dbc->bulk. */
+static krb5_error_code
+bulk_flush(krb5_context context, krb5_db2_context *dbc)
+{
+    krb5_error_code retval;
+    struct db2_bulk *bulk = dbc->bulk;
+    struct bulk_rec *rec;
+    DB *db;
+    DBT key, contents;
+    size_t i;
+
+    if (bulk->count == 0)
+        return 0;
+
+    /* Detach the buffer so that ctx_lock() doesn't try to flush it. */
+    dbc->bulk = NULL;
+    retval = ctx_lock(context, dbc, KRB5_LOCKMODE_EXCLUSIVE);
+    if (retval)
+        goto cleanup;
+
+    qsort(bulk->recs, bulk->count, sizeof(*bulk->recs), bulk_cmp);
+    db = dbc->db;
+    for (i = 0; i < bulk->count; i++) {
+        rec = &bulk->recs[i];
+        /* Of several entries for the same principal, the last one wins. */
+        if (i + 1 < bulk->count && data_eq(rec->key, rec[1].key))
+            continue;
+        key.data = rec->key.data;
+        key.size = rec->key.length;
+        contents.data = rec->contents.data;
+        contents.size = rec->contents.length;
+        if ((*db->put)(db, &key, &contents, 0) != 0) {
+            retval = errno;
+            break;
+        }
+    }
+
+    ctx_update_age(dbc);
+    (void)ctx_unlock(context, dbc);
+
+cleanup:
+    bulk_clear(bulk);
+    dbc->bulk = bulk;
+    return retval;
+}
+
+/* Buffer entry for writing to the temporary DB dbc. */
+static krb5_error_code
+bulk_put(krb5_context context, krb5_db2_context *dbc, krb5_db_entry *entry)
+{
+    krb5_error_code retval;
+    struct db2_bulk *bulk = dbc->bulk;
+    struct bulk_rec *rec, *newrecs;
+    size_t newalloc;
+
+    if (bulk == NULL) {
+        bulk = k5alloc(sizeof(*bulk), &retval);
+        if (bulk == NULL)
+            return retval;
+        dbc->bulk = bulk;
+    }
+    if (bulk->count == bulk->alloc) {
+        newalloc = (bulk->alloc == 0) ? 1024 : bulk->alloc * 2;
+        newrecs = realloc(bulk->recs, newalloc * sizeof(*newrecs));
+        if (newrecs == NULL)
+            return ENOMEM;
+        bulk->recs = newrecs;
+        bulk->alloc = newalloc;
+    }
+
+    rec = &bulk->recs[bulk->count];
+    retval = krb5_encode_princ_entry(context, &rec->contents, entry);
+    if (retval)
+        return retval;
+    retval = krb5_encode_princ_dbkey(context, &rec->key, entry->princ);
+    if (retval) {
+        krb5_free_data_contents(context, &rec->contents);
+        return retval;
+    }
+    rec->seq = bulk->count++;
+    bulk->size += rec->key.length + rec->contents.length;
+
+    if (bulk->size >= BULK_MAX_SIZE)
+        return bulk_flush(context, dbc);
+    return 0;
+}
+
 krb5_error_code
 krb5_db2_put_principal(krb5_context context, krb5_db_entry *entry,
                        char **db_args)
@@ -823,6 +1084,9 @@ krb5_db2_put_principal(krb5_context context, krb5_db_entry *entry,
         return KRB5_KDB_DBNOTINITED;
 
     dbc = context->dal_handle->db_context;
+    if (dbc->tempdb)
+        return bulk_put(context, dbc, entry);
+
     if ((retval = ctx_lock(context, dbc, KRB5_LOCKMODE_EXCLUSIVE)))
         return retval;
 
@@ -845,6 +1109,8 @@ krb5_db2_put_principal(krb5_context context, krb5_db_entry *entry,
     retval = dbret ? errno : 0;
     krb5_free_data_contents(context, &keydata);
     krb5_free_data_contents(context, &contdata);
+    if (retval == 0)
+        krb5_db2_lockout_table_clear(context, dbc, entry->princ);
 
 cleanup:
     ctx_update_age(dbc);
@@ -916,6 +1182,8 @@ krb5_db2_delete_principal(krb5_context context, krb5_const_principal searchfor)
         goto cleankey;
     dbret = (*db->del) (db, &key, 0);
     retval = dbret ? errno : 0;
+    if (retval == 0)
+        krb5_db2_lockout_table_clear(context, dbc, searchfor);
 cleankey:
     krb5_free_data_contents(context, &keydata);
 
@@ -948,6 +1216,7 @@ ctx_iterate(krb5_context context, krb5_db2_context *dbc,
         retval = krb5_decode_princ_entry(context, &contdata, &entry);
         if (retval)
             break;
+        krb5_db2_lockout_table_fetch(context, dbc, entry);
         k5_mutex_unlock(krb5_db2_mutex);
         retval = (*func)(func_arg, entry);
         krb5_dbe_free(context, entry);
@@ -999,13 +1268,13 @@ krb5_db2_set_lockmode(krb5_context context, krb5_boolean mode)
 krb5_error_code
 krb5_db2_lib_init()
 {
-    return 0;
+    return krb5_db2_lockout_lib_init();
 }
 
 krb5_error_code
 krb5_db2_lib_cleanup()
 {
-    /* right now, no cleanup required */
+    krb5_db2_lockout_lib_cleanup();
     return 0;
 }
 
@@ -1014,6 +1283,8 @@ krb5_db2_open(krb5_context context, char *conf_section, char **db_args,
               int mode)
 {
     krb5_error_code status = 0;
+    krb5_db2_context *dbc;
+    int bval;
 
     krb5_clear_error_message(context);
     if (inited(context))
@@ -1027,7 +1298,18 @@ krb5_db2_open(krb5_context context, char *conf_section, char **db_args,
     if (status != 0)
         return status;
 
-    return ctx_init(context->dal_handle->db_context);
+    /* Keep the DB open between lookups by default in the KDC, which rarely
+     * writes to it. */
+    dbc = context->dal_handle->db_context;
+    status = profile_get_boolean(KRB5_DB_GET_PROFILE(context),
+                                 KDB_MODULE_SECTION, conf_section,
+                                 KRB5_CONF_PERSISTENT_HANDLE,
+                                 (mode & KRB5_KDB_SRV_TYPE_KDC) != 0, &bval);
+    if (status != 0)
+        return status;
+    dbc->persistent = bval;
+
+    return ctx_init(context, dbc);
 }
 
 krb5_error_code
@@ -1061,6 +1343,7 @@ krb5_db2_destroy(krb5_context context, char *conf_section, char **db_args)
     krb5_error_code status;
     krb5_db2_context *dbc;
     char *dbname = NULL, *lockname = NULL, *polname = NULL, *plockname = NULL;
+    char *lockoutname = NULL;
 
     if (inited(context)) {
         status = krb5_db2_fini(context);
@@ -1088,6 +1371,10 @@ krb5_db2_destroy(krb5_context context, char *conf_section, char **db_args)
     status = unlink(lockname);
     if (status)
         goto cleanup;
+    status = ctx_dbsuffix(dbc, SUFFIX_LOCKOUT, &lockoutname);
+    if (status)
+        goto cleanup;
+    (void) unlink(lockoutname);
     status = osa_adb_destroy_db(polname, plockname, OSA_ADB_POLICY_DB_MAGIC);
     if (status)
         return status;
@@ -1099,6 +1386,7 @@ cleanup:
     free(lockname);
     free(polname);
     free(plockname);
+    free(lockoutname);
     return status;
 }
 
@@ -1325,6 +1613,11 @@ krb5_db2_promote_db(krb5_context context, char *conf_section, char **db_args)
         return KRB5_KDB_NOTLOCKED;
     if (!dbc_temp->tempdb)
         return EINVAL;
+    if (dbc_temp->bulk != NULL) {
+        retval = bulk_flush(context, dbc_temp);
+        if (retval)
+            return retval;
+    }
 
     /* Check db_args for whether we should merge non-replicated attributes. */
     for (db_argp = db_args; *db_argp; db_argp++) {
@@ -1339,6 +1632,7 @@ krb5_db2_promote_db(krb5_context context, char *conf_section, char **db_args)
     if (dbc_real == NULL)
         return retval;
     ctx_clear(dbc_real);
+    dbc_real->lockout_size = dbc_temp->lockout_size;
 
     /* Try creating the real DB. */
     dbc_real->db_name = strdup(dbc_temp->db_name);
@@ -1352,7 +1646,7 @@ krb5_db2_promote_db(krb5_context context, char *conf_section, char **db_args)
         if (dbc_real->db_name == NULL)
             goto cleanup;
         dbc_real->tempdb = FALSE;
-        retval = ctx_init(dbc_real);
+        retval = ctx_init(context, dbc_real);
         if (retval)
             goto cleanup;
         retval = ctx_lock(context, dbc_real, KRB5_DB_LOCKMODE_EXCLUSIVE);
@@ -1366,6 +1660,12 @@ krb5_db2_promote_db(krb5_context context, char *conf_section, char **db_args)
         retval = ctx_merge_nra(context, dbc_temp, dbc_real);
         if (retval)
             goto cleanup;
+        /* Write the merged entries, which were buffered. */
+        if (dbc_temp->bulk != NULL) {
+            retval = bulk_flush(context, dbc_temp);
+            if (retval)
+                goto cleanup;
+        }
     }
 
     /* Perform filesystem manipulations for the promotion. */
@@ -1373,6 +1673,9 @@ krb5_db2_promote_db(krb5_context context, char *conf_section, char **db_args)
     if (retval)
         goto cleanup;
 
+    /* The lockout counters in the table belong to the old entries. */
+    krb5_db2_lockout_table_reset(context, dbc_real);
+
     /* Unlock and finalize context since the temp DB is gone. */
     (void) krb5_db2_unlock(context);
     krb5_db2_fini(context);
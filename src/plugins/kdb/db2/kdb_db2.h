@@ -33,6 +33,11 @@
 
 #include "policy_db.h"
 
+/* Default number of slots in a new lockout side table. */
+#define DEFAULT_LOCKOUT_TABLE_SIZE 16384
+
+struct db2_bulk;
+
 typedef struct _krb5_db2_context {
     krb5_boolean        db_inited;      /* Context initialized          */
     char *              db_name;        /* Name of database             */
@@ -47,6 +52,20 @@ typedef struct _krb5_db2_context {
     krb5_boolean        tempdb;
     krb5_boolean        disable_last_success;
     krb5_boolean        disable_lockout;
+    krb5_boolean        persistent;     /* Keep DB open between locks   */
+    char *              db_file_name;   /* Name of the DB2 file         */
+    pid_t               db_pid;         /* Process which opened db      */
+    time_t              db_age;         /* Lock file mtime when opened  */
+    dev_t               db_dev;         /* Device of the opened DB file */
+    ino_t               db_ino;         /* Inode of the opened DB file  */
+    int                 lockout_size;   /* Slots in a new lockout table */
+    int                 lockout_fd;     /* Lockout side table file      */
+    void *              lockout_map;    /* Mapping of the lockout table */
+    size_t              lockout_len;    /* Length of the mapping        */
+    krb5_boolean        lockout_rdonly; /* Lockout table is read-only   */
+    time_t              lockout_synced; /* Last lockout table msync     */
+    krb5_boolean        lockout_full;   /* Table full has been logged   */
+    struct db2_bulk *   bulk;           /* Entries buffered for a load  */
 } krb5_db2_context;
 
 krb5_error_code krb5_db2_init(krb5_context);
@@ -118,6 +137,12 @@ void krb5_db2_free_policy(krb5_context kcontext, osa_policy_ent_t entry);
 extern k5_mutex_t *krb5_db2_mutex;
 
 /* lockout */
+krb5_error_code
+krb5_db2_lockout_lib_init(void);
+
+void
+krb5_db2_lockout_lib_cleanup(void);
+
 krb5_error_code
 krb5_db2_lockout_check_policy(krb5_context context,
                               krb5_db_entry *entry,
@@ -129,6 +154,24 @@ krb5_db2_lockout_audit(krb5_context context,
                        krb5_timestamp stamp,
                        krb5_error_code status);
 
+void
+krb5_db2_lockout_table_open(krb5_context context, krb5_db2_context *dbc,
+                            const char *filename);
+
+void
+krb5_db2_lockout_table_close(krb5_db2_context *dbc);
+
+void
+krb5_db2_lockout_table_fetch(krb5_context context, krb5_db2_context *dbc,
+                             krb5_db_entry *entry);
+
+void
+krb5_db2_lockout_table_clear(krb5_context context, krb5_db2_context *dbc,
+                             krb5_const_principal princ);
+
+void
+krb5_db2_lockout_table_reset(krb5_context context, krb5_db2_context *dbc);
+
 krb5_error_code
 krb5_db2_check_policy_as(krb5_context kcontext, krb5_kdc_req *request,
                          krb5_db_entry *client, krb5_db_entry *server,
@@ -28,15 +28,331 @@
 #include "kdb.h"
 #include <stdio.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <syslog.h>
 #include <kadm5/server_internal.h>
 #include "kdb5.h"
 #include "kdb_db2.h"
+#include "kdb_xdr.h"
 
 /*
  * Helper routines for databases that wish to use the default
  * principal lockout functionality.
  */
 
+/*
+ * The lockout side table holds the lockout counters (fail_auth_count,
+ * last_failed and last_success) of principals which have authenticated, so
+ * that the KDC can record an authentication without rewriting the whole
+ * principal entry under an exclusive database lock.  The table is a file next
+ * to the database, mapped shared by every process which opens the database,
+ * and laid out as an open-addressed hash table keyed by the principal's
+ * database key.  Slots stay in use once claimed, so probe sequences never
+ * break, but a slot whose record has been invalidated may be given to another
+ * principal.
+ *
+ * A valid record supersedes the counters in the principal entry.  Writing or
+ * deleting the entry invalidates the record, and promoting a loaded database
+ * invalidates them all.  The operating system writes changed pages back to the
+ * file; we also flush them with msync() at most every LOCKOUT_SYNC_INTERVAL
+ * seconds.  If a principal has no room in the table, its counters are written
+ * to the database as before.
+ *
+ * The table's file lock is a POSIX record lock, which belongs to the process
+ * rather than to the file descriptor, so table_mutex serializes table access
+ * among the threads of a process (such as a KDC with worker threads, each with
+ * its own database context).
+ */
+
+#define LOCKOUT_MAGIC           0x4b4c4f31      /* "KLO1" */
+#define LOCKOUT_NAME_MAX        108
+#define LOCKOUT_MAX_PROBE       64
+#define LOCKOUT_SYNC_INTERVAL   30
+
+#define LOCKOUT_USED            0x1     /* Slot belongs to the name */
+#define LOCKOUT_VALID           0x2     /* Counters supersede the entry's */
+
+struct lockout_header {
+    uint32_t magic;
+    uint32_t nslots;
+};
+
+struct lockout_rec {
+    uint32_t hash;
+    uint16_t flags;
+    uint16_t namelen;
+    uint32_t fail_auth_count;
+    int32_t last_failed;
+    int32_t last_success;
+    char name[LOCKOUT_NAME_MAX];
+};
+
+#define TABLE_RECS(dbc)                                                 \
+    ((struct lockout_rec *)((struct lockout_header *)(dbc)->lockout_map + 1))
+#define TABLE_NSLOTS(dbc)                                               \
+    (((struct lockout_header *)(dbc)->lockout_map)->nslots)
+
+static k5_mutex_t table_mutex = K5_MUTEX_PARTIAL_INITIALIZER;
+
+krb5_error_code
+krb5_db2_lockout_lib_init(void)
+{
+    return k5_mutex_finish_init(&table_mutex);
+}
+
+void
+krb5_db2_lockout_lib_cleanup(void)
+{
+    k5_mutex_destroy(&table_mutex);
+}
+
+/* Map the lockout table in filename into dbc, creating it if necessary.  On
+ * failure, leave dbc without a table, so that counters go to the database. */
+void
+krb5_db2_lockout_table_open(krb5_context context, krb5_db2_context *dbc,
+                            const char *filename)
+{
+    struct lockout_header hdr, *maphdr;
+    struct stat st;
+    size_t len;
+    void *map;
+    int fd, lockmode = KRB5_LOCKMODE_EXCLUSIVE, prot = PROT_READ | PROT_WRITE;
+    krb5_boolean rdonly = FALSE;
+
+    if (dbc->lockout_size <= 0 || dbc->tempdb)
+        return;
+
+    fd = open(filename, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        fd = open(filename, O_RDONLY, 0);
+        if (fd < 0)
+            return;
+        rdonly = TRUE;
+        lockmode = KRB5_LOCKMODE_SHARED;
+        prot = PROT_READ;
+    }
+    set_cloexec_fd(fd);
+    k5_mutex_lock(&table_mutex);
+    if (krb5_lock_file(context, fd, lockmode) != 0) {
+        k5_mutex_unlock(&table_mutex);
+        goto error;
+    }
+
+    if (fstat(fd, &st) != 0)
+        goto error_unlock;
+    if (st.st_size == 0 && !rdonly) {
+        /* We created the file; size it and write the header. */
+        len = sizeof(hdr) + (size_t)dbc->lockout_size *
+            sizeof(struct lockout_rec);
+        hdr.magic = LOCKOUT_MAGIC;
+        hdr.nslots = dbc->lockout_size;
+        if (ftruncate(fd, len) != 0 ||
+            pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            goto error_unlock;
+        st.st_size = len;
+    }
+    if ((size_t)st.st_size < sizeof(hdr))
+        goto error_unlock;
+
+    map = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto error_unlock;
+    maphdr = map;
+    if (maphdr->magic != LOCKOUT_MAGIC || maphdr->nslots == 0 ||
+        (size_t)st.st_size != sizeof(hdr) + (size_t)maphdr->nslots *
+        sizeof(struct lockout_rec)) {
+        munmap(map, st.st_size);
+        goto error_unlock;
+    }
+
+    (void)krb5_lock_file(context, fd, KRB5_LOCKMODE_UNLOCK);
+    k5_mutex_unlock(&table_mutex);
+    dbc->lockout_fd = fd;
+    dbc->lockout_map = map;
+    dbc->lockout_len = st.st_size;
+    dbc->lockout_rdonly = rdonly;
+    dbc->lockout_synced = time(NULL);
+    dbc->lockout_full = FALSE;
+    return;
+
+error_unlock:
+    (void)krb5_lock_file(context, fd, KRB5_LOCKMODE_UNLOCK);
+    k5_mutex_unlock(&table_mutex);
+error:
+    close(fd);
+}
+
+void
+krb5_db2_lockout_table_close(krb5_db2_context *dbc)
+{
+    if (dbc->lockout_map == NULL)
+        return;
+    if (!dbc->lockout_rdonly)
+        (void)msync(dbc->lockout_map, dbc->lockout_len, MS_SYNC);
+    munmap(dbc->lockout_map, dbc->lockout_len);
+    close(dbc->lockout_fd);
+    dbc->lockout_map = NULL;
+    dbc->lockout_len = 0;
+    dbc->lockout_fd = -1;
+}
+
+static krb5_boolean
+table_lock(krb5_context context, krb5_db2_context *dbc, int lockmode)
+{
+    if (dbc->lockout_map == NULL)
+        return FALSE;
+    if (dbc->lockout_rdonly && lockmode == KRB5_LOCKMODE_EXCLUSIVE)
+        return FALSE;
+    k5_mutex_lock(&table_mutex);
+    if (krb5_lock_file(context, dbc->lockout_fd, lockmode) != 0) {
+        k5_mutex_unlock(&table_mutex);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+table_unlock(krb5_context context, krb5_db2_context *dbc)
+{
+    (void)krb5_lock_file(context, dbc->lockout_fd, KRB5_LOCKMODE_UNLOCK);
+    k5_mutex_unlock(&table_mutex);
+}
+
+/* Flush changes to the table if we haven't done so recently. */
+static void
+table_sync(krb5_db2_context *dbc)
+{
+    time_t now = time(NULL);
+
+    if (now - dbc->lockout_synced >= LOCKOUT_SYNC_INTERVAL) {
+        (void)msync(dbc->lockout_map, dbc->lockout_len, MS_ASYNC);
+        dbc->lockout_synced = now;
+    }
+}
+
+static uint32_t
+key_hash(const krb5_data *key)
+{
+    uint32_t h = 2166136261U;
+    unsigned int i;
+
+    for (i = 0; i < key->length; i++) {
+        h ^= (unsigned char)key->data[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/*
+ * Return the slot for key.  If there is none and create is set, claim a free
+ * slot, or failing that, one whose record is no longer valid.  Return NULL if
+ * there is no such slot.  The table must be locked.
+ */
+static struct lockout_rec *
+table_find(krb5_db2_context *dbc, const krb5_data *key, krb5_boolean create)
+{
+    struct lockout_rec *recs = TABLE_RECS(dbc), *rec, *reuse = NULL;
+    uint32_t nslots = TABLE_NSLOTS(dbc), hash, n;
+
+    if (key->length > LOCKOUT_NAME_MAX)
+        return NULL;
+    hash = key_hash(key);
+    for (n = 0; n < LOCKOUT_MAX_PROBE && n < nslots; n++) {
+        rec = &recs[(hash + n) % nslots];
+        if (!(rec->flags & LOCKOUT_USED)) {
+            /* The key can't be further along the probe sequence. */
+            if (reuse == NULL)
+                reuse = rec;
+            break;
+        }
+        if (rec->hash == hash && rec->namelen == key->length &&
+            memcmp(rec->name, key->data, key->length) == 0)
+            return rec;
+        if (reuse == NULL && !(rec->flags & LOCKOUT_VALID))
+            reuse = rec;
+    }
+    if (!create || reuse == NULL)
+        return NULL;
+
+    memset(reuse, 0, sizeof(*reuse));
+    reuse->hash = hash;
+    reuse->namelen = key->length;
+    memcpy(reuse->name, key->data, key->length);
+    reuse->flags = LOCKOUT_USED;
+    return reuse;
+}
+
+static void
+rec_to_entry(const struct lockout_rec *rec, krb5_db_entry *entry)
+{
+    entry->fail_auth_count = rec->fail_auth_count;
+    entry->last_failed = rec->last_failed;
+    entry->last_success = rec->last_success;
+}
+
+static void
+entry_to_rec(const krb5_db_entry *entry, struct lockout_rec *rec)
+{
+    rec->fail_auth_count = entry->fail_auth_count;
+    rec->last_failed = entry->last_failed;
+    rec->last_success = entry->last_success;
+    rec->flags |= LOCKOUT_VALID;
+}
+
+/* If the lockout table has counters for entry, copy them into entry. */
+void
+krb5_db2_lockout_table_fetch(krb5_context context, krb5_db2_context *dbc,
+                             krb5_db_entry *entry)
+{
+    struct lockout_rec *rec;
+    krb5_data key;
+
+    if (dbc->lockout_map == NULL)
+        return;
+    if (krb5_encode_princ_dbkey(context, &key, entry->princ) != 0)
+        return;
+    if (table_lock(context, dbc, KRB5_LOCKMODE_SHARED)) {
+        rec = table_find(dbc, &key, FALSE);
+        if (rec != NULL && (rec->flags & LOCKOUT_VALID))
+            rec_to_entry(rec, entry);
+        table_unlock(context, dbc);
+    }
+    krb5_free_data_contents(context, &key);
+}
+
+/* Invalidate any lockout table counters for princ, because the principal
+ * entry has been written or deleted. */
+void
+krb5_db2_lockout_table_clear(krb5_context context, krb5_db2_context *dbc,
+                             krb5_const_principal princ)
+{
+    struct lockout_rec *rec;
+    krb5_data key;
+
+    if (dbc->lockout_map == NULL)
+        return;
+    if (krb5_encode_princ_dbkey(context, &key, princ) != 0)
+        return;
+    if (table_lock(context, dbc, KRB5_LOCKMODE_EXCLUSIVE)) {
+        rec = table_find(dbc, &key, FALSE);
+        if (rec != NULL)
+            rec->flags &= ~LOCKOUT_VALID;
+        table_unlock(context, dbc);
+    }
+    krb5_free_data_contents(context, &key);
+}
+
+/* Empty the lockout table, because the database has been replaced. */
+void
+krb5_db2_lockout_table_reset(krb5_context context, krb5_db2_context *dbc)
+{
+    if (!table_lock(context, dbc, KRB5_LOCKMODE_EXCLUSIVE))
+        return;
+    memset(TABLE_RECS(dbc), 0,
+           (size_t)TABLE_NSLOTS(dbc) * sizeof(struct lockout_rec));
+    table_unlock(context, dbc);
+}
+
 static krb5_error_code
 lookup_lockout_policy(krb5_context context,
                       krb5_db_entry *entry,
@@ -132,6 +448,8 @@ krb5_db2_lockout_check_policy(krb5_context context,
     if (code != 0)
         return code;
 
+    krb5_db2_lockout_table_fetch(context, db_ctx, entry);
+
     if (locked_check_p(context, stamp, max_fail, lockout_duration, entry))
         return KRB5KDC_ERR_CLIENT_REVOKED;
 
@@ -144,13 +462,15 @@ krb5_db2_lockout_audit(krb5_context context,
                        krb5_timestamp stamp,
                        krb5_error_code status)
 {
-    krb5_error_code code;
+    krb5_error_code code = 0;
     krb5_kvno max_fail = 0;
     krb5_deltat failcnt_interval = 0;
     krb5_deltat lockout_duration = 0;
     krb5_db2_context *db_ctx = context->dal_handle->db_context;
-    krb5_boolean need_update = FALSE;
+    krb5_boolean need_update = FALSE, table_locked = FALSE;
     krb5_timestamp unlock_time;
+    krb5_data key = empty_data();
+    struct lockout_rec *rec = NULL;
 
     switch (status) {
     case 0:
@@ -175,6 +495,18 @@ krb5_db2_lockout_audit(krb5_context context,
             return code;
     }
 
+    /* Work from the lockout table's counters, holding its lock until they
+     * have been updated. */
+    if (table_lock(context, db_ctx, KRB5_LOCKMODE_EXCLUSIVE)) {
+        table_locked = TRUE;
+        code = krb5_encode_princ_dbkey(context, &key, entry->princ);
+        if (code != 0)
+            goto cleanup;
+        rec = table_find(db_ctx, &key, FALSE);
+        if (rec != NULL && (rec->flags & LOCKOUT_VALID))
+            rec_to_entry(rec, entry);
+    }
+
     /*
      * Don't continue to modify the DB for an already locked account.
      * (In most cases, status will be KRB5KDC_ERR_CLIENT_REVOKED, and
@@ -182,7 +514,7 @@ krb5_db2_lockout_audit(krb5_context context,
      * integrity error or preauth failure before a policy check.)
      */
     if (locked_check_p(context, stamp, max_fail, lockout_duration, entry))
-        return 0;
+        goto cleanup;
 
     /* Only mark the authentication as successful if the entry
      * required preauthentication, otherwise we have no idea. */
@@ -191,7 +523,8 @@ krb5_db2_lockout_audit(krb5_context context,
             entry->fail_auth_count = 0;
             need_update = TRUE;
         }
-        if (!db_ctx->disable_last_success) {
+        /* Coalesce repeated successes within the same second. */
+        if (!db_ctx->disable_last_success && entry->last_success != stamp) {
             entry->last_success = stamp;
             need_update = TRUE;
         }
@@ -216,11 +549,30 @@ krb5_db2_lockout_audit(krb5_context context,
         need_update = TRUE;
     }
 
-    if (need_update) {
+    if (!need_update)
+        goto cleanup;
+
+    if (table_locked && rec == NULL)
+        rec = table_find(db_ctx, &key, TRUE);
+    if (rec != NULL) {
+        entry_to_rec(entry, rec);
+        table_sync(db_ctx);
+    } else {
+        /* There's no room in the table; rewrite the entry instead. */
+        if (table_locked && !db_ctx->lockout_full) {
+            syslog(LOG_WARNING, "lockout table is full; consider increasing "
+                   "lockout_table_size");
+            db_ctx->lockout_full = TRUE;
+        }
+        if (table_locked)
+            table_unlock(context, db_ctx);
+        table_locked = FALSE;
         code = krb5_db2_put_principal(context, entry, NULL);
-        if (code != 0)
-            return code;
     }
 
-    return 0;
+cleanup:
+    if (table_locked)
+        table_unlock(context, db_ctx);
+    krb5_free_data_contents(context, &key);
+    return code;
 }
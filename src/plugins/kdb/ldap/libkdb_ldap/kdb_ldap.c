@@ -41,6 +41,11 @@
 
 /*
  * ldap get age
+ *
+ * The directory has no generation counter we can cheaply read, and it may be
+ * modified by other servers, so report that the age is unknown rather than
+ * returning the current time; callers use the age to decide when cached
+ * entries are stale.
  */
 krb5_error_code
 krb5_ldap_get_age(context, db_name, age)
@@ -48,8 +53,7 @@ krb5_ldap_get_age(context, db_name, age)
     char *db_name;
     time_t *age;
 {
-    time (age);
-    return 0;
+    return KRB5_PLUGIN_OP_NOTSUPP;
 }
 
 /*
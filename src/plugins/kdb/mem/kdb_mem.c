@@ -0,0 +1,1223 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* plugins/kdb/mem/kdb_mem.c - In-memory KDB module */
+/*
+ * Copyright (C) 2014 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This module keeps its data in a backing database module (db2 by default)
+ * and passes every operation through to it, except that when it is opened by
+ * the KDC, principal lookups are answered from an in-memory snapshot of the
+ * whole principal database.  The snapshot is a hash table of decoded entries
+ * shared by all of the contexts in the process which open the same database,
+ * so that the KDC's worker threads share one copy.
+ *
+ * A snapshot is never modified once published.  Writers (kadmind, kpropd,
+ * kdb5_util) update the backing database as usual.  While lookups are being
+ * made, a loader thread checks the backing database's age about once a
+ * second; if it has changed, the loader reads a new snapshot through a context
+ * of its own and publishes it by swapping the current pointer, while lookups
+ * continue to read the old one.  After a load, the loader waits several times
+ * as long as the load took before checking again, so that a frequently
+ * modified database does not keep it busy.  Without thread support, the
+ * lookup which notices the change loads the snapshot itself.  Readers take no
+ * locks: they announce themselves in one of two counters selected by an epoch
+ * number, and the publisher advances the epoch and waits for the old epoch's
+ * counter to drain before freeing the old snapshot.
+ *
+ * The backing module must report its age through get_age; modules which
+ * cannot (such as LDAP) are refused, since the snapshot would never be
+ * refreshed.  A snapshot lookup finds an entry only under the name it was
+ * stored under, so lookups with flags which may let the backing module find
+ * an entry by another name go to the backing module if the snapshot has no
+ * entry of that name.
+ *
+ * If compiled_database is set, the KDC maps that file (written by kdb5_util
+ * compile, or by this module after a full load) instead of loading a hash
+ * table, and remaps it when it is replaced.  If the backing database changes
+ * after the file was compiled, lookups go to the backing database until the
+ * file is compiled again.
+ */
+
+#include "k5-int.h"
+#include <sys/time.h>
+#include <sys/stat.h>
+#include "kdb5.h"
+
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#ifdef __GNUC__
+#define ATOMIC_ADD(p, n) ((void)__sync_add_and_fetch(p, n))
+#define MEMORY_BARRIER() __sync_synchronize()
+#else
+/* Without compiler atomics, protect the reader counters with a mutex. */
+static k5_mutex_t atomic_lock = K5_MUTEX_PARTIAL_INITIALIZER;
+#define ATOMIC_ADD(p, n) (k5_mutex_lock(&atomic_lock), *(p) += (n),     \
+                          k5_mutex_unlock(&atomic_lock))
+#define MEMORY_BARRIER() (k5_mutex_lock(&atomic_lock),                  \
+                          k5_mutex_unlock(&atomic_lock))
+#endif
+
+#define DEFAULT_BACKING_LIBRARY "db2"
+
+/* After loading a snapshot, the loader waits this many times as long as the
+ * load took before checking the backing database again. */
+#define LOAD_BACKOFF 4
+
+/* Lookup flags with which the backing module might find an entry under
+ * another name. */
+#define ALIAS_FLAGS (KRB5_KDB_FLAG_ALIAS_OK | KRB5_KDB_FLAG_CANONICALIZE | \
+                     KRB5_KDB_FLAG_CLIENT_REFERRALS_ONLY |              \
+                     KRB5_KDB_FLAG_MAP_PRINCIPALS)
+
+struct mem_ent {
+    struct mem_ent *next;
+    krb5_ui_4 hash;
+    krb5_db_entry *entry;
+};
+
+struct snapshot {
+    time_t age;                 /* Age of the backing DB when loaded */
+    size_t nbuckets;
+    struct mem_ent **buckets;
+    struct krb5int_compiled_db *cdb; /* Mapped compiled file, if used */
+    volatile krb5_boolean stale;     /* Backing DB has changed since cdb */
+};
+
+/* The in-memory database for one backing database, shared by every context
+ * which opens it for the KDC. */
+struct shared_db {
+    struct shared_db *next;
+    char *key;
+    int refcount;
+    char *compiled;             /* Compiled database filename, if used */
+    char *realm;                /* For opening the loader's context */
+    char **args;
+    k5_mutex_t lock;
+    krb5_boolean loading;
+    struct snapshot *volatile current;
+    volatile unsigned int epoch;
+    volatile long readers[2];
+    volatile time_t checked;    /* When we last checked the backing age */
+    volatile krb5_boolean wanted; /* Lookups made since the loader checked */
+#ifdef ENABLE_THREADS
+    pthread_mutex_t loader_lock;
+    pthread_cond_t loader_cond;
+    pthread_t loader;
+    volatile pid_t loader_pid;  /* Process which started the loader */
+    krb5_boolean loader_running;
+    krb5_boolean loader_stop;
+    volatile krb5_boolean loader_failed;
+    krb5_context loader_context;
+#endif
+};
+
+typedef struct {
+    db_library lib;             /* Backing module */
+    void *backing;              /* Backing module's DB context */
+    struct shared_db *db;       /* Snapshot, if opened for the KDC */
+    char *namebuf;              /* Reused for compiled database lookups */
+    unsigned int namebufsize;
+} mem_context;
+
+static k5_mutex_t shared_lock = K5_MUTEX_PARTIAL_INITIALIZER;
+static struct shared_db *shared_list;
+
+/*
+ * The backing module keeps its state in the DAL handle's db_context, so
+ * install the backing context there while calling into it.  A krb5 context
+ * is used by only one thread at a time, so this is safe.
+ */
+static void *
+enter_backing(krb5_context context, mem_context *mc)
+{
+    void *save = context->dal_handle->db_context;
+
+    context->dal_handle->db_context = mc->backing;
+    return save;
+}
+
+static void
+leave_backing(krb5_context context, mem_context *mc, void *save)
+{
+    mc->backing = context->dal_handle->db_context;
+    context->dal_handle->db_context = save;
+}
+
+/* Define mem_NAME to call the backing module's NAME method. */
+#define PROXY(NAME, ARGLIST, ARGNAMES)                                  \
+    static krb5_error_code mem_##NAME ARGLIST                           \
+    {                                                                   \
+        mem_context *mc = context->dal_handle->db_context;             \
+        krb5_error_code ret;                                            \
+        void *save;                                                     \
+                                                                        \
+        if (mc->lib->vftabl.NAME == NULL)                               \
+            return KRB5_PLUGIN_OP_NOTSUPP;                              \
+        save = enter_backing(context, mc);                              \
+        ret = mc->lib->vftabl.NAME ARGNAMES;                            \
+        leave_backing(context, mc, save);                               \
+        return ret;                                                     \
+    }                                                                   \
+    /* hack: decl to allow a following ";" */                           \
+    static krb5_error_code mem_##NAME ARGLIST
+
+#define PROXY_VOID(NAME, ARGLIST, ARGNAMES)                             \
+    static void mem_##NAME ARGLIST                                      \
+    {                                                                   \
+        mem_context *mc = context->dal_handle->db_context;             \
+        void *save;                                                     \
+                                                                        \
+        if (mc->lib->vftabl.NAME == NULL)                               \
+            return;                                                     \
+        save = enter_backing(context, mc);                              \
+        mc->lib->vftabl.NAME ARGNAMES;                                  \
+        leave_backing(context, mc, save);                               \
+    }                                                                   \
+    /* hack: decl to allow a following ";" */                           \
+    static void mem_##NAME ARGLIST
+
+/* Return a hash of the realm and components of princ. */
+static krb5_ui_4
+princ_hash(krb5_const_principal princ)
+{
+    krb5_ui_4 h = 2166136261U;
+    const unsigned char *p, *end;
+    krb5_int32 i;
+
+    for (i = -1; i < princ->length; i++) {
+        const krb5_data *d = (i < 0) ? &princ->realm : &princ->data[i];
+
+        end = (unsigned char *)d->data + d->length;
+        for (p = (unsigned char *)d->data; p < end; p++)
+            h = (h ^ *p) * 16777619U;
+        h = (h ^ 0xff) * 16777619U;
+    }
+    return h;
+}
+
+static void
+free_snapshot(struct snapshot *snap)
+{
+    struct mem_ent *ent, *next;
+    size_t i;
+
+    if (snap == NULL)
+        return;
+    krb5int_compiled_db_close(snap->cdb);
+    for (i = 0; i < snap->nbuckets; i++) {
+        for (ent = snap->buckets[i]; ent != NULL; ent = next) {
+            next = ent->next;
+            krb5int_free_db_entry(ent->entry);
+            free(ent);
+        }
+    }
+    free(snap->buckets);
+    free(snap);
+}
+
+struct load_state {
+    krb5_context context;
+    struct mem_ent *list;
+    size_t count;
+};
+
+static int
+load_entry(krb5_pointer ptr, krb5_db_entry *entry)
+{
+    struct load_state *st = ptr;
+    struct mem_ent *ent;
+    krb5_error_code ret;
+
+    ent = k5alloc(sizeof(*ent), &ret);
+    if (ent == NULL)
+        return ret;
+    ret = krb5int_copy_db_entry(st->context, entry, &ent->entry);
+    if (ret) {
+        free(ent);
+        return ret;
+    }
+    ent->hash = princ_hash(entry->princ);
+    ent->next = st->list;
+    st->list = ent;
+    st->count++;
+    return 0;
+}
+
+/* Read every principal in the backing database into a new snapshot. */
+static krb5_error_code
+load_snapshot(krb5_context context, mem_context *mc, time_t age,
+              struct snapshot **snap_out)
+{
+    krb5_error_code ret;
+    struct load_state st;
+    struct snapshot *snap;
+    struct mem_ent *ent, *next;
+    size_t i;
+    void *save;
+
+    *snap_out = NULL;
+    st.context = context;
+    st.list = NULL;
+    st.count = 0;
+    save = enter_backing(context, mc);
+    ret = mc->lib->vftabl.iterate(context, NULL, load_entry, &st);
+    leave_backing(context, mc, save);
+    if (ret)
+        goto cleanup;
+
+    snap = k5alloc(sizeof(*snap), &ret);
+    if (snap == NULL)
+        goto cleanup;
+    snap->age = age;
+    snap->nbuckets = (st.count > 0) ? st.count : 1;
+    snap->buckets = k5alloc(snap->nbuckets * sizeof(*snap->buckets), &ret);
+    if (snap->buckets == NULL) {
+        free(snap);
+        goto cleanup;
+    }
+    for (ent = st.list; ent != NULL; ent = next) {
+        next = ent->next;
+        i = ent->hash % snap->nbuckets;
+        ent->next = snap->buckets[i];
+        snap->buckets[i] = ent;
+    }
+    st.list = NULL;
+    *snap_out = snap;
+
+cleanup:
+    for (ent = st.list; ent != NULL; ent = next) {
+        next = ent->next;
+        krb5int_free_db_entry(ent->entry);
+        free(ent);
+    }
+    return ret;
+}
+
+/* Begin reading db's current snapshot.  Return the epoch to pass to
+ * reader_exit(). */
+static unsigned int
+reader_enter(struct shared_db *db, struct snapshot **snap_out)
+{
+    unsigned int e;
+
+    for (;;) {
+        e = db->epoch;
+        ATOMIC_ADD(&db->readers[e & 1], 1);
+        if (db->epoch == e)
+            break;
+        ATOMIC_ADD(&db->readers[e & 1], -1);
+    }
+    *snap_out = db->current;
+    return e;
+}
+
+static void
+reader_exit(struct shared_db *db, unsigned int e)
+{
+    ATOMIC_ADD(&db->readers[e & 1], -1);
+}
+
+/* Make snap the current snapshot of db and free the old one once no reader
+ * can be using it.  Only one thread may publish at a time. */
+static void
+publish(struct shared_db *db, struct snapshot *snap)
+{
+    struct snapshot *old = db->current;
+    unsigned int e;
+
+    db->current = snap;
+    MEMORY_BARRIER();
+    e = db->epoch;
+    db->epoch = e + 1;
+    MEMORY_BARRIER();
+    while (db->readers[e & 1] != 0) {
+        struct timeval tv = { 0, 1000 };
+
+        (void)select(0, NULL, NULL, NULL, &tv);
+    }
+    free_snapshot(old);
+}
+
+/* Map db's compiled database file into a new snapshot if it has been
+ * replaced since the current snapshot was mapped, or set *snap_out to NULL if
+ * it has not. */
+static krb5_error_code
+map_compiled(struct shared_db *db, struct snapshot **snap_out)
+{
+    krb5_error_code ret;
+    struct snapshot *snap;
+    struct stat st;
+
+    *snap_out = NULL;
+    if (stat(db->compiled, &st) != 0)
+        return errno;
+    if (db->current != NULL && db->current->cdb->dev == st.st_dev &&
+        db->current->cdb->ino == st.st_ino)
+        return 0;
+    snap = k5alloc(sizeof(*snap), &ret);
+    if (snap == NULL)
+        return ret;
+    ret = krb5int_compiled_db_open(db->compiled, &snap->cdb);
+    if (ret) {
+        free(snap);
+        return ret;
+    }
+    snap->age = snap->cdb->age;
+    *snap_out = snap;
+    return 0;
+}
+
+/*
+ * Publish a new snapshot of db if its backing database has changed, reading
+ * it through mc and context.  Only one thread at a time may do this.
+ */
+static krb5_error_code
+update_snapshot(krb5_context context, mem_context *mc, struct shared_db *db)
+{
+    struct snapshot *snap;
+    krb5_error_code ret;
+    time_t age;
+    void *save;
+
+    save = enter_backing(context, mc);
+    ret = mc->lib->vftabl.get_age(context, NULL, &age);
+    leave_backing(context, mc, save);
+    if (ret)
+        return ret;
+    if (db->compiled != NULL) {
+        /* Keep the current mapping if the file can't be read. */
+        if (map_compiled(db, &snap) == 0 && snap != NULL) {
+            snap->stale = (age != snap->age);
+            publish(db, snap);
+        } else if (db->current != NULL) {
+            db->current->stale = (age != db->current->age);
+        }
+    } else if (age != db->current->age) {
+        ret = load_snapshot(context, mc, age, &snap);
+        if (ret == 0)
+            publish(db, snap);
+    }
+    return 0;
+}
+
+#ifdef ENABLE_THREADS
+
+static void *
+loader_main(void *arg)
+{
+    struct shared_db *db = arg;
+    krb5_context context = db->loader_context;
+    struct timespec ts;
+    time_t start, wait = 1;
+
+    if (krb5_db_open(context, db->args,
+                     KRB5_KDB_OPEN_RO | KRB5_KDB_SRV_TYPE_OTHER) != 0) {
+        /* Lookups will refresh the snapshot themselves. */
+        (void)krb5_db_fini(context);
+        db->loader_failed = TRUE;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&db->loader_lock);
+    while (!db->loader_stop) {
+        ts.tv_sec = time(NULL) + wait;
+        ts.tv_nsec = 0;
+        (void)pthread_cond_timedwait(&db->loader_cond, &db->loader_lock, &ts);
+        if (db->loader_stop || !db->wanted)
+            continue;
+        db->wanted = FALSE;
+        pthread_mutex_unlock(&db->loader_lock);
+
+        start = time(NULL);
+        (void)update_snapshot(context, context->dal_handle->db_context, db);
+        wait = (time(NULL) - start) * LOAD_BACKOFF;
+        if (wait < 1)
+            wait = 1;
+
+        pthread_mutex_lock(&db->loader_lock);
+    }
+    pthread_mutex_unlock(&db->loader_lock);
+    (void)krb5_db_fini(context);
+    return NULL;
+}
+
+/* Make sure this process has a loader thread for db, starting one if
+ * necessary.  Return true if the loader is keeping db's snapshot current. */
+static krb5_boolean
+start_loader(krb5_context context, struct shared_db *db)
+{
+    krb5_boolean running;
+    sigset_t all, old;
+    pid_t pid = getpid();
+
+    if (db->loader_pid == pid)
+        return !db->loader_failed;
+
+    k5_mutex_lock(&shared_lock);
+    if (db->loader_pid != pid) {
+        /* Threads don't survive fork(), so a loader started before the KDC
+         * forked its worker processes exists only in the parent.  Its lock
+         * may have been held when the process forked. */
+        if (db->loader_pid != 0) {
+            pthread_mutex_init(&db->loader_lock, NULL);
+            pthread_cond_init(&db->loader_cond, NULL);
+        }
+        /* The parent's loader context may have its database open (or be
+         * half-way through opening it).  Forget it without closing anything
+         * the parent still uses, and give this process's loader its own. */
+        if (db->loader_context != NULL) {
+            krb5_free_context(db->loader_context);
+            db->loader_context = NULL;
+        }
+        db->loader_pid = pid;
+        db->loader_running = FALSE;
+        db->loader_stop = FALSE;
+        db->loader_failed = TRUE;
+        if (krb5_copy_context(context, &db->loader_context) == 0 &&
+            krb5_set_default_realm(db->loader_context, db->realm) != 0) {
+            krb5_free_context(db->loader_context);
+            db->loader_context = NULL;
+        }
+        if (db->loader_context != NULL) {
+            /* Leave signal handling to the application's threads. */
+            sigfillset(&all);
+            pthread_sigmask(SIG_BLOCK, &all, &old);
+            if (pthread_create(&db->loader, NULL, loader_main, db) == 0) {
+                db->loader_running = TRUE;
+                db->loader_failed = FALSE;
+            }
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+        }
+    }
+    running = !db->loader_failed;
+    k5_mutex_unlock(&shared_lock);
+    return running;
+}
+
+static void
+stop_loader(struct shared_db *db)
+{
+    if (db->loader_running && db->loader_pid == getpid()) {
+        pthread_mutex_lock(&db->loader_lock);
+        db->loader_stop = TRUE;
+        pthread_cond_signal(&db->loader_cond);
+        pthread_mutex_unlock(&db->loader_lock);
+        pthread_join(db->loader, NULL);
+    }
+    if (db->loader_context != NULL)
+        krb5_free_context(db->loader_context);
+    pthread_cond_destroy(&db->loader_cond);
+    pthread_mutex_destroy(&db->loader_lock);
+}
+
+#else /* ENABLE_THREADS */
+
+static krb5_boolean
+start_loader(krb5_context context, struct shared_db *db)
+{
+    return FALSE;
+}
+
+static void
+stop_loader(struct shared_db *db)
+{
+}
+
+#endif /* ENABLE_THREADS */
+
+/*
+ * Make sure mc's snapshot is kept up to date.  Check at most once a second.
+ * If there is no loader thread, load a new snapshot if the backing database
+ * has changed, unless another thread is already doing so.
+ */
+static void
+refresh(krb5_context context, mem_context *mc)
+{
+    struct shared_db *db = mc->db;
+    krb5_boolean busy;
+    time_t now = time(NULL);
+
+    if (db->checked == now)
+        return;
+    if (start_loader(context, db)) {
+        db->wanted = TRUE;
+        db->checked = now;
+        return;
+    }
+
+    k5_mutex_lock(&db->lock);
+    busy = db->loading;
+    db->loading = TRUE;
+    k5_mutex_unlock(&db->lock);
+    if (busy)
+        return;
+    db->checked = now;
+
+    /* Keep using the current snapshot if the backing DB can't be read. */
+    (void)update_snapshot(context, mc, db);
+
+    k5_mutex_lock(&db->lock);
+    db->loading = FALSE;
+    k5_mutex_unlock(&db->lock);
+}
+
+static void
+free_args(char **args)
+{
+    char **p;
+
+    for (p = args; p != NULL && *p != NULL; p++)
+        free(*p);
+    free(args);
+}
+
+static krb5_error_code
+copy_args(char **args, char ***copy_out)
+{
+    krb5_error_code ret;
+    char **copy;
+    size_t i, n;
+
+    *copy_out = NULL;
+    for (n = 0; args != NULL && args[n] != NULL; n++);
+    copy = k5alloc((n + 1) * sizeof(*copy), &ret);
+    if (copy == NULL)
+        return ret;
+    for (i = 0; i < n; i++) {
+        copy[i] = strdup(args[i]);
+        if (copy[i] == NULL) {
+            free_args(copy);
+            return ENOMEM;
+        }
+    }
+    *copy_out = copy;
+    return 0;
+}
+
+static void
+free_shared_db(struct shared_db *db)
+{
+    if (db == NULL)
+        return;
+    stop_loader(db);
+    free_snapshot(db->current);
+    k5_mutex_destroy(&db->lock);
+    profile_release_string(db->compiled);
+    free(db->realm);
+    free_args(db->args);
+    free(db->key);
+    free(db);
+}
+
+/* Attach mc to the shared in-memory copy of its database, loading the
+ * database if no other context in the process has it open. */
+static krb5_error_code
+attach_shared_db(krb5_context context, mem_context *mc, char *conf_section,
+                 char **db_args)
+{
+    krb5_error_code ret;
+    struct shared_db *db;
+    struct snapshot *snap;
+    struct k5buf buf;
+    char *key;
+    time_t age;
+    void *save;
+
+    k5_buf_init_dynamic(&buf);
+    k5_buf_add_fmt(&buf, "%s\n%s", context->default_realm, conf_section);
+    for (; db_args != NULL && *db_args != NULL; db_args++)
+        k5_buf_add_fmt(&buf, "\n%s", *db_args);
+    key = k5_buf_data(&buf);
+    if (key == NULL)
+        return ENOMEM;
+
+    k5_mutex_lock(&shared_lock);
+    for (db = shared_list; db != NULL; db = db->next) {
+        if (strcmp(db->key, key) == 0)
+            break;
+    }
+    if (db != NULL) {
+        db->refcount++;
+        mc->db = db;
+        free(key);
+        k5_mutex_unlock(&shared_lock);
+        return 0;
+    }
+
+    db = k5alloc(sizeof(*db), &ret);
+    if (db == NULL)
+        goto cleanup;
+    ret = k5_mutex_init(&db->lock);
+    if (ret) {
+        free(db);
+        db = NULL;
+        goto cleanup;
+    }
+#ifdef ENABLE_THREADS
+    pthread_mutex_init(&db->loader_lock, NULL);
+    pthread_cond_init(&db->loader_cond, NULL);
+#endif
+    db->key = key;
+    key = NULL;
+    db->refcount = 1;
+    db->realm = strdup(context->default_realm);
+    if (db->realm == NULL) {
+        ret = ENOMEM;
+        goto cleanup;
+    }
+    ret = copy_args(db_args, &db->args);
+    if (ret)
+        goto cleanup;
+    ret = profile_get_string(context->profile, KDB_MODULE_SECTION,
+                             conf_section, KRB5_CONF_COMPILED_DATABASE, NULL,
+                             &db->compiled);
+    if (ret)
+        goto cleanup;
+
+    /* Without the backing database's age we could never refresh the
+     * snapshot. */
+    save = enter_backing(context, mc);
+    ret = mc->lib->vftabl.get_age(context, NULL, &age);
+    leave_backing(context, mc, save);
+    if (ret) {
+        krb5_set_error_message(context, ret,
+                               _("Backing database module for in-memory "
+                                 "database cannot report its age"));
+        goto cleanup;
+    }
+    if (db->compiled != NULL) {
+        /* Use the backing database until the file exists. */
+        if (map_compiled(db, &snap) == 0) {
+            snap->stale = (age != snap->age);
+            db->current = snap;
+        }
+    } else {
+        ret = load_snapshot(context, mc, age, &snap);
+        if (ret)
+            goto cleanup;
+        db->current = snap;
+    }
+    db->checked = time(NULL);
+
+    db->next = shared_list;
+    shared_list = db;
+    mc->db = db;
+    db = NULL;
+
+cleanup:
+    k5_mutex_unlock(&shared_lock);
+    free_shared_db(db);
+    free(key);
+    return ret;
+}
+
+static void
+detach_shared_db(mem_context *mc)
+{
+    struct shared_db **dbp, *db = mc->db;
+
+    if (db == NULL)
+        return;
+    mc->db = NULL;
+    k5_mutex_lock(&shared_lock);
+    if (--db->refcount > 0) {
+        k5_mutex_unlock(&shared_lock);
+        return;
+    }
+    for (dbp = &shared_list; *dbp != db; dbp = &(*dbp)->next);
+    *dbp = db->next;
+    k5_mutex_unlock(&shared_lock);
+    free_shared_db(db);
+}
+
+static krb5_error_code
+mem_init_library(void)
+{
+    krb5_error_code ret;
+
+#ifndef __GNUC__
+    ret = k5_mutex_finish_init(&atomic_lock);
+    if (ret)
+        return ret;
+#endif
+    ret = k5_mutex_finish_init(&shared_lock);
+    if (ret)
+        return ret;
+    return 0;
+}
+
+static krb5_error_code
+mem_fini_library(void)
+{
+    return 0;
+}
+
+/* Create a context for conf_section and load its backing module. */
+static krb5_error_code
+new_context(krb5_context context, char *conf_section, mem_context **mc_out)
+{
+    krb5_error_code ret;
+    mem_context *mc;
+    char *libname = NULL;
+
+    *mc_out = NULL;
+    mc = k5alloc(sizeof(*mc), &ret);
+    if (mc == NULL)
+        return ret;
+    ret = profile_get_string(context->profile, KDB_MODULE_SECTION,
+                             conf_section, KRB5_CONF_BACKING_LIBRARY,
+                             DEFAULT_BACKING_LIBRARY, &libname);
+    if (ret)
+        goto error;
+    ret = krb5int_db_load_module(context, libname, &mc->lib);
+    if (ret)
+        goto error;
+    profile_release_string(libname);
+    *mc_out = mc;
+    return 0;
+
+error:
+    profile_release_string(libname);
+    free(mc);
+    return ret;
+}
+
+/* Finalize the backing module's context (if it has one) and free mc. */
+static void
+free_context(krb5_context context, mem_context *mc)
+{
+    void *save;
+
+    if (mc == NULL)
+        return;
+    detach_shared_db(mc);
+    if (mc->backing != NULL) {
+        save = enter_backing(context, mc);
+        (void)mc->lib->vftabl.fini_module(context);
+        leave_backing(context, mc, save);
+    }
+    krb5int_db_unload_module(mc->lib);
+    free(mc->namebuf);
+    free(mc);
+}
+
+static krb5_boolean
+is_temporary(char **db_args)
+{
+    for (; db_args != NULL && *db_args != NULL; db_args++) {
+        if (strcmp(*db_args, "temporary") == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static krb5_error_code
+mem_init_module(krb5_context context, char *conf_section, char **db_args,
+                int mode)
+{
+    krb5_error_code ret;
+    mem_context *mc;
+    void *save;
+
+    ret = new_context(context, conf_section, &mc);
+    if (ret)
+        return ret;
+    context->dal_handle->db_context = mc;
+    save = enter_backing(context, mc);
+    ret = mc->lib->vftabl.init_module(context, conf_section, db_args, mode);
+    leave_backing(context, mc, save);
+    if (ret == 0 && (mode & KRB5_KDB_SRV_TYPE_KDC) && !is_temporary(db_args))
+        ret = attach_shared_db(context, mc, conf_section, db_args);
+    if (ret) {
+        free_context(context, mc);
+        context->dal_handle->db_context = NULL;
+    }
+    return ret;
+}
+
+static krb5_error_code
+mem_fini_module(krb5_context context)
+{
+    free_context(context, context->dal_handle->db_context);
+    context->dal_handle->db_context = NULL;
+    return 0;
+}
+
+static krb5_error_code
+mem_create(krb5_context context, char *conf_section, char **db_args)
+{
+    krb5_error_code ret;
+    mem_context *mc;
+    void *save;
+
+    ret = new_context(context, conf_section, &mc);
+    if (ret)
+        return ret;
+    context->dal_handle->db_context = mc;
+    save = enter_backing(context, mc);
+    ret = mc->lib->vftabl.create(context, conf_section, db_args);
+    leave_backing(context, mc, save);
+    if (ret) {
+        free_context(context, mc);
+        context->dal_handle->db_context = NULL;
+    }
+    return ret;
+}
+
+static krb5_error_code
+mem_destroy(krb5_context context, char *conf_section, char **db_args)
+{
+    krb5_error_code ret;
+    mem_context *mc;
+    void *save;
+
+    if (context->dal_handle->db_context != NULL)
+        (void)mem_fini_module(context);
+    ret = new_context(context, conf_section, &mc);
+    if (ret)
+        return ret;
+    context->dal_handle->db_context = mc;
+    save = enter_backing(context, mc);
+    ret = mc->lib->vftabl.destroy(context, conf_section, db_args);
+    leave_backing(context, mc, save);
+    free_context(context, mc);
+    context->dal_handle->db_context = NULL;
+    return ret;
+}
+
+/* Look up search_for in the backing database, returning our own copy of the
+ * entry, as for snapshot entries. */
+static krb5_error_code
+get_backing(krb5_context context, mem_context *mc,
+            krb5_const_principal search_for, unsigned int flags,
+            krb5_db_entry **entry)
+{
+    krb5_error_code ret;
+    krb5_db_entry *ent;
+    void *save;
+
+    save = enter_backing(context, mc);
+    ret = mc->lib->vftabl.get_principal(context, search_for, flags, &ent);
+    leave_backing(context, mc, save);
+    if (ret)
+        return ret;
+    ret = krb5int_copy_db_entry(context, ent, entry);
+    save = enter_backing(context, mc);
+    mc->lib->vftabl.free_principal(context, ent);
+    leave_backing(context, mc, save);
+    return ret;
+}
+
+/* Look up search_for in the compiled database file, or in the backing
+ * database if the file is missing or out of date. */
+static krb5_error_code
+get_compiled(krb5_context context, mem_context *mc,
+             krb5_const_principal search_for, unsigned int flags,
+             krb5_db_entry **entry)
+{
+    struct snapshot *snap;
+    krb5_error_code ret;
+    unsigned int e;
+
+    e = reader_enter(mc->db, &snap);
+    if (snap != NULL && !snap->stale) {
+        ret = krb5_unparse_name_ext(context, search_for, &mc->namebuf,
+                                    &mc->namebufsize);
+        if (ret == 0) {
+            ret = krb5int_compiled_db_get(snap->cdb, mc->namebuf,
+                                          strlen(mc->namebuf), entry);
+        }
+        reader_exit(mc->db, e);
+        if (ret != KRB5_KDB_NOENTRY || !(flags & ALIAS_FLAGS))
+            return ret;
+    } else {
+        reader_exit(mc->db, e);
+    }
+    return get_backing(context, mc, search_for, flags, entry);
+}
+
+static krb5_error_code
+mem_get_principal(krb5_context context, krb5_const_principal search_for,
+                  unsigned int flags, krb5_db_entry **entry)
+{
+    mem_context *mc = context->dal_handle->db_context;
+    struct snapshot *snap;
+    struct mem_ent *ent;
+    krb5_error_code ret;
+    krb5_ui_4 hash;
+    unsigned int e;
+    void *save;
+
+    *entry = NULL;
+    if (mc->db == NULL) {
+        save = enter_backing(context, mc);
+        ret = mc->lib->vftabl.get_principal(context, search_for, flags,
+                                            entry);
+        leave_backing(context, mc, save);
+        return ret;
+    }
+
+    refresh(context, mc);
+    if (mc->db->compiled != NULL)
+        return get_compiled(context, mc, search_for, flags, entry);
+
+    ret = KRB5_KDB_NOENTRY;
+    hash = princ_hash(search_for);
+    e = reader_enter(mc->db, &snap);
+    for (ent = snap->buckets[hash % snap->nbuckets]; ent != NULL;
+         ent = ent->next) {
+        if (ent->hash == hash &&
+            krb5_principal_compare(context, ent->entry->princ, search_for)) {
+            ret = krb5int_copy_db_entry(context, ent->entry, entry);
+            break;
+        }
+    }
+    reader_exit(mc->db, e);
+
+    /* The backing module might find the entry under another name. */
+    if (ret == KRB5_KDB_NOENTRY && (flags & ALIAS_FLAGS))
+        ret = get_backing(context, mc, search_for, flags, entry);
+    return ret;
+}
+
+static void
+mem_free_principal(krb5_context context, krb5_db_entry *entry)
+{
+    mem_context *mc = context->dal_handle->db_context;
+    void *save;
+
+    /* Entries from the snapshot are our own copies or were read from the
+     * compiled database file. */
+    if (mc->db != NULL) {
+        krb5int_free_db_entry(entry);
+        return;
+    }
+    save = enter_backing(context, mc);
+    mc->lib->vftabl.free_principal(context, entry);
+    leave_backing(context, mc, save);
+}
+
+static void *
+mem_alloc(krb5_context context, void *ptr, size_t size)
+{
+    mem_context *mc = context->dal_handle->db_context;
+    void *save, *result;
+
+    if (mc->lib->vftabl.alloc == NULL)
+        return realloc(ptr, size);
+    save = enter_backing(context, mc);
+    result = mc->lib->vftabl.alloc(context, ptr, size);
+    leave_backing(context, mc, save);
+    return result;
+}
+
+static void
+mem_free(krb5_context context, void *ptr)
+{
+    mem_context *mc = context->dal_handle->db_context;
+    void *save;
+
+    if (mc->lib->vftabl.free == NULL) {
+        free(ptr);
+        return;
+    }
+    save = enter_backing(context, mc);
+    mc->lib->vftabl.free(context, ptr);
+    leave_backing(context, mc, save);
+}
+
+PROXY(get_age, (krb5_context context, char *db_name, time_t *age),
+      (context, db_name, age));
+PROXY(lock, (krb5_context context, int mode), (context, mode));
+PROXY(unlock, (krb5_context context), (context));
+PROXY(put_principal,
+      (krb5_context context, krb5_db_entry *entry, char **db_args),
+      (context, entry, db_args));
+PROXY(delete_principal,
+      (krb5_context context, krb5_const_principal search_for),
+      (context, search_for));
+PROXY(iterate,
+      (krb5_context context, char *match_entry,
+       int (*func)(krb5_pointer, krb5_db_entry *), krb5_pointer func_arg),
+      (context, match_entry, func, func_arg));
+PROXY(create_policy, (krb5_context context, osa_policy_ent_t policy),
+      (context, policy));
+PROXY(get_policy,
+      (krb5_context context, char *name, osa_policy_ent_t *policy),
+      (context, name, policy));
+PROXY(put_policy, (krb5_context context, osa_policy_ent_t policy),
+      (context, policy));
+PROXY(iter_policy,
+      (krb5_context context, char *match_entry,
+       osa_adb_iter_policy_func func, void *data),
+      (context, match_entry, func, data));
+PROXY(delete_policy, (krb5_context context, char *policy),
+      (context, policy));
+PROXY_VOID(free_policy, (krb5_context context, osa_policy_ent_t policy),
+           (context, policy));
+PROXY(sign_authdata,
+      (krb5_context context, unsigned int flags,
+       krb5_const_principal client_princ, krb5_db_entry *client,
+       krb5_db_entry *server, krb5_db_entry *krbtgt,
+       krb5_keyblock *client_key, krb5_keyblock *server_key,
+       krb5_keyblock *krbtgt_key, krb5_keyblock *session_key,
+       krb5_timestamp authtime, krb5_authdata **tgt_auth_data,
+       krb5_authdata ***signed_auth_data),
+      (context, flags, client_princ, client, server, krbtgt, client_key,
+       server_key, krbtgt_key, session_key, authtime, tgt_auth_data,
+       signed_auth_data));
+PROXY(check_transited_realms,
+      (krb5_context context, const krb5_data *tr_contents,
+       const krb5_data *client_realm, const krb5_data *server_realm),
+      (context, tr_contents, client_realm, server_realm));
+PROXY(check_policy_as,
+      (krb5_context context, krb5_kdc_req *request, krb5_db_entry *client,
+       krb5_db_entry *server, krb5_timestamp kdc_time, const char **status,
+       krb5_pa_data ***e_data),
+      (context, request, client, server, kdc_time, status, e_data));
+PROXY(check_policy_tgs,
+      (krb5_context context, krb5_kdc_req *request, krb5_db_entry *server,
+       krb5_ticket *ticket, const char **status, krb5_pa_data ***e_data),
+      (context, request, server, ticket, status, e_data));
+PROXY_VOID(audit_as_req,
+           (krb5_context context, krb5_kdc_req *request,
+            krb5_db_entry *client, krb5_db_entry *server,
+            krb5_timestamp authtime, krb5_error_code error_code),
+           (context, request, client, server, authtime, error_code));
+PROXY_VOID(refresh_config, (krb5_context context), (context));
+PROXY(check_allowed_to_delegate,
+      (krb5_context context, krb5_const_principal client,
+       const krb5_db_entry *server, krb5_const_principal proxy),
+      (context, client, server, proxy));
+
+/* Open the database promoted from a temporary database and compile it into
+ * filename. */
+static krb5_error_code
+compile_promoted(krb5_context context, mem_context *mc, char *conf_section,
+                 char **db_args, const char *filename)
+{
+    krb5_error_code ret = 0;
+    char **args;
+    size_t i, n;
+    void *save;
+
+    for (n = 0; db_args != NULL && db_args[n] != NULL; n++);
+    args = k5alloc((n + 1) * sizeof(*args), &ret);
+    if (args == NULL)
+        return ret;
+    for (i = n = 0; db_args != NULL && db_args[i] != NULL; i++) {
+        if (strcmp(db_args[i], "temporary") != 0 &&
+            strcmp(db_args[i], "merge_nra") != 0)
+            args[n++] = db_args[i];
+    }
+    if (mc->backing == NULL) {
+        save = enter_backing(context, mc);
+        ret = mc->lib->vftabl.init_module(context, conf_section, args,
+                                          KRB5_KDB_OPEN_RO |
+                                          KRB5_KDB_SRV_TYPE_ADMIN);
+        leave_backing(context, mc, save);
+    }
+    free(args);
+    if (ret)
+        return ret;
+    return krb5_db_compile(context, filename);
+}
+
+static krb5_error_code
+mem_promote_db(krb5_context context, char *conf_section, char **db_args)
+{
+    mem_context *mc = context->dal_handle->db_context;
+    krb5_error_code ret;
+    char *filename = NULL;
+    void *save;
+
+    if (mc->lib->vftabl.promote_db == NULL)
+        return KRB5_PLUGIN_OP_NOTSUPP;
+    save = enter_backing(context, mc);
+    ret = mc->lib->vftabl.promote_db(context, conf_section, db_args);
+    leave_backing(context, mc, save);
+    if (ret)
+        return ret;
+
+    /* The load has succeeded even if compiling fails; the KDC will use the
+     * backing database while the compiled file is out of date. */
+    if (profile_get_string(context->profile, KDB_MODULE_SECTION, conf_section,
+                           KRB5_CONF_COMPILED_DATABASE, NULL,
+                           &filename) == 0 && filename != NULL) {
+        (void)compile_promoted(context, mc, conf_section, db_args, filename);
+        profile_release_string(filename);
+    }
+    return 0;
+}
+
+kdb_vftabl PLUGIN_SYMBOL_NAME(krb5_mem, kdb_function_table) = {
+    KRB5_KDB_DAL_MAJOR_VERSION,             /* major version number */
+    0,                                      /* minor version number 0 */
+    /* init_library */                  mem_init_library,
+    /* fini_library */                  mem_fini_library,
+    /* init_module */                   mem_init_module,
+    /* fini_module */                   mem_fini_module,
+    /* create */                        mem_create,
+    /* destroy */                       mem_destroy,
+    /* get_age */                       mem_get_age,
+    /* lock */                          mem_lock,
+    /* unlock */                        mem_unlock,
+    /* get_principal */                 mem_get_principal,
+    /* free_principal */                mem_free_principal,
+    /* put_principal */                 mem_put_principal,
+    /* delete_principal */              mem_delete_principal,
+    /* iterate */                       mem_iterate,
+    /* create_policy */                 mem_create_policy,
+    /* get_policy */                    mem_get_policy,
+    /* put_policy */                    mem_put_policy,
+    /* iter_policy */                   mem_iter_policy,
+    /* delete_policy */                 mem_delete_policy,
+    /* free_policy */                   mem_free_policy,
+    /* alloc */                         mem_alloc,
+    /* free */                          mem_free,
+    /* fetch_master_key */              NULL,
+    /* fetch_master_key_list */         NULL,
+    /* store_master_key_list */         NULL,
+    /* dbe_search_enctype */            NULL,
+    /* change_pwd */                    NULL,
+    /* promote_db */                    mem_promote_db,
+    /* decrypt_key_data */              NULL,
+    /* encrypt_key_data */              NULL,
+    /* sign_authdata */                 mem_sign_authdata,
+    /* check_transited_realms */        mem_check_transited_realms,
+    /* check_policy_as */               mem_check_policy_as,
+    /* check_policy_tgs */              mem_check_policy_tgs,
+    /* audit_as_req */                  mem_audit_as_req,
+    /* refresh_config */                mem_refresh_config,
+    /* check_allowed_to_delegate */     mem_check_allowed_to_delegate
+};
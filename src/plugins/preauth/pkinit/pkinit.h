@@ -260,6 +260,9 @@ struct _pkinit_kdc_req_context {
     krb5_auth_pack *rcv_auth_pack;
     krb5_auth_pack_draft9 *rcv_auth_pack9;
     krb5_preauthtype pa_type;
+    /* DH values computed while verifying the request, if any */
+    unsigned char *dh_pubkey, *server_key;
+    unsigned int dh_pubkey_len, server_key_len;
 };
 typedef struct _pkinit_kdc_req_context *pkinit_kdc_req_context;
 
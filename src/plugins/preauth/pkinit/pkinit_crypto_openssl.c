@@ -43,7 +43,18 @@
 
 #include "pkinit_crypto_openssl.h"
 
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#endif
+
 static void openssl_init(void);
+static void openssl_locks_init(void);
+static void openssl_locks_fini(void);
+
+static krb5_error_code dh_pool_init(pkinit_plg_crypto_context);
+static void dh_pool_fini(pkinit_plg_crypto_context);
 
 static krb5_error_code pkinit_init_pkinit_oids(pkinit_plg_crypto_context );
 static void pkinit_fini_pkinit_oids(pkinit_plg_crypto_context );
@@ -438,6 +449,7 @@ pkinit_init_plg_crypto(pkinit_plg_crypto_context *cryptoctx)
     if (ctx == NULL)
         goto out;
     memset(ctx, 0, sizeof(*ctx));
+    openssl_locks_init();
 
     pkiDebug("%s: initializing openssl crypto context at %p\n",
              __FUNCTION__, ctx);
@@ -449,6 +461,10 @@ pkinit_init_plg_crypto(pkinit_plg_crypto_context *cryptoctx)
     if (retval)
         goto out;
 
+    retval = dh_pool_init(ctx);
+    if (retval)
+        goto out;
+
     *cryptoctx = ctx;
 
 out:
@@ -465,8 +481,10 @@ pkinit_fini_plg_crypto(pkinit_plg_crypto_context cryptoctx)
 
     if (cryptoctx == NULL)
         return;
+    dh_pool_fini(cryptoctx);
     pkinit_fini_pkinit_oids(cryptoctx);
     pkinit_fini_dh_params(cryptoctx);
+    openssl_locks_fini();
     free(cryptoctx);
 }
 
@@ -2848,6 +2866,224 @@ cleanup:
     return retval;
 }
 
+/*
+ * Generating the KDC's half of a DH exchange is the most expensive part of a
+ * PKINIT request.  On the KDC, a background thread keeps a small pool of
+ * pregenerated key pairs for each well-known group which clients have used,
+ * so that a request usually only has to compute the shared secret.  Each key
+ * pair is used once.  A request which finds the pool empty generates its own
+ * key as before.  The thread is started on first use, so clients and KDC
+ * processes which never see a DH request do not run it.
+ */
+
+#define DH_POOL_SIZE 16
+
+/* Return a new DH object with the parameters of params and a fresh key. */
+static DH *
+dh_new_key(DH *params)
+{
+    DH *dh;
+
+    dh = DH_new();
+    if (dh == NULL)
+        return NULL;
+    dh->p = BN_dup(params->p);
+    dh->g = BN_dup(params->g);
+    if (params->q != NULL)
+        dh->q = BN_dup(params->q);
+    if (dh->p == NULL || dh->g == NULL || !DH_generate_key(dh)) {
+        DH_free(dh);
+        return NULL;
+    }
+    return dh;
+}
+
+#ifdef ENABLE_THREADS
+
+struct dh_pool_group {
+    DH *params;                 /* alias of the plugin context's group */
+    krb5_boolean active;        /* a client has asked for this group */
+    DH *keys[DH_POOL_SIZE];
+    int count;
+};
+
+struct dh_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t tid;
+    krb5_boolean started;
+    krb5_boolean stop;
+    struct dh_pool_group groups[3];
+};
+
+/* Return the active group with the fewest keys, or NULL if all active groups
+ * are full. */
+static struct dh_pool_group *
+dh_pool_want(struct dh_pool *pool)
+{
+    struct dh_pool_group *grp, *best = NULL;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        grp = &pool->groups[i];
+        if (grp->active && grp->count < DH_POOL_SIZE &&
+            (best == NULL || grp->count < best->count))
+            best = grp;
+    }
+    return best;
+}
+
+static void *
+dh_pool_refill(void *arg)
+{
+    struct dh_pool *pool = arg;
+    struct dh_pool_group *grp;
+    DH *dh;
+#ifdef SCHED_IDLE
+    struct sched_param param;
+
+    /* Only use otherwise idle CPU time. */
+    memset(&param, 0, sizeof(param));
+    (void)pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && (grp = dh_pool_want(pool)) == NULL)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->stop)
+            break;
+        pthread_mutex_unlock(&pool->lock);
+
+        dh = dh_new_key(grp->params);
+
+        pthread_mutex_lock(&pool->lock);
+        if (dh == NULL) {
+            /* Leave this group to the requests. */
+            grp->active = FALSE;
+        } else if (grp->count < DH_POOL_SIZE) {
+            grp->keys[grp->count++] = dh;
+        } else {
+            DH_free(dh);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static krb5_error_code
+dh_pool_init(pkinit_plg_crypto_context plgctx)
+{
+    struct dh_pool *pool;
+
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return ENOMEM;
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        free(pool);
+        return ENOMEM;
+    }
+    if (pthread_cond_init(&pool->cond, NULL) != 0) {
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+        return ENOMEM;
+    }
+    pool->groups[0].params = plgctx->dh_1024;
+    pool->groups[1].params = plgctx->dh_2048;
+    pool->groups[2].params = plgctx->dh_4096;
+    plgctx->dh_pool = pool;
+    return 0;
+}
+
+static void
+dh_pool_fini(pkinit_plg_crypto_context plgctx)
+{
+    struct dh_pool *pool = plgctx->dh_pool;
+    int i, j;
+
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = TRUE;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    if (pool->started)
+        pthread_join(pool->tid, NULL);
+
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < pool->groups[i].count; j++)
+            DH_free(pool->groups[i].keys[j]);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    plgctx->dh_pool = NULL;
+}
+
+/* Start the refill thread with signals blocked, leaving signal handling to
+ * the application's threads.  Call with the pool locked. */
+static void
+dh_pool_start(struct dh_pool *pool)
+{
+    sigset_t all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&pool->tid, NULL, dh_pool_refill, pool) == 0)
+        pool->started = TRUE;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Take a pregenerated key pair for the group of params, or return NULL if
+ * none is available. */
+static DH *
+dh_pool_take(pkinit_plg_crypto_context plgctx, DH *params)
+{
+    struct dh_pool *pool = plgctx->dh_pool;
+    struct dh_pool_group *grp = NULL;
+    DH *dh = NULL;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (BN_cmp(pool->groups[i].params->p, params->p) == 0 &&
+            BN_cmp(pool->groups[i].params->g, params->g) == 0)
+            grp = &pool->groups[i];
+    }
+    if (grp == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->started)
+        dh_pool_start(pool);
+    if (grp->count > 0)
+        dh = grp->keys[--grp->count];
+    grp->active = TRUE;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    return dh;
+}
+
+#else /* ENABLE_THREADS */
+
+static krb5_error_code
+dh_pool_init(pkinit_plg_crypto_context plgctx)
+{
+    return 0;
+}
+
+static void
+dh_pool_fini(pkinit_plg_crypto_context plgctx)
+{
+}
+
+static DH *
+dh_pool_take(pkinit_plg_crypto_context plgctx, DH *params)
+{
+    return NULL;
+}
+
+#endif /* ENABLE_THREADS */
+
 /* kdc's dh function */
 krb5_error_code
 server_process_dh(krb5_context context,
@@ -2872,12 +3108,12 @@ server_process_dh(krb5_context context,
     /* get client's received DH parameters that we saved in server_check_dh */
     dh = cryptoctx->dh;
 
-    dh_server = DH_new();
+    /* Use a pregenerated key pair if we have one. */
+    dh_server = dh_pool_take(plg_cryptoctx, dh);
+    if (dh_server == NULL)
+        dh_server = dh_new_key(dh);
     if (dh_server == NULL)
         goto cleanup;
-    dh_server->p = BN_dup(dh->p);
-    dh_server->g = BN_dup(dh->g);
-    dh_server->q = BN_dup(dh->q);
 
     /* decode client's public key */
     p = data;
@@ -2889,9 +3125,6 @@ server_process_dh(krb5_context context,
         goto cleanup;
     ASN1_INTEGER_free(pub_key);
 
-    if (!DH_generate_key(dh_server))
-        goto cleanup;
-
     /* generate DH session key */
     *server_key_len = DH_size(dh_server);
     if ((*server_key = malloc(*server_key_len)) == NULL)
@@ -2951,6 +3184,87 @@ openssl_init()
     }
 }
 
+/*
+ * OpenSSL releases before 1.1.0 are only thread-safe if the application
+ * supplies locking callbacks.  The KDC's DH pool and worker threads use
+ * OpenSSL from several threads, so install callbacks if nobody else has, and
+ * remove them when the last plugin context goes away (unless the application
+ * has replaced them in the meantime).  Plugin contexts may be created and
+ * freed by different threads, so the reference count has its own lock.
+ */
+#if defined(ENABLE_THREADS) && OPENSSL_VERSION_NUMBER < 0x10100000L
+
+static pthread_mutex_t openssl_locks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t *openssl_locks;
+static int openssl_locks_refs = 0;
+
+static void
+openssl_lock(int mode, int n, const char *file, int line)
+{
+    if (mode & CRYPTO_LOCK)
+        pthread_mutex_lock(&openssl_locks[n]);
+    else
+        pthread_mutex_unlock(&openssl_locks[n]);
+}
+
+static void
+openssl_locks_init(void)
+{
+    pthread_mutex_t *locks;
+    int i, n;
+
+    pthread_mutex_lock(&openssl_locks_lock);
+    if (openssl_locks_refs++ > 0 || CRYPTO_get_locking_callback() != NULL)
+        goto done;
+    n = CRYPTO_num_locks();
+    locks = calloc(n, sizeof(*locks));
+    if (locks == NULL)
+        goto done;
+    for (i = 0; i < n; i++)
+        pthread_mutex_init(&locks[i], NULL);
+    openssl_locks = locks;
+    CRYPTO_set_locking_callback(openssl_lock);
+
+done:
+    pthread_mutex_unlock(&openssl_locks_lock);
+}
+
+static void
+openssl_locks_fini(void)
+{
+    int i, n;
+
+    pthread_mutex_lock(&openssl_locks_lock);
+    if (--openssl_locks_refs > 0 || openssl_locks == NULL)
+        goto done;
+    /* Leave alone any callback the application installed over ours. */
+    if (CRYPTO_get_locking_callback() != openssl_lock)
+        goto done;
+    CRYPTO_set_locking_callback(NULL);
+    n = CRYPTO_num_locks();
+    for (i = 0; i < n; i++)
+        pthread_mutex_destroy(&openssl_locks[i]);
+    free(openssl_locks);
+    openssl_locks = NULL;
+
+done:
+    pthread_mutex_unlock(&openssl_locks_lock);
+}
+
+#else
+
+static void
+openssl_locks_init(void)
+{
+}
+
+static void
+openssl_locks_fini(void)
+{
+}
+
+#endif
+
 static krb5_error_code
 pkinit_encode_dh_params(BIGNUM *p, BIGNUM *g, BIGNUM *q,
                         unsigned char **buf, unsigned int *buf_len)
@@ -90,10 +90,13 @@ struct _pkinit_identity_crypto_context {
     pkinit_deferred_id *deferred_ids;
 };
 
+struct dh_pool;
+
 struct _pkinit_plg_crypto_context {
     DH *dh_1024;
     DH *dh_2048;
     DH *dh_4096;
+    struct dh_pool *dh_pool;    /* pregenerated KDC key pairs */
     ASN1_OBJECT *id_pkinit_authData;
     ASN1_OBJECT *id_pkinit_authData9;
     ASN1_OBJECT *id_pkinit_DHKeyData;
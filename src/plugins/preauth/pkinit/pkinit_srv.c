@@ -276,115 +276,166 @@ out:
     return retval;
 }
 
+/*
+ * State for a verify operation.  The signature check and the DH computation
+ * are passed to the KDC's offload callback, which runs them on a worker
+ * thread if the KDC has any, so verification proceeds in stages.
+ */
+struct verify_state {
+    krb5_context context;
+    krb5_kdc_req *request;
+    krb5_enc_tkt_part *enc_tkt_reply;
+    krb5_preauthtype pa_type;
+    krb5_kdcpreauth_callbacks cb;
+    krb5_kdcpreauth_rock rock;
+    krb5_kdcpreauth_verify_respond_fn respond;
+    void *arg;
+
+    pkinit_kdc_context plgctx;
+    pkinit_kdc_req_context reqctx;
+    krb5_pa_pk_as_req *reqp;
+    krb5_pa_pk_as_req_draft9 *reqp9;
+    krb5_data authp_data;
+    krb5_data krb5_authz;
+    int is_signed;
+};
+
+/* Run compute on a KDC worker thread if the KDC can, or here if not. */
 static void
-pkinit_server_verify_padata(krb5_context context,
-                            krb5_data *req_pkt,
-                            krb5_kdc_req * request,
-                            krb5_enc_tkt_part * enc_tkt_reply,
-                            krb5_pa_data * data,
-                            krb5_kdcpreauth_callbacks cb,
-                            krb5_kdcpreauth_rock rock,
-                            krb5_kdcpreauth_moddata moddata,
-                            krb5_kdcpreauth_verify_respond_fn respond,
-                            void *arg)
+offload(struct verify_state *state, krb5_kdcpreauth_compute_fn compute,
+        krb5_kdcpreauth_compute_done_fn done)
 {
-    krb5_error_code retval = 0;
-    krb5_data authp_data = {0, 0, NULL}, krb5_authz = {0, 0, NULL};
-    krb5_pa_pk_as_req *reqp = NULL;
-    krb5_pa_pk_as_req_draft9 *reqp9 = NULL;
-    krb5_auth_pack *auth_pack = NULL;
-    krb5_auth_pack_draft9 *auth_pack9 = NULL;
-    pkinit_kdc_context plgctx = NULL;
-    pkinit_kdc_req_context reqctx = NULL;
-    krb5_checksum cksum = {0, 0, 0, NULL};
-    krb5_data *der_req = NULL;
-    int valid_eku = 0, valid_san = 0;
-    krb5_data k5data;
-    int is_signed = 1;
-    krb5_pa_data **e_data = NULL;
-    krb5_kdcpreauth_modreq modreq = NULL;
-
-    pkiDebug("pkinit_verify_padata: entered!\n");
-    if (data == NULL || data->length <= 0 || data->contents == NULL) {
-        (*respond)(arg, 0, NULL, NULL, NULL);
+    if (state->cb->vers >= 3) {
+        state->cb->offload(state->context, state->rock, compute, done, state);
         return;
     }
+    (*done)(state, (*compute)(state->context, state));
+}
 
+/* Respond to the KDC and release the verify state. */
+static void
+verify_finish(struct verify_state *state, krb5_error_code retval)
+{
+    krb5_context context = state->context;
+    pkinit_kdc_context plgctx = state->plgctx;
+    krb5_pa_data **e_data = NULL;
+    krb5_kdcpreauth_modreq modreq = NULL;
+    krb5_kdcpreauth_verify_respond_fn respond = state->respond;
+    void *arg = state->arg;
 
-    if (moddata == NULL) {
-        (*respond)(arg, EINVAL, NULL, NULL, NULL);
-        return;
+    if (retval && state->pa_type == KRB5_PADATA_PK_AS_REQ &&
+        state->reqctx != NULL) {
+        pkiDebug("pkinit_verify_padata failed: creating e-data\n");
+        if (pkinit_create_edata(context, plgctx->cryptoctx,
+                                state->reqctx->cryptoctx, plgctx->idctx,
+                                plgctx->opts, retval, &e_data))
+            pkiDebug("pkinit_create_edata failed\n");
     }
 
-    plgctx = pkinit_find_realm_context(context, moddata, request->server);
-    if (plgctx == NULL) {
-        (*respond)(arg, 0, NULL, NULL, NULL);
-        return;
+    if (!retval) {
+        /* remember to set the PREAUTH flag in the reply */
+        state->enc_tkt_reply->flags |= TKT_FLG_PRE_AUTH;
+        modreq = (krb5_kdcpreauth_modreq)state->reqctx;
+        state->reqctx = NULL;
     }
 
-#ifdef DEBUG_ASN1
-    print_buffer_bin(data->contents, data->length, "/tmp/kdc_as_req");
-#endif
-    /* create a per-request context */
-    retval = pkinit_init_kdc_req_context(context, &reqctx);
-    if (retval)
-        goto cleanup;
-    reqctx->pa_type = data->pa_type;
+    free_krb5_pa_pk_as_req(&state->reqp);
+    free_krb5_pa_pk_as_req_draft9(&state->reqp9);
+    free(state->authp_data.data);
+    free(state->krb5_authz.data);
+    if (state->reqctx != NULL)
+        pkinit_fini_kdc_req_context(context, state->reqctx);
+    free(state);
 
-    PADATA_TO_KRB5DATA(data, &k5data);
+    (*respond)(arg, retval, modreq, e_data, NULL);
+}
 
-    switch ((int)data->pa_type) {
-    case KRB5_PADATA_PK_AS_REQ:
-        pkiDebug("processing KRB5_PADATA_PK_AS_REQ\n");
-        retval = k5int_decode_krb5_pa_pk_as_req(&k5data, &reqp);
-        if (retval) {
-            pkiDebug("decode_krb5_pa_pk_as_req failed\n");
-            goto cleanup;
-        }
-#ifdef DEBUG_ASN1
-        print_buffer_bin(reqp->signedAuthPack.data,
-                         reqp->signedAuthPack.length,
-                         "/tmp/kdc_signed_data");
-#endif
-        retval = cms_signeddata_verify(context, plgctx->cryptoctx,
-                                       reqctx->cryptoctx, plgctx->idctx, CMS_SIGN_CLIENT,
-                                       plgctx->opts->require_crl_checking,
-                                       (unsigned char *)
-                                       reqp->signedAuthPack.data, reqp->signedAuthPack.length,
-                                       (unsigned char **)&authp_data.data,
-                                       &authp_data.length,
-                                       (unsigned char **)&krb5_authz.data,
-                                       &krb5_authz.length, &is_signed);
-        break;
-    case KRB5_PADATA_PK_AS_REP_OLD:
-    case KRB5_PADATA_PK_AS_REQ_OLD:
-        pkiDebug("processing KRB5_PADATA_PK_AS_REQ_OLD\n");
-        retval = k5int_decode_krb5_pa_pk_as_req_draft9(&k5data, &reqp9);
-        if (retval) {
-            pkiDebug("decode_krb5_pa_pk_as_req_draft9 failed\n");
-            goto cleanup;
-        }
-#ifdef DEBUG_ASN1
-        print_buffer_bin(reqp9->signedAuthPack.data,
-                         reqp9->signedAuthPack.length,
-                         "/tmp/kdc_signed_data_draft9");
-#endif
+/* Compute the KDC's DH key ahead of pkinit_server_return_padata(). */
+static krb5_error_code
+verify_compute_dh(krb5_context context, void *arg)
+{
+    struct verify_state *state = arg;
+    pkinit_kdc_context plgctx = state->plgctx;
+    pkinit_kdc_req_context reqctx = state->reqctx;
+    krb5_subject_pk_info *spki = reqctx->rcv_auth_pack->clientPublicValue;
+
+    return server_process_dh(context, plgctx->cryptoctx, reqctx->cryptoctx,
+                             plgctx->idctx,
+                             (unsigned char *)spki->subjectPublicKey.data,
+                             spki->subjectPublicKey.length,
+                             &reqctx->dh_pubkey, &reqctx->dh_pubkey_len,
+                             &reqctx->server_key, &reqctx->server_key_len);
+}
 
-        retval = cms_signeddata_verify(context, plgctx->cryptoctx,
-                                       reqctx->cryptoctx, plgctx->idctx, CMS_SIGN_DRAFT9,
-                                       plgctx->opts->require_crl_checking,
-                                       (unsigned char *)
-                                       reqp9->signedAuthPack.data, reqp9->signedAuthPack.length,
-                                       (unsigned char **)&authp_data.data,
-                                       &authp_data.length,
-                                       (unsigned char **)&krb5_authz.data,
-                                       &krb5_authz.length, NULL);
-        break;
-    default:
-        pkiDebug("unrecognized pa_type = %d\n", data->pa_type);
-        retval = EINVAL;
-        goto cleanup;
+static void
+verify_compute_dh_done(void *arg, krb5_error_code code)
+{
+    struct verify_state *state = arg;
+
+    /* On failure, pkinit_server_return_padata() will try again and report
+     * the error. */
+    if (code)
+        pkiDebug("failed to precompute dh key\n");
+    verify_finish(state, 0);
+}
+
+/* Check the request's signature and the client certificate. */
+static krb5_error_code
+verify_signature(krb5_context context, void *arg)
+{
+    struct verify_state *state = arg;
+    pkinit_kdc_context plgctx = state->plgctx;
+    pkinit_kdc_req_context reqctx = state->reqctx;
+
+    if (state->pa_type == KRB5_PADATA_PK_AS_REQ) {
+        return cms_signeddata_verify(context, plgctx->cryptoctx,
+                                     reqctx->cryptoctx, plgctx->idctx,
+                                     CMS_SIGN_CLIENT,
+                                     plgctx->opts->require_crl_checking,
+                                     (unsigned char *)
+                                     state->reqp->signedAuthPack.data,
+                                     state->reqp->signedAuthPack.length,
+                                     (unsigned char **)
+                                     &state->authp_data.data,
+                                     &state->authp_data.length,
+                                     (unsigned char **)
+                                     &state->krb5_authz.data,
+                                     &state->krb5_authz.length,
+                                     &state->is_signed);
+    } else {
+        return cms_signeddata_verify(context, plgctx->cryptoctx,
+                                     reqctx->cryptoctx, plgctx->idctx,
+                                     CMS_SIGN_DRAFT9,
+                                     plgctx->opts->require_crl_checking,
+                                     (unsigned char *)
+                                     state->reqp9->signedAuthPack.data,
+                                     state->reqp9->signedAuthPack.length,
+                                     (unsigned char **)
+                                     &state->authp_data.data,
+                                     &state->authp_data.length,
+                                     (unsigned char **)
+                                     &state->krb5_authz.data,
+                                     &state->krb5_authz.length, NULL);
     }
+}
+
+static void
+verify_signature_done(void *arg, krb5_error_code retval)
+{
+    struct verify_state *state = arg;
+    krb5_context context = state->context;
+    krb5_kdc_req *request = state->request;
+    pkinit_kdc_context plgctx = state->plgctx;
+    pkinit_kdc_req_context reqctx = state->reqctx;
+    krb5_pa_pk_as_req *reqp = state->reqp;
+    krb5_auth_pack *auth_pack = NULL;
+    krb5_auth_pack_draft9 *auth_pack9 = NULL;
+    krb5_checksum cksum = {0, 0, 0, NULL};
+    krb5_data *der_req = NULL;
+    int valid_eku = 0, valid_san = 0;
+    krb5_data k5data;
+    int is_signed = state->is_signed;
+
     if (retval) {
         pkiDebug("pkcs7_signeddata_verify failed\n");
         goto cleanup;
@@ -422,11 +473,12 @@ pkinit_server_verify_padata(krb5_context context,
         }
     }
 #ifdef DEBUG_ASN1
-    print_buffer_bin(authp_data.data, authp_data.length, "/tmp/kdc_auth_pack");
+    print_buffer_bin(state->authp_data.data, state->authp_data.length,
+                     "/tmp/kdc_auth_pack");
 #endif
 
-    OCTETDATA_TO_KRB5DATA(&authp_data, &k5data);
-    switch ((int)data->pa_type) {
+    OCTETDATA_TO_KRB5DATA(&state->authp_data, &k5data);
+    switch ((int)state->pa_type) {
     case KRB5_PADATA_PK_AS_REQ:
         retval = k5int_decode_krb5_auth_pack(&k5data, &auth_pack);
         if (retval) {
@@ -453,7 +505,7 @@ pkinit_server_verify_padata(krb5_context context,
                                      "value not supported."));
             goto cleanup;
         }
-        der_req = cb->request_body(context, rock);
+        der_req = state->cb->request_body(context, state->rock);
         retval = krb5_c_make_checksum(context, CKSUMTYPE_NIST_SHA, NULL,
                                       0, der_req, &cksum);
         if (retval) {
@@ -467,8 +519,8 @@ pkinit_server_verify_padata(krb5_context context,
             pkiDebug("failed to match the checksum\n");
 #ifdef DEBUG_CKSUM
             pkiDebug("calculating checksum on buf size (%d)\n",
-                     req_pkt->length);
-            print_buffer(req_pkt->data, req_pkt->length);
+                     der_req->length);
+            print_buffer(der_req->data, der_req->length);
             pkiDebug("received checksum type=%d size=%d ",
                      auth_pack->pkAuthenticator.paChecksum.checksum_type,
                      auth_pack->pkAuthenticator.paChecksum.length);
@@ -525,37 +577,126 @@ pkinit_server_verify_padata(krb5_context context,
         break;
     }
 
-    /* remember to set the PREAUTH flag in the reply */
-    enc_tkt_reply->flags |= TKT_FLG_PRE_AUTH;
-    modreq = (krb5_kdcpreauth_modreq)reqctx;
-    reqctx = NULL;
-
 cleanup:
-    if (retval && data->pa_type == KRB5_PADATA_PK_AS_REQ) {
-        pkiDebug("pkinit_verify_padata failed: creating e-data\n");
-        if (pkinit_create_edata(context, plgctx->cryptoctx, reqctx->cryptoctx,
-                                plgctx->idctx, plgctx->opts, retval, &e_data))
-            pkiDebug("pkinit_create_edata failed\n");
+    free(cksum.contents);
+    free_krb5_auth_pack(&auth_pack);
+    free_krb5_auth_pack_draft9(context, &auth_pack9);
+
+    /* Generate the KDC's DH key now, off the event loop if possible. */
+    if (!retval && reqctx->rcv_auth_pack != NULL &&
+        reqctx->rcv_auth_pack->clientPublicValue != NULL) {
+        offload(state, verify_compute_dh, verify_compute_dh_done);
+        return;
+    }
+    verify_finish(state, retval);
+}
+
+static void
+pkinit_server_verify_padata(krb5_context context,
+                            krb5_data *req_pkt,
+                            krb5_kdc_req * request,
+                            krb5_enc_tkt_part * enc_tkt_reply,
+                            krb5_pa_data * data,
+                            krb5_kdcpreauth_callbacks cb,
+                            krb5_kdcpreauth_rock rock,
+                            krb5_kdcpreauth_moddata moddata,
+                            krb5_kdcpreauth_verify_respond_fn respond,
+                            void *arg)
+{
+    krb5_error_code retval = 0;
+    pkinit_kdc_context plgctx = NULL;
+    struct verify_state *state;
+    krb5_data k5data;
+
+    pkiDebug("pkinit_verify_padata: entered!\n");
+    if (data == NULL || data->length <= 0 || data->contents == NULL) {
+        (*respond)(arg, 0, NULL, NULL, NULL);
+        return;
+    }
+
+
+    if (moddata == NULL) {
+        (*respond)(arg, EINVAL, NULL, NULL, NULL);
+        return;
+    }
+
+    plgctx = pkinit_find_realm_context(context, moddata, request->server);
+    if (plgctx == NULL) {
+        (*respond)(arg, 0, NULL, NULL, NULL);
+        return;
     }
 
+    state = calloc(1, sizeof(*state));
+    if (state == NULL) {
+        (*respond)(arg, ENOMEM, NULL, NULL, NULL);
+        return;
+    }
+    state->context = context;
+    state->request = request;
+    state->enc_tkt_reply = enc_tkt_reply;
+    state->pa_type = data->pa_type;
+    state->cb = cb;
+    state->rock = rock;
+    state->respond = respond;
+    state->arg = arg;
+    state->plgctx = plgctx;
+    state->is_signed = 1;
+
+#ifdef DEBUG_ASN1
+    print_buffer_bin(data->contents, data->length, "/tmp/kdc_as_req");
+#endif
+    /* create a per-request context */
+    retval = pkinit_init_kdc_req_context(context, &state->reqctx);
+    if (retval)
+        goto error;
+    state->reqctx->pa_type = data->pa_type;
+
+    PADATA_TO_KRB5DATA(data, &k5data);
+
     switch ((int)data->pa_type) {
     case KRB5_PADATA_PK_AS_REQ:
-        free_krb5_pa_pk_as_req(&reqp);
-        free(cksum.contents);
+        pkiDebug("processing KRB5_PADATA_PK_AS_REQ\n");
+        retval = k5int_decode_krb5_pa_pk_as_req(&k5data, &state->reqp);
+        if (retval) {
+            pkiDebug("decode_krb5_pa_pk_as_req failed\n");
+            goto error;
+        }
+#ifdef DEBUG_ASN1
+        print_buffer_bin(state->reqp->signedAuthPack.data,
+                         state->reqp->signedAuthPack.length,
+                         "/tmp/kdc_signed_data");
+#endif
         break;
     case KRB5_PADATA_PK_AS_REP_OLD:
     case KRB5_PADATA_PK_AS_REQ_OLD:
-        free_krb5_pa_pk_as_req_draft9(&reqp9);
+        pkiDebug("processing KRB5_PADATA_PK_AS_REQ_OLD\n");
+        retval = k5int_decode_krb5_pa_pk_as_req_draft9(&k5data,
+                                                       &state->reqp9);
+        if (retval) {
+            pkiDebug("decode_krb5_pa_pk_as_req_draft9 failed\n");
+            goto error;
+        }
+#ifdef DEBUG_ASN1
+        print_buffer_bin(state->reqp9->signedAuthPack.data,
+                         state->reqp9->signedAuthPack.length,
+                         "/tmp/kdc_signed_data_draft9");
+#endif
+        break;
+    default:
+        pkiDebug("unrecognized pa_type = %d\n", data->pa_type);
+        retval = EINVAL;
+        goto error;
     }
-    free(authp_data.data);
-    free(krb5_authz.data);
-    if (reqctx != NULL)
-        pkinit_fini_kdc_req_context(context, reqctx);
-    free_krb5_auth_pack(&auth_pack);
-    free_krb5_auth_pack_draft9(context, &auth_pack9);
 
-    (*respond)(arg, retval, modreq, e_data, NULL);
+    /* Certificate chain validation and the signature check are the expensive
+     * part of verification; do them off the event loop if we can. */
+    offload(state, verify_signature, verify_signature_done);
+    return;
+
+error:
+    verify_finish(state, retval);
 }
+
 static krb5_error_code
 return_pkinit_kx(krb5_context context, krb5_kdc_req *request,
                  krb5_kdc_rep *reply, krb5_keyblock *encrypting_key,
@@ -786,13 +927,23 @@ pkinit_server_return_padata(krb5_context context,
     if (rep != NULL && (rep->choice == choice_pa_pk_as_rep_dhInfo ||
                         rep->choice == choice_pa_pk_as_rep_draft9_dhSignedData)) {
         pkiDebug("received DH key delivery AS REQ\n");
-        retval = server_process_dh(context, plgctx->cryptoctx,
-                                   reqctx->cryptoctx, plgctx->idctx, subjectPublicKey,
-                                   subjectPublicKey_len, &dh_pubkey, &dh_pubkey_len,
-                                   &server_key, &server_key_len);
-        if (retval) {
-            pkiDebug("failed to process/create dh paramters\n");
-            goto cleanup;
+        if (reqctx->server_key != NULL) {
+            /* Use the key computed while verifying the request. */
+            dh_pubkey = reqctx->dh_pubkey;
+            dh_pubkey_len = reqctx->dh_pubkey_len;
+            server_key = reqctx->server_key;
+            server_key_len = reqctx->server_key_len;
+            reqctx->dh_pubkey = reqctx->server_key = NULL;
+        } else {
+            retval = server_process_dh(context, plgctx->cryptoctx,
+                                       reqctx->cryptoctx, plgctx->idctx,
+                                       subjectPublicKey, subjectPublicKey_len,
+                                       &dh_pubkey, &dh_pubkey_len,
+                                       &server_key, &server_key_len);
+            if (retval) {
+                pkiDebug("failed to process/create dh paramters\n");
+                goto cleanup;
+            }
         }
     }
     if ((rep9 != NULL &&
@@ -1446,6 +1597,10 @@ pkinit_fini_kdc_req_context(krb5_context context, void *ctx)
         free_krb5_auth_pack(&reqctx->rcv_auth_pack);
     if (reqctx->rcv_auth_pack9 != NULL)
         free_krb5_auth_pack_draft9(context, &reqctx->rcv_auth_pack9);
+    free(reqctx->dh_pubkey);
+    if (reqctx->server_key != NULL)
+        zap(reqctx->server_key, reqctx->server_key_len);
+    free(reqctx->server_key);
 
     free(reqctx);
 }
@@ -49,8 +49,6 @@
 #define GETSOCKNAME_ARG3_TYPE unsigned int
 #endif
 
-static char *kprop_version = KPROP_PROT_VERSION;
-
 char    *progname = 0;
 int     debug = 0;
 int     iprop_notify = 0;
@@ -72,12 +70,15 @@ void    PRS(int, char **);
 void    get_tickets(krb5_context);
 static void usage(void);
 static void open_connection(krb5_context, char *, int *);
-void    kerberos_authenticate(krb5_context, krb5_auth_context *,
-                              int, krb5_principal, krb5_creds **);
-int     open_database(krb5_context, char *, int *);
+krb5_error_code kerberos_authenticate(krb5_context, krb5_auth_context *,
+                                      int, krb5_principal, char *,
+                                      krb5_creds **);
+int     open_database(krb5_context, char *, off_t *);
 void    close_database(krb5_context, int);
 void    xmit_database(krb5_context, krb5_auth_context, krb5_creds *,
-                      int, int, int);
+                      int, int, off_t);
+static void xmit_database_2(krb5_context, krb5_auth_context, krb5_creds *,
+                            int, int, off_t);
 void    send_error(krb5_context, krb5_creds *, int, char *, krb5_error_code);
 void    update_last_prop_file(char *, char *);
 
@@ -93,7 +94,9 @@ main(argc, argv)
     int     argc;
     char    **argv;
 {
-    int     fd, database_fd, database_size;
+    int     fd, database_fd;
+    off_t   database_size;
+    krb5_boolean streaming;
     krb5_error_code retval;
     krb5_context context;
     krb5_creds *my_creds;
@@ -110,23 +113,58 @@ main(argc, argv)
 
     if (iprop_notify) {
         open_connection(context, slave_host, &fd);
-        kerberos_authenticate(context, &auth_context, fd, my_principal, &my_creds);
+        kerberos_authenticate(context, &auth_context, fd, my_principal,
+                              KPROP_PROT_VERSION, &my_creds);
         /* XXX - Should we allocate a new error code? */
         send_error(context, my_creds, fd, _("iprop_notify: update available"), KRB5KRB_ERR_GENERIC);
         krb5_free_cred_contents(context, my_creds);
         exit(0);
     }
 
-    database_fd = open_database(context, file, &database_size);
+    /* With "-f -", send a dump (such as the output of kdb5_util dump) as it
+     * is read from standard input. */
+    streaming = (strcmp(file, "-") == 0);
+    if (streaming) {
+        database_fd = STDIN_FILENO;
+        database_size = -1;
+    } else {
+        database_fd = open_database(context, file, &database_size);
+    }
+
     open_connection(context, slave_host, &fd);
-    kerberos_authenticate(context, &auth_context, fd, my_principal,
-                          &my_creds);
-    xmit_database(context, auth_context, my_creds, fd, database_fd,
-                  database_size);
-    update_last_prop_file(slave_host, file);
+    retval = kerberos_authenticate(context, &auth_context, fd, my_principal,
+                                   KPROP_PROT_VERSION_2, &my_creds);
+    if (retval == 0) {
+        xmit_database_2(context, auth_context, my_creds, fd, database_fd,
+                        database_size);
+    } else {
+        /* The slave's kpropd only understands protocol version 1. */
+        close(fd);
+        krb5_auth_con_free(context, auth_context);
+        krb5_free_address(context, sender_addr);
+        krb5_free_address(context, receiver_addr);
+        if (streaming) {
+            com_err(progname, 0, _("%s does not support streamed "
+                                   "propagation"), slave_host);
+            exit(1);
+        }
+        if ((UINT64_TYPE)database_size > 0xFFFFFFFFUL) {
+            com_err(progname, 0, _("Database file is too large for the "
+                                   "kpropd on %s"), slave_host);
+            exit(1);
+        }
+        open_connection(context, slave_host, &fd);
+        kerberos_authenticate(context, &auth_context, fd, my_principal,
+                              KPROP_PROT_VERSION, &my_creds);
+        xmit_database(context, auth_context, my_creds, fd, database_fd,
+                      database_size);
+    }
+    if (!streaming)
+        update_last_prop_file(slave_host, file);
     printf(_("Database propagation to %s: SUCCEEDED\n"), slave_host);
     krb5_free_cred_contents(context, my_creds);
-    close_database(context, database_fd);
+    if (!streaming)
+        close_database(context, database_fd);
     exit(0);
 }
 
@@ -394,11 +432,18 @@ open_connection(krb5_context context, char *host, int *fd_out)
 }
 
 
-void kerberos_authenticate(context, auth_context, fd, me, new_creds)
+/*
+ * Authenticate to kpropd using protocol version.  If the server does not
+ * support version and version is not KPROP_PROT_VERSION, return
+ * KRB5_SENDAUTH_BADAPPLVERS; exit on any other error.
+ */
+krb5_error_code
+kerberos_authenticate(context, auth_context, fd, me, version, new_creds)
     krb5_context context;
     krb5_auth_context *auth_context;
     int fd;
     krb5_principal me;
+    char *version;
     krb5_creds ** new_creds;
 {
     krb5_error_code retval;
@@ -420,9 +465,12 @@ void kerberos_authenticate(context, auth_context, fd, me, new_creds)
     }
 
     retval = krb5_sendauth(context, auth_context, (void *)&fd,
-                           kprop_version, me, creds.server,
+                           version, me, creds.server,
                            AP_OPTS_MUTUAL_REQUIRED, NULL, &creds, NULL,
                            &error, &rep_result, new_creds);
+    if (retval == KRB5_SENDAUTH_BADAPPLVERS &&
+        strcmp(version, KPROP_PROT_VERSION) != 0)
+        return retval;
     if (retval) {
         com_err(progname, retval, _("while authenticating to server"));
         if (error) {
@@ -445,6 +493,7 @@ void kerberos_authenticate(context, auth_context, fd, me, new_creds)
         exit(1);
     }
     krb5_free_ap_rep_enc_part(context, rep_result);
+    return 0;
 }
 
 char * dbpathname;
@@ -460,7 +509,7 @@ int
 open_database(context, data_fn, size)
     krb5_context context;
     char *data_fn;
-    int *size;
+    off_t *size;
 {
     int             fd;
     int             err;
@@ -543,7 +592,7 @@ xmit_database(context, auth_context, my_creds, fd, database_fd,
     krb5_creds *my_creds;
     int fd;
     int database_fd;
-    int in_database_size;
+    off_t in_database_size;
 {
     krb5_int32      n;
     krb5_data       inbuf, outbuf;
@@ -684,6 +733,212 @@ xmit_database(context, auth_context, my_creds, fd, database_fd,
     /* inbuf.data points to local storage */
 }
 
+/* Display the contents of a KRB_ERROR message received from kpropd. */
+static void
+display_remote_error(krb5_context context, krb5_data *inbuf)
+{
+    krb5_error_code retval;
+    krb5_error *error;
+
+    retval = krb5_rd_error(context, inbuf, &error);
+    if (retval) {
+        com_err(progname, retval,
+                _("while decoding error response from server"));
+        return;
+    }
+    if (error->error == KRB_ERR_GENERIC) {
+        if (error->text.data)
+            fprintf(stderr, _("Generic remote error: %s\n"), error->text.data);
+    } else if (error->error) {
+        com_err(progname,
+                (krb5_error_code)error->error + ERROR_TABLE_BASE_krb5,
+                _("signalled from server"));
+        if (error->text.data) {
+            fprintf(stderr, _("Error text from server: %s\n"),
+                    error->text.data);
+        }
+    }
+    krb5_free_error(context, error);
+}
+
+/* Read a KRB_SAFE message containing a 64-bit value from kpropd. */
+static void
+read_safe_u64(krb5_context context, krb5_auth_context auth_context, int fd,
+              const char *what, UINT64_TYPE *val_out)
+{
+    krb5_error_code retval;
+    krb5_data inbuf, outbuf;
+
+    retval = krb5_read_message(context, &fd, &inbuf);
+    if (retval) {
+        com_err(progname, retval, _("while reading %s from server"), what);
+        exit(1);
+    }
+    if (krb5_is_krb_error(&inbuf)) {
+        display_remote_error(context, &inbuf);
+        exit(1);
+    }
+    retval = krb5_rd_safe(context, auth_context, &inbuf, &outbuf, NULL);
+    krb5_free_data_contents(context, &inbuf);
+    if (retval) {
+        com_err(progname, retval, _("while decoding %s from server"), what);
+        exit(1);
+    }
+    if (outbuf.length != 8) {
+        com_err(progname, KRB5KRB_ERR_GENERIC,
+                _("while decoding %s from server"), what);
+        exit(1);
+    }
+    *val_out = load_64_be(outbuf.data);
+    krb5_free_data_contents(context, &outbuf);
+}
+
+/*
+ * Send the database using protocol version 2 (see kprop.h).  If database_size
+ * is negative, database_fd is a stream of unknown length which cannot be
+ * resumed.  Otherwise the transfer is identified by the file's inode number,
+ * modification time and size, so that kpropd can pick up where an interrupted
+ * attempt to send the same dump left off.
+ */
+static void
+xmit_database_2(krb5_context context, krb5_auth_context auth_context,
+                krb5_creds *my_creds, int fd, int database_fd,
+                off_t database_size)
+{
+    krb5_error_code retval;
+    krb5_data inbuf, outbuf;
+    unsigned char hdr[8 + KPROP_ID_LEN];
+    char *buf, msg[128];
+    struct stat st;
+    UINT64_TYPE size, offset, sent_size, total, frac;
+    ssize_t n;
+
+    if (database_size < 0)
+        size = KPROP_SIZE_UNKNOWN;
+    else
+        size = database_size;
+    store_64_be(size, hdr);
+    memset(hdr + 8, 0, KPROP_ID_LEN);
+    if (database_size >= 0 && fstat(database_fd, &st) == 0) {
+#if defined HAVE_STRUCT_STAT_ST_MTIMENSEC
+        frac = st.st_mtimensec;
+#elif defined HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC
+        frac = st.st_mtimespec.tv_nsec;
+#elif defined HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+        frac = st.st_mtim.tv_nsec;
+#else
+        frac = 0;
+#endif
+        store_64_be(st.st_ino, hdr + 8);
+        store_64_be(st.st_mtime, hdr + 16);
+        store_64_be(frac, hdr + 24);
+        store_64_be(st.st_size, hdr + 32);
+    }
+
+    inbuf = make_data(hdr, sizeof(hdr));
+    retval = krb5_mk_safe(context, auth_context, &inbuf, &outbuf, NULL);
+    if (retval) {
+        com_err(progname, retval, _("while encoding database size"));
+        send_error(context, my_creds, fd, _("while encoding database size"),
+                   retval);
+        exit(1);
+    }
+    retval = krb5_write_message(context, &fd, &outbuf);
+    krb5_free_data_contents(context, &outbuf);
+    if (retval) {
+        com_err(progname, retval, _("while sending database size"));
+        exit(1);
+    }
+
+    /* kpropd tells us where to start; nonzero means we are resuming. */
+    read_safe_u64(context, auth_context, fd, _("starting offset"), &offset);
+    if (offset > 0) {
+        if (database_size < 0 || offset > size ||
+            lseek(database_fd, offset, SEEK_SET) == (off_t)-1) {
+            com_err(progname, 0, _("Server requested invalid starting "
+                                   "offset"));
+            send_error(context, my_creds, fd, "Invalid starting offset",
+                       KRB5KRB_ERR_GENERIC);
+            exit(1);
+        }
+        if (debug)
+            printf("Resuming at offset %.0f.\n", (double)offset);
+    }
+
+    retval = krb5_auth_con_initivector(context, auth_context);
+    if (retval) {
+        send_error(context, my_creds, fd,
+                   "failed while initializing i_vector", retval);
+        com_err(progname, retval, _("while allocating i_vector"));
+        exit(1);
+    }
+
+    buf = malloc(KPROP_BUFSIZ_2);
+    if (buf == NULL) {
+        com_err(progname, ENOMEM, _("while allocating database buffer"));
+        send_error(context, my_creds, fd, NULL, ENOMEM);
+        exit(1);
+    }
+
+    /*
+     * Send the database in large blocks without waiting for any response,
+     * ending with an empty block.
+     */
+    sent_size = 0;
+    for (;;) {
+        n = read(database_fd, buf, KPROP_BUFSIZ_2);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            com_err(progname, errno, _("while reading database"));
+            send_error(context, my_creds, fd, "Error reading database file",
+                       KRB5KRB_ERR_GENERIC);
+            exit(1);
+        }
+        inbuf = make_data(buf, n);
+        retval = krb5_mk_priv(context, auth_context, &inbuf, &outbuf, NULL);
+        if (retval) {
+            snprintf(msg, sizeof(msg),
+                     "while encoding database block starting at %.0f",
+                     (double)(offset + sent_size));
+            com_err(progname, retval, "%s", msg);
+            send_error(context, my_creds, fd, msg, retval);
+            exit(1);
+        }
+        retval = krb5_write_message(context, &fd, &outbuf);
+        krb5_free_data_contents(context, &outbuf);
+        if (retval) {
+            com_err(progname, retval,
+                    _("while sending database block starting at %.0f"),
+                    (double)(offset + sent_size));
+            exit(1);
+        }
+        if (n == 0)
+            break;
+        sent_size += n;
+        if (debug)
+            printf("%.0f bytes sent.\n", (double)(offset + sent_size));
+    }
+    free(buf);
+
+    total = offset + sent_size;
+    if (database_size >= 0 && total != size) {
+        com_err(progname, 0, _("Premature EOF found for database file!"));
+        send_error(context, my_creds, fd,
+                   "Premature EOF found for database file!",
+                   KRB5KRB_ERR_GENERIC);
+        exit(1);
+    }
+
+    /* Wait for kpropd to acknowledge the whole database. */
+    read_safe_u64(context, auth_context, fd, _("final size packet"), &size);
+    if (size != total) {
+        com_err(progname, 0, _("Kpropd sent database size %.0f, expecting "
+                               "%.0f"), (double)size, (double)total);
+        exit(1);
+    }
+}
+
 void
 send_error(context, my_creds, fd, err_text, err_code)
     krb5_context context;
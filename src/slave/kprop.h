@@ -31,7 +31,25 @@
 
 #define KPROP_PROT_VERSION "kprop5_01"
 
+/*
+ * Protocol version 2 differs from version 1 as follows.  The initial KRB_SAFE
+ * message from kprop contains a 64-bit database size (KPROP_SIZE_UNKNOWN if
+ * the dump is streamed) followed by a KPROP_ID_LEN-byte transfer identifier,
+ * which is all zeros if the transfer cannot be resumed.  kpropd replies with
+ * a KRB_SAFE message containing the 64-bit offset at which kprop should
+ * begin, which is nonzero if kpropd holds a checkpoint for a previous attempt
+ * with the same identifier.  The database is then sent in KRB_PRIV blocks of
+ * up to KPROP_BUFSIZ_2 bytes, followed by an empty KRB_PRIV block.  The final
+ * acknowledgement from kpropd contains the 64-bit total size.  kprop forms
+ * the transfer identifier from the dump file's inode number, modification
+ * time in seconds and nanoseconds, and size, each as a 64-bit value.
+ */
+#define KPROP_PROT_VERSION_2 "kprop5_02"
+
 #define KPROP_BUFSIZ 32768
+#define KPROP_BUFSIZ_2 (256 * 1024)
+#define KPROP_SIZE_UNKNOWN (~(UINT64_TYPE)0)
+#define KPROP_ID_LEN 32
 
 /* pathnames are in osconf.h, included via k5-int.h */
 
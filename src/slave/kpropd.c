@@ -115,7 +115,11 @@ typedef struct _kadm5_iprop_handle_t {
 } *kadm5_iprop_handle_t;
 
 
-static char *kprop_version = KPROP_PROT_VERSION;
+/* Set if the client authenticated using KPROP_PROT_VERSION_2. */
+static krb5_boolean prot_version_2;
+
+/* Write a resume checkpoint after receiving this many bytes. */
+#define CHECKPOINT_INTERVAL (64 * 1024 * 1024)
 
 static kadm5_config_params params;
 
@@ -155,6 +159,7 @@ void    kerberos_authenticate(krb5_context, int, krb5_principal *,
                               krb5_enctype *, struct sockaddr_storage *);
 krb5_boolean authorized_principal(krb5_context, krb5_principal, krb5_enctype);
 void    recv_database(krb5_context, int, int, krb5_data *);
+static void recv_database_2(krb5_context, int, int, krb5_data *);
 void    load_database(krb5_context, char *, char *);
 void    send_error(krb5_context, int, krb5_error_code, char *);
 void    recv_error(krb5_context, krb5_data *);
@@ -532,13 +537,18 @@ void doit(fd)
                 temp_file_name);
         exit(1);
     }
-    if ((database_fd = open(temp_file_name,
-                            O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0) {
+    /* Version 2 transfers may resume into the existing temporary file. */
+    database_fd = open(temp_file_name,
+                       O_WRONLY|O_CREAT|(prot_version_2 ? 0 : O_TRUNC), 0600);
+    if (database_fd < 0) {
         com_err(progname, errno, _("while opening database file, '%s'"),
                 temp_file_name);
         exit(1);
     }
-    recv_database(kpropd_context, fd, database_fd, &confmsg);
+    if (prot_version_2)
+        recv_database_2(kpropd_context, fd, database_fd, &confmsg);
+    else
+        recv_database(kpropd_context, fd, database_fd, &confmsg);
     if (rename(temp_file_name, file)) {
         com_err(progname, errno, _("while renaming %s to %s"),
                 temp_file_name, file);
@@ -585,7 +595,7 @@ static kdb_fullresync_result_t *
 full_resync(CLIENT *clnt)
 {
     static kdb_fullresync_result_t clnt_res;
-    uint32_t vers = IPROPX_VERSION_1; /* max version we support */
+    uint32_t vers = IPROPX_VERSION; /* max version we support */
     enum clnt_stat status;
 
     memset(&clnt_res, 0, sizeof(clnt_res));
@@ -1343,6 +1353,7 @@ kerberos_authenticate(context, fd, clientp, etype, my_sin)
     struct sockaddr_storage  r_sin;
     GETSOCKNAME_ARG3_TYPE sin_length;
     krb5_keytab           keytab = NULL;
+    krb5_data             version;
 
     /*
      * Set recv_addr and send_addr
@@ -1367,8 +1378,7 @@ kerberos_authenticate(context, fd, clientp, etype, my_sin)
             com_err(progname, retval, _("while unparsing client name"));
             exit(1);
         }
-        fprintf(stderr, "krb5_recvauth(%d, %s, %s, ...)\n", fd, kprop_version,
-                name);
+        fprintf(stderr, "krb5_recvauth(%d, %s, ...)\n", fd, name);
         free(name);
     }
 
@@ -1404,14 +1414,26 @@ kerberos_authenticate(context, fd, clientp, etype, my_sin)
         }
     }
 
-    retval = krb5_recvauth(context, &auth_context, (void *) &fd,
-                           kprop_version, server, 0, keytab, &ticket);
+    retval = krb5_recvauth_version(context, &auth_context, (void *) &fd,
+                                   server, 0, keytab, &ticket, &version);
     if (retval) {
         syslog(LOG_ERR, _("Error in krb5_recvauth: %s"),
                error_message(retval));
         exit(1);
     }
 
+    /* Both version strings include the terminator and have the same length. */
+    if (version.length == sizeof(KPROP_PROT_VERSION_2) &&
+        memcmp(version.data, KPROP_PROT_VERSION_2, version.length) == 0) {
+        prot_version_2 = TRUE;
+    } else if (version.length != sizeof(KPROP_PROT_VERSION) ||
+               memcmp(version.data, KPROP_PROT_VERSION,
+                      version.length) != 0) {
+        syslog(LOG_ERR, _("Unsupported kprop protocol version"));
+        exit(1);
+    }
+    krb5_free_data_contents(context, &version);
+
     retval = krb5_copy_principal(context, ticket->enc_part2->client, clientp);
     if (retval) {
         syslog(LOG_ERR, _("Error in krb5_copy_prinicpal: %s"),
@@ -1629,6 +1651,239 @@ recv_database(context, fd, database_fd, confmsg)
     }
 }
 
+/*
+ * Read a resume checkpoint for the temporary file.  A checkpoint contains the
+ * transfer identifier, the 64-bit total database size, and the 64-bit number
+ * of bytes known to be safely written to the file.  Return 0 if there is no
+ * checkpoint matching id and database_size.
+ */
+static UINT64_TYPE
+read_checkpoint(const char *ckpt_name, const unsigned char *id,
+                UINT64_TYPE database_size)
+{
+    unsigned char buf[KPROP_ID_LEN + 16];
+    int fd;
+    ssize_t n;
+
+    fd = open(ckpt_name, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n != sizeof(buf) || memcmp(buf, id, KPROP_ID_LEN) != 0 ||
+        load_64_be(buf + KPROP_ID_LEN) != database_size)
+        return 0;
+    return load_64_be(buf + KPROP_ID_LEN + 8);
+}
+
+/* Flush the received data to disk and record a resume checkpoint. */
+static void
+write_checkpoint(const char *ckpt_name, int database_fd,
+                 const unsigned char *id, UINT64_TYPE database_size,
+                 UINT64_TYPE offset)
+{
+    unsigned char buf[KPROP_ID_LEN + 16];
+    int fd;
+
+    if (fsync(database_fd) != 0)
+        return;
+    memcpy(buf, id, KPROP_ID_LEN);
+    store_64_be(database_size, buf + KPROP_ID_LEN);
+    store_64_be(offset, buf + KPROP_ID_LEN + 8);
+    fd = THREEPARAMOPEN(ckpt_name, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0)
+        return;
+    if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+        (void)unlink(ckpt_name);
+    close(fd);
+}
+
+/*
+ * Receive the database using protocol version 2 (see kprop.h).  If kprop
+ * supplies a transfer identifier matching the checkpoint left by an earlier,
+ * interrupted attempt, keep the data already received and ask kprop to send
+ * only the rest.
+ */
+static void
+recv_database_2(krb5_context context, int fd, int database_fd,
+                krb5_data *confmsg)
+{
+    krb5_error_code retval;
+    krb5_data inbuf, outbuf;
+    unsigned char id[KPROP_ID_LEN], zero_id[KPROP_ID_LEN], offbuf[8];
+    char buf[1024], *ckpt_name;
+    struct stat st;
+    UINT64_TYPE database_size, offset, received_size, last_ckpt;
+    ssize_t n;
+
+    if (asprintf(&ckpt_name, "%s.ckpt", temp_file_name) < 0) {
+        com_err(progname, ENOMEM, _("while allocating checkpoint filename"));
+        send_error(context, fd, ENOMEM, NULL);
+        exit(1);
+    }
+
+    /* Receive and decode the size and transfer identifier from the client. */
+    retval = krb5_read_message(context, &fd, &inbuf);
+    if (retval) {
+        send_error(context, fd, retval, "while reading database size");
+        com_err(progname, retval,
+                _("while reading size of database from client"));
+        exit(1);
+    }
+    if (krb5_is_krb_error(&inbuf))
+        recv_error(context, &inbuf);
+    retval = krb5_rd_safe(context, auth_context, &inbuf, &outbuf, NULL);
+    krb5_free_data_contents(context, &inbuf);
+    if (retval || outbuf.length != 8 + KPROP_ID_LEN) {
+        if (!retval)
+            retval = KRB5KRB_ERR_GENERIC;
+        send_error(context, fd, retval, "while decoding database size");
+        com_err(progname, retval,
+                _("while decoding database size from client"));
+        exit(1);
+    }
+    database_size = load_64_be(outbuf.data);
+    memcpy(id, outbuf.data + 8, KPROP_ID_LEN);
+    krb5_free_data_contents(context, &outbuf);
+
+    /* Decide where to begin.  Transfers with an all-zero identifier (such as
+     * streamed dumps) are never resumed. */
+    memset(zero_id, 0, sizeof(zero_id));
+    offset = 0;
+    if (memcmp(id, zero_id, KPROP_ID_LEN) != 0 &&
+        database_size != KPROP_SIZE_UNKNOWN &&
+        fstat(database_fd, &st) == 0) {
+        offset = read_checkpoint(ckpt_name, id, database_size);
+        if (offset > database_size || offset > (UINT64_TYPE)st.st_size)
+            offset = 0;
+    }
+    if (offset == 0)
+        (void)unlink(ckpt_name);
+    if (ftruncate(database_fd, offset) != 0 ||
+        lseek(database_fd, offset, SEEK_SET) == (off_t)-1) {
+        send_error(context, fd, errno, "while preparing database file");
+        com_err(progname, errno, _("while preparing database file"));
+        exit(1);
+    }
+
+    store_64_be(offset, offbuf);
+    inbuf = make_data(offbuf, sizeof(offbuf));
+    retval = krb5_mk_safe(context, auth_context, &inbuf, &outbuf, NULL);
+    if (retval) {
+        send_error(context, fd, retval, "while encoding starting offset");
+        com_err(progname, retval, _("while encoding starting offset"));
+        exit(1);
+    }
+    retval = krb5_write_message(context, &fd, &outbuf);
+    krb5_free_data_contents(context, &outbuf);
+    if (retval) {
+        com_err(progname, retval, _("while sending starting offset"));
+        exit(1);
+    }
+
+    retval = krb5_auth_con_initivector(context, auth_context);
+    if (retval) {
+        send_error(context, fd, retval,
+                   "failed while initializing i_vector");
+        com_err(progname, retval, _("while initializing i_vector"));
+        exit(1);
+    }
+
+    if (debug) {
+        if (offset > 0) {
+            fprintf(stderr, _("Full propagation transfer resumed at offset "
+                              "%.0f.\n"), (double)offset);
+        } else {
+            fprintf(stderr, _("Full propagation transfer started.\n"));
+        }
+    }
+
+    /* Receive blocks until kprop sends an empty one. */
+    received_size = offset;
+    last_ckpt = offset;
+    for (;;) {
+        retval = krb5_read_message(context, &fd, &inbuf);
+        if (retval) {
+            snprintf(buf, sizeof(buf),
+                     "while reading database block starting at offset %.0f",
+                     (double)received_size);
+            com_err(progname, retval, "%s", buf);
+            send_error(context, fd, retval, buf);
+            exit(1);
+        }
+        if (krb5_is_krb_error(&inbuf))
+            recv_error(context, &inbuf);
+        retval = krb5_rd_priv(context, auth_context, &inbuf, &outbuf, NULL);
+        krb5_free_data_contents(context, &inbuf);
+        if (retval) {
+            snprintf(buf, sizeof(buf),
+                     "while decoding database block starting at offset %.0f",
+                     (double)received_size);
+            com_err(progname, retval, "%s", buf);
+            send_error(context, fd, retval, buf);
+            exit(1);
+        }
+        if (outbuf.length == 0) {
+            krb5_free_data_contents(context, &outbuf);
+            break;
+        }
+        if (database_size != KPROP_SIZE_UNKNOWN &&
+            received_size + outbuf.length > database_size) {
+            snprintf(buf, sizeof(buf),
+                     "Received more than %.0f bytes for database file",
+                     (double)database_size);
+            com_err(progname, 0, "%s", buf);
+            send_error(context, fd, KRB5KRB_ERR_GENERIC, buf);
+            exit(1);
+        }
+        n = write(database_fd, outbuf.data, outbuf.length);
+        if (n < 0 || (size_t)n != outbuf.length) {
+            retval = (n < 0) ? errno : KRB5KRB_ERR_GENERIC;
+            snprintf(buf, sizeof(buf),
+                     "while writing database block starting at offset %.0f",
+                     (double)received_size);
+            com_err(progname, retval, "%s", buf);
+            send_error(context, fd, retval, buf);
+            exit(1);
+        }
+        received_size += outbuf.length;
+        krb5_free_data_contents(context, &outbuf);
+
+        if (memcmp(id, zero_id, KPROP_ID_LEN) != 0 &&
+            received_size - last_ckpt >= CHECKPOINT_INTERVAL) {
+            write_checkpoint(ckpt_name, database_fd, id, database_size,
+                             received_size);
+            last_ckpt = received_size;
+        }
+    }
+
+    if (database_size != KPROP_SIZE_UNKNOWN && received_size != database_size) {
+        snprintf(buf, sizeof(buf),
+                 "Received %.0f bytes, expected %.0f bytes for database file",
+                 (double)received_size, (double)database_size);
+        com_err(progname, 0, "%s", buf);
+        send_error(context, fd, KRB5KRB_ERR_GENERIC, buf);
+        exit(1);
+    }
+    (void)unlink(ckpt_name);
+    free(ckpt_name);
+
+    if (debug)
+        fprintf(stderr, _("Full propagation transfer finished.\n"));
+
+    /*
+     * Create message acknowledging number of bytes received, but
+     * don't send it until kdb5_util returns successfully.
+     */
+    store_64_be(received_size, offbuf);
+    inbuf = make_data(offbuf, sizeof(offbuf));
+    retval = krb5_mk_safe(context, auth_context, &inbuf, confmsg, NULL);
+    if (retval) {
+        com_err(progname, retval, "while encoding # of received bytes");
+        send_error(context, fd, retval, "while encoding # of received bytes");
+        exit(1);
+    }
+}
 
 void
 send_error(context, fd, err_code, err_text)
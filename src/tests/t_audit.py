@@ -28,4 +28,28 @@ output = realm.run([uuclient, hostname, 'testing message', port_arg])
 if 'Hello' not in output:
     fail('U2U request failed unexpectedly')
 
+realm.stop()
+
+# Pass audit events to the module from a consumer thread, and check
+# that the events queued by the worker threads reach the log once the
+# KDC has shut down.
+kdc_conf = {'kdcdefaults': {'audit_queue_length': '16'}}
+realm = K5Realm(krb5_conf=conf, kdc_conf=kdc_conf, start_kdc=False,
+                get_creds=False)
+logsize = os.path.getsize('au.log')
+realm.start_kdc(['-t', '2'])
+realm.kinit(realm.user_princ, password('user'))
+realm.run([kvno, realm.host_princ])
+realm.stop()
+f = open('au.log')
+f.seek(logsize)
+events = f.read().splitlines()
+f.close()
+if (len(events) < 4 or '"KDC_START"' not in events[0] or
+    '"KDC_STOP"' not in events[-1]):
+    fail('Unexpected audit log after queued events')
+if (not [e for e in events if '"AS_REQ"' in e and '"user"' in e] or
+    not [e for e in events if '"TGS_REQ"' in e and '"host"' in e]):
+    fail('Queued AS or TGS events missing from audit log')
+
 success('Audit tests')
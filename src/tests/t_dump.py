@@ -47,6 +47,81 @@ out = realm.run_kadminl('getpols')
 if 'fred\n' not in out or 'barney\n' not in out:
     fail('Missing policy after second load')
 
+# Load a dump with the principal records in reverse order and one record
+# repeated, and make sure the result dumps the same as the original.
+realm.run([kdb5_util, 'dump', dumpfile])
+f = open(dumpfile)
+lines = f.readlines()
+f.close()
+princs = [l for l in lines[1:] if l.startswith('princ\t')]
+others = [l for l in lines[1:] if not l.startswith('princ\t')]
+revfile = os.path.join(realm.testdir, 'dump.rev')
+f = open(revfile, 'w')
+f.writelines([lines[0]] + princs[::-1] + [princs[0]] + others)
+f.close()
+realm.run([kdb5_util, 'load', revfile])
+dump2 = os.path.join(realm.testdir, 'dump2')
+realm.run([kdb5_util, 'dump', dump2])
+if not cmp(dumpfile, dump2, False):
+    fail('Reordered dump did not load to the same database')
+
+# Load and dump a database spanning several batches of records using
+# worker threads, and make sure the results match the serial code.
+user = [l for l in princs if l.split('\t')[6] == realm.user_princ][0]
+bigfile = os.path.join(realm.testdir, 'dump.big')
+f = open(bigfile, 'w')
+f.write(lines[0])
+for i in range(1000):
+    fields = user.split('\t')
+    fields[6] = 'user%d@%s' % (i, realm.realm)
+    fields[2] = str(len(fields[6]))
+    f.write('\t'.join(fields))
+f.writelines(princs + others)
+f.close()
+realm.run([kdb5_util, 'load', bigfile])
+realm.run([kdb5_util, 'dump', dumpfile])
+realm.run([kdb5_util, 'load', '-threads', '4', bigfile])
+realm.run([kdb5_util, 'dump', dump2])
+if not cmp(dumpfile, dump2, False):
+    fail('Threaded load did not match serial load')
+realm.run([kdb5_util, 'dump', '-threads', '4', dump2])
+if not cmp(dumpfile, dump2, False):
+    fail('Threaded dump did not match serial dump')
+
+# Dump and load the same database in binary format, with and without
+# threads, and make sure the contents survive.
+binfile = os.path.join(realm.testdir, 'dump.bin')
+realm.run([kdb5_util, 'dump', '-binary', binfile])
+realm.run([kdb5_util, 'load', binfile])
+realm.run([kdb5_util, 'dump', dump2])
+if not cmp(dumpfile, dump2, False):
+    fail('Binary dump did not load to the same database')
+realm.run([kdb5_util, 'dump', '-binary', '-threads', '4', dump2])
+realm.run([kdb5_util, 'load', dump2])
+realm.run([kdb5_util, 'dump', dump2])
+if not cmp(dumpfile, dump2, False):
+    fail('Threaded binary dump did not load to the same database')
+if os.path.getsize(binfile) >= os.path.getsize(dumpfile):
+    fail('Binary dump is not smaller than text dump')
+
+# Corrupted and truncated binary dumps should be rejected.
+f = open(binfile, 'rb')
+bindata = f.read()
+f.close()
+pos = len(bindata) // 2
+f = open(dump2, 'wb')
+f.write(bindata[:pos] + chr(ord(bindata[pos]) ^ 1) + bindata[pos + 1:])
+f.close()
+out = realm.run([kdb5_util, 'load', dump2], expected_code=1)
+if 'Database format error' not in out:
+    fail('Expected error not seen for corrupted binary dump')
+f = open(dump2, 'wb')
+f.write(bindata[:-12])
+f.close()
+out = realm.run([kdb5_util, 'load', dump2], expected_code=1)
+if 'incomplete or corrupted' not in out:
+    fail('Expected error not seen for truncated binary dump')
+
 srcdumpdir = os.path.join(srctop, 'tests', 'dumpfiles')
 srcdump = os.path.join(srcdumpdir, 'dump')
 srcdump_r18 = os.path.join(srcdumpdir, 'dump.r18')
@@ -186,4 +186,28 @@ kpropd.send_signal(signal.SIGUSR1)
 wait_for_prop(kpropd, True)
 check_serial(realm, 'None', slave)
 
+# Conditional iprop dumps, used by kadmind for full resyncs, reuse an
+# existing dump while its serial number is still in the ulog.  After a
+# ulog reset, a new dump is made and then reused.
+def dump_id(dumpfile):
+    st = os.stat(dumpfile)
+    return (st.st_ino, st.st_mtime)
+
+def check_dump_reused(dumpfile):
+    realm.run([kdb5_util, 'dump', '-i', '-c', dumpfile])
+    id = dump_id(dumpfile)
+    realm.run([kdb5_util, 'dump', '-i', '-c', dumpfile])
+    if dump_id(dumpfile) != id:
+        fail('Conditional dump was not reused')
+    return id
+
+cdump = os.path.join(realm.testdir, 'cdump')
+id = check_dump_reused(cdump)
+realm.addprinc('resync')
+if check_dump_reused(cdump) != id:
+    fail('Conditional dump was not reused after an update')
+realm.run([kproplog, '-R'])
+if check_dump_reused(cdump) == id:
+    fail('Conditional dump was reused after ulog reset')
+
 success('iprop tests')
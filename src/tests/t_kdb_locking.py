@@ -32,4 +32,25 @@ output = realm.run_kadminl('modprinc -allow_tix ' + p)
 if 'Cannot lock database' in output:
     fail('krb5kdc still holds a lock on the principal db')
 
+# The KDC keeps its DB handle open between lookups; make sure it
+# notices changes made by another process.
+realm.kinit(p, p, expected_code=1)
+realm.run_kadminl('modprinc +allow_tix ' + p)
+realm.kinit(p, p)
+realm.run_kadminl('cpw -pw newpw ' + p)
+realm.kinit(p, 'newpw')
+realm.run_kadminl('cpw -pw anotherpw ' + p)
+realm.kinit(p, 'newpw', expected_code=1)
+realm.kinit(p, 'anotherpw')
+
+# The KDC also caches recently used principal entries; make sure the
+# cache is discarded when an entry changes.
+realm.run([kvno, realm.host_princ])
+realm.run_kadminl('modprinc -allow_svr ' + realm.host_princ)
+realm.run([kdestroy])
+realm.kinit(p, 'anotherpw')
+realm.run([kvno, realm.host_princ], expected_code=1)
+realm.run_kadminl('modprinc +allow_svr ' + realm.host_princ)
+realm.run([kvno, realm.host_princ])
+
 success('KDB locking tests')
@@ -0,0 +1,72 @@
+#!/usr/bin/python
+from k5test import *
+import time
+
+# Run the KDC on the in-memory KDB module, backed by the default db2 module.
+conf = {'dbmodules': {'db': {'db_library': 'mem'}}}
+realm = K5Realm(kdc_conf=conf)
+realm.run([kvno, realm.host_princ])
+
+# Other programs should pass through to the backing database.
+output = realm.run([kdb5_util, 'dump', '-'])
+if realm.host_princ not in output:
+    fail('Host principal not found in dump')
+
+# While lookups are being made, the KDC checks for changes made by
+# other processes about once a second, and loads the database again
+# in the background.  Wait for a lookup to trigger a check, then for
+# the check.
+def wait_for_reload():
+    time.sleep(1.5)
+    realm.run([kvno, realm.host_princ])
+    time.sleep(1.5)
+
+# A principal not in the memory copy is looked up in the backing
+# database when aliases are allowed, as for TGS requests.
+realm.addprinc('svc/localhost')
+realm.run([kvno, 'svc/localhost'])
+
+realm.run_kadminl('delprinc -force svc/localhost')
+wait_for_reload()
+realm.run([kdestroy])
+realm.kinit(realm.user_princ, password('user'))
+output = realm.run([kvno, 'svc/localhost'], expected_code=1)
+if 'not found in Kerberos database' not in output:
+    fail('Deleted principal still visible to KDC')
+
+realm.run_kadminl('cpw -pw newpw user')
+wait_for_reload()
+realm.kinit(realm.user_princ, 'newpw')
+realm.stop()
+
+# Serve lookups from a compiled copy of the database.
+conf = {'dbmodules': {'db': {'db_library': 'mem',
+                             'compiled_database': '$testdir/db.compiled'}}}
+realm = K5Realm(kdc_conf=conf, start_kdc=False, get_creds=False)
+compiled = os.path.join(realm.testdir, 'db.compiled')
+realm.run([kdb5_util, 'compile', compiled])
+realm.start_kdc()
+realm.kinit(realm.user_princ, password('user'))
+realm.run([kvno, realm.host_princ])
+
+# Changes made after the file was compiled come from the backing database.
+realm.addprinc('svc/localhost')
+time.sleep(1.5)
+realm.run([kvno, 'svc/localhost'])
+
+# Loading a dump compiles the database again, and the KDC maps the new file.
+dumpfile = os.path.join(realm.testdir, 'dump')
+realm.run([kdb5_util, 'dump', dumpfile])
+os.remove(compiled)
+realm.run([kdb5_util, 'load', dumpfile])
+if not os.path.exists(compiled):
+    fail('Compiled database not written by load')
+time.sleep(1.5)
+realm.run([kdestroy])
+realm.kinit(realm.user_princ, password('user'))
+realm.run([kvno, 'svc/localhost'])
+output = realm.run([kvno, 'nonexistent/localhost'], expected_code=1)
+if 'not found in Kerberos database' not in output:
+    fail('Expected error message not seen for missing principal')
+
+success('In-memory KDB module')
@@ -1,5 +1,7 @@
 #!/usr/bin/python
 from k5test import *
+import re
+import time
 
 realm = K5Realm(create_user=False, create_host=False)
 
@@ -67,4 +69,37 @@ realm.run(['env', 'KRB5_TRACE=' + tracefile, kinit, '-T', realm.ccache,
 if preauth_type_received(tracefile, 138):
     fail('encrypted challenge')
 
+# Return the preauth hint cache hit and miss counts the KDC logs on
+# SIGUSR1.
+def hint_cache_stats(realm, pid):
+    logfile = os.path.join(realm.testdir, 'kdc.log')
+    nlines = len(open(logfile).readlines())
+    os.kill(pid, signal.SIGUSR1)
+    for i in range(50):
+        for line in open(logfile).readlines()[nlines:]:
+            m = re.search(r'preauth hint cache: (\d+) hits, (\d+) misses',
+                          line)
+            if m:
+                return int(m.group(1)), int(m.group(2))
+        time.sleep(0.1)
+    fail('No preauth hint cache statistics after SIGUSR1')
+
+# The KDC may reuse the salt information it sent earlier for the same
+# client.  Make sure it does, and that the salt it offers follows a
+# key change.
+realm.stop_kdc()
+pidfile = os.path.join(realm.testdir, 'kdc.pid')
+realm.start_kdc(['-P', pidfile])
+f = open(pidfile)
+pid = int(f.read())
+f.close()
+realm.run_kadminl('cpw -pw pw1 -e aes256-cts:normal user')
+realm.kinit('user', 'pw1')
+realm.kinit('user', 'pw1')
+hits, misses = hint_cache_stats(realm, pid)
+if hits < 1:
+    fail('Preauth hint list salt information was not cached')
+realm.run_kadminl('cpw -pw pw2 -e aes256-cts:onlyrealm user')
+realm.kinit('user', 'pw2')
+
 success('Key data tests')
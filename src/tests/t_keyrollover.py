@@ -43,6 +43,15 @@ expected = 'krbtgt/%s@%s\n\tEtype (skey, tkt): ' \
 if expected not in output:
     fail('keyrollover: expected TGS enctype not found after change')
 
+# Change a service key while the KDC is running, and make sure that new
+# tickets for the service are issued in the new key and not in a copy of the
+# old key remembered by the KDC.
+ktname = os.path.join(realm.testdir, 'keytab2')
+realm.run([kvno, realm.host_princ])
+realm.run_kadminl('ktadd -k %s %s' % (ktname, realm.host_princ))
+realm.kinit(realm.user_princ, password('user'))
+realm.run([kvno, '-k', ktname, realm.host_princ])
+
 # Test that the KDC only accepts the first enctype for a kvno, for a
 # local-realm TGS request.  To set this up, we abuse an edge-case
 # behavior of modprinc -kvno.  First, set up a DES3 krbtgt entry at
@@ -1,5 +1,6 @@
 #!/usr/bin/python
 from k5test import *
+import struct
 
 conf_slave = {'dbmodules': {'db': {'database_name': '$testdir/db.slave'}}}
 
@@ -41,4 +42,63 @@ for realm in multipass_realms(create_user=False):
             if 'wakawaka' not in out:
                 fail('Slave does not have all principals from master')
 
+    # Wait for a single-use kpropd to finish and return its output.
+    def kpropd_output(kpropd):
+        out = ''
+        while True:
+            line = kpropd.stdout.readline()
+            if line == '':
+                return out
+            output('kpropd: ' + line)
+            out += line
+
+    # Propagate a dump read from standard input.
+    realm.addprinc('streamed')
+    realm.run([kdb5_util, 'dump', dumpfile])
+    dump = open(dumpfile).read()
+    kpropd = realm.start_kpropd(slave, ['-d', '-t'])
+    realm.run([kprop, '-f', '-', '-P', str(realm.kprop_port()), hostname],
+              input=dump)
+    kpropd_output(kpropd)
+    if 'streamed' not in realm.run_kadminl('listprincs', slave):
+        fail('Slave does not have principals from streamed dump')
+
+    # Simulate an interrupted transfer of the same dump file, and check
+    # that kpropd resumes from its checkpoint.
+    realm.addprinc('resumed')
+    realm.run([kdb5_util, 'dump', dumpfile])
+    dump = open(dumpfile).read()
+    # Truncate the modification time to whole seconds, so that the
+    # transfer identifier can be computed here.
+    mtime = int(os.stat(dumpfile).st_mtime)
+    os.utime(dumpfile, (mtime, mtime))
+    st = os.stat(dumpfile)
+    half = len(dump) // 2
+    tempfile = os.path.join(realm.testdir, 'incoming-slave-datatrans.temp')
+    def write_partial(size):
+        f = open(tempfile, 'w')
+        f.write(dump[:half])
+        f.close()
+        f = open(tempfile + '.ckpt', 'w')
+        f.write(struct.pack('>QQQQQQ', st.st_ino, mtime, 0, st.st_size,
+                            size, half))
+        f.close()
+
+    # A checkpoint recording a different database size is not used.
+    write_partial(st.st_size + 1)
+    kpropd = realm.start_kpropd(slave, ['-d', '-t'])
+    realm.run([kprop, '-f', dumpfile, '-P', str(realm.kprop_port()),
+               hostname])
+    if 'transfer started' not in kpropd_output(kpropd):
+        fail('kpropd resumed transfer with mismatched size')
+
+    write_partial(st.st_size)
+    kpropd = realm.start_kpropd(slave, ['-d', '-t'])
+    realm.run([kprop, '-f', dumpfile, '-P', str(realm.kprop_port()),
+               hostname])
+    if ('resumed at offset %d' % half) not in kpropd_output(kpropd):
+        fail('kpropd did not resume transfer')
+    if 'resumed' not in realm.run_kadminl('listprincs', slave):
+        fail('Slave does not have principals from resumed transfer')
+
 success('kprop tests')
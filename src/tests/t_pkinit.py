@@ -98,6 +98,17 @@ realm.kinit('user@%s' % realm.realm,
 realm.klist('user@%s' % realm.realm)
 realm.run([kvno, realm.host_princ])
 
+# Run it again with KDC worker threads, which check the signature and
+# compute the DH key while the event loop carries on.
+realm.stop_kdc()
+realm.start_kdc(['-t', '2'])
+realm.kinit('user@%s' % realm.realm,
+            flags=['-X', 'X509_user_identity=%s' % file_identity])
+realm.klist('user@%s' % realm.realm)
+realm.run([kvno, realm.host_princ])
+realm.stop_kdc()
+realm.start_kdc()
+
 # Run the basic test - PKINIT with FILE: identity, with a password on the key,
 # supplied by the prompter.
 # Expect failure if the responder does nothing, and we have no prompter.
@@ -90,6 +90,13 @@ output = realm.run([kinit, realm.user_princ], input='wrong\n', expected_code=1)
 if 'Password incorrect while getting initial credentials' not in output:
     fail('Expected error message not seen in kinit output')
 
+# The KDC records failures in the lockout table; kadmin should see them.
+if not os.path.exists(os.path.join(realm.testdir, 'db.lockout')):
+    fail('Lockout table not created')
+output = realm.run_kadminl('getprinc user')
+if 'Failed password attempts: 2' not in output:
+    fail('Failure count not seen in getprinc output')
+
 # Now the account should be locked out.
 output = realm.run([kinit, realm.user_princ], expected_code=1)
 if 'Clients credentials have been revoked while getting initial credentials' \
@@ -98,6 +105,9 @@ if 'Clients credentials have been revoked while getting initial credentials' \
 
 # Check that modprinc -unlock allows a further attempt.
 output = realm.run_kadminl('modprinc -unlock user')
+output = realm.run_kadminl('getprinc user')
+if 'Failed password attempts: 0' not in output:
+    fail('Failure count not reset by modprinc -unlock')
 realm.kinit(realm.user_princ, password('user'))
 
 # Make sure a nonexistent policy reference doesn't prevent authentication.
@@ -77,6 +77,17 @@ restart_kdc(realm, {'kdcdefaults': {'no_host_referral': '*',
                                     'host_based_services': '*'}})
 test(realm, 'unknown', False, 'srv-hst, kdcdefaults nohost * hostbased *')
 
+# The KDC remembers failed searches and referral results, but forgets
+# them when the database changes.
+restart_kdc(realm, {})
+test(realm, 'principal', False, 'principal, before adding server')
+test(realm, 'principal', False, 'principal, cached')
+test(realm, 'srv-hst', True, 'srv-hst, before adding server')
+test(realm, 'srv-hst', True, 'srv-hst, cached')
+realm.addprinc('a/x.d')
+realm.run(['./gcred', 'principal', 'a/x.d'])
+realm.run(['./gcred', 'srv-hst', 'a/x.d'])
+
 # Regression test for #7483: a KDC should not return a host referral
 # to its own realm.
 drealm = {'domain_realm': {'d': 'KRBTEST.COM'}}